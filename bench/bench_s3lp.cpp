@@ -0,0 +1,377 @@
+#include <benchmark/benchmark.h>
+#include <string>
+#include <vector>
+extern "C" {
+#include "../include/s3extract.h"
+#include "../include/s3lp.h"
+#include "../include/s3prefilter.h"
+#include "../include/s3quantile.h"
+#include "../include/s3redelivery.h"
+#include "../include/s3sort.h"
+#include "../include/s3topk.h"
+}
+#include "../include/s3query.hpp"
+
+// Micro benchmarks for the per-line hot path
+// Run: make bench, or ./bench_s3lp --benchmark_filter=<regex>
+
+static const char *SAMPLE_LOG =
+	"79a59df900b949e55d96a1e698fbacedfd6e09d98eacf8f8d5218e7cd47ef2be amzn-s3-demo-bucket1 "
+	"[06/Feb/2019:00:00:38 +0000] 192.0.2.3 79a59df900b949e55d96a1e698fbacedfd6e09d98eacf8f8d5218e7cd47ef2be "
+	"3E57427F3EXAMPLE REST.GET.OBJECT tech-talk/episode-1234.mp3 \"GET /tech-talk/episode-1234.mp3 HTTP/1.1\" "
+	"206 - 1048576 24117248 70 10 \"-\" \"Spotify/8.8.4.669 Android/33 (SM-G781B)\" - "
+	"s9lzHYrFp76ZVxRcpX9+5cjAnEH2ROuNkd2BHfIa6UkFVdtjf5mKR3/eTPFvsiP/XV/VLi31234= SigV4 "
+	"ECDHE-RSA-AES128-GCM-SHA256 AuthHeader amzn-s3-demo-bucket1.s3.us-west-1.amazonaws.com TLSv1.2 - - "
+	"\"bytes=0-1048575\"";
+
+static const char *SAMPLE_AGENTS[] = {
+	"Spotify/8.8.4.669 Android/33 (SM-G781B)",
+	"AppleCoreMedia/1.0.0.20E252 (iPhone; U; CPU OS 16_4_1 like Mac OS X; en_us)",
+	"Mozilla/5.0 (Windows NT 10.0; Win64; x64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/120.0 Safari/537.36",
+	"RawVoice Generator/1.0",
+};
+
+static s_context_t
+make_context(size_t capacity)
+{
+	s_context_t context = {};
+	context.ip_track.capacity = capacity;
+	context.ip_track.ip_hashes = (uint64_t *)calloc(capacity, sizeof(uint64_t));
+	context.output_filetype_flag = BIN_FILE;
+	return context;
+}
+
+static void
+BM_ParseLogEntry(benchmark::State &state)
+{
+	std::string line(SAMPLE_LOG);
+	std::vector<char> buffer(line.size() + 1);
+	s_context_t context = make_context(IP_HASH);
+	p_log_t parsed;
+
+	for (auto _ : state) {
+		// Tokenizing is destructive, restore the line each iteration
+		memcpy(buffer.data(), line.c_str(), line.size() + 1);
+		benchmark::DoNotOptimize(parse_log_entry(buffer.data(), &parsed, &context));
+	}
+	state.SetBytesProcessed(state.iterations() * line.size());
+	free(context.ip_track.ip_hashes);
+}
+BENCHMARK(BM_ParseLogEntry);
+
+// Arg 0: the line passes -O and is tokenized in full, Arg 1: it stops at the operation
+static void
+BM_ParseLogEntryPrefiltered(benchmark::State &state)
+{
+	std::string line(SAMPLE_LOG);
+	std::vector<char> buffer(line.size() + 1);
+	s_context_t context = make_context(IP_HASH);
+	prefilter_t filter = {};
+	prefilter_add(&filter, PREFILTER_FIELD_OPERATION, state.range(0) ? "REST.PUT.OBJECT" : "REST.GET.OBJECT");
+	context.prefilter = &filter;
+	p_log_t parsed;
+
+	for (auto _ : state) {
+		memcpy(buffer.data(), line.c_str(), line.size() + 1);
+		benchmark::DoNotOptimize(parse_log_entry(buffer.data(), &parsed, &context));
+	}
+	state.SetBytesProcessed(state.iterations() * line.size());
+	prefilter_free(&filter);
+	free(context.ip_track.ip_hashes);
+}
+BENCHMARK(BM_ParseLogEntryPrefiltered)->Arg(0)->Arg(1);
+
+static void
+BM_ExtractLogEntry(benchmark::State &state)
+{
+	std::string line(SAMPLE_LOG);
+	s_context_t context = make_context(IP_HASH);
+	p_log_t parsed;
+	s_log_t slim;
+	parse_log_entry(&line[0], &parsed, &context);
+
+	for (auto _ : state) {
+		extract_log_entry(&parsed, &slim, &context);
+		benchmark::DoNotOptimize(slim);
+	}
+	free(context.ip_track.ip_hashes);
+}
+BENCHMARK(BM_ExtractLogEntry);
+
+static void
+BM_HashKey(benchmark::State &state)
+{
+	const char *key = "tech-talk/episode-1234.mp3";
+	for (auto _ : state) {
+		benchmark::DoNotOptimize(hash_key(key));
+	}
+}
+BENCHMARK(BM_HashKey);
+
+static void
+BM_ExtractPath(benchmark::State &state)
+{
+	const char *key = "/tech-talk/episode-1234.mp3";
+	for (auto _ : state) {
+		benchmark::DoNotOptimize(extract_path(key));
+	}
+}
+BENCHMARK(BM_ExtractPath);
+
+static void
+BM_ParseIpv4(benchmark::State &state)
+{
+	const char *ip = "203.113.27.184";
+	size_t length = strlen(ip);
+	uint32_t addr;
+	for (auto _ : state) {
+		benchmark::DoNotOptimize(parse_ipv4(ip, length, &addr));
+		benchmark::DoNotOptimize(addr);
+	}
+}
+BENCHMARK(BM_ParseIpv4);
+
+// Lookup over N disjoint /24 ranges, random addresses so the deep levels miss cache
+static void
+BM_ExtractLocation(benchmark::State &state)
+{
+	size_t count = state.range(0);
+	char path[] = "/tmp/bench_geo_XXXXXX";
+	FILE *db_file = fdopen(mkstemp(path), "w");
+	for (size_t i = 0; i < count; i++) {
+		fprintf(db_file, "%zu,%zu,US\n", i << 9, (i << 9) + 255);
+	}
+	fclose(db_file);
+	geo_db_t *db = geo_db_load(path);
+	unlink(path);
+
+	uint32_t ip = 12345;
+	uint32_t span = (uint32_t)(count << 9);
+	for (auto _ : state) {
+		ip = ip * 1664525u + 1013904223u;
+		benchmark::DoNotOptimize(extract_location(ip % span, db));
+	}
+	geo_db_free(db);
+}
+BENCHMARK(BM_ExtractLocation)->Arg(1 << 10)->Arg(1 << 18)->Arg(1 << 22);
+
+static void
+BM_CheckPattern(benchmark::State &state)
+{
+	const char *agent = SAMPLE_AGENTS[2];
+	for (auto _ : state) {
+		benchmark::DoNotOptimize(check_pattern(agent, "Spotify/"));
+	}
+}
+BENCHMARK(BM_CheckPattern);
+
+static void
+BM_ExtractSystem(benchmark::State &state)
+{
+	size_t i = 0;
+	for (auto _ : state) {
+		benchmark::DoNotOptimize(extract_system(SAMPLE_AGENTS[i++ & 3]));
+	}
+}
+BENCHMARK(BM_ExtractSystem);
+
+static void
+BM_ExtractPlatform(benchmark::State &state)
+{
+	size_t i = 0;
+	for (auto _ : state) {
+		benchmark::DoNotOptimize(extract_platform(SAMPLE_AGENTS[i++ & 3]));
+	}
+}
+BENCHMARK(BM_ExtractPlatform);
+
+// Arg: distinct listeners, table sized to stay under half full
+static void
+BM_IsUniqueIp(benchmark::State &state)
+{
+	uint32_t distinct = state.range(0);
+	s_context_t context = make_context(distinct * 2 + 1);
+	uint32_t i = 0;
+
+	for (auto _ : state) {
+		uint32_t n = i++ % distinct;
+		benchmark::DoNotOptimize(is_unique_ip(n * 2654435761u, n % 97, &context));
+	}
+	free(context.ip_track.ip_hashes);
+}
+BENCHMARK(BM_IsUniqueIp)->Arg(1 << 10)->Arg(1 << 16)->Arg(1 << 20);
+
+// Arg: distinct listeners, windowed table starting at IP_HASH and growing as s3lp's does
+static void
+BM_IsUniqueIpWindowed(benchmark::State &state)
+{
+	uint32_t distinct = state.range(0);
+	s_context_t context = {};
+	ip_track_init(&context.ip_track, IP_HASH, DEDUP_WINDOW);
+	uint32_t i = 0;
+
+	for (auto _ : state) {
+		uint32_t n = i++ % distinct;
+		benchmark::DoNotOptimize(is_unique_ip(n * 2654435761u, n % 97, &context));
+	}
+	ip_track_free(&context.ip_track);
+}
+BENCHMARK(BM_IsUniqueIpWindowed)->Arg(1 << 10)->Arg(1 << 16)->Arg(1 << 20);
+
+// Arg: 0 every request new, 1 every request delivered twice in a row
+static void
+BM_RedeliverySeen(benchmark::State &state)
+{
+	s_context_t context = make_context(1);
+	std::string line = SAMPLE_LOG;
+	p_log_t parsed;
+	parse_log_entry(&line[0], &parsed, &context);
+	char *id = &line[parsed.request_id.off];
+	redelivery_t filter;
+	redelivery_init(&filter, REDELIVERY_WINDOW);
+	int repeat = (int)state.range(0);
+	uint64_t i = 0;
+
+	for (auto _ : state) {
+		uint64_t n = (i++ >> repeat) * 0x9e3779b97f4a7c15ull;
+		for (int d = 0; d < 16; d++) {
+			id[d] = "0123456789ABCDEF"[(n >> (4 * d)) & 15];
+		}
+		benchmark::DoNotOptimize(redelivery_seen(&filter, &parsed));
+	}
+	redelivery_free(&filter);
+	free(context.ip_track.ip_hashes);
+}
+BENCHMARK(BM_RedeliverySeen)->Arg(0)->Arg(1);
+
+static void
+BM_PrintLogAsJson(benchmark::State &state)
+{
+	FILE *sink = fopen("/dev/null", "w");
+	s_log_wide_t log = {0xc0000203, 0x1234abcd, 0xdeadbeef, 1549411238, 1024, 23552, 70, 206, 2, 1, 4, 2};
+	extract_config_t config = {};
+	int first = 1;
+
+	for (auto _ : state) {
+		print_log_as_json(&log, sink, first, &config);
+		first = 0;
+	}
+	fclose(sink);
+}
+BENCHMARK(BM_PrintLogAsJson);
+
+// Hourly buckets in a zone with DST, a month of timestamps
+static void
+BM_TimeBucketKey(benchmark::State &state)
+{
+	time_bucket_t bucket;
+	time_bucket_init(&bucket, "h", "CET-1CEST,M3.5.0,M10.5.0/3");
+	uint32_t i = 0;
+
+	for (auto _ : state) {
+		benchmark::DoNotOptimize(time_bucket_key(&bucket, 1743465600 + (i++ * 2654435761u) % 2592000));
+	}
+	time_bucket_free(&bucket);
+}
+BENCHMARK(BM_TimeBucketKey);
+
+// Arg: distinct items, a 256 counter sketch (s3_extract -k default) over a skewed stream
+static void
+BM_SpaceSavingUpdate(benchmark::State &state)
+{
+	uint64_t distinct = state.range(0);
+	space_saving_t sketch;
+	space_saving_init(&sketch, TOPK_MIN_COUNTERS);
+	uint64_t i = 0;
+
+	for (auto _ : state) {
+		// Squaring a uniform draw skews it toward small items
+		uint64_t draw = hash64_mix(i++, HASH64_SECRET[0]) % distinct;
+		benchmark::DoNotOptimize(space_saving_update(&sketch, draw * draw / distinct, 1, 0));
+	}
+	space_saving_free(&sketch);
+}
+BENCHMARK(BM_SpaceSavingUpdate)->Arg(1 << 8)->Arg(1 << 16)->Arg(1 << 20);
+
+// Download times spread over 1..30000 ms, as s3_extract -q t sees them
+static void
+BM_DDSketchAdd(benchmark::State &state)
+{
+	dd_mapping_t mapping;
+	dd_mapping_init(&mapping, QUANTILE_ALPHA);
+	dd_sketch_t sketch;
+	dd_sketch_init(&sketch, &mapping);
+	uint64_t i = 0;
+
+	for (auto _ : state) {
+		benchmark::DoNotOptimize(dd_sketch_add(&sketch, hash64_mix(i++, HASH64_SECRET[1]) % 30000 + 1));
+	}
+	dd_sketch_free(&sketch);
+	dd_mapping_free(&mapping);
+}
+BENCHMARK(BM_DDSketchAdd);
+
+// A 1M record run of a month's timestamps, s3_sort's in-memory step
+static void
+BM_RadixSortRecords(benchmark::State &state)
+{
+	std::vector<s_log_t> logs(1 << 20), work(logs.size()), scratch(logs.size());
+	for (size_t i = 0; i < logs.size(); i++) {
+		logs[i] = {};
+		logs[i].timestamp = 1746057600u + (uint32_t)(hash64_mix(i, HASH64_SECRET[2]) % 2592000);
+		logs[i].podcast_hash = (uint32_t)hash64_mix(i % 500, HASH64_SECRET[3]);
+	}
+	sort_key_t key;
+	sort_key_init(&key, state.range(0), 0);
+
+	for (auto _ : state) {
+		state.PauseTiming();
+		work = logs;
+		state.ResumeTiming();
+		benchmark::DoNotOptimize(radix_sort_records(&key, work.data(), scratch.data(), work.size()));
+	}
+	state.SetItemsProcessed(state.iterations() * logs.size());
+}
+BENCHMARK(BM_RadixSortRecords)->Arg(SORT_BY_TIME)->Arg(SORT_BY_PODCAST);
+
+// Podcast and hourly keys of a month of records in a zone with DST
+// Arg 0: composite_key_pack per record, as s3_extract grouped before, 1: query_pack_keys per batch
+static void
+BM_PackGroupKeys(benchmark::State &state)
+{
+	std::vector<s_log_t> logs(QUERY_BATCH);
+	for (size_t i = 0; i < logs.size(); i++) {
+		logs[i] = {};
+		logs[i].timestamp = 1743465600u + (uint32_t)i * 600;
+		logs[i].podcast_hash = (uint32_t)hash64_mix(i % 500, HASH64_SECRET[3]);
+	}
+	time_bucket_t bucket;
+	time_bucket_init(&bucket, "h", "CET-1CEST,M3.5.0,M10.5.0/3");
+	extract_config_t config = {};
+	config.time_bucket = &bucket;
+	config.group_count = 2;
+	config.group_keys[0] = GROUP_PODCAST;
+	config.group_keys[1] = GROUP_TIME;
+	composite_key_t layout;
+	composite_key_init(&layout, &config);
+	std::vector<packed_key_t> keys(logs.size());
+
+	for (auto _ : state) {
+		if (state.range(0) == 0) {
+			for (size_t i = 0; i < logs.size(); i++) {
+				s_log_wide_t wide;
+				widen_record(&logs[i], &wide);
+				keys[i] = composite_key_pack(&layout, &wide, &config);
+			}
+		}
+		else {
+			query_pack_keys(&layout, &config, logs.data(), logs.size(), keys.data());
+		}
+		benchmark::DoNotOptimize(keys.data());
+	}
+	state.SetItemsProcessed(state.iterations() * logs.size());
+	time_bucket_free(&bucket);
+}
+BENCHMARK(BM_PackGroupKeys)->Arg(0)->Arg(1);
+
+BENCHMARK_MAIN();
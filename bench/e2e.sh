@@ -0,0 +1,44 @@
+#!/bin/sh
+# End-to-end throughput benchmark
+#
+# USAGE: bench/e2e.sh [lines ...]     (default: 1000000)
+#   ex:  bench/e2e.sh 1000000 10000000 100000000
+#
+# Datasets are generated once per size with a fixed seed and reused across runs.
+# Each tool writes its own -s stats JSON, they are merged into
+# out/bench/e2e_<commit>.json so runs can be compared between commits.
+
+set -e
+
+SEED=${BENCH_SEED:-42}
+OUT=${BENCH_OUT:-out/bench}
+REV=$(git rev-parse --short HEAD 2>/dev/null || echo unknown)
+RESULT="$OUT/e2e_$REV.json"
+
+[ $# -eq 0 ] && set -- 1000000
+mkdir -p "$OUT"
+
+{
+	printf '{\n  "commit": "%s",\n  "seed": %s,\n  "runs": [' "$REV" "$SEED"
+	sep=""
+	for lines in "$@"; do
+		data="$OUT/data_${lines}_${SEED}.log"
+		if [ ! -f "$data" ]; then
+			./fake_logs -n "$lines" -s "$SEED" -o "$data" >/dev/null
+		fi
+
+		./s3lp -f "$data" -o "$OUT/data_${lines}.bin" -s "$OUT/s3lp.json"
+		./s3_extract -f "$OUT/data_${lines}.bin" -o /dev/null -s "$OUT/extract_none.json"
+		./s3_extract -f "$OUT/data_${lines}.bin" -o /dev/null -g p -s "$OUT/extract_podcast.json"
+
+		printf '%s\n    {\n      "lines": %s,\n      "dataset_bytes": %s,\n' "$sep" "$lines" "$(wc -c <"$data")"
+		printf '      "s3lp": %s,\n' "$(cat "$OUT/s3lp.json")"
+		printf '      "s3_extract": %s,\n' "$(cat "$OUT/extract_none.json")"
+		printf '      "s3_extract_podcast": %s\n    }' "$(cat "$OUT/extract_podcast.json")"
+		sep=","
+		rm -f "$OUT/data_${lines}.bin" "$OUT/s3lp.json" "$OUT/extract_none.json" "$OUT/extract_podcast.json"
+	done
+	printf '\n  ]\n}\n'
+} >"$RESULT"
+
+echo "Results: $RESULT"
@@ -0,0 +1,75 @@
+#pragma once
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "s3extract.h"
+#include "s3spill.h"
+
+#define AGGREGATE_KEY_BITS 128		   // packed_key_t width, the sum of every key's bits must fit
+#define AGGREGATE_TIME_BIAS 86400	   // local bucket starts can sit up to a day before 1970
+#define AGGREGATE_START_GROUPS 1024	   // table slots before the first growth
+#define AGGREGATE_FULL 2			   // aggregate_add: a new group would exceed the table budget
+
+// Output order, ORDER_KEY sorts every level by key, the others sort the innermost
+// level by that aggregate (largest first) inside key ordered parents
+#define ORDER_KEY 0
+#define ORDER_REQUESTS 1
+#define ORDER_UNIQUE 2
+#define ORDER_BYTES 3
+#define ORDER_TIME 4 // total download_time_ms
+
+// Composite group key, first key in the high bits so key order is lexicographic
+typedef unsigned __int128 packed_key_t;
+
+// Field layout of a packed key
+typedef struct composite_key_s {
+	int count;
+	int group_by[GROUP_KEYS_MAX]; // GROUP_* per level, outermost first
+	int shift[GROUP_KEYS_MAX];
+	int bits[GROUP_KEYS_MAX];
+	uint32_t time_unit; // seconds per GROUP_TIME step, bucket starts are multiples of it
+} composite_key_t;
+
+// Running totals of one group
+typedef struct aggregate_s {
+	packed_key_t key;
+	packed_key_t prefix; // key without its innermost level, set for sorting
+	uint64_t rank;		 // ordering aggregate, set for sorting
+	uint64_t requests;
+	uint64_t unique; // UNIQUE_IP records
+	uint64_t bytes_kb;
+	uint64_t time_ms;
+	uint8_t flags; // flags of a record in the group, for formatting IP keys
+} aggregate_t;
+
+// Hash aggregate: open addressing over the packed key, entries stay dense for sorting
+typedef struct aggregate_table_s {
+	aggregate_t *groups;
+	uint32_t *index; // key -> group + 1, 0 when empty
+	uint32_t index_mask;
+	uint32_t count;
+	uint32_t capacity;
+	uint64_t budget; // bytes of groups and index the table may grow to, 0 for no limit
+} aggregate_table_t;
+
+//// Function Prototypes
+//
+int composite_key_init(composite_key_t *layout, const extract_config_t *config);
+packed_key_t composite_key_pack(const composite_key_t *layout, const s_log_wide_t *log, const extract_config_t *config);
+uint64_t composite_key_part(const composite_key_t *layout, packed_key_t key, int level);
+int aggregate_table_init(aggregate_table_t *table);
+void aggregate_table_free(aggregate_table_t *table);
+void aggregate_table_reset(aggregate_table_t *table);
+int aggregate_add(aggregate_table_t *table, packed_key_t key, const s_log_wide_t *log);
+int aggregate_merge(aggregate_table_t *table, const aggregate_t *partial);
+void aggregate_sort(aggregate_table_t *table, const composite_key_t *layout, int order_by);
+int extract_aggregates(FILE *input, FILE *output, const extract_config_t *config);
+
+
+#ifdef __cplusplus
+}
+#endif
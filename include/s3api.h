@@ -0,0 +1,105 @@
+#pragma once
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "s3catalog.h"
+#include "s3lp.h"
+#include "s3prefilter.h"
+
+// libs3lp: the parser and the .bin format without the CLIs. Every call works on a caller
+// owned object with no global state, results come back as S3LP_* codes and nothing is
+// written to stderr (errno holds the cause of an S3LP_EIO), and records are handed out from
+// buffers allocated once per object. An object belongs to one thread at a time, any number
+// of them can run side by side.
+
+// Return codes
+#define S3LP_OK 0
+#define S3LP_ENOMEM 1	// allocation failed
+#define S3LP_EIO 2		// file could not be opened, mapped or saved
+#define S3LP_EFORMAT 3	// dedup state is not a snapshot written by s3lp -S
+#define S3LP_ESTOPPED 4 // a callback returned nonzero, the parser takes no more input
+#define S3LP_ESTATE 5	// call out of order, ex: feed after finish
+#define S3LP_EOPTION 6	// a prefilter option is malformed, ex: status_range "99-"
+
+/**
+ * Batch of parsed records, valid until the callback returns
+ * wide is NULL unless the parser was opened with options.wide, else wide[i] is logs[i]
+ * Return nonzero to stop the parser, feed then returns S3LP_ESTOPPED
+ */
+typedef int (*s3lp_batch_fn)(const s_log_t *logs, const s_log_wide_t *wide, size_t count, void *user);
+
+// Line the parser rejected, as it was read, with its PARSE_* code (see parse_status_name)
+typedef void (*s3lp_reject_fn)(const char *line, size_t length, int status, void *user);
+
+// Push parser settings, zeroed fields take the s3lp defaults
+typedef struct s3lp_options_s {
+	s3lp_batch_fn on_batch;	  // required
+	s3lp_reject_fn on_reject; // NULL drops rejected lines
+	void *user;				  // passed to both callbacks
+	size_t batch_size;		  // records per on_batch call, default BATCH_SIZE
+	int wide;				  // also build s_log_wide_t records
+	uint32_t dedup_window;	  // hours an (ip, key) pair counts as unique once, default DEDUP_WINDOW
+	const char *dedup_state;  // dedup snapshot to start from (s3lp -S), NULL starts empty
+	const geo_db_t *geo;	  // country table for location_id, borrowed, NULL leaves it unknown
+	// Prefilter (s3lp -O -B -K -H), lines that fail are skipped before they are parsed in full
+	// and only counted in stats.filtered. Comma separated names, copied, NULL keeps every line
+	const char *operations;	  // ex: "REST.GET.OBJECT"
+	const char *buckets;
+	const char *key_prefixes;
+	const char *status_range; // "200-299", "206" or "400-"
+} s3lp_options_t;
+
+// Push parser: raw log bytes in, record batches out through options.on_batch
+typedef struct s3lp_parser_s {
+	s3lp_options_t options;
+	s_context_t context; // dedup table and line counts, stats disabled
+	prefilter_t prefilter; // built from the options, context.prefilter points here when set
+	p_log_t parsed;		 // view of the line being parsed
+	char *line;			 // line arena, a partial line waits here between feeds
+	size_t line_length;
+	size_t line_capacity;
+	s_log_t *batch;
+	s_log_wide_t *wide_batch;
+	size_t count; // records waiting in batch
+	int state;	  // S3LP_OK until stopped, failed or finished
+	int finished;
+} s3lp_parser_t;
+
+// Pull reader: records of a mapped .bin file, filtered before they are handed out
+typedef struct s3lp_reader_s {
+	const uint8_t *data; // mapping, NULL for an empty file
+	size_t length;		 // whole records only
+	uint32_t record_size;
+	size_t next; // byte offset of the next record to test
+	catalog_query_t filter;
+	int filtered; // 0 hands out every record
+	uint64_t scanned; // records tested
+	uint64_t matched; // records handed out
+} s3lp_reader_t;
+
+//// Function Prototypes
+//
+// Push API
+int s3lp_parser_init(s3lp_parser_t *parser, const s3lp_options_t *options);
+int s3lp_parser_feed(s3lp_parser_t *parser, const void *data, size_t length);
+int s3lp_parser_finish(s3lp_parser_t *parser);
+int s3lp_parser_save(const s3lp_parser_t *parser, const char *path);
+const parse_stats_t *s3lp_parser_stats(const s3lp_parser_t *parser);
+void s3lp_parser_free(s3lp_parser_t *parser);
+
+// Pull API
+int s3lp_reader_open(s3lp_reader_t *reader, const char *path, int wide, const catalog_query_t *filter);
+size_t s3lp_reader_next_batch(s3lp_reader_t *reader, const void **records, size_t max);
+const void *s3lp_reader_next(s3lp_reader_t *reader);
+void s3lp_reader_close(s3lp_reader_t *reader);
+
+const char *s3lp_strerror(int code);
+
+
+#ifdef __cplusplus
+}
+#endif
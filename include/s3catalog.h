@@ -0,0 +1,84 @@
+#pragma once
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "s3lp.h"
+
+#define CATALOG_MANIFEST "MANIFEST"		 // in the dataset directory, one line per file
+#define CATALOG_LOCK "MANIFEST.lock"		 // serializes writers, readers never take it
+#define CATALOG_HEADER "# s3lp catalog v1: path bucket first last records record_size podcasts"
+#define CATALOG_PODCASTS_MAX 4096		 // listed per file, a file with more matches any podcast
+#define CATALOG_BATCH 8192				 // records a scan thread filters per pipe write
+#define CATALOG_THREADS_MAX 64
+
+// One .bin of a dataset, bucket from s3lp -b or -B, else <dir>/<bucket>/<file>.bin, else "-"
+typedef struct catalog_entry_s {
+	char *path;			 // relative to the dataset directory
+	char bucket[64];
+	uint32_t first;		 // earliest timestamp
+	uint32_t last;		 // latest timestamp
+	uint64_t records;
+	uint32_t record_size; // sizeof(s_log_t), or sizeof(s_log_wide_t) for s3lp -tw files
+	uint64_t *podcasts;	  // sorted podcast_hash values present
+	uint32_t podcast_count;
+	int any_podcast;	  // more than CATALOG_PODCASTS_MAX, never pruned on podcast
+	const uint8_t *data;  // records mapped by catalog_map, NULL to read the file
+} catalog_entry_t;
+
+typedef struct catalog_s {
+	char *dir;
+	catalog_entry_t *entries; // sorted by path
+	uint32_t count;
+	uint32_t capacity;
+} catalog_t;
+
+// Predicate over records, pruning files first: timestamp in [from, to), podcast if set
+typedef struct catalog_query_s {
+	uint32_t from;
+	uint32_t to;
+	int has_podcast;
+	uint32_t podcast_narrow; // hash_fold32 of the show, matched in s_log_t files
+	uint64_t podcast_wide;	 // hash64 of the show, matched in wide files
+} catalog_query_t;
+
+// Parallel scan of the files a query keeps, their matching records come out of one pipe
+typedef struct catalog_scan_s {
+	const catalog_t *catalog;
+	const catalog_query_t *query;
+	uint32_t *files; // entries to read
+	uint32_t file_count;
+	uint32_t record_size; // shared by every file read
+	uint32_t next; // next file to claim, under lock
+	int threads;
+	pthread_t workers[CATALOG_THREADS_MAX];
+	pthread_mutex_t lock; // file claims and pipe writes
+	int fd;				  // pipe write end, closed by the last worker out
+	int active;			  // workers still running
+	uint64_t scanned;	  // records read
+	uint64_t matched;	  // records written
+	int failed;
+} catalog_scan_t;
+
+//// Function Prototypes
+//
+int catalog_load(catalog_t *catalog, const char *dir);
+void catalog_free(catalog_t *catalog);
+int catalog_map(catalog_t *catalog);
+int catalog_write(const catalog_t *catalog);
+int catalog_scan_file(catalog_entry_t *entry, FILE *input, uint32_t record_size);
+int catalog_register(const char *dir, const char *file, uint32_t record_size, const char *bucket);
+int catalog_query_podcast(catalog_query_t *query, const char *podcast);
+int catalog_match(const catalog_entry_t *entry, const catalog_query_t *query);
+int catalog_record_match(const catalog_query_t *query, const void *record, uint32_t record_size);
+FILE *catalog_scan_start(catalog_scan_t *scan, const catalog_t *catalog, const catalog_query_t *query, int threads);
+int catalog_scan_finish(catalog_scan_t *scan);
+
+
+#ifdef __cplusplus
+}
+#endif
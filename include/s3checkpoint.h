@@ -0,0 +1,56 @@
+#pragma once
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/types.h>
+
+#include "s3lp.h"
+
+#define CHECKPOINT_EVERY 100		  // default batches between checkpoints (1M lines)
+#define CHECKPOINT_MAGIC "S3LPCKP3"	  // checkpoint file, 8 bytes
+#define CHECKPOINT_DEDUP_SUFFIX ".dedup" // dedup snapshots next to the checkpoint, + slot digit
+
+// One resume point, every offset is at a batch boundary so the output holds
+// exactly the records of the input before input_offset
+typedef struct checkpoint_record_s {
+	char magic[8];
+	int32_t output_filetype_flag; // resume refuses a different -t
+	int32_t dedup_slot;			  // snapshot written with this record, slots alternate
+	uint64_t input_offset;		// first input byte not yet in the output
+	uint64_t input_size;		// input length when written, resume refuses a shorter file
+	uint64_t output_offset;		// output length at input_offset
+	uint64_t quarantine_offset; // quarantine length at input_offset, 0 without -q
+	parse_stats_t stats;		// line accounting up to input_offset
+} checkpoint_record_t;
+
+// Checkpoint writer, the slow part (dedup snapshot, fsync) runs in a forked
+// child that sees the table copy-on-write while parsing carries on
+typedef struct checkpoint_s {
+	char *path;		  // checkpoint file
+	char *dedup_path; // path + CHECKPOINT_DEDUP_SUFFIX + slot, the slot digit is rewritten
+	uint32_t every;	  // batches between checkpoints
+	uint32_t batches; // batches since the last one
+	pid_t writer;	  // child still writing, 0 when none
+	int slot;		  // dedup snapshot slot the next checkpoint writes
+	uint64_t written; // checkpoints started
+	uint64_t skipped; // batches that found the previous writer still running
+	uint64_t failed;  // writers that exited with an error
+} checkpoint_t;
+
+//// Function Prototypes
+//
+int checkpoint_init(checkpoint_t *checkpoint, const char *path, uint32_t every);
+void checkpoint_batch(checkpoint_t *checkpoint, s_context_t *context, uint64_t input_offset, FILE *input,
+					  FILE *output);
+void checkpoint_finish(checkpoint_t *checkpoint, int completed);
+int checkpoint_resume(checkpoint_t *checkpoint, checkpoint_record_t *record, ip_track_t *track,
+					  uint32_t window_hours);
+FILE *checkpoint_reopen(const char *path, uint64_t offset);
+
+
+#ifdef __cplusplus
+}
+#endif
@@ -13,29 +13,83 @@ extern "C" {
 #include <unistd.h>
 
 #include "s3lp.h"
+#include "s3time.h"
 
-#define EXTRACT_OPTIONS "f:o:g:vh"
+#define EXTRACT_OPTIONS "f:o:g:s:i:k:r:m:j:c:q:a:p:T:z:O:L:M:D:F:U:P:S:wvh"
+#define EXTRACT_QUERY_OPTIONS "gTzFUPOLkrmqpac" // read by extract_query_option, each takes a value
+#define EXTRACT_ERROR_MAX 256
 #define GROUP_NONE 0
 #define GROUP_PODCAST 1
 #define GROUP_IP 2
-#define GROUP_TIME 3
+#define GROUP_TIME 3 // time_bucket_t width, days by default
+#define GROUP_COUNTRY 4
+#define GROUP_KEY 5 // episode (full key)
+#define GROUP_SYSTEM 6
+#define GROUP_PLATFORM 7
 #define GROUP_THRESHOLD 128
+#define LOG_GROUP_START 4 // records a new group has room for, doubled as it fills
 #define FLUSH_THRESHOLD 10000
-#define SECONDS_IN_DAY 86400
+#define QUANTILE_MAX 16 // quantiles printed per group
+#define GROUP_KEYS_MAX 4 // keys of a composite group, -g p,t,s
 
+// Records are held as s_log_wide_t, 28 byte s_log_t input is widened on read
 typedef struct log_group_s {
-	uint32_t group_key;
-	s_log_t *logs;
+	uint64_t group_key;
+	s_log_wide_t *logs;
 	int count;
 	int capacity;
 } log_group_t;
 
-int extract_to_json(FILE *input, FILE *output, int group_by, int verbose_flag);
-void print_log_as_json(s_log_t *log, FILE *output, int is_first);
-void print_grouped_json(log_group_t *groups, int group_count, FILE *output, int group_by);
-char *get_group_name(int group_by);
-char *format_timestamp(uint32_t timestamp);
-char *format_hash(uint32_t hash);
+// s3_extract run options
+typedef struct extract_config_s {
+	int group_by;	  // GROUP_*
+	int verbose;	  // progress on stderr every FLUSH_THRESHOLD records
+	int wide;		  // input is s3lp -t w records, hashes printed as 64 bit
+	s3_stats_t *perf; // stage timers, batches are FLUSH_THRESHOLD records
+	int top_k;		  // > 0 reports the top_k items of each group instead of the logs (s3topk.h)
+	int rank_by;	  // GROUP_* of the ranked item
+	int metric;		  // METRIC_* weight of each record
+	int threads;	  // top-K workers over a mapped input
+	int counters;	  // top-K sketch counters per group, 0 picks from top_k
+	int quantile_of;  // QUANTILE_* field summarized per group instead of the logs (s3quantile.h)
+	double alpha;	  // quantile relative accuracy
+	int quantile_count;
+	double quantiles[QUANTILE_MAX]; // in [0, 1]
+	const time_bucket_t *time_bucket; // GROUP_TIME width and reporting zone, NULL for UTC days
+	int aggregate;					  // 1 prints per group totals instead of the logs (s3aggregate.h)
+	int group_count;				  // keys in group_keys, group_by is the first
+	int group_keys[GROUP_KEYS_MAX];
+	int order_by;	// ORDER_* of aggregate output
+	uint64_t limit; // aggregate groups printed per innermost parent, 0 for all
+	uint64_t memory_budget; // bytes groups may hold before spilling to temporary files, 0 for no limit
+} extract_config_t;
+
+// Query options as s3_extract and s3_serve requests give them (EXTRACT_QUERY_OPTIONS).
+// Zone dependent values stay text until the caller has set up its time_bucket_t.
+typedef struct extract_query_s {
+	extract_config_t config; // verbose, wide, perf, threads, time_bucket, memory_budget are the caller's
+	int order_by;			 // -1 unless -O was given
+	const char *bucket_spec; // -T, -g h sets "h"
+	const char *time_zone;	 // -z
+	const char *from;		 // --from
+	const char *to;			 // --to
+	const char *podcast;	 // --podcast
+} extract_query_t;
+
+int extract_to_json(FILE *input, FILE *output, const extract_config_t *config);
+void extract_query_init(extract_query_t *query);
+int extract_query_option(extract_query_t *query, int option, const char *value, char *error);
+int extract_query_finish(extract_query_t *query, char *error);
+int read_record(FILE *input, int wide, s_log_wide_t *record);
+void widen_record(const s_log_t *slim, s_log_wide_t *record);
+uint64_t extract_group_key(const s_log_wide_t *log, int group_by, const extract_config_t *config);
+char *format_group_key(int group_by, uint64_t group_key, uint8_t flags, const extract_config_t *config);
+void print_log_as_json(const s_log_wide_t *log, FILE *output, int is_first, const extract_config_t *config);
+void print_grouped_json(log_group_t *groups, int group_count, FILE *output, const extract_config_t *config);
+const char *get_group_name(int group_by, const extract_config_t *config);
+char *format_timestamp(int64_t local);
+char *format_hash(uint64_t hash, int wide);
+char *format_ip(const s_log_wide_t *log, int wide);
 void print_help(void);
 
 
@@ -0,0 +1,38 @@
+#pragma once
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <stdio.h>
+
+#define GEO_UNKNOWN 0	  // location_id for no database / no matching range
+#define GEO_LINE_MAX 1024 // longest database row
+#define GEO_PREFETCH 4	  // Eytzinger levels prefetched ahead (16 nodes = one 64 byte line)
+
+// Checked once the search lands, start and country share a cache line
+typedef struct geo_leaf_s {
+	uint32_t start;	 // first address of the range
+	uint32_t country; // location_id
+} geo_leaf_t;
+
+// IPv4 -> country lookup table
+// Ranges are stored in Eytzinger (BFS) order, index 0 unused, so the top levels
+// of the implicit search tree share cache lines and every probe is branchless
+typedef struct geo_db_s {
+	uint32_t *range_end; // last address of each range, Eytzinger order
+	geo_leaf_t *leaf;	 // rest of each range, same order
+	size_t count;		 // ranges loaded
+} geo_db_t;
+
+//// Function Prototypes
+//
+geo_db_t *geo_db_load(const char *path);
+void geo_db_free(geo_db_t *db);
+uint8_t geo_country_id(const char *code);
+const char *geo_country_code(uint8_t location_id);
+
+
+#ifdef __cplusplus
+}
+#endif
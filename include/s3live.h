@@ -0,0 +1,96 @@
+#pragma once
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "s3lp.h"
+
+#define LIVE_OPTIONS "L:m:r:w:h"
+#define LIVE_MAGIC "S3LPLIV1"  // shared segment, 8 bytes
+#define LIVE_RECORDS (1 << 16) // recent records kept in the ring, 1.8 MB
+#define LIVE_MINUTES 60		   // per minute aggregates kept, the hour before the newest record
+#define LIVE_SKETCH_BITS 10	   // HyperLogLog registers = 1 << bits, about 3% error
+#define LIVE_SKETCH (1 << LIVE_SKETCH_BITS)
+#define LIVE_RETRIES 64		   // torn snapshot retries before a reader gives up
+#define LIVE_WINDOW 15		   // default minutes s3_live sums
+
+// One minute of traffic
+typedef struct live_minute_s {
+	uint32_t minute;	// timestamp / 60, 0 when the slot is unused
+	uint32_t requests;	// records
+	uint32_t downloads; // records flagged UNIQUE_IP
+	uint32_t reserved;
+	uint64_t bytes_kb;
+	uint8_t sketch[LIVE_SKETCH]; // HyperLogLog registers over ip_hash, merged across minutes for listeners
+} live_minute_t;
+
+// Start of the shared segment, the ring of capacity s_log_t follows it
+// Written by one s3lp, read by any number of processes. sequence is odd while a publish
+// is under way, a reader copies what it needs and keeps the copy only if sequence was
+// even and unchanged across it. Readers never write, so they cannot hold up the writer.
+typedef struct live_header_s {
+	char magic[8];
+	uint32_t capacity;	// records in the ring
+	int32_t pid;		// writer
+	uint64_t sequence;	// seqlock
+	uint64_t written;	// records ever published, the newest is ring[(written - 1) % capacity]
+	uint64_t late;		// records older than the minute table, kept in the ring only
+	uint64_t published; // unix time of the last publish
+	uint32_t newest;	// newest minute published
+	uint32_t reserved;
+	live_minute_t minutes[LIVE_MINUTES]; // minute m in slot m % LIVE_MINUTES
+} live_header_t;
+
+// s3lp's side of the segment
+typedef struct live_s {
+	char *name;
+	live_header_t *shared;
+	s_log_t *ring;
+	size_t length;						 // mapping
+	live_minute_t minutes[LIVE_MINUTES]; // private copy, only slots marked dirty are copied out
+	uint64_t dirty;						 // bit per slot changed since the last publish
+	uint32_t newest;
+	uint64_t late;
+	uint64_t written;
+	uint64_t publishes;
+} live_t;
+
+// A reader's mapping, read only
+typedef struct live_view_s {
+	const live_header_t *shared;
+	const s_log_t *ring;
+	size_t length;
+} live_view_t;
+
+// Totals of the minutes ending at the newest one
+typedef struct live_window_s {
+	uint32_t first; // first minute summed
+	uint32_t last;	// newest minute
+	uint64_t requests;
+	uint64_t downloads;
+	uint64_t bytes_kb;
+	double listeners; // distinct ip_hash, HyperLogLog estimate
+} live_window_t;
+
+//// Function Prototypes
+//
+// Writer
+int live_open(live_t *live, const char *name, uint32_t capacity);
+void live_publish(live_t *live, const s_log_t *records, size_t count);
+void live_close(live_t *live);
+
+// Readers
+int live_attach(live_view_t *view, const char *name);
+int live_snapshot(const live_view_t *view, live_header_t *header, s_log_t *recent, uint32_t *count);
+void live_window(const live_header_t *header, uint32_t minutes, live_window_t *window);
+double live_estimate(const uint8_t *sketch);
+void live_detach(live_view_t *view);
+void print_live_help(void);
+
+
+#ifdef __cplusplus
+}
+#endif
@@ -12,65 +12,106 @@ extern "C" {
 #include <time.h>
 #include <unistd.h>
 
-#define DJB2HASH 5381 // djb2 prime
+#include "s3geo.h"
+#include "s3stats.h"
+
 #define IP_HASH 12289 // prime number near batch size
 #define LOG_DEFAULT 1024
-#define PARSER_OPTIONS "f:o:vt::h"
+#define PARSER_OPTIONS "f:o:q:s:i:l:d:D:S:W:C:E:RA:b:L:U:O:B:H:K:vt:h"
 #define BATCH_SIZE 10000
 #define MEGABYTE 1048576
 #define fsize_KB 1000
+#define SECONDS_IN_DAY 86400
+#define READ_CHUNK MEGABYTE // line reader refill size
+#define DEDUP_WINDOW 24		// default hours an ip + key pair stays deduplicated
+#define DEDUP_MAX_LOAD_NUM 3 // windowed dedup table grows past 3/4 full
+#define DEDUP_MAX_LOAD_DEN 4
+#define DEDUP_MAGIC "S3LPDDP1" // dedup snapshot file, 8 bytes
 
 #define BIN_FILE 1025
 #define CSV_FILE 1026
+#define WIDE_FILE 1027 // binary s_log_wide_t records, 64 bit hashes
+
+// parse_log_entry return codes, also index parse_stats_t::rejected
+#define PARSE_OK 0
+#define PARSE_SHORT_LINE 1 // fewer than the 26 mandatory fields
+#define PARSE_BAD_STATUS 2 // http status missing or outside 200-599
+#define PARSE_TIME_FAIL 3  // timestamp not [dd/Mon/yyyy:HH:MM:SS +zzzz]
+#define PARSE_BAD_RANGE 4  // 206 range header present but not bytes=start-end
+#define PARSE_STATUS_COUNT 5
+#define PARSE_FILTERED -1 // well formed, failed the s3lp -O/-B/-H/-K prefilter (not counted as rejected)
 
-#define PARSE_TIME_FAIL 3
+// Byte range of one field inside the line arena
+// Fields are NUL terminated in place, so LOG_FIELD() can go straight to the string helpers
+typedef struct span_s {
+	uint32_t off;
+	uint32_t len;
+} span_t;
 
+// Parsed log - PRE-PROCESSING
+// Holds spans over the caller's line buffer instead of a private copy, one struct is
+// reused for every line so the hot loop stays inside L1/L2
 typedef struct p_log_s {
-	char buffer[LOG_DEFAULT];
+	char *line; // line arena, tokenized in place (NOT owned)
 	size_t length;
 
-	char *bucket_owner;
-	char *bucket_name; // Only lowercase letters, numbers, dots, and hyphens
-	struct tm time;	   // strftime format: [%d/%b/%Y:%H:%M:%S %z]
+	span_t bucket_owner;
+	span_t bucket_name; // Only lowercase letters, numbers, dots, and hyphens
+	time_t timestamp;	// strftime format: [%d/%b/%Y:%H:%M:%S %z]
 
-	char *remote_ip;
-	char *requester_id;
-	char *request_id;
+	span_t remote_ip;
+	span_t requester_id;
+	span_t request_id;
 
-	char *operation;
-	char *key;
+	span_t operation;
+	span_t key;
 
-	char *request_uri;
+	span_t request_uri;
 	int http_code;
-	char *err_code;
+	span_t err_code;
 
 	size_t bytes_sent;
 	size_t object_size;
 	time_t ms_ttime;
 	time_t ms_tatime;
 
-	char *referer;
-	char *user_agent;
-	char *ver_id;
-	char *host_id;
-
-	char *auth_sig;
-	char *cipher_suite;
-	char *auth_type;
-	char *host_header;
-	char *TLS_ver;
-	char *ARN_ap;
-	char *acl_required;
-	char *range_get;
+	span_t referer;
+	span_t user_agent;
+	span_t ver_id;
+	span_t host_id;
+
+	span_t auth_sig;
+	span_t cipher_suite;
+	span_t auth_type;
+	span_t host_header;
+	span_t TLS_ver;
+	span_t ARN_ap;
+	span_t acl_required;
+	span_t range_get;
 	size_t byte_start;
 	size_t byte_end;
+
+	// remote_ip as a number: exact IPv4, IPv6 /64 prefix, or hash64() of unparseable text
+	uint64_t ip_addr;
+	int ip_hashed; // ip_addr is not an exact IPv4, see IP_HASHED
+
+	// hash64() of the key and its show prefix, set as the field is closed
+	uint64_t key_hash64;
+	uint64_t podcast_hash64;
+
+	// hash64() of request_id and host_id, only with a redelivery filter (s3redelivery.h), 0 until set
+	uint64_t request_hash64;
+	uint64_t host_hash64;
 } p_log_t;
 
+// Resolve a span to its NUL terminated string, missing fields resolve to ""
+#define LOG_FIELD(log, field) ((log)->field.len ? (log)->line + (log)->field.off : "")
+
 // Slimed down log struct - POST-PROCESSING
-// 28 byte struct :D
+// 28 byte struct :D (location_id fills what was padding)
 typedef struct s_log_s {
 	uint32_t timestamp;			// mktime
-	uint32_t ip_hash;			// remote_ip
+	uint32_t ip_hash;			// remote_ip, exact IPv4 unless flags & IP_HASHED
 	uint32_t podcast_hash;		// key
 	uint32_t key_hash;			// key
 	uint16_t bytes_sent_kb;		// bytes_sent / 1024
@@ -81,8 +122,28 @@ typedef struct s_log_s {
 	uint8_t platform_id;		// user agent
 	uint8_t completion_percent; // bytes_sent / object_size
 	uint8_t flags;				// 8 Bit Flag for checking download progress
+	uint8_t location_id;		// remote_ip country, geo_country_code(), 0 = unknown
 } s_log_t;
 
+// Wide slim log, s_log_t with the full 64 bit hashes
+// Millions of keys or listeners collide at 32 bits, use -t w when grouping needs them distinct
+// 40 byte struct
+typedef struct s_log_wide_s {
+	uint64_t ip_hash;			// remote_ip, exact IPv4 or IPv6 /64 prefix unless flags & IP_HASHED
+	uint64_t podcast_hash;		// key
+	uint64_t key_hash;			// key
+	uint32_t timestamp;			// mktime
+	uint16_t bytes_sent_kb;		// bytes_sent / 1024
+	uint16_t object_size_kb;	// object_size
+	uint16_t download_time_ms;	// ms_ttime
+	uint8_t http_code;			// http_code
+	uint8_t system_id;			// user agent
+	uint8_t platform_id;		// user agent
+	uint8_t completion_percent; // bytes_sent / object_size
+	uint8_t flags;				// 8 Bit Flag for checking download progress
+	uint8_t location_id;		// remote_ip country, geo_country_code(), 0 = unknown
+} s_log_wide_t;
+
 // Enum Codes for System ID and Platform ID
 typedef enum {
 	UNKNOWN = 0,
@@ -122,19 +183,62 @@ typedef enum { //
 	UNIQUE_IP = 1,
 	STRT_206DL = 2,
 	MID_206DL = 4,
-	END_206DL = 8
+	END_206DL = 8,
+	IP_HASHED = 16 // ip_hash is not an exact IPv4 (IPv6 or unparseable remote_ip)
 } http_flag_t;
 
 // Unique IP Address manager, uses Hash Table
+// hours == NULL is a fixed size table where pairs never expire (tests, benches)
 typedef struct ip_track_s {
 	uint64_t *ip_hashes;
 	size_t count;
 	size_t capacity;
+	uint32_t *hours;	   // hour (timestamp / 3600) each pair last counted as unique
+	uint32_t window_hours; // pairs count again after this many hours
+	uint32_t now_hour;	   // hour of the line being deduplicated
+	uint64_t expired;	   // pairs dropped or reused after their window
+	int grow_failed;	   // a rehash could not allocate, the table ran past its load limit
+	void *mapping;		   // snapshot the arrays point into, NULL when on the heap
+	size_t mapping_length;
 } ip_track_t;
 
+// Line accounting for the whole run
+typedef struct parse_stats_s {
+	uint64_t lines;		 // lines read
+	uint64_t long_lines; // lines longer than LOG_DEFAULT (kept whole)
+	uint64_t malformed;	 // lines rejected by parse_log_entry
+	uint64_t rejected[PARSE_STATUS_COUNT]; // rejected lines per PARSE_* code
+	uint64_t duplicates; // lines dropped as a repeated delivery of a request (s3lp -U)
+	uint64_t filtered;	 // lines skipped by the prefilter (s3lp -O -B -H -K)
+} parse_stats_t;
+
+// Chunked line reader: lines are handed out in place from one buffer that only
+// grows when a single line is longer than the whole buffer
+typedef struct line_reader_s {
+	FILE *input;
+	char *buffer;
+	size_t capacity;
+	size_t start; // first unread byte
+	size_t end;	  // end of valid data
+	uint64_t base; // input offset of buffer[0]
+	int eof;
+	int stream;	 // refill with whatever read(2) returns instead of waiting for a full chunk
+	int drained; // stream only: read_line returned NULL once because no whole line was buffered
+	int error;	 // errno of the read or buffer growth that made read_line return NULL, 0 at EOF
+} line_reader_t;
+
 // provides context to some of the functions
 typedef struct s_context_s {
 	ip_track_t ip_track;
+	parse_stats_t stats;
+	s3_stats_t perf;  // stage timers and throughput, perf.enabled = 0 to skip
+	FILE *quarantine; // rejected lines with reason codes, NULL to drop them
+	geo_db_t *geo;	  // IPv4 -> country table, NULL leaves location_id unknown
+	struct session_table_s *sessions; // download stitching (s3session.h), NULL when off
+	struct checkpoint_s *checkpoint;  // periodic resume points (s3checkpoint.h), NULL when off
+	struct live_s *live;			  // rolling window in shared memory (s3live.h), NULL when off
+	struct redelivery_s *redelivery;  // repeated delivery filter (s3redelivery.h), NULL when off
+	struct prefilter_s *prefilter;	  // lines kept by operation, bucket, status, key (s3prefilter.h), NULL = all
 	int verbose;
 	int output_filetype_flag;
 } s_context_t;
@@ -142,15 +246,34 @@ typedef struct s_context_s {
 //// Function Prototypes
 //
 int process_log(FILE *log, FILE *output, s_context_t *context);
-void parse_log_entry(char *in_log, p_log_t *full_log, s_context_t *context);
+int parse_log_entry(char *in_log, p_log_t *full_log, s_context_t *context);
+void quarantine_log(p_log_t *full_log, int status, s_context_t *context);
+const char *parse_status_name(int status);
+int parse_timestamp(const char *field, size_t length, time_t *timestamp);
+int parse_range(const char *field, size_t length, size_t *byte_start, size_t *byte_end);
+int parse_ipv4(const char *field, size_t length, uint32_t *ip);
+int parse_ipv6(const char *field, size_t length, uint16_t groups[8]);
+
+// Line Reader
+int line_reader_init(line_reader_t *reader, FILE *input);
+char *read_line(line_reader_t *reader, size_t *length);
+void line_reader_free(line_reader_t *reader);
+
+// Input offset of the next unread line
+static inline uint64_t
+line_reader_offset(const line_reader_t *reader)
+{
+	return reader->base + reader->start;
+}
 
 // Extract Log and Send to Slim
 void extract_log_entry(p_log_t *full_log, s_log_t *slim_log, s_context_t *context);
+void widen_log_entry(const p_log_t *full_log, const s_log_t *slim_log, s_log_wide_t *wide_log);
 uint32_t extract_path(const char *key);
 uint32_t hash_key(const char *key);
 uint8_t extract_system(const char *device);
 uint8_t extract_platform(const char *user_agent);
-uint8_t extract_location(const char *location);
+uint8_t extract_location(uint32_t ip, const geo_db_t *db);
 uint8_t set_flags(p_log_t *full_log, s_log_t *slim_log, s_context_t *context);
 
 // Might want another wrapper around is_unique_ip that updates a analytics struct
@@ -158,13 +281,19 @@ uint8_t set_flags(p_log_t *full_log, s_log_t *slim_log, s_context_t *context);
 // Instead of having the hash there, we have a struct that has counts, manages the opener download
 // and closer download requests as 1 unique entity with bit flags
 int is_unique_ip(uint32_t ip_hash, uint32_t key_hash, s_context_t *context);
+int ip_track_init(ip_track_t *track, size_t capacity, uint32_t window_hours);
+int ip_track_load(ip_track_t *track, const char *path, uint32_t window_hours);
+int ip_track_save(const ip_track_t *track, const char *path);
+void ip_track_free(ip_track_t *track);
 //
 //
 int check_pattern(const char *check_str, const char *pattern);
 
 // Process Slim Logs
 void process_slim_logs(s_log_t *slim_log, int num_entries, FILE *output, s_context_t *context);
+void output_CSV_header(FILE *output);
 void output_CSV(s_log_t *slim_log, int num_entrie, FILE *output, s_context_t *context);
+void process_wide_logs(s_log_wide_t *wide_log, int num_entries, FILE *output, s_context_t *context);
 
 // Faster atoi conversion, less err checking overhead
 static inline int
@@ -190,6 +319,96 @@ fast_atol(const char *str)
 	return val;
 }
 
+// HASHING -------------------------------------------------------------------------------------
+// wyhash (Wang Yi, public domain), reads 8 bytes at a time instead of DJB2's one
+static const uint64_t HASH64_SECRET[4] = {0xa0761d6478bd642full, 0xe7037ed1a0b428dbull, 0x8ebc6af09c88c6e3ull,
+										  0x589965cc75374cc3ull};
+
+static inline uint64_t
+hash64_mix(uint64_t a, uint64_t b)
+{
+	__uint128_t r = (__uint128_t)a * b;
+	return (uint64_t)r ^ (uint64_t)(r >> 64);
+}
+
+static inline uint64_t
+hash64_read8(const uint8_t *p)
+{
+	uint64_t v;
+	memcpy(&v, p, 8);
+	return v;
+}
+
+static inline uint64_t
+hash64_read4(const uint8_t *p)
+{
+	uint32_t v;
+	memcpy(&v, p, 4);
+	return v;
+}
+
+/**
+ * @BRIEF 64 bit hash of a byte range
+ * @PARAM data   : Bytes to hash, need not be NUL terminated
+ * @PARAM length : Number of bytes
+ * @RETURN 64 bit hash, fold with hash_fold32() for the s_log_t fields
+ */
+static inline uint64_t
+hash64(const void *data, size_t length)
+{
+	const uint8_t *p = (const uint8_t *)data;
+	const uint64_t *s = HASH64_SECRET;
+	uint64_t seed = hash64_mix(s[0], s[1]);
+	uint64_t a, b;
+
+	if (length <= 16) {
+		if (length >= 4) {
+			size_t mid = (length >> 3) << 2;
+			a = (hash64_read4(p) << 32) | hash64_read4(p + mid);
+			b = (hash64_read4(p + length - 4) << 32) | hash64_read4(p + length - 4 - mid);
+		}
+		else if (length > 0) {
+			a = ((uint64_t)p[0] << 16) | ((uint64_t)p[length >> 1] << 8) | p[length - 1];
+			b = 0;
+		}
+		else {
+			a = b = 0;
+		}
+	}
+	else {
+		size_t i = length;
+		if (i > 48) {
+			uint64_t see1 = seed, see2 = seed;
+			do {
+				seed = hash64_mix(hash64_read8(p) ^ s[1], hash64_read8(p + 8) ^ seed);
+				see1 = hash64_mix(hash64_read8(p + 16) ^ s[2], hash64_read8(p + 24) ^ see1);
+				see2 = hash64_mix(hash64_read8(p + 32) ^ s[3], hash64_read8(p + 40) ^ see2);
+				p += 48;
+				i -= 48;
+			} while (i > 48);
+			seed ^= see1 ^ see2;
+		}
+		while (i > 16) {
+			seed = hash64_mix(hash64_read8(p) ^ s[1], hash64_read8(p + 8) ^ seed);
+			i -= 16;
+			p += 16;
+		}
+		a = hash64_read8(p + i - 16);
+		b = hash64_read8(p + i - 8);
+	}
+	a ^= s[1];
+	b ^= seed;
+	__uint128_t r = (__uint128_t)a * b;
+	return hash64_mix((uint64_t)r ^ s[0] ^ length, (uint64_t)(r >> 64) ^ s[1]);
+}
+
+// 64 -> 32 bit fold for the 28 byte s_log_t
+static inline uint32_t
+hash_fold32(uint64_t hash)
+{
+	return (uint32_t)(hash ^ (hash >> 32));
+}
+
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,93 @@
+#pragma once
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+
+#include "s3lp.h"
+
+#define PREFILTER_NAMES 16 // names per set, -O / -B / -K may repeat or take a comma list
+
+// Fields the tokenizer checks, S3 access log positions
+#define PREFILTER_FIELD_BUCKET 1
+#define PREFILTER_FIELD_OPERATION 6
+#define PREFILTER_FIELD_KEY 7
+#define PREFILTER_FIELD_STATUS 9
+
+// Names a field must equal, or start with for prefix sets. Empty = any
+typedef struct prefilter_set_s {
+	uint32_t count;
+	uint32_t lengths[PREFILTER_NAMES];
+	char *names[PREFILTER_NAMES]; // owned
+} prefilter_set_t;
+
+// Line prefilter (s3lp -O -B -H -K)
+// parse_log_entry hands each field to prefilter_field as soon as its span is known, before
+// store_field parses or hashes it, so a line that fails stops tokenizing right there: a
+// bucket mismatch skips the timestamp, an operation mismatch skips the key hash.
+typedef struct prefilter_s {
+	prefilter_set_t buckets;
+	prefilter_set_t operations;
+	prefilter_set_t key_prefixes;
+	int status_min; // inclusive, 0 when -H was not given
+	int status_max;
+	int last_field; // no check past this field, 0 = none
+} prefilter_t;
+
+//// Function Prototypes
+//
+int prefilter_add(prefilter_t *filter, int field, const char *list);
+int prefilter_status(prefilter_t *filter, const char *range);
+void prefilter_free(prefilter_t *filter);
+
+// Exact match when prefix is 0
+static inline int
+prefilter_set_matches(const prefilter_set_t *set, const char *field, uint32_t length, int prefix)
+{
+	for (uint32_t i = 0; i < set->count; i++) {
+		uint32_t want = set->lengths[i];
+		if ((prefix ? length >= want : length == want) && memcmp(field, set->names[i], want) == 0) {
+			return 1;
+		}
+	}
+	return set->count == 0;
+}
+
+/**
+ * @BRIEF Checks one field of the line being tokenized
+ * @PARAM filter      : Prefilter
+ * @PARAM field_index : Position of the field in the S3 log format
+ * @PARAM field       : Field text, NUL terminated
+ * @PARAM length      : Field length
+ * @RETURN 1 when the line fails the prefilter and can be dropped, else 0
+ *
+ * @DETAILS A status that is not 3 digits passes, so store_field still rejects it as malformed.
+ */
+static inline int
+prefilter_field(const prefilter_t *filter, int field_index, const char *field, uint32_t length)
+{
+	switch (field_index) {
+	case PREFILTER_FIELD_BUCKET:
+		return !prefilter_set_matches(&filter->buckets, field, length, 0);
+	case PREFILTER_FIELD_OPERATION:
+		return !prefilter_set_matches(&filter->operations, field, length, 0);
+	case PREFILTER_FIELD_KEY:
+		return !prefilter_set_matches(&filter->key_prefixes, field, length, 1);
+	case PREFILTER_FIELD_STATUS: {
+		if (filter->status_min == 0 || length != 3 || (uint8_t)(field[0] - '0') > 9 || (uint8_t)(field[1] - '0') > 9 ||
+			(uint8_t)(field[2] - '0') > 9) {
+			return 0;
+		}
+		int status = (field[0] - '0') * 100 + (field[1] - '0') * 10 + (field[2] - '0');
+		return status < filter->status_min || status > filter->status_max;
+	}
+	default:
+		return 0;
+	}
+}
+
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,57 @@
+#pragma once
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "s3extract.h"
+
+#define QUANTILE_ALPHA 0.01	   // default relative accuracy
+#define QUANTILE_MAX_BINS 8192 // bins per sketch, covers 1..65535 down to alpha 0.001, the lowest fold past it
+#define QUANTILE_SLACK_BINS 32 // spare bins added when a sketch grows
+#define QUANTILE_TABLE 65536   // values with a precomputed bin (every uint16_t field)
+
+// Field a sketch summarizes
+#define QUANTILE_NONE 0
+#define QUANTILE_TIME 1	 // download_time_ms
+#define QUANTILE_BYTES 2 // bytes_sent_kb
+
+// Value -> bin mapping shared by every sketch of one accuracy
+// bin i holds (gamma^(i-1), gamma^i], gamma = (1 + alpha) / (1 - alpha)
+typedef struct dd_mapping_s {
+	double alpha;
+	double gamma;
+	double log_gamma;
+	int16_t *table; // bin of every value below QUANTILE_TABLE, no log per record
+} dd_mapping_t;
+
+// DDSketch: any quantile within alpha relative error, mergeable, a few KB
+typedef struct dd_sketch_s {
+	const dd_mapping_t *mapping;
+	uint64_t *bins;
+	int32_t offset;		 // bin index of bins[0]
+	uint32_t bin_count;	 // bins allocated
+	uint64_t zero_count; // values of 0
+	uint64_t count;
+	uint64_t sum;
+	uint64_t min;
+	uint64_t max;
+} dd_sketch_t;
+
+//// Function Prototypes
+//
+int dd_mapping_init(dd_mapping_t *mapping, double alpha);
+void dd_mapping_free(dd_mapping_t *mapping);
+void dd_sketch_init(dd_sketch_t *sketch, const dd_mapping_t *mapping);
+void dd_sketch_free(dd_sketch_t *sketch);
+int dd_sketch_add(dd_sketch_t *sketch, uint64_t value);
+int dd_sketch_merge(dd_sketch_t *dst, const dd_sketch_t *src);
+double dd_sketch_quantile(const dd_sketch_t *sketch, double q);
+int extract_quantiles(FILE *input, FILE *output, const extract_config_t *config);
+
+
+#ifdef __cplusplus
+}
+#endif
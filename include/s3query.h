@@ -0,0 +1,20 @@
+#pragma once
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stddef.h>
+
+#include "s3aggregate.h"
+
+#define QUERY_BATCH 4096 // records read and key packed per step of s3_extract's composite groups
+
+//// Function Prototypes
+//
+void query_pack_keys(const composite_key_t *layout, const extract_config_t *config, const void *records,
+					 size_t count, packed_key_t *keys);
+
+
+#ifdef __cplusplus
+}
+#endif
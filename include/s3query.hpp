@@ -0,0 +1,483 @@
+#pragma once
+// Typed query kernels over slim logs, header only
+//
+// GroupBy<PodcastKey, DayKey>::Aggregate<Count, Sum<&s_log_t::bytes_sent_kb>, Avg<&s_log_t::download_time_ms>>
+// is a hash aggregate whose key packing and per group updates are fixed at compile time. Keys
+// pack into the same packed_key_t layout as s3_extract's composite groups (composite_key_init),
+// so composite_key_part, format_group_key and the aggregate printer read them unchanged. The
+// same templates back query_pack_keys, which s3_extract calls with its runtime -g keys.
+//
+//     GroupBy<PodcastKey, DayKey>::Aggregate<Count, Sum<&s_log_t::bytes_sent_kb>> totals(&config);
+//     totals.add(logs, count); // s_log_t, or s_log_wide_t when config.wide
+//     totals.sort();
+//     for (const auto &group : totals)
+//         printf("%lx %ld %lu\n", totals.key(group, 0), totals.key(group, 1), totals.value<1>(group));
+
+#include <algorithm>
+#include <array>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <tuple>
+#include <type_traits>
+
+#include "s3aggregate.h"
+#include "s3query.h"
+#include "s3time.h"
+
+namespace s3q {
+
+template <class Log> constexpr bool is_wide = std::is_same_v<Log, s_log_wide_t>;
+
+// RECORD FIELDS -------------------------------------------------------------------------------
+// Fields are named by their s_log_t member, the s_log_wide_t member of the same name is read
+// from wide records.
+
+template <auto Field> struct WideField;
+#define S3Q_WIDE_FIELD(name)                                                                                           \
+	template <> struct WideField<&s_log_t::name> {                                                                     \
+		static constexpr auto member = &s_log_wide_t::name;                                                            \
+	}
+S3Q_WIDE_FIELD(timestamp);
+S3Q_WIDE_FIELD(ip_hash);
+S3Q_WIDE_FIELD(podcast_hash);
+S3Q_WIDE_FIELD(key_hash);
+S3Q_WIDE_FIELD(bytes_sent_kb);
+S3Q_WIDE_FIELD(object_size_kb);
+S3Q_WIDE_FIELD(download_time_ms);
+S3Q_WIDE_FIELD(http_code);
+S3Q_WIDE_FIELD(system_id);
+S3Q_WIDE_FIELD(platform_id);
+S3Q_WIDE_FIELD(completion_percent);
+S3Q_WIDE_FIELD(flags);
+S3Q_WIDE_FIELD(location_id);
+#undef S3Q_WIDE_FIELD
+
+template <auto Field, class Log>
+inline uint64_t
+field_value(const Log &log)
+{
+	static_assert(std::is_same_v<Log, s_log_t> || is_wide<Log>, "records are s_log_t or s_log_wide_t");
+	if constexpr (is_wide<Log>) {
+		return log.*WideField<Field>::member;
+	}
+	else {
+		return log.*Field;
+	}
+}
+// END RECORD FIELDS ---------------------------------------------------------------------------
+
+// GROUP KEYS ----------------------------------------------------------------------------------
+// A key reads its part of a record as extract_group_key does. GROUP_TIME is packed as a bucket
+// index by pack_time, a batch at a time.
+
+// What packing needs beyond the record, taken from the extract config
+struct KeyContext {
+	const time_bucket_t *bucket; // NULL for UTC days
+	uint32_t time_unit;			 // seconds per bucket index, composite_key_t::time_unit
+	int fixed_width;			 // buckets are whole divisions of a day, not weeks or months
+
+	explicit KeyContext(const extract_config_t *config)
+		: bucket(config->time_bucket),
+		  time_unit((bucket != NULL && bucket->unit == BUCKET_SECONDS) ? bucket->width : SECONDS_IN_DAY),
+		  fixed_width((bucket == NULL || bucket->unit == BUCKET_SECONDS) && SECONDS_IN_DAY % time_unit == 0)
+	{
+	}
+
+	/**
+	 * @BRIEF UTC offset shared by every timestamp of a batch
+	 * @PARAM logs   : Batch
+	 * @PARAM count  : Records in the batch
+	 * @PARAM offset : Set to the offset when there is one
+	 * @RETURN 1 when no zone transition falls inside the batch's time range
+	 */
+	template <class Log>
+	int
+	batch_offset(const Log *logs, size_t count, int32_t *offset) const
+	{
+		if (bucket == NULL) {
+			*offset = 0;
+			return 1;
+		}
+		const time_zone_t *zone = &bucket->zone;
+		if (zone->count == 0) {
+			*offset = zone->initial;
+			return 1;
+		}
+		uint32_t first = UINT32_MAX;
+		uint32_t last = 0;
+		for (size_t i = 0; i < count; i++) {
+			first = std::min(first, logs[i].timestamp);
+			last = std::max(last, logs[i].timestamp);
+		}
+		const int64_t *next = std::upper_bound(zone->at, zone->at + zone->count, (int64_t)first);
+		*offset = time_zone_offset(zone, first);
+		return next == zone->at + zone->count || *next > (int64_t)last;
+	}
+};
+
+struct PodcastKey {
+	static constexpr int group = GROUP_PODCAST;
+	template <class Log> static uint64_t get(const Log &log) { return log.podcast_hash; }
+};
+
+struct IpKey {
+	static constexpr int group = GROUP_IP;
+	template <class Log>
+	static uint64_t
+	get(const Log &log)
+	{
+		// Narrow hashed addresses share the 32 bit space with exact IPv4, keep them apart
+		if constexpr (is_wide<Log>) {
+			return log.ip_hash;
+		}
+		else {
+			return log.ip_hash | (uint64_t)((log.flags & IP_HASHED) != 0) << 32;
+		}
+	}
+};
+
+// Bucket width and zone come from config->time_bucket, days in UTC without one
+struct TimeKey {
+	static constexpr int group = GROUP_TIME;
+};
+using DayKey = TimeKey;
+
+struct CountryKey {
+	static constexpr int group = GROUP_COUNTRY;
+	template <class Log> static uint64_t get(const Log &log) { return log.location_id; }
+};
+
+struct EpisodeKey {
+	static constexpr int group = GROUP_KEY;
+	template <class Log> static uint64_t get(const Log &log) { return log.key_hash; }
+};
+
+struct SystemKey {
+	static constexpr int group = GROUP_SYSTEM;
+	template <class Log> static uint64_t get(const Log &log) { return log.system_id; }
+};
+
+struct PlatformKey {
+	static constexpr int group = GROUP_PLATFORM;
+	template <class Log> static uint64_t get(const Log &log) { return log.platform_id; }
+};
+
+// Bucket indexes of a batch: one add and divide per record when the batch sits between zone
+// transitions, time_bucket_key per record otherwise
+template <class Log>
+inline void
+pack_time(const Log *logs, size_t count, const KeyContext &context, int shift, packed_key_t *keys)
+{
+	uint64_t unit = context.time_unit;
+	int32_t offset = 0;
+	if (context.fixed_width && context.batch_offset(logs, count, &offset)) {
+		uint64_t base = (uint64_t)(AGGREGATE_TIME_BIAS + offset);
+		for (size_t i = 0; i < count; i++) {
+			keys[i] |= (packed_key_t)((logs[i].timestamp + base) / unit) << shift;
+		}
+		return;
+	}
+	for (size_t i = 0; i < count; i++) {
+		int64_t start = time_bucket_key(context.bucket, logs[i].timestamp);
+		keys[i] |= (packed_key_t)(uint64_t)((start + AGGREGATE_TIME_BIAS) / (int64_t)unit) << shift;
+	}
+}
+
+// ORs one key's part of every record of a batch into keys
+template <class Key, class Log>
+inline void
+pack_column(const Log *logs, size_t count, const KeyContext &context, int shift, packed_key_t *keys)
+{
+	if constexpr (Key::group == GROUP_TIME) {
+		pack_time(logs, count, context, shift, keys);
+	}
+	else {
+		for (size_t i = 0; i < count; i++) {
+			keys[i] |= (packed_key_t)Key::get(logs[i]) << shift;
+		}
+	}
+}
+// END GROUP KEYS ------------------------------------------------------------------------------
+
+// AGGREGATES ----------------------------------------------------------------------------------
+// An aggregate keeps `words` uint64_t of state per group, init sets them for a new group.
+
+struct Count {
+	static constexpr int words = 1;
+	static void init(uint64_t *state) { state[0] = 0; }
+	template <class Log> static void add(uint64_t *state, const Log &) { state[0]++; }
+	static void merge(uint64_t *state, const uint64_t *other) { state[0] += other[0]; }
+	static uint64_t result(const uint64_t *state) { return state[0]; }
+};
+
+// Records flagged UNIQUE_IP, the "unique" of s3_extract totals
+struct Unique {
+	static constexpr int words = 1;
+	static void init(uint64_t *state) { state[0] = 0; }
+	template <class Log> static void add(uint64_t *state, const Log &log) { state[0] += (log.flags & UNIQUE_IP) != 0; }
+	static void merge(uint64_t *state, const uint64_t *other) { state[0] += other[0]; }
+	static uint64_t result(const uint64_t *state) { return state[0]; }
+};
+
+template <auto Field> struct Sum {
+	static constexpr int words = 1;
+	static void init(uint64_t *state) { state[0] = 0; }
+	template <class Log> static void add(uint64_t *state, const Log &log) { state[0] += field_value<Field>(log); }
+	static void merge(uint64_t *state, const uint64_t *other) { state[0] += other[0]; }
+	static uint64_t result(const uint64_t *state) { return state[0]; }
+};
+
+template <auto Field> struct Avg {
+	static constexpr int words = 2; // sum, count
+	static void init(uint64_t *state) { state[0] = state[1] = 0; }
+	template <class Log>
+	static void
+	add(uint64_t *state, const Log &log)
+	{
+		state[0] += field_value<Field>(log);
+		state[1]++;
+	}
+	static void
+	merge(uint64_t *state, const uint64_t *other)
+	{
+		state[0] += other[0];
+		state[1] += other[1];
+	}
+	static double result(const uint64_t *state) { return (state[1] == 0) ? 0.0 : (double)state[0] / state[1]; }
+};
+
+template <auto Field> struct Min {
+	static constexpr int words = 1;
+	static void init(uint64_t *state) { state[0] = UINT64_MAX; }
+	template <class Log> static void add(uint64_t *state, const Log &log) { state[0] = std::min(state[0], field_value<Field>(log)); }
+	static void merge(uint64_t *state, const uint64_t *other) { state[0] = std::min(state[0], other[0]); }
+	static uint64_t result(const uint64_t *state) { return state[0]; }
+};
+
+template <auto Field> struct Max {
+	static constexpr int words = 1;
+	static void init(uint64_t *state) { state[0] = 0; }
+	template <class Log> static void add(uint64_t *state, const Log &log) { state[0] = std::max(state[0], field_value<Field>(log)); }
+	static void merge(uint64_t *state, const uint64_t *other) { state[0] = std::max(state[0], other[0]); }
+	static uint64_t result(const uint64_t *state) { return state[0]; }
+};
+// END AGGREGATES ------------------------------------------------------------------------------
+
+// GROUP BY ------------------------------------------------------------------------------------
+// Where each aggregate's words start in a group's state
+template <class... Ops>
+constexpr std::array<int, sizeof...(Ops)>
+state_offsets()
+{
+	std::array<int, sizeof...(Ops)> offsets{};
+	int sizes[] = {Ops::words...};
+	for (size_t i = 0, at = 0; i < sizeof...(Ops); at += sizes[i++]) {
+		offsets[i] = (int)at;
+	}
+	return offsets;
+}
+
+template <class... Keys> struct GroupBy {
+	static_assert(sizeof...(Keys) >= 1 && sizeof...(Keys) <= GROUP_KEYS_MAX, "1 to GROUP_KEYS_MAX keys");
+
+	// Packed keys of a batch, as composite_key_pack gives them one record at a time
+	template <class Log>
+	static void
+	pack(const composite_key_t &layout, const KeyContext &context, const Log *logs, size_t count, packed_key_t *keys)
+	{
+		memset(keys, 0, count * sizeof(packed_key_t));
+		int level = 0;
+		(pack_column<Keys>(logs, count, context, layout.shift[level++], keys), ...);
+	}
+
+	// Hash aggregate with open addressing over the packed key, groups stay dense for sorting
+	template <class... Ops> class Aggregate {
+	  public:
+		static_assert(sizeof...(Ops) >= 1, "at least one aggregate");
+		static constexpr int words = (Ops::words + ...);
+
+		struct Group {
+			packed_key_t key;
+			uint64_t state[words];
+		};
+
+		// Keys, record width and time bucket from config, its group_keys are ignored
+		explicit Aggregate(const extract_config_t *config) : config_(*config), context_(config)
+		{
+			config_.group_count = sizeof...(Keys);
+			int level = 0;
+			((config_.group_keys[level++] = Keys::group), ...);
+			valid_ = (composite_key_init(&layout_, &config_) == 0);
+		}
+		~Aggregate()
+		{
+			free(groups_);
+			free(index_);
+			free(keys_);
+		}
+		Aggregate(const Aggregate &) = delete;
+		Aggregate &operator=(const Aggregate &) = delete;
+
+		/**
+		 * @BRIEF Adds records to their groups
+		 * @PARAM logs  : Records, s_log_wide_t when the config is wide
+		 * @PARAM count : Number of records
+		 * @RETURN 0 on success, 1 on allocation failure or records of the other width
+		 */
+		template <class Log>
+		int
+		add(const Log *logs, size_t count)
+		{
+			if (!valid_ || is_wide<Log> != (config_.wide != 0)) {
+				return 1;
+			}
+			if (keys_ == NULL && (keys_ = (packed_key_t *)malloc(QUERY_BATCH * sizeof(packed_key_t))) == NULL) {
+				return 1;
+			}
+			for (size_t start = 0; start < count; start += QUERY_BATCH) {
+				size_t batch = std::min<size_t>(QUERY_BATCH, count - start);
+				pack(layout_, context_, logs + start, batch, keys_);
+				for (size_t i = 0; i < batch; i++) {
+					Group *group = find(keys_[i]);
+					if (group == NULL) {
+						return 1;
+					}
+					update(group->state, logs[start + i]);
+				}
+			}
+			return 0;
+		}
+
+		// Adds the groups of another aggregate over the same keys, ex: one per thread
+		int
+		merge(const Aggregate &other)
+		{
+			for (const Group &partial : other) {
+				Group *group = find(partial.key);
+				if (group == NULL) {
+					return 1;
+				}
+				size_t op = 0;
+				((Ops::merge(group->state + offsets_[op], partial.state + offsets_[op]), op++), ...);
+			}
+			return 0;
+		}
+
+		// Key order, outermost key first
+		void
+		sort()
+		{
+			std::sort(groups_, groups_ + count_, [](const Group &a, const Group &b) { return a.key < b.key; });
+			rebuild();
+		}
+
+		uint32_t size() const { return count_; }
+		const Group *begin() const { return groups_; }
+		const Group *end() const { return groups_ + count_; }
+		const composite_key_t &layout() const { return layout_; }
+
+		// Key of one level, as extract_group_key gives it (for format_group_key)
+		uint64_t key(const Group &group, int level) const { return composite_key_part(&layout_, group.key, level); }
+
+		// Result of the I-th aggregate
+		template <size_t I>
+		auto
+		value(const Group &group) const
+		{
+			using Op = std::tuple_element_t<I, std::tuple<Ops...>>;
+			return Op::result(group.state + offsets_[I]);
+		}
+
+	  private:
+		static constexpr std::array<int, sizeof...(Ops)> offsets_ = state_offsets<Ops...>();
+
+		template <class Log>
+		static void
+		update(uint64_t *state, const Log &log)
+		{
+			size_t op = 0;
+			(Ops::add(state + offsets_[op++], log), ...);
+		}
+
+		uint32_t
+		home(packed_key_t key) const
+		{
+			return (uint32_t)hash64_mix((uint64_t)key ^ HASH64_SECRET[0], (uint64_t)(key >> 64) ^ HASH64_SECRET[3]) &
+				   index_mask_;
+		}
+
+		// Group of key, a new one initialized; NULL on allocation failure
+		Group *
+		find(packed_key_t key)
+		{
+			if (count_ == capacity_ && grow() != 0) {
+				return NULL;
+			}
+			uint32_t slot = home(key);
+			for (; index_[slot] != 0; slot = (slot + 1) & index_mask_) {
+				Group *group = &groups_[index_[slot] - 1];
+				if (group->key == key) {
+					return group;
+				}
+			}
+			Group *group = &groups_[count_];
+			group->key = key;
+			size_t op = 0;
+			(Ops::init(group->state + offsets_[op++]), ...);
+			index_[slot] = ++count_;
+			return group;
+		}
+
+		// Doubles the groups and the index, the index stays at most half full
+		int
+		grow()
+		{
+			uint32_t capacity = (capacity_ == 0) ? AGGREGATE_START_GROUPS : capacity_ * 2;
+			Group *groups = (Group *)realloc(groups_, capacity * sizeof(Group));
+			uint32_t *index = (uint32_t *)calloc(capacity * 2, sizeof(uint32_t));
+			if (groups == NULL || index == NULL) {
+				groups_ = (groups != NULL) ? groups : groups_;
+				free(index);
+				return 1;
+			}
+			groups_ = groups;
+			free(index_);
+			index_ = index;
+			capacity_ = capacity;
+			index_mask_ = capacity * 2 - 1;
+			rebuild();
+			return 0;
+		}
+
+		void
+		rebuild()
+		{
+			if (index_ == NULL) {
+				return;
+			}
+			memset(index_, 0, (index_mask_ + 1) * sizeof(uint32_t));
+			for (uint32_t i = 0; i < count_; i++) {
+				uint32_t slot = home(groups_[i].key);
+				while (index_[slot] != 0) {
+					slot = (slot + 1) & index_mask_;
+				}
+				index_[slot] = i + 1;
+			}
+		}
+
+		extract_config_t config_;
+		KeyContext context_;
+		composite_key_t layout_;
+		int valid_ = 0;
+		Group *groups_ = NULL;
+		uint32_t *index_ = NULL;
+		uint32_t index_mask_ = 0;
+		uint32_t count_ = 0;
+		uint32_t capacity_ = 0;
+		packed_key_t *keys_ = NULL; // one batch
+	};
+};
+// END GROUP BY --------------------------------------------------------------------------------
+
+} // namespace s3q
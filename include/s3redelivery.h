@@ -0,0 +1,71 @@
+#pragma once
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+
+#include "s3lp.h"
+
+#define REDELIVERY_WINDOW 1				// default hours of log time a request is remembered, -U
+#define REDELIVERY_GENERATIONS 4		// Bloom filters, the window spans all but the newest
+#define REDELIVERY_BLOCK_BITS 18		// 64 byte lines, 16 MB, each holds a 128 bit block of every generation
+#define REDELIVERY_BLOCKS (1 << REDELIVERY_BLOCK_BITS)
+#define REDELIVERY_PROBES 4				// bits set per generation, 7 hash bits each
+#define REDELIVERY_CONFIRM (1 << 18)	// requests kept exactly at first, grows while all are in the window
+#define REDELIVERY_CONFIRM_MAX (1 << 22) // exact window cap, 144 MB, past it the oldest requests are forgotten
+#define REDELIVERY_END UINT32_MAX		// end of a hash chain
+
+// A request as S3 names it: request id plus host id, hashed
+typedef struct redelivery_key_s {
+	uint64_t id;
+	uint64_t host;
+} redelivery_key_t;
+
+// Exact window entry, a chain step is one 32 byte read
+typedef struct redelivery_slot_s {
+	redelivery_key_t key;
+	uint64_t sequence;	 // insert number, falls along a chain
+	uint32_t next;		 // hash chain, newest first
+	uint32_t generation; // newest generation when inserted
+} redelivery_slot_t;
+
+// Repeated log delivery filter
+// A rotating blocked Bloom filter answers "new" for almost every line. The generations are
+// interleaved, so a key's block in every one of them shares a cache line and a check costs
+// one miss. Hits are confirmed against the exact keys of every request the filters still
+// cover (up to REDELIVERY_CONFIRM_MAX of them), so a false positive never drops a line.
+// Rotation only relabels a filter: each line carries the newest generation it has seen and
+// clears the blocks of generations that rotated in since, the first time it is touched.
+typedef struct redelivery_s {
+	uint64_t *filters;							  // BLOCKS lines of 2 words per generation
+	uint32_t *stamps;							  // per line, newest generation when last touched
+	uint32_t generation[REDELIVERY_GENERATIONS]; // log time generation held by each filter
+	uint32_t newest;							  // newest generation, inserts go to its filter
+	uint32_t span;								  // seconds of log time per generation
+
+	// Exact window: keys in arrival order, the oldest overwritten once the filters have
+	// rotated past it, or the ring doubles
+	redelivery_slot_t *slots;
+	uint32_t *buckets;	 // chain heads, capacity of them
+	uint32_t capacity;	 // slots, a power of 2
+	uint64_t inserted;
+
+	uint64_t checked;
+	uint64_t duplicates;  // lines dropped
+	uint64_t unconfirmed; // filter hits not in the exact window, kept
+	uint64_t forgotten;	  // requests overwritten while still in the window (cap reached)
+	uint64_t missing;	  // lines without a request id, kept
+} redelivery_t;
+
+//// Function Prototypes
+//
+int redelivery_init(redelivery_t *filter, uint32_t window_hours);
+void redelivery_prefetch(const redelivery_t *filter, p_log_t *full_log);
+int redelivery_seen(redelivery_t *filter, p_log_t *full_log);
+void redelivery_free(redelivery_t *filter);
+
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,100 @@
+#pragma once
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/stat.h>
+
+#include "s3catalog.h"
+#include "s3extract.h"
+
+#define SERVE_OPTIONS "D:l:n:j:C:vh"
+#define SERVE_WORKERS_MAX 64
+#define SERVE_QUEUE 256				// accepted connections waiting for a worker
+#define SERVE_REQUEST_MAX 4096		// bytes of one request line
+#define SERVE_WORDS_MAX 64			// words of one request
+#define SERVE_CACHE_ENTRIES 256		// results kept, least recently used dropped first
+#define SERVE_CACHE_DEFAULT 64		// MB of results kept, -C
+#define SERVE_TIMEOUT 10			// seconds a client has to send its request
+#define SERVE_ERROR_MAX EXTRACT_ERROR_MAX
+
+// Dataset as one manifest read it, files mapped; queries hold a reference while they scan
+typedef struct serve_snapshot_s {
+	catalog_t catalog;
+	uint64_t generation; // bumped on every manifest change, part of the cache key
+	struct stat manifest; // as loaded, a different inode, size or mtime means reload
+	int present;		  // a manifest existed
+	int refs;
+} serve_snapshot_t;
+
+// Result of one request and generation
+typedef struct serve_entry_s {
+	char *key; // request words, '\n' separated
+	uint64_t generation;
+	char *body;
+	size_t length;
+	uint64_t used; // cache clock at the last hit
+} serve_entry_t;
+
+// Answer to one request
+typedef struct serve_reply_s {
+	char *body; // JSON, malloc'd, NULL on error
+	size_t length;
+	int cached;					 // came from the result cache
+	double micros;				 // time to answer
+	char error[SERVE_ERROR_MAX]; // set when body is NULL
+} serve_reply_t;
+
+// Query daemon over one dataset
+typedef struct serve_s {
+	char *dataset;
+	char *manifest_path;
+	char *socket_path; // NULL when answering in process only
+	int listen_fd;
+	int workers;		  // connections answered at once
+	int readers;		  // scan threads per query
+	uint64_t memory_budget; // per query grouping memory before spilling
+	int verbose;
+	volatile sig_atomic_t stopping; // serve_stop, safe from a signal handler
+
+	pthread_mutex_t lock; // snapshot, queue and cache
+	pthread_mutex_t reload; // one manifest reload at a time
+	pthread_cond_t ready;	// queue has a connection, or the server is closing
+	serve_snapshot_t *snapshot;
+	int queue[SERVE_QUEUE];
+	int queue_head;
+	int queue_count;
+	int closing;
+	pthread_t threads[SERVE_WORKERS_MAX];
+
+	serve_entry_t cache[SERVE_CACHE_ENTRIES];
+	int cache_count;
+	uint64_t cache_bytes;
+	uint64_t cache_budget;
+	uint64_t cache_clock;
+
+	uint64_t queries;
+	uint64_t hits;
+	uint64_t failures;
+	uint64_t reloads;
+} serve_t;
+
+//// Function Prototypes
+//
+int serve_open(serve_t *server, const char *dataset, const char *socket_path, int workers, int readers,
+			   uint64_t cache_bytes);
+int serve_run(serve_t *server);
+void serve_stop(serve_t *server);
+void serve_close(serve_t *server);
+int serve_answer(serve_t *server, const char *request, serve_reply_t *reply);
+int serve_request(const char *socket_path, int argc, char **argv, FILE *output, int verbose);
+void print_serve_help(void);
+
+
+#ifdef __cplusplus
+}
+#endif
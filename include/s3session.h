@@ -0,0 +1,64 @@
+#pragma once
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "s3lp.h"
+
+#define SESSION_CAPACITY (1 << 18) // live sessions before the oldest is forced out
+#define SESSION_WINDOW 86400	   // default seconds a download session stays open
+#define SESSION_INTERVALS 6		   // coverage intervals kept per session
+#define SESSION_END UINT32_MAX	   // end of a hash chain
+
+// One download: every GET of the same key by the same listener (ip, user agent)
+// inside the window, with the byte ranges it covered
+typedef struct session_s {
+	uint64_t ip;	   // p_log_t::ip_addr
+	uint64_t key;	   // p_log_t::key_hash64
+	uint64_t agent;	   // hash64 of the user agent
+	uint32_t next;	   // hash chain
+	uint64_t object_size;
+	uint64_t download_ms;
+	s_log_t record; // first request, completed into the download record on close
+	uint8_t live;	// 0 once emitted, the slot is reclaimed when the ring reaches it
+	uint8_t partial; // any 206 seen
+	uint8_t intervals;
+	uint64_t covered[SESSION_INTERVALS][2]; // sorted, disjoint [first, last] byte ranges
+} session_t;
+
+// Sessions live in a ring in arrival order so the oldest is always at head,
+// expiring one is O(1) and memory never exceeds capacity sessions
+typedef struct session_table_s {
+	session_t *ring;
+	uint32_t *buckets; // chain heads, SESSION_END when empty
+	uint32_t capacity;
+	uint32_t bucket_mask;
+	uint32_t head; // oldest slot
+	uint32_t used; // slots between head and tail (live or emitted)
+
+	uint32_t window;	// seconds after its first request a session closes
+	uint32_t watermark; // newest timestamp seen
+
+	FILE *output; // download records, s_log_t
+	uint64_t requests;
+	uint64_t downloads;
+	uint64_t forced; // sessions closed early because the table was full
+	uint64_t merged; // interval merges that over count a gap (interval list full)
+} session_table_t;
+
+//// Function Prototypes
+//
+session_table_t *session_table_create(uint32_t capacity, uint32_t window, FILE *output);
+void session_track(session_table_t *table, const p_log_t *full_log, const s_log_t *slim_log);
+void session_flush(session_table_t *table);
+void session_table_free(session_table_t *table);
+void session_add_range(session_t *session, uint64_t first, uint64_t last, uint64_t *merged);
+uint64_t session_covered(const session_t *session);
+
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,51 @@
+#pragma once
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "s3lp.h"
+#include "s3spill.h"
+
+#define SORT_OPTIONS "f:o:k:M:wvh"
+#define SORT_DIGITS_MAX 12	// key bytes, 64 bit podcast_hash + 32 bit timestamp
+#define SORT_MIN_RUN 1024	// records per run however small the budget
+#define SORT_MAX_RUN (1 << 24) // records per run with no budget and an input of unknown size
+#define SORT_READ_CHUNK 65536 // records per fread while filling a run
+
+// Sort orders
+#define SORT_BY_TIME 0	  // timestamp
+#define SORT_BY_PODCAST 1 // podcast_hash, then timestamp
+
+// Where the key of a record lives, digits are single bytes for the radix passes
+typedef struct sort_key_s {
+	size_t record_size; // s_log_t or s_log_wide_t
+	size_t time_offset;
+	size_t podcast_offset;
+	int podcast_bytes; // 0 when sorting by time only
+	int digit_count;
+	uint16_t digit[SORT_DIGITS_MAX]; // byte offsets in a record, least significant first
+} sort_key_t;
+
+// s3_sort run options
+typedef struct sort_config_s {
+	int sort_by;			// SORT_BY_*
+	int wide;				// records are s3lp -t w s_log_wide_t
+	int verbose;			// runs and merge on stderr
+	uint64_t memory_budget; // bytes for a run and its radix scratch, 0 for no limit
+} sort_config_t;
+
+//// Function Prototypes
+//
+void sort_key_init(sort_key_t *key, int sort_by, int wide);
+int sort_key_compare(const sort_key_t *key, const void *a, const void *b);
+void *radix_sort_records(const sort_key_t *key, void *records, void *scratch, size_t count);
+int sort_files(FILE **inputs, int input_count, FILE *output, const sort_config_t *config);
+void print_sort_help(void);
+
+
+#ifdef __cplusplus
+}
+#endif
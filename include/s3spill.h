@@ -0,0 +1,58 @@
+#pragma once
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <stdio.h>
+
+#define SPILL_DIR "/tmp"			   // run files when TMPDIR is unset
+#define SPILL_BUFFER (1 << 20)		   // stdio buffer of one run file, the unit of its I/O
+#define SPILL_MIN_BUFFER (64 << 10)	   // floor when many partitions share a small budget
+#define SPILL_PARTITIONS 64			   // partitions when the input size is unknown (a pipe)
+#define SPILL_MAX_PARTITIONS 256	   // per level, partitions of partitions go further
+#define SPILL_MAX_LEVEL 3			   // repartitions before a group set may exceed the budget
+#define SPILL_DEFAULT_FRACTION 2	   // no -M: budget is physical memory / this
+
+// Fixed size records hash-partitioned into anonymous temporary files. A partition is
+// written once, then read back once from the start, both sequentially through a large buffer.
+typedef struct spill_s {
+	FILE **runs;	   // one per partition, NULL once released
+	char **buffers;	   // setvbuf buffers of runs
+	uint64_t *records; // written per partition
+	uint32_t count;	   // partitions, 0 when not spilling
+	uint32_t level;	   // 0 for partitions of the input, seeds the partition hash
+	size_t record_size;
+	size_t buffer_size;
+} spill_t;
+
+// Sequential reader over one sorted run inside a shared run file, pread keeps runs independent
+typedef struct run_reader_s {
+	int fd;
+	uint64_t offset; // next byte to read
+	uint64_t end;	 // first byte past the run
+	char *buffer;
+	size_t size;	 // buffer capacity
+	size_t length;	 // bytes buffered
+	size_t position; // next buffered byte
+} run_reader_t;
+
+//// Function Prototypes
+//
+FILE *spill_tmpfile(void);
+uint64_t spill_default_budget(void);
+uint32_t spill_partitions(FILE *input, uint64_t used, uint64_t budget);
+int spill_open(spill_t *spill, uint32_t count, uint32_t level, size_t record_size, uint64_t budget);
+uint32_t spill_partition(const spill_t *spill, uint64_t low, uint64_t high);
+int spill_write(spill_t *spill, uint32_t partition, const void *record);
+FILE *spill_rewind(spill_t *spill, uint32_t partition);
+void spill_release(spill_t *spill, uint32_t partition);
+void spill_close(spill_t *spill);
+int run_reader_init(run_reader_t *reader, FILE *file, uint64_t offset, uint64_t end, size_t size);
+int run_reader_next(run_reader_t *reader, void *record, size_t record_size);
+void run_reader_free(run_reader_t *reader);
+
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,96 @@
+#pragma once
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#define STATS_LATENCY_BUCKETS 24 // log2 microsecond buckets, last one is open ended
+
+struct parse_stats_s; // s3lp.h
+
+// Pipeline stages timed by the cycle counters
+typedef enum {
+	STAGE_READ = 0,	 // line reader / record fread
+	STAGE_TOKENIZE,	 // field splitting, includes STAGE_TIMESTAMP while running
+	STAGE_TIMESTAMP, // timestamp validation + conversion
+	STAGE_UA,		 // user agent classification
+	STAGE_GEO,		 // remote_ip -> country lookup
+	STAGE_DEDUP,	 // 206 flags + unique ip table
+	STAGE_REDELIVERY, // repeated request id + host id check
+	STAGE_SESSION,	 // download session stitching
+	STAGE_GROUP,	 // s3_extract grouping
+	STAGE_WRITE,	 // output formatting and fwrite
+	STAGE_COUNT
+} stats_stage_t;
+
+// Throughput and latency instrumentation shared by s3lp and s3_extract
+// Disabled stats cost one predictable branch per timed section
+typedef struct s3_stats_s {
+	int enabled;
+	uint64_t stage_cycles[STAGE_COUNT];
+
+	uint64_t lines;	  // input lines / records
+	uint64_t bytes;	  // input bytes
+	uint64_t batches; // batches written
+
+	// Batch latency histogram, bucket i counts batches taking < 2^i microseconds
+	uint64_t batch_latency[STATS_LATENCY_BUCKETS];
+	struct timespec batch_start;
+
+	// Unique ip table load, updated by the owner of the table
+	double dedup_load;
+
+	// Periodic report to stderr, interval 0 disables it
+	double report_interval;
+	struct timespec start, last_report;
+	uint64_t start_cycles;
+	uint64_t last_lines, last_bytes;
+} s3_stats_t;
+
+// Cycle counter: TSC where available, monotonic nanoseconds otherwise
+static inline uint64_t
+stats_cycles(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	return __rdtsc();
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+#endif
+}
+
+static inline uint64_t
+stats_begin(const s3_stats_t *stats)
+{
+	return stats->enabled ? stats_cycles() : 0;
+}
+
+static inline void
+stats_end(s3_stats_t *stats, int stage, uint64_t begin)
+{
+	if (stats->enabled) {
+		stats->stage_cycles[stage] += stats_cycles() - begin;
+	}
+}
+
+//// Function Prototypes
+//
+void stats_init(s3_stats_t *stats, int enabled, double report_interval);
+void stats_batch_begin(s3_stats_t *stats);
+void stats_batch_end(s3_stats_t *stats);
+void stats_report(s3_stats_t *stats, FILE *output);
+void stats_write_json(const s3_stats_t *stats, const struct parse_stats_s *parse, FILE *output);
+const char *stats_stage_name(int stage);
+
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,51 @@
+#pragma once
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <stdio.h>
+
+#define TIME_ZONE_DIR "/usr/share/zoneinfo" // TZif files, -z Europe/Berlin
+#define TIME_ZONE_LAST_YEAR 2106			// uint32_t timestamps end here, rules are expanded up to it
+#define TIME_ZONE_DST_RULE "M3.2.0,M11.1.0" // POSIX default when a TZ string names DST without a rule
+
+// Bucket units
+#define BUCKET_SECONDS 0 // fixed width, minutes or hours dividing a day, or a day
+#define BUCKET_WEEK 1	 // Monday 00:00 local
+#define BUCKET_MONTH 2	 // 1st 00:00 local
+
+// UTC offset history of a reporting zone, offsets are seconds east of UTC
+typedef struct time_zone_s {
+	int64_t *at;	  // UTC second each offset starts, ascending
+	int32_t *offset;  // offset from at[i] on
+	uint32_t count;	  // transitions, 0 for a fixed offset
+	uint32_t capacity;
+	int32_t initial;  // offset before at[0]
+	char name[64];
+} time_zone_t;
+
+// How GROUP_TIME cuts time: a width on the local wall clock of a zone
+typedef struct time_bucket_s {
+	int unit;		// BUCKET_*
+	uint32_t width; // seconds for BUCKET_SECONDS
+	char name[16];	// "hour", "5min", "day", printed as the group name
+	time_zone_t zone;
+} time_bucket_t;
+
+//// Function Prototypes
+//
+int time_zone_load(time_zone_t *zone, const char *name);
+void time_zone_free(time_zone_t *zone);
+int32_t time_zone_offset(const time_zone_t *zone, int64_t utc);
+int time_bucket_init(time_bucket_t *bucket, const char *spec, const char *zone_name);
+void time_bucket_free(time_bucket_t *bucket);
+int64_t time_bucket_key(const time_bucket_t *bucket, uint32_t timestamp);
+int64_t time_local(const time_bucket_t *bucket, uint32_t timestamp);
+void format_local_time(int64_t local, char *buffer, size_t size);
+int time_parse(const char *text, const time_zone_t *zone, int64_t *utc);
+
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,57 @@
+#pragma once
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "s3extract.h"
+
+#define TOPK_SLACK 4		  // Space-Saving counters kept per reported item
+#define TOPK_MIN_COUNTERS 256 // counters kept even for small K
+#define TOPK_START_COUNTERS 8 // sketches start small and double up to their limit
+#define TOPK_THREADS_MAX 64
+
+// Weight each record adds to its item
+#define METRIC_REQUESTS 0 // 1 per record
+#define METRIC_UNIQUE 1	  // 1 per record flagged UNIQUE_IP (unique downloads)
+#define METRIC_BYTES 2	  // bytes_sent_kb
+
+// One monitored item, count over-estimates by at most error
+typedef struct ss_counter_s {
+	uint64_t item;
+	uint64_t count;	   // upper bound on the item's weight
+	uint64_t error;	   // count - error is a lower bound
+	uint32_t heap_pos; // position in space_saving_t::heap
+	uint8_t flags;	   // record flags of the first sighting (IP_HASHED for formatting)
+} ss_counter_t;
+
+// Space-Saving summary: at most limit counters, once full a new item replaces the
+// smallest counter and inherits its count as error. Any item whose weight exceeds
+// total / limit is guaranteed to be monitored.
+typedef struct space_saving_s {
+	ss_counter_t *counters;
+	uint32_t *heap;	 // counter indices, smallest count on top
+	uint32_t *index; // open addressing item -> counter + 1, 0 when empty
+	uint32_t count;	 // counters in use
+	uint32_t capacity;
+	uint32_t limit;
+	uint32_t index_mask;
+	uint64_t unmonitored; // bound left by merges on items no counter holds
+} space_saving_t;
+
+//// Function Prototypes
+//
+int space_saving_init(space_saving_t *sketch, uint32_t limit);
+void space_saving_free(space_saving_t *sketch);
+int space_saving_update(space_saving_t *sketch, uint64_t item, uint64_t weight, uint8_t flags);
+int space_saving_find(const space_saving_t *sketch, uint64_t item);
+int space_saving_merge(space_saving_t *dst, const space_saving_t *src);
+uint64_t space_saving_min(const space_saving_t *sketch);
+int extract_top_k(FILE *input, FILE *output, const extract_config_t *config);
+
+
+#ifdef __cplusplus
+}
+#endif
@@ -1,115 +1,739 @@
+#include <math.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <time.h>
+#include <unistd.h>
 
 #define LOGS_TO_MAKE 1000000
 #define NUM_PODCASTS 20
+#define FAKE_OPTIONS "n:s:o:t:p:e:z:i:6:d:m:l:r:x:u:h"
 
-// Array of realistic podcast names
+#define CHUNK_LINES 65536	  // lines per work unit, fixed so output does not depend on -t
+#define LINE_RESERVE 32768	  // worst case bytes for one line delivered twice, long fields included
+#define MAX_THREADS 64
+#define BASE_TIMESTAMP 1746057600 // 01/May/2025:00:00:00 +0000
+
+// Array of realistic podcast names, shows past NUM_PODCASTS are named show-<n>
 const char *podcast_names[NUM_PODCASTS] = {
 	"tech-talk",	   "daily-news",	 "comedy-hour",	  "true-crime",		   "history-deep-dive",
 	"startup-stories", "music-reviews",	 "book-club",	  "fitness-tips",	   "cooking-show",
 	"travel-tales",	   "science-corner", "movie-reviews", "language-learning", "meditation-guide",
 	"sports-weekly",   "art-spotlight",	 "gaming-news",	  "health-matters",	   "finance-focus"};
 
-int
-main()
+// Podcast client mix, weights are rough shares of downloads
+typedef struct agent_s {
+	const char *user_agent;
+	int weight;
+} agent_t;
+
+static const agent_t agents[] = {
+	{"AppleCoreMedia/1.0.0.21E236 (iPhone; U; CPU OS 17_4_1 like Mac OS X; en_us)", 22},
+	{"Podcasts/1.1.0 (iPhone; iOS 17.4.1) AppleCoreMedia/1.0.0.21E236", 8},
+	{"AppleCoreMedia/1.0.0.21E236 (iPad; U; CPU OS 17_4_1 like Mac OS X; en_us)", 3},
+	{"AppleCoreMedia/1.0.0.23E224 (Macintosh; U; Intel Mac OS X 14_4_1; en_us)", 3},
+	{"AppleCoreMedia/1.0.0.21T216 (Apple TV; U; CPU OS 17_4 like Mac OS X; en_us) tvOS", 1},
+	{"atc/1.0 watchOS/10.4 model/Watch6,2 hwp/t8301 build/21T216 (6; dt:251)", 1},
+	{"AppleCoreMedia/1.0.0.21L227 (HomePod; U; CPU OS 17_4 like Mac OS X; en_us)", 1},
+	{"Spotify/8.9.36.616 Android/34 (SM-S918B)", 14},
+	{"Spotify/8.9.36 iOS/17.4.1 (iPhone15,3)", 6},
+	{"Spotify/1.2.33.1039 Win32_x86_64/0 (PC desktop)", 2},
+	{"Overcast/3.0 (+http://overcast.fm/; iOS podcast app)", 4},
+	{"PocketCasts/1.0 (Pocket Casts - Android; +https://pocketcasts.com/)", 4},
+	{"Podcast Addict - Android Google Pixel 7 (Mobile)", 3},
+	{"CastBox/9.40.3-240401005 (Linux;Android 13) ExoPlayerLib/2.10.4", 2},
+	{"Youtube/19.14.37 Android/14 (Pixel 8 Pro)", 3},
+	{"Player FM Android/5.2 (Mobile)", 1},
+	{"Stitcher/Android", 1},
+	{"Amazon Music Podcast Echo/1.0 (Alexa; Echo Dot)", 2},
+	{"GoogleHome/1.0 (Linux; Android 10) CrKey/1.56.500000", 1},
+	{"Mozilla/5.0 (Windows NT 10.0; Win64; x64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/124.0.0.0 "
+	 "Safari/537.36",
+	 4},
+	{"Mozilla/5.0 (Macintosh; Intel Mac OS X 10_15_7) AppleWebKit/605.1.15 (KHTML, like Gecko) Version/17.4 "
+	 "Safari/605.1.15",
+	 2},
+	{"Mozilla/5.0 (Linux; Android 14; Pixel 8) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/124.0 Mobile "
+	 "Safari/537.36",
+	 3},
+	{"RawVoice Generator/1.0 (Blubrry Podcasting)", 1},
+	{"Googlebot/2.1 (+http://www.google.com/bot.html)", 1},
+	{"curl/8.5.0", 1},
+};
+#define NUM_AGENTS (sizeof(agents) / sizeof(agents[0]))
+
+static const char *months[12] = {"Jan", "Feb", "Mar", "Apr", "May", "Jun", "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"};
+
+// Generator settings, shared read-only by all workers
+typedef struct gen_config_s {
+	long lines;
+	uint64_t seed;
+	int threads;
+	long shows;
+	long episodes;	// per show
+	long listeners; // distinct listeners (IP + user agent)
+	double zipf;	// popularity exponent for shows and episodes
+	double ipv6_pct;
+	int days;
+	double malformed_pct;
+	double long_pct;
+	double partial_pct; // downloads fetched as 206 range sequences
+	double other_pct;	// HEAD / PUT / LIST traffic on the bucket
+	double repeat_pct;	// lines delivered twice, as S3 logging now and then does
+	int agent_total;	// sum of agent weights
+} gen_config_t;
+
+// Zipf(n, s) sampler, rejection-inversion (Hormann & Derflinger), O(1) per draw
+typedef struct zipf_s {
+	long n;
+	double exponent;
+	double h_integral_x1;
+	double h_integral_n;
+	double s;
+} zipf_t;
+
+// Growable per-chunk output buffer
+typedef struct out_buf_s {
+	char *data;
+	size_t len;
+	size_t cap;
+} out_buf_t;
+
+// One unit of work: CHUNK_LINES lines, its own RNG stream
+typedef struct chunk_job_s {
+	const gen_config_t *config;
+	const zipf_t *show_zipf;
+	const zipf_t *episode_zipf;
+	const zipf_t *listener_zipf;
+	long chunk;
+	long lines;
+	out_buf_t out;
+	int failed;
+} chunk_job_t;
+
+// RANDOM -----------------------------------------------------------------------------------------
+// wyrand: tiny, fast and statistically solid, state is one word per chunk
+static inline uint64_t
+rng_next(uint64_t *state)
 {
-	FILE *f = fopen("fake_s3.log", "w");
-	if (!f) {
-		perror("Failed to open file");
-		return 1;
+	*state += 0xa0761d6478bd642full;
+	__uint128_t m = (__uint128_t)(*state ^ 0xe7037ed1a0b428dbull) * *state;
+	return (uint64_t)(m >> 64) ^ (uint64_t)m;
+}
+
+static inline double
+rng_double(uint64_t *state)
+{
+	return (rng_next(state) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static inline uint64_t
+rng_below(uint64_t *state, uint64_t bound)
+{
+	return (uint64_t)(((__uint128_t)rng_next(state) * bound) >> 64);
+}
+
+// Stateless mixer for per-listener / per-episode attributes
+static inline uint64_t
+mix64(uint64_t x)
+{
+	x ^= x >> 30;
+	x *= 0xbf58476d1ce4e5b9ull;
+	x ^= x >> 27;
+	x *= 0x94d049bb133111ebull;
+	x ^= x >> 31;
+	return x;
+}
+
+// ZIPF -------------------------------------------------------------------------------------------
+static double
+zipf_helper1(double x)
+{
+	return (fabs(x) > 1e-8) ? log1p(x) / x : 1 - x * (0.5 - x * (1.0 / 3.0 - 0.25 * x));
+}
+
+static double
+zipf_helper2(double x)
+{
+	return (fabs(x) > 1e-8) ? expm1(x) / x : 1 + x * 0.5 * (1 + x * (1.0 / 3.0) * (1 + 0.25 * x));
+}
+
+static double
+zipf_h(const zipf_t *z, double x)
+{
+	return exp(-z->exponent * log(x));
+}
+
+static double
+zipf_h_integral(const zipf_t *z, double x)
+{
+	double log_x = log(x);
+	return zipf_helper2((1 - z->exponent) * log_x) * log_x;
+}
+
+static double
+zipf_h_integral_inverse(const zipf_t *z, double x)
+{
+	double t = x * (1 - z->exponent);
+	if (t < -1) {
+		t = -1;
+	}
+	return exp(zipf_helper1(t) * x);
+}
+
+static void
+zipf_init(zipf_t *z, long n, double exponent)
+{
+	z->n = n;
+	z->exponent = exponent;
+	z->h_integral_x1 = zipf_h_integral(z, 1.5) - 1;
+	z->h_integral_n = zipf_h_integral(z, n + 0.5);
+	z->s = 2 - zipf_h_integral_inverse(z, zipf_h_integral(z, 2.5) - zipf_h(z, 2));
+}
+
+// Returns a rank in [1, n], rank 1 is the most popular
+static long
+zipf_sample(const zipf_t *z, uint64_t *rng)
+{
+	for (;;) {
+		double u = z->h_integral_n + rng_double(rng) * (z->h_integral_x1 - z->h_integral_n);
+		double x = zipf_h_integral_inverse(z, u);
+		long k = (long)(x + 0.5);
+		if (k < 1) {
+			k = 1;
+		}
+		else if (k > z->n) {
+			k = z->n;
+		}
+		if (k - x <= z->s || u >= zipf_h_integral(z, k + 0.5) - zipf_h(z, k)) {
+			return k;
+		}
 	}
+}
+
+// FIELD FORMATTING -------------------------------------------------------------------------------
+// [dd/Mon/yyyy:HH:MM:SS +0000] via civil_from_days, no libc time calls
+static int
+format_log_time(char *dest, int64_t timestamp)
+{
+	int64_t days = timestamp / 86400;
+	int secs = (int)(timestamp % 86400);
 
-	srand(time(NULL)); // Add some randomness
+	days += 719468;
+	int64_t era = days / 146097;
+	int64_t doe = days - era * 146097;
+	int64_t yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+	int64_t doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+	int64_t mp = (5 * doy + 2) / 153;
+	int day = (int)(doy - (153 * mp + 2) / 5 + 1);
+	int month = (int)(mp < 10 ? mp + 3 : mp - 9);
+	int64_t year = yoe + era * 400 + (month <= 2);
 
-	for (int i = 0; i < LOGS_TO_MAKE; i++) {
-		int id = i;
-		int second = i % 60;
-		int minute = (i / 60) % 60;
-		int hour = (i / 3600) % 24;
+	return sprintf(dest, "[%02d/%s/%04ld:%02d:%02d:%02d +0000]", day, months[month - 1], (long)year, secs / 3600,
+				   (secs / 60) % 60, secs % 60);
+}
+
+// Listener id -> stable IPv4 or IPv6 address
+static int
+format_ip(char *dest, long listener, const gen_config_t *config)
+{
+	uint64_t h = mix64((uint64_t)listener ^ (config->seed * 0x9e3779b97f4a7c15ull));
+	if ((h % 10000) < config->ipv6_pct * 100) {
+		uint64_t g = mix64(h);
+		return sprintf(dest, "2001:db8:%x:%x:%x:%x:%x:%x", (unsigned)(h >> 16) & 0xffff, (unsigned)(h >> 32) & 0xffff,
+					   (unsigned)(h >> 48), (unsigned)g & 0xffff, (unsigned)(g >> 16) & 0xffff,
+					   (unsigned)(g >> 32) & 0xffff);
+	}
+	// Skip 0.x.x.x, loopback and multicast space
+	unsigned first = 1 + (unsigned)((h >> 24) % 223);
+	if (first == 127) {
+		first = 128;
+	}
+	return sprintf(dest, "%u.%u.%u.%u", first, (unsigned)(h >> 16) & 0xff, (unsigned)(h >> 8) & 0xff,
+				   1 + (unsigned)(h & 0xff) % 254);
+}
 
-		// Select a podcast (distribute roughly evenly but with some randomness)
-		int podcast_id = (i / 100) % NUM_PODCASTS; // Change podcast every 100 entries
-		if (rand() % 10 == 0) {					   // 10% chance to pick random podcast
-			podcast_id = rand() % NUM_PODCASTS;
+// Listener id -> stable user agent, weighted by the client mix
+static const char *
+listener_agent(long listener, const gen_config_t *config)
+{
+	int pick = (int)(mix64((uint64_t)listener * 0x632be59bd9b4e019ull ^ config->seed) % config->agent_total);
+	for (size_t i = 0; i < NUM_AGENTS; i++) {
+		pick -= agents[i].weight;
+		if (pick < 0) {
+			return agents[i].user_agent;
 		}
-		const char *podcast_name = podcast_names[podcast_id];
+	}
+	return agents[0].user_agent;
+}
 
-		// Episode number within that podcast
-		int episode_num = (i / NUM_PODCASTS) + 1;
+static void
+format_show(char *dest, long show)
+{
+	if (show <= NUM_PODCASTS) {
+		strcpy(dest, podcast_names[show - 1]);
+	}
+	else {
+		sprintf(dest, "show-%ld", show);
+	}
+}
 
-		// Determine if this should be a partial download (206)
-		int is_partial = (i % 7 == 0); // ~14% partial downloads
-		int http_code = is_partial ? 206 : 200;
+static int
+out_reserve(out_buf_t *out, size_t need)
+{
+	if (out->cap - out->len >= need) {
+		return 0;
+	}
+	size_t cap = (out->cap == 0) ? (size_t)CHUNK_LINES * 640 : out->cap * 2;
+	while (cap - out->len < need) {
+		cap *= 2;
+	}
+	char *data = realloc(out->data, cap);
+	if (data == NULL) {
+		return -1;
+	}
+	out->data = data;
+	out->cap = cap;
+	return 0;
+}
+
+// One request line as s3 writes it, range is NULL for non 206 lines
+typedef struct fake_line_s {
+	int64_t timestamp;
+	const char *ip;
+	const char *method;
+	const char *operation;
+	const char *key;
+	int http_code;
+	long bytes_sent;
+	long object_size;
+	int total_ms;
+	const char *user_agent;
+	const char *range;
+} fake_line_t;
+
+/**
+ * @BRIEF Appends one access log line, optionally malformed or with an oversized field
+ * @PARAM out  : Chunk buffer, has LINE_RESERVE bytes free
+ * @PARAM line : Request to format
+ * @PARAM rng  : Chunk RNG
+ * @PARAM config : Generator settings
+ */
+static void
+emit_line(out_buf_t *out, const fake_line_t *line, uint64_t *rng, const gen_config_t *config)
+{
+	char *start = out->data + out->len;
+	char *dest = start;
+	char time_str[40];
+	char long_agent[8192];
+	const char *user_agent = line->user_agent;
+	const char *query = "";
+	char long_query[4096];
+
+	format_log_time(time_str, line->timestamp);
+
+	// Long fields: tracking query strings on the key or bloated user agents
+	if (rng_double(rng) * 100 < config->long_pct) {
+		if (rng_next(rng) & 1) {
+			int len = sprintf(long_agent, "%s ", line->user_agent);
+			int pad = 1024 + (int)rng_below(rng, 4096);
+			for (int i = 0; i < pad; i++) {
+				long_agent[len++] = 'a' + (char)(i % 26);
+			}
+			long_agent[len] = '\0';
+			user_agent = long_agent;
+		}
+		else {
+			int len = sprintf(long_query, "?utm_source=feed&token=");
+			int pad = 1024 + (int)rng_below(rng, 2048);
+			for (int i = 0; i < pad; i++) {
+				long_query[len++] = "0123456789abcdef"[rng_next(rng) & 15];
+			}
+			long_query[len] = '\0';
+			query = long_query;
+		}
+	}
 
-		// Vary object sizes and bytes sent
-		int object_size = 15000000 + (rand() % 10000000); // 15-25MB files
-		int bytes_sent;
+	uint64_t request_id = rng_next(rng);
+	uint64_t host_id = rng_next(rng);
+	dest += sprintf(dest,
+					"79a59df900b949e55d96a1e698fbacedfd6e09d98eacf8f8d5218e7cd47ef2be " // bucket_owner
+					"podcast-media "													// bucket_name
+					"%s "																// time
+					"%s "																// remote_ip
+					"- "																// requester_id
+					"%016lX "															// request_id
+					"%s "																// operation
+					"%s "																// key
+					"\"%s /podcast-media/%s%s HTTP/1.1\" "								// request_uri
+					"%d "																// http_code
+					"- "																// err_code
+					"%ld "																// bytes_sent
+					"%ld "																// object_size
+					"%d "																// ms_ttime
+					"%d "																// ms_tatime
+					"\"-\" "															// referer
+					"\"%s\" "															// user_agent
+					"- "																// ver_id
+					"%016lx%016lx= "													// host_id
+					"SigV4 "															// auth_sig
+					"ECDHE-RSA-AES128-GCM-SHA256 "										// cipher_suite
+					"- "																// auth_type
+					"podcast-media.s3.us-east-1.amazonaws.com "							// host_header
+					"TLSv1.3 "															// TLS_ver
+					"- "																// ARN_ap
+					"-",																// acl_required
+					time_str, line->ip, (unsigned long)request_id, line->operation, line->key, line->method, line->key, query,
+					line->http_code, line->bytes_sent, line->object_size, line->total_ms,
+					1 + line->total_ms / 10, user_agent, (unsigned long)host_id, (unsigned long)mix64(host_id));
+	if (line->range != NULL) {
+		dest += sprintf(dest, " \"%s\"", line->range);
+	}
 
-		if (is_partial) {
-			bytes_sent = rand() % object_size; // Partial download
+	// Malformed: cut the line short or mangle the timestamp
+	if (rng_double(rng) * 100 < config->malformed_pct) {
+		if (rng_next(rng) & 1) {
+			dest = start + rng_below(rng, dest - start);
 		}
 		else {
-			bytes_sent = object_size; // Complete download
+			char *bracket = memchr(start, '[', dest - start);
+			memcpy(bracket, "[99/Foo", 7); // day and month of the time field
+		}
+	}
+	*dest++ = '\n';
+	out->len += dest - start;
+
+	// Repeated delivery: the same record again, request id and host id included
+	if (config->repeat_pct > 0 && rng_double(rng) * 100 < config->repeat_pct) {
+		memcpy(dest, start, dest - start);
+		out->len += dest - start;
+	}
+}
+
+// WORKER -----------------------------------------------------------------------------------------
+/**
+ * @BRIEF Generates one chunk of lines into job->out
+ * @PARAM arg : chunk_job_t
+ *
+ * @DETAILS Each download picks a listener, show and episode from Zipf distributions,
+ *          a timestamp anywhere in the configured day span (so files are not time
+ *          ordered) and then either a full 200 or a 206 range sequence that may be
+ *          abandoned part way. Non-GET bucket traffic is owed per download line, so
+ *          -x is a share of lines however many lines a range sequence takes.
+ */
+static void *
+generate_chunk(void *arg)
+{
+	chunk_job_t *job = arg;
+	const gen_config_t *config = job->config;
+	uint64_t rng = mix64(config->seed ^ mix64((uint64_t)job->chunk + 1));
+	long written = 0;
+	// Non download lines owed: other_pct of all lines, not of downloads
+	double other_share = (config->other_pct >= 100) ? 0 : config->other_pct / (100 - config->other_pct);
+	double other_due = 0;
+
+	char ip[64];
+	char show[32];
+	char key[96];
+	char range[64];
+
+	job->out.len = 0;
+	while (written < job->lines) {
+		long listener = zipf_sample(job->listener_zipf, &rng);
+		long show_id = zipf_sample(job->show_zipf, &rng);
+		long episode = zipf_sample(job->episode_zipf, &rng);
+
+		format_ip(ip, listener, config);
+		format_show(show, show_id);
+		// Newest episodes are the popular ones
+		sprintf(key, "%s/episode-%ld.mp3", show, config->episodes - episode + 1);
+
+		fake_line_t line = {0};
+		line.timestamp = BASE_TIMESTAMP + (int64_t)rng_below(&rng, (uint64_t)config->days * 86400);
+		line.ip = ip;
+		line.key = key;
+		line.user_agent = listener_agent(listener, config);
+		line.object_size = 5000000 + (long)(mix64((uint64_t)show_id << 32 | episode) % 75000000);
+
+		double kind = rng_double(&rng) * 100;
+
+		// Bucket traffic that is not a download
+		if (other_due >= 1 || config->other_pct >= 100) {
+			other_due -= 1;
+			static const char *ops[] = {"REST.HEAD.OBJECT", "REST.PUT.OBJECT", "REST.GET.BUCKET",
+										"REST.GET.OBJECT_TAGGING", "REST.DELETE.OBJECT"};
+			static const char *methods[] = {"HEAD", "PUT", "GET", "GET", "DELETE"};
+			static const int codes[] = {200, 200, 200, 404, 204};
+			int op = (int)rng_below(&rng, 5);
+			line.operation = ops[op];
+			line.method = methods[op];
+			line.http_code = codes[op];
+			line.bytes_sent = (op == 2) ? 4096 + (long)rng_below(&rng, 60000) : 0;
+			line.total_ms = 5 + (int)rng_below(&rng, 40);
+			if (out_reserve(&job->out, LINE_RESERVE) != 0) {
+				job->failed = 1;
+				return NULL;
+			}
+			emit_line(&job->out, &line, &rng, config);
+			written++;
+			continue;
+		}
+
+		line.operation = "REST.GET.OBJECT";
+		line.method = "GET";
+		long download_start = written;
+
+		// Multi-range download, optional 2 byte probe first (AppleCoreMedia does this)
+		if (kind < config->partial_pct) {
+			long chunk_size = 1048576L << rng_below(&rng, 3);
+			long offset = 0;
+			int abandon = rng_below(&rng, 4) == 0;
+			long stop = abandon ? (long)rng_below(&rng, line.object_size) : line.object_size;
+			line.http_code = 206;
+			line.range = range;
+
+			if (rng_next(&rng) & 1) {
+				sprintf(range, "bytes=0-1");
+				line.bytes_sent = 2;
+				line.total_ms = 10 + (int)rng_below(&rng, 50);
+				if (out_reserve(&job->out, LINE_RESERVE) != 0) {
+					job->failed = 1;
+					return NULL;
+				}
+				emit_line(&job->out, &line, &rng, config);
+				written++;
+			}
+			while (offset < stop && written < job->lines) {
+				long last = offset + chunk_size - 1;
+				if (last >= line.object_size) {
+					last = line.object_size - 1;
+				}
+				sprintf(range, "bytes=%ld-%ld", offset, last);
+				line.bytes_sent = last - offset + 1;
+				line.total_ms = 20 + (int)rng_below(&rng, 2000);
+				line.timestamp += 1 + line.total_ms / 1000;
+				if (out_reserve(&job->out, LINE_RESERVE) != 0) {
+					job->failed = 1;
+					return NULL;
+				}
+				emit_line(&job->out, &line, &rng, config);
+				written++;
+				offset = last + 1;
+			}
+			other_due += (written - download_start) * other_share;
+			continue;
+		}
+
+		// Full download
+		line.http_code = 200;
+		line.bytes_sent = line.object_size;
+		line.total_ms = 100 + (int)rng_below(&rng, 30000);
+		if (out_reserve(&job->out, LINE_RESERVE) != 0) {
+			job->failed = 1;
+			return NULL;
 		}
+		emit_line(&job->out, &line, &rng, config);
+		written++;
+		other_due += other_share;
+	}
+	return NULL;
+}
+
+static void
+print_usage(void)
+{
+	fprintf(stderr, "USAGE: ./fake_logs [options]\n"
+					"\t-n lines    : lines to generate (default %d)\n"
+					"\t-s seed     : RNG seed, same seed + options gives the same file (default: time)\n"
+					"\t-o filepath : output file (default fake_s3.log, - for stdout)\n"
+					"\t-t threads  : generator threads, output does not depend on it (default: cpus)\n"
+					"\t-p shows    : distinct shows (default 200)\n"
+					"\t-e episodes : episodes per show (default 300)\n"
+					"\t-z exponent : Zipf exponent for show / episode popularity (default 1.0)\n"
+					"\t-i ips      : distinct listeners (default 2000000)\n"
+					"\t-6 percent  : listeners on IPv6 (default 15)\n"
+					"\t-d days     : days spanned by the timestamps (default 7)\n"
+					"\t-m percent  : malformed lines (default 0.1)\n"
+					"\t-l percent  : lines with a >1KB user agent or key (default 0.5)\n"
+					"\t-r percent  : downloads fetched as 206 range sequences (default 40)\n"
+					"\t-x percent  : lines of non download traffic, HEAD/PUT/LIST (default 10)\n"
+					"\t-u percent  : lines delivered twice, on top of -n (default 0)\n",
+			LOGS_TO_MAKE);
+}
+
+int
+main(int argc, char *argv[])
+{
+	gen_config_t config = {
+		.lines = LOGS_TO_MAKE,
+		.seed = (uint64_t)time(NULL), // Random unless -s pins it for reproducible datasets
+		.threads = (int)sysconf(_SC_NPROCESSORS_ONLN),
+		.shows = 200,
+		.episodes = 300,
+		.listeners = 2000000,
+		.zipf = 1.0,
+		.ipv6_pct = 15,
+		.days = 7,
+		.malformed_pct = 0.1,
+		.long_pct = 0.5,
+		.partial_pct = 40,
+		.other_pct = 10,
+	};
+	const char *output_file = "fake_s3.log";
+
+	int opt;
+	while ((opt = getopt(argc, argv, FAKE_OPTIONS)) != -1) {
+		switch (opt) {
+		case 'n':
+			config.lines = atol(optarg);
+			break;
+		case 's':
+			config.seed = strtoull(optarg, NULL, 10);
+			break;
+		case 'o':
+			output_file = optarg;
+			break;
+		case 't':
+			config.threads = atoi(optarg);
+			break;
+		case 'p':
+			config.shows = atol(optarg);
+			break;
+		case 'e':
+			config.episodes = atol(optarg);
+			break;
+		case 'z':
+			config.zipf = atof(optarg);
+			break;
+		case 'i':
+			config.listeners = atol(optarg);
+			break;
+		case '6':
+			config.ipv6_pct = atof(optarg);
+			break;
+		case 'd':
+			config.days = atoi(optarg);
+			break;
+		case 'm':
+			config.malformed_pct = atof(optarg);
+			break;
+		case 'l':
+			config.long_pct = atof(optarg);
+			break;
+		case 'r':
+			config.partial_pct = atof(optarg);
+			break;
+		case 'x':
+			config.other_pct = atof(optarg);
+			break;
+		case 'u':
+			config.repeat_pct = atof(optarg);
+			break;
+		default:
+			print_usage();
+			return 1;
+		}
+	}
+	if (config.threads < 1) {
+		config.threads = 1;
+	}
+	if (config.threads > MAX_THREADS) {
+		config.threads = MAX_THREADS;
+	}
+	if (config.lines < 0 || config.shows < 1 || config.episodes < 1 || config.listeners < 1 || config.days < 1 ||
+		config.zipf <= 0) {
+		print_usage();
+		return 1;
+	}
+	for (size_t i = 0; i < NUM_AGENTS; i++) {
+		config.agent_total += agents[i].weight;
+	}
 
-		fprintf(f,
-				"79a59df900b949e5 "						  // bucket_owner
-				"bucket%d "								  // bucket_name
-				"[03/May/2025:%02d:%02d:%02d +0000] "	  // time
-				"203.0.113.%d "							  // remote_ip
-				"arn:aws:iam::123456789012:user/test-%d " // requester_id
-				"EXAMPLEID%d "							  // request_id
-				"REST.GET.OBJECT "						  // operation
-				"%s/episode-%d.mp3 "					  // key (podcast_name/episode-N.mp3)
-				"\"GET /%s/episode-%d.mp3 HTTP/1.1\" "	  // request_uri
-				"%d "									  // http_code (200 or 206)
-				"- "									  // err_code
-				"%d "									  // bytes_sent (variable)
-				"%d "									  // object_size (variable)
-				"%d "									  // ms_ttime (variable)
-				"42 "									  // ms_tatime
-				"\"-\" "								  // referer
-				"\"FakeAgent/1.0\" "					  // user_agent
-				"v%d "									  // ver_id
-				"HOSTID%d "								  // host_id
-				"SigV2 "								  // auth_sig
-				"ECDHE-RSA-AES128-GCM-SHA256 "			  // cipher_suite
-				"AuthHeader "							  // auth_type
-				"host%d.example.com "					  // host_header
-				"TLSv1.2 "								  // TLS_ver
-				"arn:aws:s3:::example-AP%d "			  // ARN_ap
-				"false",								  // acl_required
-				id % 1000, hour, minute, second,		  // bucket, time fields
-				id % 255, id % 100, id,					  // IP, requester, request_id
-				podcast_name, episode_num,				  // key fields (podcast/episode)
-				podcast_name, episode_num,				  // request_uri fields
-				http_code,								  // http_code
-				bytes_sent, object_size,				  // bytes_sent, object_size
-				20 + (rand() % 100),					  // ms_ttime
-				id % 500, id % 50,						  // ver_id, host_id
-				id % 10, id % 100);						  // host_header, ARN_ap
-
-		// Add range field ONLY for 206 responses
-		if (is_partial) {
-			int start_byte = rand() % (object_size / 2);
-			int end_byte = start_byte + bytes_sent - 1;
-			fprintf(f, " \"bytes=%d-%d\"", start_byte, end_byte);
+	FILE *f = (strcmp(output_file, "-") == 0) ? stdout : fopen(output_file, "w");
+	if (!f) {
+		perror("Failed to open file");
+		return 1;
+	}
+
+	zipf_t show_zipf, episode_zipf, listener_zipf;
+	zipf_init(&show_zipf, config.shows, config.zipf);
+	zipf_init(&episode_zipf, config.episodes, config.zipf);
+	zipf_init(&listener_zipf, config.listeners, 0.6); // heavy listeners exist, but the tail is long
+
+	// Two sets of jobs: one round generates while the previous round is written
+	long chunks = (config.lines + CHUNK_LINES - 1) / CHUNK_LINES;
+	chunk_job_t *jobs = calloc(2 * config.threads, sizeof(chunk_job_t));
+	pthread_t *tids = calloc(2 * config.threads, sizeof(pthread_t));
+	if (jobs == NULL || tids == NULL) {
+		perror("calloc jobs");
+		return 1;
+	}
+
+	int err = 0;
+	long next_chunk = 0;
+	int round = 0;
+	int in_flight[2] = {0, 0};
+
+	while (next_chunk < chunks || in_flight[0] || in_flight[1]) {
+		int set = round & 1;
+
+		// Launch the next round into this set of jobs
+		chunk_job_t *batch = jobs + set * config.threads;
+		int launched = 0;
+		for (int t = 0; t < config.threads && next_chunk < chunks; t++, next_chunk++) {
+			batch[t].config = &config;
+			batch[t].show_zipf = &show_zipf;
+			batch[t].episode_zipf = &episode_zipf;
+			batch[t].listener_zipf = &listener_zipf;
+			batch[t].chunk = next_chunk;
+			batch[t].lines = (next_chunk == chunks - 1) ? config.lines - next_chunk * CHUNK_LINES : CHUNK_LINES;
+			if (pthread_create(&tids[set * config.threads + t], NULL, generate_chunk, &batch[t]) != 0) {
+				perror("pthread_create");
+				return 1;
+			}
+			launched++;
 		}
+		in_flight[set] = launched;
 
-		fprintf(f, "\n");
+		// Write the previous round in chunk order while this one runs
+		int prev = set ^ 1;
+		chunk_job_t *done = jobs + prev * config.threads;
+		for (int t = 0; t < in_flight[prev]; t++) {
+			pthread_join(tids[prev * config.threads + t], NULL);
+			if (done[t].failed) {
+				fprintf(stderr, "chunk %ld: out of memory\n", done[t].chunk);
+				err = 1;
+			}
+			else if (fwrite(done[t].out.data, 1, done[t].out.len, f) != done[t].out.len) {
+				perror("fwrite");
+				err = 1;
+			}
+		}
+		in_flight[prev] = 0;
+		round++;
 	}
 
-	fclose(f);
-	printf("Generated %d log entries across %d different podcasts with ~%d partial downloads (206 responses)\n",
-		   LOGS_TO_MAKE, NUM_PODCASTS, LOGS_TO_MAKE / 7);
+	for (int t = 0; t < 2 * config.threads; t++) {
+		free(jobs[t].out.data);
+	}
+	free(jobs);
+	free(tids);
 
-	// Print podcast distribution info
-	printf("Podcasts created:\n");
-	for (int i = 0; i < NUM_PODCASTS; i++) {
-		printf("  %s\n", podcast_names[i]);
+	if (f != stdout) {
+		fclose(f);
+	}
+	else {
+		fflush(f);
+	}
+	if (err) {
+		return 1;
 	}
 
+	fprintf(stderr,
+			"Generated %ld log entries: %ld shows x %ld episodes, %ld listeners (%.0f%% IPv6), %d days, seed %lu\n",
+			config.lines, config.shows, config.episodes, config.listeners, config.ipv6_pct, config.days,
+			(unsigned long)config.seed);
 	return 0;
 }
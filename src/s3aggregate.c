@@ -0,0 +1,747 @@
+#include "../include/s3aggregate.h"
+#include "../include/s3query.h"
+
+// COMPOSITE KEYS ------------------------------------------------------------------------------
+// Every grouping key gets a fixed bit field in one packed_key_t, outermost key highest, so a
+// composite group is a single integer: hashed as one, and sorted by key it lists the groups
+// level by level. GROUP_TIME is stored as a bucket index, not a timestamp, to stay small.
+
+// Bits a key needs
+static int
+key_bits(int group_by, const extract_config_t *config, uint32_t time_unit)
+{
+	switch (group_by) {
+	case GROUP_PODCAST:
+	case GROUP_KEY:
+		return config->wide ? 64 : 32;
+	case GROUP_IP:
+		return config->wide ? 64 : 33; // narrow hashed addresses set bit 32
+	case GROUP_COUNTRY:
+	case GROUP_SYSTEM:
+	case GROUP_PLATFORM:
+		return 8;
+	case GROUP_TIME: {
+		uint64_t last = ((uint64_t)UINT32_MAX + 14 * 3600 + AGGREGATE_TIME_BIAS) / time_unit;
+		return 64 - __builtin_clzll(last);
+	}
+	default:
+		return 0;
+	}
+}
+
+/**
+ * @BRIEF Lays out the packed key of config->group_keys
+ * @PARAM layout : Layout to fill
+ * @PARAM config : Keys, record width and time bucket
+ * @RETURN 0 on success, 1 when a key is invalid or they need more than AGGREGATE_KEY_BITS
+ */
+int
+composite_key_init(composite_key_t *layout, const extract_config_t *config)
+{
+	memset(layout, 0, sizeof(*layout));
+	const time_bucket_t *bucket = config->time_bucket;
+	layout->time_unit = (bucket != NULL && bucket->unit == BUCKET_SECONDS) ? bucket->width : SECONDS_IN_DAY;
+	layout->count = config->group_count;
+	if (layout->count < 1 || layout->count > GROUP_KEYS_MAX) {
+		fprintf(stderr, "Composite keys: 1 to %d keys\n", GROUP_KEYS_MAX);
+		return 1;
+	}
+
+	int total = 0;
+	for (int i = 0; i < layout->count; i++) {
+		layout->group_by[i] = config->group_keys[i];
+		layout->bits[i] = key_bits(layout->group_by[i], config, layout->time_unit);
+		if (layout->bits[i] == 0) {
+			fprintf(stderr, "Composite keys: %s cannot be a key\n", get_group_name(layout->group_by[i], config));
+			return 1;
+		}
+		total += layout->bits[i];
+	}
+	if (total > AGGREGATE_KEY_BITS) {
+		fprintf(stderr, "Composite keys: %d bits, at most %d fit\n", total, AGGREGATE_KEY_BITS);
+		return 1;
+	}
+	for (int i = layout->count - 1, shift = 0; i >= 0; i--) {
+		layout->shift[i] = shift;
+		shift += layout->bits[i];
+	}
+	return 0;
+}
+
+// Packed key of a record
+packed_key_t
+composite_key_pack(const composite_key_t *layout, const s_log_wide_t *log, const extract_config_t *config)
+{
+	packed_key_t key = 0;
+	for (int i = 0; i < layout->count; i++) {
+		uint64_t part = extract_group_key(log, layout->group_by[i], config);
+		if (layout->group_by[i] == GROUP_TIME) {
+			part = (uint64_t)(((int64_t)part + AGGREGATE_TIME_BIAS) / layout->time_unit);
+		}
+		key |= (packed_key_t)part << layout->shift[i];
+	}
+	return key;
+}
+
+// One level of a packed key, as extract_group_key returns it (for format_group_key)
+uint64_t
+composite_key_part(const composite_key_t *layout, packed_key_t key, int level)
+{
+	int bits = layout->bits[level];
+	uint64_t mask = (bits == 64) ? UINT64_MAX : (1ull << bits) - 1;
+	uint64_t part = (uint64_t)(key >> layout->shift[level]) & mask;
+	if (layout->group_by[level] == GROUP_TIME) {
+		return (uint64_t)((int64_t)part * layout->time_unit - AGGREGATE_TIME_BIAS);
+	}
+	return part;
+}
+// END COMPOSITE KEYS --------------------------------------------------------------------------
+
+// HASH AGGREGATE ------------------------------------------------------------------------------
+
+static inline uint32_t
+aggregate_home(const aggregate_table_t *table, packed_key_t key)
+{
+	return (uint32_t)hash64_mix((uint64_t)key ^ HASH64_SECRET[0], (uint64_t)(key >> 64) ^ HASH64_SECRET[3]) &
+		   table->index_mask;
+}
+
+int
+aggregate_table_init(aggregate_table_t *table)
+{
+	memset(table, 0, sizeof(*table));
+	table->capacity = AGGREGATE_START_GROUPS;
+	table->index_mask = AGGREGATE_START_GROUPS * 2 - 1;
+	table->groups = (aggregate_t *)malloc(table->capacity * sizeof(aggregate_t));
+	table->index = (uint32_t *)calloc(table->index_mask + 1, sizeof(uint32_t));
+	if (table->groups == NULL || table->index == NULL) {
+		perror("Aggregate: Malloc");
+		return 1;
+	}
+	return 0;
+}
+
+void
+aggregate_table_free(aggregate_table_t *table)
+{
+	free(table->groups);
+	free(table->index);
+	memset(table, 0, sizeof(*table));
+}
+
+// Doubles the groups and the index, the index stays at most half full
+static int
+aggregate_grow(aggregate_table_t *table)
+{
+	aggregate_t *groups = (aggregate_t *)realloc(table->groups, table->capacity * 2 * sizeof(aggregate_t));
+	if (groups == NULL) {
+		perror("Aggregate: Realloc");
+		return 1;
+	}
+	table->groups = groups;
+	uint32_t *index = (uint32_t *)calloc((table->index_mask + 1) * 2, sizeof(uint32_t));
+	if (index == NULL) {
+		perror("Aggregate: Calloc");
+		return 1;
+	}
+	table->capacity *= 2;
+	free(table->index);
+	table->index = index;
+	table->index_mask = table->index_mask * 2 + 1;
+	for (uint32_t i = 0; i < table->count; i++) {
+		uint32_t slot = aggregate_home(table, table->groups[i].key);
+		while (table->index[slot] != 0) {
+			slot = (slot + 1) & table->index_mask;
+		}
+		table->index[slot] = i + 1;
+	}
+	return 0;
+}
+
+// Bytes the table holds, checked against its budget before growing
+static inline uint64_t
+aggregate_table_bytes(const aggregate_table_t *table)
+{
+	return (uint64_t)table->capacity * sizeof(aggregate_t) + (uint64_t)(table->index_mask + 1) * sizeof(uint32_t);
+}
+
+// Group of key, a new one is zeroed; AGGREGATE_FULL when growing would exceed the budget
+static inline int
+aggregate_find(aggregate_table_t *table, packed_key_t key, aggregate_t **found)
+{
+	uint32_t slot = aggregate_home(table, key);
+	for (; table->index[slot] != 0; slot = (slot + 1) & table->index_mask) {
+		aggregate_t *group = &table->groups[table->index[slot] - 1];
+		if (group->key == key) {
+			*found = group;
+			return 0;
+		}
+	}
+
+	if (table->count == table->capacity) {
+		if (table->budget > 0 && aggregate_table_bytes(table) * 2 > table->budget) {
+			return AGGREGATE_FULL;
+		}
+		if (aggregate_grow(table) != 0) {
+			return 1;
+		}
+		slot = aggregate_home(table, key);
+		while (table->index[slot] != 0) {
+			slot = (slot + 1) & table->index_mask;
+		}
+	}
+	aggregate_t *group = &table->groups[table->count];
+	memset(group, 0, sizeof(*group));
+	group->key = key;
+	table->index[slot] = ++table->count;
+	*found = group;
+	return 0;
+}
+
+/**
+ * @BRIEF Adds a record to its group's totals
+ * @PARAM table : Hash aggregate
+ * @PARAM key   : composite_key_pack of the record
+ * @PARAM log   : Record
+ * @RETURN 0 on success, 1 on allocation failure, AGGREGATE_FULL when a new group would exceed the budget
+ */
+int
+aggregate_add(aggregate_table_t *table, packed_key_t key, const s_log_wide_t *log)
+{
+	aggregate_t *group = NULL;
+	int err = aggregate_find(table, key, &group);
+	if (err != 0) {
+		return err;
+	}
+	if (group->requests == 0) {
+		group->flags = log->flags;
+	}
+	group->requests++;
+	group->unique += (log->flags & UNIQUE_IP) ? 1 : 0;
+	group->bytes_kb += log->bytes_sent_kb;
+	group->time_ms += log->download_time_ms;
+	return 0;
+}
+
+/**
+ * @BRIEF Adds partial totals of a group, as spilled by an earlier pass
+ * @PARAM table   : Hash aggregate
+ * @PARAM partial : Totals of some of the group's records
+ * @RETURN As aggregate_add
+ */
+int
+aggregate_merge(aggregate_table_t *table, const aggregate_t *partial)
+{
+	aggregate_t *group = NULL;
+	int err = aggregate_find(table, partial->key, &group);
+	if (err != 0) {
+		return err;
+	}
+	if (group->requests == 0) {
+		group->flags = partial->flags;
+	}
+	group->requests += partial->requests;
+	group->unique += partial->unique;
+	group->bytes_kb += partial->bytes_kb;
+	group->time_ms += partial->time_ms;
+	return 0;
+}
+
+// Empties the table, its memory is kept for the next pass
+void
+aggregate_table_reset(aggregate_table_t *table)
+{
+	table->count = 0;
+	memset(table->index, 0, (table->index_mask + 1) * sizeof(uint32_t));
+}
+
+static int
+compare_aggregate(const void *a, const void *b)
+{
+	const aggregate_t *left = (const aggregate_t *)a;
+	const aggregate_t *right = (const aggregate_t *)b;
+	if (left->prefix != right->prefix) {
+		return (left->prefix < right->prefix) ? -1 : 1;
+	}
+	if (left->rank != right->rank) {
+		return (left->rank > right->rank) ? -1 : 1; // largest first
+	}
+	return (left->key < right->key) ? -1 : (left->key > right->key);
+}
+
+/**
+ * @BRIEF Orders the groups for output, ties always broken by key
+ * @PARAM table    : Hash aggregate, its index is invalid afterwards
+ * @PARAM layout   : Key layout
+ * @PARAM order_by : ORDER_*
+ */
+void
+aggregate_sort(aggregate_table_t *table, const composite_key_t *layout, int order_by)
+{
+	int inner_bits = layout->bits[layout->count - 1];
+	for (uint32_t i = 0; i < table->count; i++) {
+		aggregate_t *group = &table->groups[i];
+		group->prefix = (layout->count > 1) ? group->key >> inner_bits : 0;
+		switch (order_by) {
+		case ORDER_REQUESTS:
+			group->rank = group->requests;
+			break;
+		case ORDER_UNIQUE:
+			group->rank = group->unique;
+			break;
+		case ORDER_BYTES:
+			group->rank = group->bytes_kb;
+			break;
+		case ORDER_TIME:
+			group->rank = group->time_ms;
+			break;
+		default:
+			group->rank = 0;
+		}
+	}
+	qsort(table->groups, table->count, sizeof(aggregate_t), compare_aggregate);
+	memset(table->index, 0, (table->index_mask + 1) * sizeof(uint32_t));
+}
+// END HASH AGGREGATE --------------------------------------------------------------------------
+
+// AGGREGATE EXTRACT ---------------------------------------------------------------------------
+// One pass into the hash aggregate, one sort, then the nested JSON straight off the sorted
+// groups: a level opens when its key differs from the previous group's.
+//
+// Past the memory budget the table is flushed as partial aggregates into hash partitions of
+// the key and refilled. Each partition then holds every partial of its keys, so it is merged
+// alone (repartitioned if it is still too large), sorted and appended as a run; a k-way merge
+// of the runs feeds the same printer.
+
+// Sorted runs of the partitions done so far and the table every pass reuses
+typedef struct aggregate_job_s {
+	const composite_key_t *layout;
+	const extract_config_t *config;
+	aggregate_table_t table;
+	FILE *run_file;	   // sorted runs back to back, NULL until the first spill
+	char *run_buffer;  // its setvbuf buffer
+	uint64_t *run_end; // end offset of each run
+	uint32_t run_count;
+	uint32_t run_capacity;
+	uint32_t partitions; // spilled partitions over every level, for -v
+	void *batch;		 // QUERY_BATCH records read at level 0
+	packed_key_t *keys;	 // their packed keys
+} aggregate_job_t;
+
+// Sorted groups -> nested JSON, one group at a time
+typedef struct aggregate_printer_s {
+	FILE *output;
+	const composite_key_t *layout;
+	const extract_config_t *config;
+	aggregate_t last; // last printed group
+	int started;	  // last is set
+	uint64_t siblings; // innermost groups printed under the current parent
+	uint64_t printed;
+} aggregate_printer_t;
+
+static const char *
+order_name(int order_by)
+{
+	switch (order_by) {
+	case ORDER_REQUESTS:
+		return "requests";
+	case ORDER_UNIQUE:
+		return "unique";
+	case ORDER_BYTES:
+		return "bytes_kb";
+	case ORDER_TIME:
+		return "time_ms";
+	default:
+		return "key";
+	}
+}
+
+static void
+print_level_open(FILE *output, const composite_key_t *layout, const aggregate_t *group, int level,
+				 const extract_config_t *config, int comma)
+{
+	char *label = format_group_key(layout->group_by[level], composite_key_part(layout, group->key, level),
+								   group->flags, config);
+	fprintf(output, "%s%*s\"%s\": ", comma ? ",\n" : "", 4 + level * 2, "", label);
+	free(label);
+}
+
+static void
+print_aggregates_begin(aggregate_printer_t *printer, FILE *output, const composite_key_t *layout,
+					   const extract_config_t *config)
+{
+	memset(printer, 0, sizeof(*printer));
+	printer->output = output;
+	printer->layout = layout;
+	printer->config = config;
+	fprintf(output, "{\n");
+	fprintf(output, "  \"grouped_by\": [");
+	for (int i = 0; i < layout->count; i++) {
+		fprintf(output, "%s\"%s\"", (i > 0) ? ", " : "", get_group_name(layout->group_by[i], config));
+	}
+	fprintf(output, "], \n");
+	fprintf(output, "  \"ordered_by\": \"%s\", \n", order_name(config->order_by));
+	fprintf(output, "  \"limit\": %lu, \n", config->limit);
+	fprintf(output, "  \"groups\":  {\n");
+}
+
+static void
+print_aggregate(aggregate_printer_t *printer, const aggregate_t *group)
+{
+	const composite_key_t *layout = printer->layout;
+	const extract_config_t *config = printer->config;
+	FILE *output = printer->output;
+	const aggregate_t *last = printer->started ? &printer->last : NULL;
+	int inner = layout->count - 1;
+
+	int level = 0; // first level that differs from the last printed group
+	while (last != NULL && level < inner &&
+		   composite_key_part(layout, group->key, level) == composite_key_part(layout, last->key, level)) {
+		level++;
+	}
+	if (level < inner) {
+		printer->siblings = 0;
+	}
+	if (config->limit > 0 && printer->siblings >= config->limit) {
+		return;
+	}
+
+	// Close the levels of the last group down to the shared prefix, open ours
+	for (int j = inner - 1; last != NULL && j >= level; j--) {
+		fprintf(output, "\n%*s}", 4 + j * 2, "");
+	}
+	for (int j = level; j < inner; j++) {
+		print_level_open(output, layout, group, j, config, last != NULL && j == level);
+		fprintf(output, "{\n");
+	}
+	print_level_open(output, layout, group, inner, config, last != NULL && level == inner);
+	fprintf(output, "{\"requests\": %lu, \"unique\": %lu, \"bytes_kb\": %lu, \"mean_time_ms\": %.1f}",
+			group->requests, group->unique, group->bytes_kb, (double)group->time_ms / (double)group->requests);
+	printer->last = *group;
+	printer->started = 1;
+	printer->siblings++;
+	printer->printed++;
+}
+
+static void
+print_aggregates_end(aggregate_printer_t *printer, uint64_t total_groups)
+{
+	FILE *output = printer->output;
+	for (int j = printer->layout->count - 2; printer->started && j >= 0; j--) {
+		fprintf(output, "\n%*s}", 4 + j * 2, "");
+	}
+	fprintf(output, "\n  },\n");
+	fprintf(output, "  \"total_groups\": %lu, \n", total_groups);
+	fprintf(output, "  \"printed_groups\": %lu\n", printer->printed);
+	fprintf(output, "}\n");
+}
+
+// Sorts the table and appends it to the run file as one run
+static int
+aggregate_write_run(aggregate_job_t *job)
+{
+	aggregate_table_t *table = &job->table;
+	if (job->run_file == NULL) {
+		job->run_file = spill_tmpfile();
+		job->run_buffer = (char *)malloc(SPILL_BUFFER);
+		if (job->run_file == NULL || job->run_buffer == NULL) {
+			perror("Aggregate: run file");
+			return 1;
+		}
+		setvbuf(job->run_file, job->run_buffer, _IOFBF, SPILL_BUFFER);
+	}
+	if (job->run_count == job->run_capacity) {
+		uint32_t capacity = (job->run_capacity == 0) ? 64 : job->run_capacity * 2;
+		uint64_t *run_end = (uint64_t *)realloc(job->run_end, capacity * sizeof(uint64_t));
+		if (run_end == NULL) {
+			perror("Aggregate: Realloc");
+			return 1;
+		}
+		job->run_end = run_end;
+		job->run_capacity = capacity;
+	}
+
+	aggregate_sort(table, job->layout, job->config->order_by);
+	if (fwrite(table->groups, sizeof(aggregate_t), table->count, job->run_file) != table->count) {
+		perror("Aggregate: fwrite run");
+		return 1;
+	}
+	uint64_t start = (job->run_count > 0) ? job->run_end[job->run_count - 1] : 0;
+	job->run_end[job->run_count++] = start + (uint64_t)table->count * sizeof(aggregate_t);
+	aggregate_table_reset(table);
+	return 0;
+}
+
+// Writes the table's partial aggregates to their partitions, opening them on the first flush
+static int
+aggregate_spill(aggregate_job_t *job, spill_t *spill, FILE *input, int level)
+{
+	aggregate_table_t *table = &job->table;
+	if (spill->count == 0) {
+		uint32_t count = spill_partitions(input, aggregate_table_bytes(table), table->budget);
+		if (spill_open(spill, count, (uint32_t)level, sizeof(aggregate_t), table->budget) != 0) {
+			return 1;
+		}
+		job->partitions += count;
+		if (job->config->verbose) {
+			fprintf(stderr, "Aggregates: %u groups at the memory budget, spilling into %u partitions (level %d)\n",
+					table->count, count, level);
+		}
+	}
+	for (uint32_t i = 0; i < table->count; i++) {
+		const aggregate_t *group = &table->groups[i];
+		uint32_t partition = spill_partition(spill, (uint64_t)group->key, (uint64_t)(group->key >> 64));
+		if (spill_write(spill, partition, group) != 0) {
+			return 1;
+		}
+	}
+	aggregate_table_reset(table);
+	return 0;
+}
+
+/**
+ * @BRIEF Aggregates records (level 0) or spilled partials (deeper levels) into the table
+ * @PARAM job   : Extract state
+ * @PARAM input : Records, or a partition of partial aggregates
+ * @PARAM level : Partition depth of input
+ * @RETURN 0 on success, 1 on failure
+ *
+ * @DETAILS Leaves the table filled and unsorted when level 0 fit the budget,
+ *          otherwise every group ends up in a sorted run.
+ */
+static int
+aggregate_pass(aggregate_job_t *job, FILE *input, int level)
+{
+	const extract_config_t *config = job->config;
+	aggregate_table_t *table = &job->table;
+	s3_stats_t *perf = config->perf;
+	size_t record_size = config->wide ? sizeof(s_log_wide_t) : sizeof(s_log_t);
+	spill_t spill;
+	memset(&spill, 0, sizeof(spill));
+
+	int err = 0;
+	s_log_wide_t log;
+	aggregate_t partial;
+	packed_key_t key = 0;
+	size_t next = 0;  // next record of the batch
+	size_t count = 0; // records in the batch
+	for (;;) {
+		if (level == 0) {
+			// Keys are packed a batch at a time by the kernels of the -g keys
+			if (next == count) {
+				count = fread(job->batch, record_size, QUERY_BATCH, input);
+				next = 0;
+				if (count == 0) {
+					break;
+				}
+				query_pack_keys(job->layout, config, job->batch, count, job->keys);
+				perf->lines += count;
+				perf->bytes += count * record_size;
+			}
+			if (config->wide) {
+				log = ((const s_log_wide_t *)job->batch)[next];
+			}
+			else {
+				widen_record(&((const s_log_t *)job->batch)[next], &log);
+			}
+			key = job->keys[next++];
+		}
+		else if (fread(&partial, sizeof(partial), 1, input) != 1) {
+			break;
+		}
+
+		err = (level == 0) ? aggregate_add(table, key, &log) : aggregate_merge(table, &partial);
+		if (err == AGGREGATE_FULL) {
+			if (level >= SPILL_MAX_LEVEL) {
+				fprintf(stderr, "Aggregates: partition still over the memory budget after %d splits, continuing "
+								"over it\n", level);
+				table->budget = 0;
+			}
+			else if (aggregate_spill(job, &spill, input, level) != 0) {
+				break;
+			}
+			err = (level == 0) ? aggregate_add(table, key, &log) : aggregate_merge(table, &partial);
+		}
+		if (err != 0) {
+			break;
+		}
+	}
+	if (err != 0) {
+		spill_close(&spill);
+		return 1;
+	}
+
+	if (spill.count == 0) {
+		return (level == 0) ? 0 : aggregate_write_run(job);
+	}
+	err = aggregate_spill(job, &spill, input, level);
+	for (uint32_t i = 0; !err && i < spill.count; i++) {
+		if (spill.records[i] > 0) {
+			FILE *partition = spill_rewind(&spill, i);
+			err = (partition == NULL) || aggregate_pass(job, partition, level + 1) != 0;
+		}
+		spill_release(&spill, i);
+	}
+	spill_close(&spill);
+	return err;
+}
+
+// Sift down of the merge heap, smallest head on top
+static void
+merge_sift(uint32_t *heap, uint32_t count, const aggregate_t *heads, uint32_t i)
+{
+	for (;;) {
+		uint32_t smallest = i;
+		uint32_t left = 2 * i + 1;
+		uint32_t right = left + 1;
+		if (left < count && compare_aggregate(&heads[heap[left]], &heads[heap[smallest]]) < 0) {
+			smallest = left;
+		}
+		if (right < count && compare_aggregate(&heads[heap[right]], &heads[heap[smallest]]) < 0) {
+			smallest = right;
+		}
+		if (smallest == i) {
+			return;
+		}
+		uint32_t swap = heap[i];
+		heap[i] = heap[smallest];
+		heap[smallest] = swap;
+		i = smallest;
+	}
+}
+
+// K-way merge of the sorted runs into the printer, runs hold disjoint keys
+static int
+aggregate_merge_runs(aggregate_job_t *job, aggregate_printer_t *printer, uint64_t *total_groups)
+{
+	uint32_t runs = job->run_count;
+	uint64_t budget = job->config->memory_budget;
+	size_t buffer = SPILL_BUFFER;
+	if (budget > 0 && budget / 2 / runs < buffer) {
+		buffer = (budget / 2 / runs < 64 * sizeof(aggregate_t)) ? 64 * sizeof(aggregate_t) : budget / 2 / runs;
+	}
+	if (fflush(job->run_file) != 0) {
+		perror("Aggregate: fflush run");
+		return 1;
+	}
+
+	run_reader_t *readers = (run_reader_t *)calloc(runs, sizeof(run_reader_t));
+	aggregate_t *heads = (aggregate_t *)malloc(runs * sizeof(aggregate_t));
+	uint32_t *heap = (uint32_t *)malloc(runs * sizeof(uint32_t));
+	int err = (readers == NULL || heads == NULL || heap == NULL);
+	uint32_t count = 0;
+	for (uint32_t i = 0; !err && i < runs; i++) {
+		uint64_t start = (i > 0) ? job->run_end[i - 1] : 0;
+		err = run_reader_init(&readers[i], job->run_file, start, job->run_end[i], buffer) != 0;
+		if (!err && run_reader_next(&readers[i], &heads[i], sizeof(aggregate_t)) == 1) {
+			heap[count++] = i;
+		}
+	}
+	for (uint32_t i = count / 2; !err && i-- > 0;) {
+		merge_sift(heap, count, heads, i);
+	}
+
+	*total_groups = 0;
+	while (!err && count > 0) {
+		uint32_t run = heap[0];
+		print_aggregate(printer, &heads[run]);
+		(*total_groups)++;
+		int got = run_reader_next(&readers[run], &heads[run], sizeof(aggregate_t));
+		if (got < 0) {
+			err = 1;
+		}
+		else if (got == 0) {
+			heap[0] = heap[--count];
+		}
+		merge_sift(heap, count, heads, 0);
+	}
+
+	for (uint32_t i = 0; readers != NULL && i < runs; i++) {
+		run_reader_free(&readers[i]);
+	}
+	free(readers);
+	free(heads);
+	free(heap);
+	if (err) {
+		fprintf(stderr, "Aggregates: merging %u runs failed\n", runs);
+	}
+	return err;
+}
+
+/**
+ * @BRIEF Per group totals over one or more keys
+ * @PARAM input  : Binary slim (or wide) log stream
+ * @PARAM output : JSON destination
+ * @PARAM config : Keys (outermost first), order, limit per innermost parent, memory budget
+ * @RETURN 0 on success, -1 on a bad key set, allocation or spill failure
+ *
+ * @DETAILS Groups hold requests, unique downloads, bytes and download time,
+ *          never the records, so memory is one aggregate_t per group. Past
+ *          config->memory_budget they spill to temporary files.
+ */
+int
+extract_aggregates(FILE *input, FILE *output, const extract_config_t *config)
+{
+	s3_stats_t *perf = config->perf;
+	composite_key_t layout;
+	aggregate_job_t job;
+	memset(&job, 0, sizeof(job));
+	job.layout = &layout;
+	job.config = config;
+	if (composite_key_init(&layout, config) != 0) {
+		return -1;
+	}
+	if (aggregate_table_init(&job.table) != 0) {
+		aggregate_table_free(&job.table);
+		return -1;
+	}
+	job.table.budget = config->memory_budget;
+	job.batch = malloc(QUERY_BATCH * sizeof(s_log_wide_t));
+	job.keys = (packed_key_t *)malloc(QUERY_BATCH * sizeof(packed_key_t));
+	if (job.batch == NULL || job.keys == NULL) {
+		perror("Aggregate: Malloc");
+		aggregate_table_free(&job.table);
+		free(job.batch);
+		free(job.keys);
+		return -1;
+	}
+
+	uint64_t timer = stats_begin(perf);
+	int err = aggregate_pass(&job, input, 0);
+	if (!err && job.run_count == 0) {
+		aggregate_sort(&job.table, &layout, config->order_by);
+	}
+	stats_end(perf, STAGE_GROUP, timer);
+
+	uint64_t total_groups = job.table.count;
+	if (!err) {
+		timer = stats_begin(perf);
+		aggregate_printer_t printer;
+		print_aggregates_begin(&printer, output, &layout, config);
+		if (job.run_count == 0) {
+			for (uint32_t i = 0; i < job.table.count; i++) {
+				print_aggregate(&printer, &job.table.groups[i]);
+			}
+		}
+		else {
+			aggregate_table_free(&job.table); // the merge buffers take its place
+			err = aggregate_merge_runs(&job, &printer, &total_groups);
+		}
+		print_aggregates_end(&printer, total_groups);
+		stats_end(perf, STAGE_WRITE, timer);
+	}
+	if (config->verbose) {
+		fprintf(stderr, "Aggregates: %lu records, %lu groups, %u partitions, %u runs\n", perf->lines,
+				total_groups, job.partitions, job.run_count);
+	}
+	aggregate_table_free(&job.table);
+	if (job.run_file != NULL) {
+		fclose(job.run_file);
+	}
+	free(job.run_buffer);
+	free(job.run_end);
+	free(job.batch);
+	free(job.keys);
+	return err ? -1 : 0;
+}
+// END AGGREGATE EXTRACT -----------------------------------------------------------------------
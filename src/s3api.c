@@ -0,0 +1,381 @@
+#include "../include/s3api.h"
+#include <fcntl.h>
+#include <sys/mman.h>
+
+// PUSH PARSER ---------------------------------------------------------------------------------
+// Bytes arrive in pieces of any size. Each line is gathered in the parser's arena, which is
+// also where the tokenizer writes its terminators, so the caller's buffer is never modified
+// and a line split across feeds costs nothing extra. The arena only grows for a line longer
+// than any before it, records go to one batch reused for every on_batch call.
+
+/**
+ * @BRIEF Sets up a push parser
+ * @PARAM parser  : Parser to initialize
+ * @PARAM options : Callbacks and settings, copied, zeroed fields take the s3lp defaults
+ * @RETURN S3LP_OK, S3LP_ENOMEM, S3LP_EFORMAT for a dedup_state that is not a snapshot,
+ *         S3LP_EIO for one that exists but cannot be opened or mapped,
+ *         S3LP_EOPTION for a malformed prefilter option, S3LP_ESTATE without on_batch
+ */
+int
+s3lp_parser_init(s3lp_parser_t *parser, const s3lp_options_t *options)
+{
+	memset(parser, 0, sizeof(*parser));
+	if (options->on_batch == NULL) {
+		return S3LP_ESTATE;
+	}
+	parser->options = *options;
+	if (parser->options.batch_size == 0) {
+		parser->options.batch_size = BATCH_SIZE;
+	}
+	if (parser->options.dedup_window == 0) {
+		parser->options.dedup_window = DEDUP_WINDOW;
+	}
+	parser->context.geo = (geo_db_t *)options->geo;
+	parser->context.output_filetype_flag = options->wide ? WIDE_FILE : BIN_FILE;
+
+	// Same prefilter as s3lp -O -B -K -H
+	const char *lists[] = {options->operations, options->buckets, options->key_prefixes};
+	const int fields[] = {PREFILTER_FIELD_OPERATION, PREFILTER_FIELD_BUCKET, PREFILTER_FIELD_KEY};
+	int refused = 0;
+	for (int i = 0; i < 3 && refused == 0; i++) {
+		refused = (lists[i] != NULL) ? prefilter_add(&parser->prefilter, fields[i], lists[i]) : 0;
+	}
+	if (refused == 0 && options->status_range != NULL) {
+		refused = prefilter_status(&parser->prefilter, options->status_range);
+	}
+	if (refused != 0) {
+		s3lp_parser_free(parser);
+		return (refused == -1) ? S3LP_ENOMEM : S3LP_EOPTION;
+	}
+	if (parser->prefilter.last_field != 0) {
+		parser->context.prefilter = &parser->prefilter;
+	}
+
+	int loaded = -1;
+	if (options->dedup_state != NULL) {
+		loaded = ip_track_load(&parser->context.ip_track, options->dedup_state, parser->options.dedup_window);
+		if (loaded > 0) {
+			s3lp_parser_free(parser); // the prefilter names are already copied
+			return (loaded == 1) ? S3LP_EFORMAT : S3LP_EIO;
+		}
+	}
+	if (loaded == -1 && ip_track_init(&parser->context.ip_track, IP_HASH, parser->options.dedup_window) != 0) {
+		s3lp_parser_free(parser);
+		return S3LP_ENOMEM;
+	}
+
+	parser->line_capacity = LOG_DEFAULT;
+	parser->line = (char *)malloc(parser->line_capacity);
+	parser->batch = (s_log_t *)calloc(parser->options.batch_size, sizeof(s_log_t));
+	if (options->wide) {
+		parser->wide_batch = (s_log_wide_t *)calloc(parser->options.batch_size, sizeof(s_log_wide_t));
+	}
+	if (parser->line == NULL || parser->batch == NULL || (options->wide && parser->wide_batch == NULL)) {
+		s3lp_parser_free(parser);
+		return S3LP_ENOMEM;
+	}
+	return S3LP_OK;
+}
+
+// Hands the waiting records to on_batch
+static void
+parser_flush(s3lp_parser_t *parser)
+{
+	if (parser->count == 0) {
+		return;
+	}
+	int stop = parser->options.on_batch(parser->batch, parser->wide_batch, parser->count, parser->options.user);
+	parser->count = 0;
+	if (stop) {
+		parser->state = S3LP_ESTOPPED;
+	}
+}
+
+// Parses the line gathered in the arena, same accounting as process_log
+static void
+parser_line(s3lp_parser_t *parser)
+{
+	size_t length = parser->line_length;
+	parser->line_length = 0;
+	if (length > 0 && parser->line[length - 1] == '\r') {
+		length--;
+	}
+	parser->line[length] = '\0';
+
+	s_context_t *context = &parser->context;
+	context->stats.lines++;
+	if (length >= LOG_DEFAULT) {
+		context->stats.long_lines++;
+	}
+	int status = parse_log_entry(parser->line, &parser->parsed, context);
+	if (status == PARSE_FILTERED) {
+		context->stats.filtered++;
+		return;
+	}
+	if (status != PARSE_OK) {
+		context->stats.malformed++;
+		context->stats.rejected[status]++;
+		if (parser->options.on_reject != NULL) {
+			// The tokenizer only turned spaces into '\0', up to where it stopped
+			for (size_t i = 0; i < parser->parsed.length; i++) {
+				if (parser->line[i] == '\0') {
+					parser->line[i] = ' ';
+				}
+			}
+			parser->options.on_reject(parser->line, length, status, parser->options.user);
+		}
+		return;
+	}
+
+	extract_log_entry(&parser->parsed, &parser->batch[parser->count], context);
+	if (context->ip_track.grow_failed) {
+		parser->state = S3LP_ENOMEM; // the unique listener table could not grow, counts would drift
+		return;
+	}
+	if (parser->wide_batch != NULL) {
+		widen_log_entry(&parser->parsed, &parser->batch[parser->count], &parser->wide_batch[parser->count]);
+	}
+	if (++parser->count == parser->options.batch_size) {
+		parser_flush(parser);
+	}
+}
+
+/**
+ * @BRIEF Parses the complete lines in a piece of raw log, keeps the trailing partial line
+ * @PARAM parser : Parser
+ * @PARAM data   : Log bytes, any split, not modified
+ * @PARAM length : Number of bytes
+ * @RETURN S3LP_OK, S3LP_ENOMEM, S3LP_ESTOPPED once on_batch asked to stop, S3LP_ESTATE after finish
+ *
+ * @DETAILS Records reach on_batch only in full batches, s3lp_parser_finish delivers the rest.
+ */
+int
+s3lp_parser_feed(s3lp_parser_t *parser, const void *data, size_t length)
+{
+	if (parser->finished) {
+		return S3LP_ESTATE;
+	}
+	const char *bytes = (const char *)data;
+	while (parser->state == S3LP_OK && length > 0) {
+		const char *newline = (const char *)memchr(bytes, '\n', length);
+		size_t chunk = (newline != NULL) ? (size_t)(newline - bytes) : length;
+
+		// Room for the chunk and the terminator
+		if (parser->line_length + chunk + 1 > parser->line_capacity) {
+			size_t capacity = parser->line_capacity * 2;
+			while (parser->line_length + chunk + 1 > capacity) {
+				capacity *= 2;
+			}
+			char *line = (char *)realloc(parser->line, capacity);
+			if (line == NULL) {
+				parser->state = S3LP_ENOMEM;
+				break;
+			}
+			parser->line = line;
+			parser->line_capacity = capacity;
+		}
+		memcpy(parser->line + parser->line_length, bytes, chunk);
+		parser->line_length += chunk;
+		if (newline == NULL) {
+			break;
+		}
+		parser_line(parser);
+		bytes += chunk + 1;
+		length -= chunk + 1;
+	}
+	return parser->state;
+}
+
+/**
+ * @BRIEF Parses a last line without a newline and delivers the records still waiting
+ * @PARAM parser : Parser, takes no more input afterwards
+ * @RETURN S3LP_OK, or the code that stopped the parser
+ */
+int
+s3lp_parser_finish(s3lp_parser_t *parser)
+{
+	if (parser->finished) {
+		return S3LP_ESTATE;
+	}
+	parser->finished = 1;
+	if (parser->state == S3LP_OK && parser->line_length > 0) {
+		parser_line(parser);
+	}
+	if (parser->state == S3LP_OK) {
+		parser_flush(parser);
+	}
+	return parser->state;
+}
+
+/**
+ * @BRIEF Writes the unique listener table, the dedup_state of a later parser
+ * @PARAM parser : Parser
+ * @PARAM path   : Snapshot file, replaced atomically
+ * @RETURN S3LP_OK or S3LP_EIO
+ */
+int
+s3lp_parser_save(const s3lp_parser_t *parser, const char *path)
+{
+	return (ip_track_save(&parser->context.ip_track, path) == 0) ? S3LP_OK : S3LP_EIO;
+}
+
+// Lines read, rejected per PARSE_* code and longer than LOG_DEFAULT so far
+const parse_stats_t *
+s3lp_parser_stats(const s3lp_parser_t *parser)
+{
+	return &parser->context.stats;
+}
+
+void
+s3lp_parser_free(s3lp_parser_t *parser)
+{
+	ip_track_free(&parser->context.ip_track);
+	prefilter_free(&parser->prefilter);
+	parser->context.prefilter = NULL;
+	free(parser->line);
+	free(parser->batch);
+	free(parser->wide_batch);
+	parser->line = NULL;
+	parser->batch = NULL;
+	parser->wide_batch = NULL;
+}
+// END PUSH PARSER -----------------------------------------------------------------------------
+
+// PULL READER ---------------------------------------------------------------------------------
+// A .bin file is mapped read only and its records are handed out in place. The filter runs
+// inside the iterator, so records that fail it never leave the library, and each call returns
+// the longest run of consecutive matches, one pointer for many records.
+
+/**
+ * @BRIEF Maps a binary log file for reading
+ * @PARAM reader : Reader to initialize
+ * @PARAM path   : File written by s3lp (-t w when wide)
+ * @PARAM wide   : Records are s_log_wide_t
+ * @PARAM filter : Records to hand out, copied, NULL for all
+ * @RETURN S3LP_OK or S3LP_EIO
+ *
+ * @DETAILS A partial record at the end of the file is ignored, as s3_extract does.
+ */
+int
+s3lp_reader_open(s3lp_reader_t *reader, const char *path, int wide, const catalog_query_t *filter)
+{
+	memset(reader, 0, sizeof(*reader));
+	reader->record_size = wide ? sizeof(s_log_wide_t) : sizeof(s_log_t);
+	if (filter != NULL) {
+		reader->filter = *filter;
+		reader->filtered = 1;
+	}
+
+	int fd = open(path, O_RDONLY);
+	struct stat st;
+	if (fd < 0 || fstat(fd, &st) != 0) {
+		if (fd >= 0) {
+			close(fd);
+		}
+		return S3LP_EIO;
+	}
+	reader->length = (size_t)st.st_size - (size_t)st.st_size % reader->record_size;
+	if (reader->length > 0) {
+		void *mapping = mmap(NULL, reader->length, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (mapping == MAP_FAILED) {
+			close(fd);
+			reader->length = 0;
+			return S3LP_EIO;
+		}
+		posix_madvise(mapping, reader->length, POSIX_MADV_SEQUENTIAL);
+		reader->data = (const uint8_t *)mapping;
+	}
+	close(fd);
+	return S3LP_OK;
+}
+
+/**
+ * @BRIEF Next run of consecutive records that pass the filter
+ * @PARAM reader  : Reader
+ * @PARAM records : Set to the first record of the run, inside the mapping
+ * @PARAM max     : Most records to return
+ * @RETURN Records in the run, 0 at end of file (records set to NULL)
+ */
+size_t
+s3lp_reader_next_batch(s3lp_reader_t *reader, const void **records, size_t max)
+{
+	// An empty file has no mapping, and NULL + 0 is still undefined
+	if (reader->data == NULL || reader->next >= reader->length) {
+		*records = NULL;
+		return 0;
+	}
+	size_t size = reader->record_size;
+	if (!reader->filtered) {
+		size_t count = (reader->length - reader->next) / size;
+		count = (count < max) ? count : max;
+		*records = reader->data + reader->next;
+		reader->next += count * size;
+		reader->scanned += count;
+		reader->matched += count;
+		return count;
+	}
+
+	// Skip to the first match, then extend the run
+	while (reader->next < reader->length &&
+		   !catalog_record_match(&reader->filter, reader->data + reader->next, size)) {
+		reader->next += size;
+		reader->scanned++;
+	}
+	size_t count = 0;
+	*records = reader->data + reader->next;
+	while (count < max && reader->next < reader->length &&
+		   catalog_record_match(&reader->filter, reader->data + reader->next, size)) {
+		reader->next += size;
+		count++;
+	}
+	reader->scanned += count;
+	reader->matched += count;
+	return count;
+}
+
+// Next record that passes the filter, NULL at end of file
+const void *
+s3lp_reader_next(s3lp_reader_t *reader)
+{
+	if (reader->data == NULL) {
+		return NULL;
+	}
+	const void *record = NULL;
+	return (s3lp_reader_next_batch(reader, &record, 1) == 1) ? record : NULL;
+}
+
+void
+s3lp_reader_close(s3lp_reader_t *reader)
+{
+	if (reader->data != NULL) {
+		munmap((void *)reader->data, reader->length);
+	}
+	reader->data = NULL;
+	reader->length = 0;
+	reader->next = 0;
+}
+// END PULL READER -----------------------------------------------------------------------------
+
+// Message for an S3LP_* code
+const char *
+s3lp_strerror(int code)
+{
+	switch (code) {
+	case S3LP_OK:
+		return "ok";
+	case S3LP_ENOMEM:
+		return "out of memory";
+	case S3LP_EIO:
+		return "file could not be opened, mapped or written";
+	case S3LP_EFORMAT:
+		return "not a dedup snapshot";
+	case S3LP_ESTOPPED:
+		return "stopped by callback";
+	case S3LP_ESTATE:
+		return "call out of order";
+	case S3LP_EOPTION:
+		return "malformed prefilter option";
+	default:
+		return "unknown error";
+	}
+}
@@ -0,0 +1,728 @@
+#include "../include/s3catalog.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+// MANIFEST ------------------------------------------------------------------------------------
+// A dataset is a directory of .bin files, one per bucket per day by convention, and a text
+// MANIFEST with a line per file:
+//
+//     path \t bucket \t first \t last \t records \t record_size \t podcasts
+//
+// podcasts is a comma separated list of hex hashes, or * when the file holds too many to list.
+// Writers rewrite the whole manifest to MANIFEST.tmp, sync it and rename it into place under
+// MANIFEST.lock, so a reader always sees a complete manifest, old or new.
+
+static void
+entry_free(catalog_entry_t *entry)
+{
+	if (entry->data != NULL) {
+		munmap((void *)entry->data, entry->records * entry->record_size);
+	}
+	free(entry->path);
+	free(entry->podcasts);
+	memset(entry, 0, sizeof(*entry));
+}
+
+static char *
+manifest_path(const char *dir, const char *name)
+{
+	size_t length = strlen(dir) + strlen(name) + 2;
+	char *path = (char *)malloc(length);
+	if (path != NULL) {
+		snprintf(path, length, "%s/%s", dir, name);
+	}
+	return path;
+}
+
+// Parses one manifest line, 0 on success
+static int
+entry_parse(catalog_entry_t *entry, char *line)
+{
+	char *fields[7];
+	int count = 0;
+	for (char *field = line; count < 7; count++) {
+		fields[count] = field;
+		char *tab = strchr(field, '\t');
+		if (tab == NULL) {
+			count++;
+			break;
+		}
+		*tab = '\0';
+		field = tab + 1;
+	}
+	if (count != 7) {
+		return 1;
+	}
+	fields[6][strcspn(fields[6], "\r\n")] = '\0';
+
+	memset(entry, 0, sizeof(*entry));
+	entry->path = strdup(fields[0]);
+	snprintf(entry->bucket, sizeof(entry->bucket), "%s", fields[1]);
+	entry->first = (uint32_t)strtoul(fields[2], NULL, 10);
+	entry->last = (uint32_t)strtoul(fields[3], NULL, 10);
+	entry->records = strtoull(fields[4], NULL, 10);
+	entry->record_size = (uint32_t)strtoul(fields[5], NULL, 10);
+	if (entry->path == NULL || (entry->record_size != sizeof(s_log_t) && entry->record_size != sizeof(s_log_wide_t))) {
+		free(entry->path);
+		return 1;
+	}
+
+	if (strcmp(fields[6], "*") == 0) {
+		entry->any_podcast = 1;
+		return 0;
+	}
+	uint32_t listed = (*fields[6] == '\0') ? 0 : 1;
+	for (const char *c = fields[6]; *c != '\0'; c++) {
+		listed += (*c == ',');
+	}
+	entry->podcasts = (uint64_t *)malloc((listed + 1) * sizeof(uint64_t));
+	if (entry->podcasts == NULL) {
+		free(entry->path);
+		return 1;
+	}
+	for (char *hash = fields[6]; *hash != '\0' && entry->podcast_count < listed;) {
+		char *end = NULL;
+		entry->podcasts[entry->podcast_count++] = strtoull(hash, &end, 16);
+		hash = (*end == ',') ? end + 1 : end;
+	}
+	return 0;
+}
+
+/**
+ * @BRIEF Reads the manifest of a dataset
+ * @PARAM catalog : Catalog to fill
+ * @PARAM dir     : Dataset directory, a missing manifest is an empty dataset
+ * @RETURN 0 on success, 1 on a read or allocation failure
+ */
+int
+catalog_load(catalog_t *catalog, const char *dir)
+{
+	memset(catalog, 0, sizeof(*catalog));
+	catalog->dir = strdup(dir);
+	char *path = manifest_path(dir, CATALOG_MANIFEST);
+	if (catalog->dir == NULL || path == NULL) {
+		perror("Catalog: Malloc");
+		free(path);
+		return 1;
+	}
+	FILE *manifest = fopen(path, "r");
+	if (manifest == NULL) {
+		free(path);
+		if (errno == ENOENT) {
+			return 0;
+		}
+		perror("Catalog: fopen manifest");
+		return 1;
+	}
+
+	int err = 0;
+	char *line = NULL;
+	size_t size = 0;
+	uint64_t number = 0;
+	while (!err && getline(&line, &size, manifest) != -1) {
+		number++;
+		if (*line == '#' || *line == '\n') {
+			continue;
+		}
+		if (catalog->count == catalog->capacity) {
+			uint32_t capacity = (catalog->capacity == 0) ? 64 : catalog->capacity * 2;
+			catalog_entry_t *entries =
+				(catalog_entry_t *)realloc(catalog->entries, capacity * sizeof(catalog_entry_t));
+			if (entries == NULL) {
+				perror("Catalog: Realloc");
+				err = 1;
+				break;
+			}
+			catalog->entries = entries;
+			catalog->capacity = capacity;
+		}
+		if (entry_parse(&catalog->entries[catalog->count], line) != 0) {
+			fprintf(stderr, "Catalog: %s line %lu is malformed, skipped\n", path, number);
+			continue;
+		}
+		catalog->count++;
+	}
+	free(line);
+	fclose(manifest);
+	free(path);
+	return err;
+}
+
+void
+catalog_free(catalog_t *catalog)
+{
+	for (uint32_t i = 0; i < catalog->count; i++) {
+		entry_free(&catalog->entries[i]);
+	}
+	free(catalog->entries);
+	free(catalog->dir);
+	memset(catalog, 0, sizeof(*catalog));
+}
+
+/**
+ * @BRIEF Maps the records of every file, scans then read them in place
+ * @PARAM catalog : Loaded catalog
+ * @RETURN 0 on success, 1 when a file is missing or shorter than its manifest line
+ *
+ * @DETAILS Only the records the manifest counts are mapped, so a file s3lp is still
+ *          appending to is read as it was registered.
+ */
+int
+catalog_map(catalog_t *catalog)
+{
+	for (uint32_t i = 0; i < catalog->count; i++) {
+		catalog_entry_t *entry = &catalog->entries[i];
+		size_t length = entry->records * entry->record_size;
+		if (entry->data != NULL || length == 0) {
+			continue;
+		}
+		char *path = manifest_path(catalog->dir, entry->path);
+		int fd = (path != NULL) ? open(path, O_RDONLY) : -1;
+		struct stat st;
+		void *mapping = MAP_FAILED;
+		if (fd >= 0 && fstat(fd, &st) == 0 && (uint64_t)st.st_size >= length) {
+			mapping = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, 0);
+		}
+		if (fd >= 0) {
+			close(fd);
+		}
+		if (mapping == MAP_FAILED) {
+			fprintf(stderr, "Catalog: cannot map %s\n", (path != NULL) ? path : entry->path);
+			free(path);
+			return 1;
+		}
+		free(path);
+		entry->data = (const uint8_t *)mapping;
+	}
+	return 0;
+}
+
+static int
+compare_entry_path(const void *a, const void *b)
+{
+	return strcmp(((const catalog_entry_t *)a)->path, ((const catalog_entry_t *)b)->path);
+}
+
+/**
+ * @BRIEF Replaces the manifest with the catalog, sorted by path
+ * @PARAM catalog : Entries and dataset directory
+ * @RETURN 0 on success, 1 on failure (the old manifest is left in place)
+ */
+int
+catalog_write(const catalog_t *catalog)
+{
+	qsort(catalog->entries, catalog->count, sizeof(catalog_entry_t), compare_entry_path);
+	char *path = manifest_path(catalog->dir, CATALOG_MANIFEST);
+	char *tmp_path = manifest_path(catalog->dir, CATALOG_MANIFEST ".tmp");
+	FILE *output = (path != NULL && tmp_path != NULL) ? fopen(tmp_path, "w") : NULL;
+	if (output == NULL) {
+		perror("Catalog: fopen manifest");
+		free(path);
+		free(tmp_path);
+		return 1;
+	}
+
+	fprintf(output, "%s\n", CATALOG_HEADER);
+	for (uint32_t i = 0; i < catalog->count; i++) {
+		const catalog_entry_t *entry = &catalog->entries[i];
+		fprintf(output, "%s\t%s\t%u\t%u\t%lu\t%u\t", entry->path, entry->bucket, entry->first, entry->last,
+				entry->records, entry->record_size);
+		if (entry->any_podcast) {
+			fputc('*', output);
+		}
+		for (uint32_t j = 0; !entry->any_podcast && j < entry->podcast_count; j++) {
+			fprintf(output, (entry->record_size == sizeof(s_log_t)) ? "%s%08lx" : "%s%016lx", (j > 0) ? "," : "",
+					entry->podcasts[j]);
+		}
+		fputc('\n', output);
+	}
+	int failed = fflush(output) != 0 || fsync(fileno(output)) != 0;
+	failed |= fclose(output) != 0;
+	if (failed || rename(tmp_path, path) != 0) {
+		perror("Catalog: write manifest");
+		unlink(tmp_path);
+		free(path);
+		free(tmp_path);
+		return 1;
+	}
+	free(path);
+	free(tmp_path);
+	return 0;
+}
+// END MANIFEST --------------------------------------------------------------------------------
+
+// REGISTRATION --------------------------------------------------------------------------------
+
+static int
+compare_u64(const void *a, const void *b)
+{
+	uint64_t left = *(const uint64_t *)a;
+	uint64_t right = *(const uint64_t *)b;
+	return (left < right) ? -1 : (left > right);
+}
+
+/**
+ * @BRIEF Summarizes a .bin for the manifest: time range, records and podcasts
+ * @PARAM entry       : Entry to fill, path and bucket are left to the caller
+ * @PARAM input       : Records
+ * @PARAM record_size : sizeof(s_log_t) or sizeof(s_log_wide_t)
+ * @RETURN 0 on success, 1 on a read or allocation failure
+ */
+int
+catalog_scan_file(catalog_entry_t *entry, FILE *input, uint32_t record_size)
+{
+	entry->first = UINT32_MAX;
+	entry->last = 0;
+	entry->records = 0;
+	entry->record_size = record_size;
+	entry->any_podcast = 0;
+	entry->podcast_count = 0;
+
+	// Podcasts: open addressing set, hash + 1 so 0 marks a free slot
+	uint32_t slots = CATALOG_PODCASTS_MAX * 2;
+	uint64_t *set = (uint64_t *)calloc(slots, sizeof(uint64_t));
+	uint8_t *batch = (uint8_t *)malloc((size_t)CATALOG_BATCH * record_size);
+	if (set == NULL || batch == NULL) {
+		perror("Catalog: Malloc");
+		free(set);
+		free(batch);
+		return 1;
+	}
+
+	size_t got;
+	while ((got = fread(batch, record_size, CATALOG_BATCH, input)) > 0) {
+		for (size_t i = 0; i < got; i++) {
+			const uint8_t *record = batch + i * record_size;
+			uint32_t timestamp;
+			uint64_t podcast;
+			if (record_size == sizeof(s_log_t)) {
+				timestamp = ((const s_log_t *)record)->timestamp;
+				podcast = ((const s_log_t *)record)->podcast_hash;
+			}
+			else {
+				timestamp = ((const s_log_wide_t *)record)->timestamp;
+				podcast = ((const s_log_wide_t *)record)->podcast_hash;
+			}
+			entry->first = (timestamp < entry->first) ? timestamp : entry->first;
+			entry->last = (timestamp > entry->last) ? timestamp : entry->last;
+			if (entry->any_podcast) {
+				continue;
+			}
+			uint32_t slot = (uint32_t)hash64_mix(podcast ^ HASH64_SECRET[2], HASH64_SECRET[3]) & (slots - 1);
+			while (set[slot] != 0 && set[slot] != podcast + 1) {
+				slot = (slot + 1) & (slots - 1);
+			}
+			if (set[slot] == 0) {
+				if (entry->podcast_count == CATALOG_PODCASTS_MAX) {
+					entry->any_podcast = 1;
+					continue;
+				}
+				set[slot] = podcast + 1;
+				entry->podcast_count++;
+			}
+		}
+		entry->records += got;
+	}
+	free(batch);
+	if (ferror(input)) {
+		perror("Catalog: fread");
+		free(set);
+		return 1;
+	}
+	if (entry->records == 0) {
+		entry->first = 0;
+	}
+
+	free(entry->podcasts);
+	entry->podcasts = NULL;
+	if (entry->any_podcast) {
+		entry->podcast_count = 0;
+		free(set);
+		return 0;
+	}
+	entry->podcasts = (uint64_t *)malloc((entry->podcast_count + 1) * sizeof(uint64_t));
+	if (entry->podcasts == NULL) {
+		perror("Catalog: Malloc");
+		free(set);
+		return 1;
+	}
+	uint32_t count = 0;
+	for (uint32_t i = 0; i < slots; i++) {
+		if (set[i] != 0) {
+			entry->podcasts[count++] = set[i] - 1;
+		}
+	}
+	qsort(entry->podcasts, count, sizeof(uint64_t), compare_u64);
+	free(set);
+	return 0;
+}
+
+/**
+ * @BRIEF Adds or refreshes a file in its dataset's manifest
+ * @PARAM dir         : Dataset directory
+ * @PARAM file        : Finished .bin inside dir
+ * @PARAM record_size : sizeof(s_log_t) or sizeof(s_log_wide_t)
+ * @PARAM bucket      : Bucket the records came from, NULL for the file's first directory level
+ *                      under dir ("-" for a file directly in dir)
+ * @RETURN 0 on success, 1 on failure (the manifest is unchanged)
+ */
+int
+catalog_register(const char *dir, const char *file, uint32_t record_size, const char *bucket)
+{
+	char root[PATH_MAX];
+	char full[PATH_MAX];
+	if (realpath(dir, root) == NULL || realpath(file, full) == NULL) {
+		perror("Catalog: realpath");
+		return 1;
+	}
+	size_t root_length = strlen(root);
+	if (bucket != NULL && (bucket[0] == '\0' || strlen(bucket) >= sizeof(((catalog_entry_t *)0)->bucket) ||
+						   strpbrk(bucket, " \t\n") != NULL)) {
+		fprintf(stderr, "Catalog: \"%s\" is not a bucket name\n", bucket);
+		return 1;
+	}
+	if (strncmp(full, root, root_length) != 0 || full[root_length] != '/') {
+		fprintf(stderr, "Catalog: %s is not inside the dataset %s\n", file, dir);
+		return 1;
+	}
+
+	catalog_entry_t entry;
+	memset(&entry, 0, sizeof(entry));
+	entry.path = strdup(full + root_length + 1);
+	FILE *input = fopen(full, "rb");
+	if (entry.path == NULL || input == NULL) {
+		perror("Catalog: open file");
+		if (input != NULL) {
+			fclose(input);
+		}
+		entry_free(&entry);
+		return 1;
+	}
+	const char *slash = strchr(entry.path, '/');
+	if (bucket != NULL) {
+		snprintf(entry.bucket, sizeof(entry.bucket), "%s", bucket);
+	}
+	else {
+		snprintf(entry.bucket, sizeof(entry.bucket), "%.*s", (slash != NULL) ? (int)(slash - entry.path) : 1,
+				 (slash != NULL) ? entry.path : "-");
+	}
+	int err = catalog_scan_file(&entry, input, record_size);
+	fclose(input);
+	if (err) {
+		entry_free(&entry);
+		return 1;
+	}
+
+	// Read, update and replace the manifest under the lock
+	char *lock_path = manifest_path(root, CATALOG_LOCK);
+	int lock = (lock_path != NULL) ? open(lock_path, O_RDWR | O_CREAT, 0644) : -1;
+	free(lock_path);
+	if (lock < 0 || lockf(lock, F_LOCK, 0) != 0) {
+		perror("Catalog: lock");
+		if (lock >= 0) {
+			close(lock);
+		}
+		entry_free(&entry);
+		return 1;
+	}
+	catalog_t catalog;
+	err = catalog_load(&catalog, root);
+	uint32_t i = 0;
+	while (!err && i < catalog.count && strcmp(catalog.entries[i].path, entry.path) != 0) {
+		i++;
+	}
+	if (!err && i == catalog.count) {
+		catalog_entry_t *entries =
+			(catalog_entry_t *)realloc(catalog.entries, (catalog.count + 1) * sizeof(catalog_entry_t));
+		err = (entries == NULL);
+		if (!err) {
+			catalog.entries = entries;
+			catalog.capacity = ++catalog.count;
+			memset(&catalog.entries[i], 0, sizeof(catalog_entry_t));
+		}
+	}
+	if (!err) {
+		entry_free(&catalog.entries[i]);
+		catalog.entries[i] = entry;
+		memset(&entry, 0, sizeof(entry));
+		err = catalog_write(&catalog);
+	}
+	lockf(lock, F_ULOCK, 0);
+	close(lock);
+	catalog_free(&catalog);
+	entry_free(&entry);
+	return err;
+}
+// END REGISTRATION ----------------------------------------------------------------------------
+
+// PRUNING -------------------------------------------------------------------------------------
+
+/**
+ * @BRIEF Sets the podcast of a query
+ * @PARAM query   : Query to narrow
+ * @PARAM podcast : Show name as in the key (/show/episode.mp3 -> show), or 0x<hash> as printed
+ * @RETURN 0 on success, 1 on a malformed hash
+ */
+int
+catalog_query_podcast(catalog_query_t *query, const char *podcast)
+{
+	query->has_podcast = 1;
+	if (strncmp(podcast, "0x", 2) == 0) {
+		char *end = NULL;
+		uint64_t hash = strtoull(podcast + 2, &end, 16);
+		query->podcast_narrow = (uint32_t)hash;
+		query->podcast_wide = hash;
+		return (end == podcast + 2 || *end != '\0');
+	}
+	// The show prefix, as the tokenizer hashes it
+	if (*podcast == '/') {
+		podcast++;
+	}
+	size_t length = strcspn(podcast, "/");
+	query->podcast_wide = hash64(podcast, length);
+	query->podcast_narrow = hash_fold32(query->podcast_wide);
+	return 0;
+}
+
+// 1 when a file may hold records of the query
+int
+catalog_match(const catalog_entry_t *entry, const catalog_query_t *query)
+{
+	if (entry->records == 0 || entry->last < query->from || entry->first >= query->to) {
+		return 0;
+	}
+	if (!query->has_podcast || entry->any_podcast) {
+		return 1;
+	}
+	uint64_t podcast = (entry->record_size == sizeof(s_log_t)) ? query->podcast_narrow : query->podcast_wide;
+	return bsearch(&podcast, entry->podcasts, entry->podcast_count, sizeof(uint64_t), compare_u64) != NULL;
+}
+
+// 1 when a record satisfies the query
+int
+catalog_record_match(const catalog_query_t *query, const void *record, uint32_t record_size)
+{
+	if (record_size == sizeof(s_log_t)) {
+		const s_log_t *log = (const s_log_t *)record;
+		return log->timestamp >= query->from && log->timestamp < query->to &&
+			   (!query->has_podcast || log->podcast_hash == query->podcast_narrow);
+	}
+	const s_log_wide_t *log = (const s_log_wide_t *)record;
+	return log->timestamp >= query->from && log->timestamp < query->to &&
+		   (!query->has_podcast || log->podcast_hash == query->podcast_wide);
+}
+// END PRUNING ---------------------------------------------------------------------------------
+
+// PARALLEL SCAN -------------------------------------------------------------------------------
+// Workers claim surviving files one at a time, filter their records in batches and write each
+// batch whole to a pipe under the lock, so the reader sees whole records. Batches of different
+// files interleave, which only changes the order grouped logs list records in. The last worker
+// out closes the pipe, ending the reader's input. Files mapped by catalog_map are filtered in
+// place instead of through stdio.
+
+static int
+write_all(int fd, const uint8_t *data, size_t length)
+{
+	while (length > 0) {
+		ssize_t written = write(fd, data, length);
+		if (written < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return 1;
+		}
+		data += written;
+		length -= (size_t)written;
+	}
+	return 0;
+}
+
+// Filters a mapped file without copying it first, a file wholly inside the query is written as is
+static int
+scan_mapped(catalog_scan_t *scan, const catalog_entry_t *entry, uint8_t *batch)
+{
+	const catalog_query_t *query = scan->query;
+	uint32_t size = scan->record_size;
+	uint64_t podcast = (size == sizeof(s_log_t)) ? query->podcast_narrow : query->podcast_wide;
+	int only_podcast = !entry->any_podcast && entry->podcast_count == 1 && entry->podcasts[0] == podcast;
+	int whole = entry->first >= query->from && entry->last < query->to && (!query->has_podcast || only_podcast);
+	int failed = 0;
+
+	for (uint64_t start = 0; !failed && start < entry->records; start += CATALOG_BATCH) {
+		uint64_t got = entry->records - start;
+		got = (got < CATALOG_BATCH) ? got : CATALOG_BATCH;
+		const uint8_t *records = entry->data + start * size;
+		size_t kept = got;
+		if (!whole) {
+			kept = 0;
+			for (uint64_t i = 0; i < got; i++) {
+				if (catalog_record_match(query, records + i * size, size)) {
+					memcpy(batch + kept * size, records + i * size, size);
+					kept++;
+				}
+			}
+			records = batch;
+		}
+		pthread_mutex_lock(&scan->lock);
+		failed = scan->failed || write_all(scan->fd, records, kept * size) != 0;
+		scan->scanned += got;
+		scan->matched += kept;
+		pthread_mutex_unlock(&scan->lock);
+	}
+	return failed;
+}
+
+static void *
+scan_worker(void *arg)
+{
+	catalog_scan_t *scan = (catalog_scan_t *)arg;
+	uint32_t size = scan->record_size;
+	uint8_t *batch = (uint8_t *)malloc((size_t)CATALOG_BATCH * size);
+	char *buffer = (char *)malloc(1 << 20);
+	int failed = (batch == NULL || buffer == NULL);
+
+	while (!failed) {
+		pthread_mutex_lock(&scan->lock);
+		uint32_t claim = scan->next++;
+		failed = scan->failed;
+		pthread_mutex_unlock(&scan->lock);
+		if (claim >= scan->file_count || failed) {
+			break;
+		}
+
+		const catalog_entry_t *entry = &scan->catalog->entries[scan->files[claim]];
+		if (entry->data != NULL) {
+			failed = scan_mapped(scan, entry, batch);
+			continue;
+		}
+		char *path = manifest_path(scan->catalog->dir, entry->path);
+		FILE *input = (path != NULL) ? fopen(path, "rb") : NULL;
+		if (input == NULL) {
+			fprintf(stderr, "Catalog: cannot open %s\n", (path != NULL) ? path : entry->path);
+			free(path);
+			failed = 1;
+			break;
+		}
+		setvbuf(input, buffer, _IOFBF, 1 << 20);
+
+		size_t got;
+		while (!failed && (got = fread(batch, size, CATALOG_BATCH, input)) > 0) {
+			size_t kept = 0;
+			for (size_t i = 0; i < got; i++) {
+				const uint8_t *record = batch + i * size;
+				if (catalog_record_match(scan->query, record, size)) {
+					memmove(batch + kept * size, record, size);
+					kept++;
+				}
+			}
+			pthread_mutex_lock(&scan->lock);
+			failed = scan->failed || write_all(scan->fd, batch, kept * size) != 0;
+			scan->scanned += got;
+			scan->matched += kept;
+			pthread_mutex_unlock(&scan->lock);
+		}
+		fclose(input);
+		free(path);
+	}
+
+	pthread_mutex_lock(&scan->lock);
+	scan->failed |= failed;
+	if (--scan->active == 0) {
+		close(scan->fd);
+	}
+	pthread_mutex_unlock(&scan->lock);
+	free(batch);
+	free(buffer);
+	return NULL;
+}
+
+/**
+ * @BRIEF Prunes the catalog and starts reading the kept files
+ * @PARAM scan    : Scan state, finished with catalog_scan_finish
+ * @PARAM catalog : Dataset
+ * @PARAM query   : Files outside it are skipped, records outside it dropped
+ * @PARAM threads : Files read at once
+ * @RETURN Stream of the matching records, NULL on failure or mixed record widths
+ */
+FILE *
+catalog_scan_start(catalog_scan_t *scan, const catalog_t *catalog, const catalog_query_t *query, int threads)
+{
+	memset(scan, 0, sizeof(*scan));
+	scan->catalog = catalog;
+	scan->query = query;
+	scan->files = (uint32_t *)malloc((catalog->count + 1) * sizeof(uint32_t));
+	if (scan->files == NULL) {
+		perror("Catalog: Malloc");
+		return NULL;
+	}
+	for (uint32_t i = 0; i < catalog->count; i++) {
+		if (!catalog_match(&catalog->entries[i], query)) {
+			continue;
+		}
+		if (scan->record_size != 0 && scan->record_size != catalog->entries[i].record_size) {
+			fprintf(stderr, "Catalog: %s mixes narrow and wide files, narrow the query\n", catalog->dir);
+			free(scan->files);
+			scan->files = NULL;
+			return NULL;
+		}
+		scan->record_size = catalog->entries[i].record_size;
+		scan->files[scan->file_count++] = i;
+	}
+	if (scan->record_size == 0) {
+		scan->record_size = sizeof(s_log_t);
+	}
+
+	int fds[2];
+	FILE *stream = (pipe(fds) == 0) ? fdopen(fds[0], "rb") : NULL;
+	if (stream == NULL) {
+		perror("Catalog: pipe");
+		free(scan->files);
+		scan->files = NULL;
+		return NULL;
+	}
+	signal(SIGPIPE, SIG_IGN); // a reader that stops early fails the writes instead
+	pthread_mutex_init(&scan->lock, NULL);
+	scan->fd = fds[1];
+
+	scan->threads = (threads < 1) ? 1 : (threads > CATALOG_THREADS_MAX) ? CATALOG_THREADS_MAX : threads;
+	if ((uint32_t)scan->threads > scan->file_count) {
+		scan->threads = (scan->file_count > 0) ? (int)scan->file_count : 1;
+	}
+	scan->active = scan->threads;
+	for (int i = 0; i < scan->threads; i++) {
+		if (pthread_create(&scan->workers[i], NULL, scan_worker, scan) != 0) {
+			perror("Catalog: pthread_create");
+			// The workers never started count as finished
+			pthread_mutex_lock(&scan->lock);
+			scan->failed = 1;
+			scan->active -= scan->threads - i;
+			if (scan->active == 0) {
+				close(scan->fd);
+			}
+			pthread_mutex_unlock(&scan->lock);
+			scan->threads = i;
+			break;
+		}
+	}
+	return stream;
+}
+
+// Waits for the workers, the stream must have been read to its end or closed first
+int
+catalog_scan_finish(catalog_scan_t *scan)
+{
+	for (int i = 0; i < scan->threads; i++) {
+		pthread_join(scan->workers[i], NULL);
+	}
+	pthread_mutex_destroy(&scan->lock);
+	free(scan->files);
+	scan->files = NULL;
+	return scan->failed;
+}
+// END PARALLEL SCAN ---------------------------------------------------------------------------
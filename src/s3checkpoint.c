@@ -0,0 +1,262 @@
+#include "../include/s3checkpoint.h"
+#include <sys/wait.h>
+
+// CHECKPOINTS ---------------------------------------------------------------------------------
+// Resume points for long backfills. Every `every` batches the parent flushes its output and
+// records the offsets, then forks: the child writes the dedup table (copy-on-write, so it sees
+// the table as of the fork), syncs the output and renames the checkpoint into place. The
+// parent only pays for the flush and the fork.
+
+/**
+ * @BRIEF Sets up a checkpoint writer
+ * @PARAM checkpoint : Writer to initialize
+ * @PARAM path       : Checkpoint file
+ * @PARAM every      : Batches between checkpoints
+ * @RETURN 0 on success, 1 on allocation failure
+ */
+int
+checkpoint_init(checkpoint_t *checkpoint, const char *path, uint32_t every)
+{
+	memset(checkpoint, 0, sizeof(*checkpoint));
+	size_t length = strlen(path) + sizeof(CHECKPOINT_DEDUP_SUFFIX) + 1;
+	checkpoint->path = strdup(path);
+	checkpoint->dedup_path = (char *)malloc(length);
+	if (checkpoint->path == NULL || checkpoint->dedup_path == NULL) {
+		perror("Checkpoint: Malloc");
+		free(checkpoint->path);
+		free(checkpoint->dedup_path);
+		return 1;
+	}
+	snprintf(checkpoint->dedup_path, length, "%s%s0", path, CHECKPOINT_DEDUP_SUFFIX);
+	checkpoint->every = every;
+	return 0;
+}
+
+// Points dedup_path at a snapshot slot
+static char *
+dedup_slot_path(checkpoint_t *checkpoint, int slot)
+{
+	checkpoint->dedup_path[strlen(checkpoint->dedup_path) - 1] = (char)('0' + slot);
+	return checkpoint->dedup_path;
+}
+
+// Writes the record to path.tmp, syncs it and renames it over path
+static int
+write_record(const char *path, const checkpoint_record_t *record)
+{
+	size_t length = strlen(path) + 5;
+	char *tmp_path = (char *)malloc(length);
+	if (tmp_path == NULL) {
+		return 1;
+	}
+	snprintf(tmp_path, length, "%s.tmp", path);
+
+	FILE *output = fopen(tmp_path, "wb");
+	if (output == NULL) {
+		perror("fopen checkpoint");
+		free(tmp_path);
+		return 1;
+	}
+	int failed = fwrite(record, sizeof(*record), 1, output) != 1 || fflush(output) != 0 ||
+				 fsync(fileno(output)) != 0;
+	failed |= fclose(output) != 0;
+	if (failed || rename(tmp_path, path) != 0) {
+		perror("write checkpoint");
+		unlink(tmp_path);
+		free(tmp_path);
+		return 1;
+	}
+	free(tmp_path);
+	return 0;
+}
+
+// Everything the child does, dedup snapshot first so the record never points past it
+static int
+write_checkpoint(checkpoint_t *checkpoint, const s_context_t *context, const checkpoint_record_t *record,
+				 FILE *output)
+{
+	if (ip_track_save(&context->ip_track, dedup_slot_path(checkpoint, record->dedup_slot)) != 0) {
+		perror("write dedup snapshot");
+		return 1;
+	}
+	if (fdatasync(fileno(output)) != 0 ||
+		(context->quarantine != NULL && fdatasync(fileno(context->quarantine)) != 0)) {
+		perror("sync output");
+		return 1;
+	}
+	return write_record(checkpoint->path, record);
+}
+
+// Collects a finished writer, options 0 waits for it
+static void
+checkpoint_reap(checkpoint_t *checkpoint, int options)
+{
+	if (checkpoint->writer == 0) {
+		return;
+	}
+	int status = 0;
+	pid_t done = waitpid(checkpoint->writer, &status, options);
+	if (done == 0) {
+		return; // still writing
+	}
+	if (done < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		fprintf(stderr, "%s: checkpoint writer failed, keeping the previous one\n", checkpoint->path);
+		checkpoint->failed++;
+	}
+	else {
+		checkpoint->slot ^= 1; // the record now points at this slot, the next one writes the other
+	}
+	checkpoint->writer = 0;
+}
+
+/**
+ * @BRIEF Counts a written batch and checkpoints every `every` batches
+ * @PARAM checkpoint   : Writer
+ * @PARAM context      : Dedup table, quarantine and line accounting to record
+ * @PARAM input_offset : Input offset of the first line not yet in the output
+ * @PARAM input        : Input stream, its size is recorded
+ * @PARAM output       : Output stream, flushed before its offset is taken
+ *
+ * @DETAILS Call only between batches, when every line before input_offset has
+ *          been written. A checkpoint that falls due while the previous writer
+ *          is still running is retried on the next batch.
+ */
+void
+checkpoint_batch(checkpoint_t *checkpoint, s_context_t *context, uint64_t input_offset, FILE *input,
+				 FILE *output)
+{
+	if (++checkpoint->batches < checkpoint->every) {
+		return;
+	}
+	checkpoint_reap(checkpoint, WNOHANG);
+	if (checkpoint->writer != 0) {
+		checkpoint->skipped++;
+		return;
+	}
+
+	checkpoint_record_t record;
+	memset(&record, 0, sizeof(record));
+	memcpy(record.magic, CHECKPOINT_MAGIC, sizeof(record.magic));
+	record.output_filetype_flag = context->output_filetype_flag;
+	record.dedup_slot = checkpoint->slot;
+	record.input_offset = input_offset;
+	record.stats = context->stats;
+
+	struct stat st;
+	if (fstat(fileno(input), &st) == 0) {
+		record.input_size = st.st_size;
+	}
+	if (fflush(output) != 0 || (context->quarantine != NULL && fflush(context->quarantine) != 0)) {
+		perror("flush output");
+		return;
+	}
+	record.output_offset = ftello(output);
+	if (context->quarantine != NULL) {
+		record.quarantine_offset = ftello(context->quarantine);
+	}
+
+	checkpoint->batches = 0;
+	checkpoint->written++;
+	pid_t pid = fork();
+	if (pid == 0) {
+		// _exit: the parent's stdio buffers must not be flushed twice
+		_exit(write_checkpoint(checkpoint, context, &record, output));
+	}
+	if (pid < 0) {
+		perror("fork checkpoint writer");
+		if (write_checkpoint(checkpoint, context, &record, output) == 0) {
+			checkpoint->slot ^= 1;
+		}
+		else {
+			checkpoint->failed++;
+		}
+		return;
+	}
+	checkpoint->writer = pid;
+}
+
+/**
+ * @BRIEF Loads the last checkpoint and the dedup table it was written with
+ * @PARAM checkpoint   : Writer, continues from the resumed checkpoint
+ * @PARAM record       : Set to the checkpoint
+ * @PARAM track        : Set to the dedup table as of the checkpoint
+ * @PARAM window_hours : Dedup window for this run
+ * @RETURN 0 on success, -1 when there is no checkpoint, 1 when it is unreadable
+ */
+int
+checkpoint_resume(checkpoint_t *checkpoint, checkpoint_record_t *record, ip_track_t *track,
+				  uint32_t window_hours)
+{
+	FILE *input = fopen(checkpoint->path, "rb");
+	if (input == NULL) {
+		return -1;
+	}
+	int bad = fread(record, sizeof(*record), 1, input) != 1 ||
+			  memcmp(record->magic, CHECKPOINT_MAGIC, sizeof(record->magic)) != 0 ||
+			  (record->dedup_slot != 0 && record->dedup_slot != 1);
+	fclose(input);
+	if (bad) {
+		fprintf(stderr, "%s: not a checkpoint\n", checkpoint->path);
+		return 1;
+	}
+
+	if (ip_track_load(track, dedup_slot_path(checkpoint, record->dedup_slot), window_hours) != 0) {
+		fprintf(stderr, "%s: dedup snapshot missing or unreadable\n", checkpoint->dedup_path);
+		return 1;
+	}
+	checkpoint->slot = record->dedup_slot ^ 1;
+	return 0;
+}
+
+/**
+ * @BRIEF Opens a file for appending after cutting it back to a checkpoint offset
+ * @PARAM path   : Output or quarantine file from the checkpointed run
+ * @PARAM offset : Length recorded in the checkpoint
+ * @RETURN Stream positioned at offset, NULL when the file is missing or shorter
+ */
+FILE *
+checkpoint_reopen(const char *path, uint64_t offset)
+{
+	FILE *file = fopen(path, "ab");
+	if (file == NULL) {
+		perror("fopen resume");
+		return NULL;
+	}
+	struct stat st;
+	if (fstat(fileno(file), &st) != 0 || (uint64_t)st.st_size < offset) {
+		fprintf(stderr, "%s: shorter than the checkpoint, cannot resume\n", path);
+		fclose(file);
+		return NULL;
+	}
+	// Drops the partial batch written after the checkpoint, the seek resyncs ftello
+	if (ftruncate(fileno(file), offset) != 0 || fseeko(file, 0, SEEK_END) != 0) {
+		perror("truncate resume");
+		fclose(file);
+		return NULL;
+	}
+	return file;
+}
+
+/**
+ * @BRIEF Waits for the last writer and releases the checkpoint
+ * @PARAM checkpoint : Writer
+ * @PARAM completed  : Run reached end of input, the checkpoint files are removed
+ */
+void
+checkpoint_finish(checkpoint_t *checkpoint, int completed)
+{
+	if (checkpoint->path == NULL) {
+		return;
+	}
+	checkpoint_reap(checkpoint, 0);
+	if (completed) {
+		unlink(checkpoint->path);
+		unlink(dedup_slot_path(checkpoint, 0));
+		unlink(dedup_slot_path(checkpoint, 1));
+	}
+	free(checkpoint->path);
+	free(checkpoint->dedup_path);
+	checkpoint->path = NULL;
+	checkpoint->dedup_path = NULL;
+}
+// END CHECKPOINTS -----------------------------------------------------------------------------
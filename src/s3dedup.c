@@ -0,0 +1,286 @@
+#include "../include/s3lp.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+
+// DEDUP STATE ---------------------------------------------------------------------------------
+// Unique listener table: open addressing over (ip, key) pairs with a parallel array holding
+// the hour each pair last counted as unique. A pair counts again once window_hours have
+// passed, so uniqueness follows the log's clock instead of process lifetime, and the table can
+// be carried from one run to the next as a snapshot. libs3lp runs this code too, so nothing
+// here prints: failures come back as return codes with errno set, and the callers report them.
+
+// Snapshot file header, followed by ip_hashes[capacity] then hours[capacity]
+typedef struct dedup_header_s {
+	char magic[8]; // DEDUP_MAGIC
+	uint64_t capacity;
+	uint64_t count;
+	uint32_t window_hours;
+	uint32_t now_hour; // newest hour seen by the run that wrote it
+} dedup_header_t;
+
+/**
+ * @BRIEF Allocates an empty windowed dedup table
+ * @PARAM track        : Table to initialize
+ * @PARAM capacity     : Initial slots, the table grows past 3/4 full
+ * @PARAM window_hours : Hours a pair stays deduplicated
+ * @RETURN 0 on success, 1 on allocation failure
+ */
+int
+ip_track_init(ip_track_t *track, size_t capacity, uint32_t window_hours)
+{
+	memset(track, 0, sizeof(*track));
+	track->capacity = capacity;
+	track->window_hours = window_hours;
+	track->ip_hashes = (uint64_t *)calloc(capacity, sizeof(uint64_t));
+	track->hours = (uint32_t *)calloc(capacity, sizeof(uint32_t));
+	if (track->ip_hashes == NULL || track->hours == NULL) {
+		ip_track_free(track);
+		return 1;
+	}
+	return 0;
+}
+
+void
+ip_track_free(ip_track_t *track)
+{
+	if (track->mapping != NULL) {
+		munmap(track->mapping, track->mapping_length);
+	}
+	else {
+		free(track->ip_hashes);
+		free(track->hours);
+	}
+	track->mapping = NULL;
+	track->ip_hashes = NULL;
+	track->hours = NULL;
+}
+
+// Pair counted within the window ending at now_hour, signed so out of order lines stay live
+static inline int
+dedup_live(const ip_track_t *track, size_t index)
+{
+	return (int32_t)(track->now_hour - track->hours[index]) < (int32_t)track->window_hours;
+}
+
+/**
+ * @BRIEF Rehashes into a table of the given size, dropping expired pairs
+ * @PARAM track    : Windowed table
+ * @PARAM capacity : New slot count
+ * @RETURN 0 on success, 1 on allocation failure (the table is left as it was)
+ */
+static int
+ip_track_rehash(ip_track_t *track, size_t capacity)
+{
+	uint64_t *ip_hashes = (uint64_t *)calloc(capacity, sizeof(uint64_t));
+	uint32_t *hours = (uint32_t *)calloc(capacity, sizeof(uint32_t));
+	if (ip_hashes == NULL || hours == NULL) {
+		free(ip_hashes);
+		free(hours);
+		return 1;
+	}
+
+	size_t count = 0;
+	for (size_t i = 0; i < track->capacity; i++) {
+		if (track->ip_hashes[i] == 0 || !dedup_live(track, i)) {
+			continue;
+		}
+		size_t index = track->ip_hashes[i] % capacity;
+		while (ip_hashes[index] != 0) {
+			index = (index + 1) % capacity;
+		}
+		ip_hashes[index] = track->ip_hashes[i];
+		hours[index] = track->hours[i];
+		count++;
+	}
+	track->expired += track->count - count;
+
+	// A loaded snapshot stays mapped until its arrays are replaced
+	ip_track_free(track);
+	track->ip_hashes = ip_hashes;
+	track->hours = hours;
+	track->capacity = capacity;
+	track->count = count;
+	return 0;
+}
+
+/**
+ * @BRIEF Checks the ip + key pair against the unique listener table
+ * @PARAM ip_hash  : slim_log ip_hash
+ * @PARAM key_hash : slim_log key_hash
+ * @PARAM context  : Table owner, ip_track.now_hour is the hour of the current line
+ * @RETURN 1 when the pair counts as unique, 0 when already counted
+ *
+ * @DETAILS Linear probing from hash % capacity. With a window (ip_track.hours set)
+ *          a pair last counted window_hours or more ago counts again, and slots
+ *          holding such expired pairs are reused for new ones. Without a window
+ *          the table is fixed size and pairs never expire.
+ */
+int
+is_unique_ip(uint32_t ip_hash, uint32_t key_hash, s_context_t *context)
+{
+	ip_track_t *track = &context->ip_track;
+
+	// Combine ip hash and key hash to generate unique id
+	uint64_t complete_hash = (((uint64_t)ip_hash << 32) | key_hash);
+
+	// Ensure Hash isnt 0
+	if (complete_hash == 0) {
+		complete_hash = 1;
+	}
+
+	// Keep the load low enough that probes stay short, expired pairs make room first
+	if (track->hours != NULL && (track->count + 1) * DEDUP_MAX_LOAD_DEN > track->capacity * DEDUP_MAX_LOAD_NUM) {
+		size_t live = 0;
+		for (size_t i = 0; i < track->capacity; i++) {
+			live += (track->ip_hashes[i] != 0 && dedup_live(track, i));
+		}
+		size_t capacity = track->capacity;
+		if ((live + 1) * DEDUP_MAX_LOAD_DEN * 2 > capacity * DEDUP_MAX_LOAD_NUM) {
+			capacity = capacity * 2 + 1;
+		}
+		// Probing still works past the load limit, only slower, the caller reports it
+		if (ip_track_rehash(track, capacity) != 0) {
+			track->grow_failed = 1;
+		}
+	}
+
+	// Normalize that Hash to be within index range
+	size_t index = complete_hash % track->capacity; // Capacity is Hashing value
+	size_t original_index = index;
+	size_t reuse = SIZE_MAX; // first expired slot on the probe path
+
+	do {
+		// Index empty
+		if (track->ip_hashes[index] == 0) {
+			if (reuse != SIZE_MAX) {
+				index = reuse;
+				track->expired++;
+			}
+			else {
+				track->count += 1;
+			}
+			track->ip_hashes[index] = complete_hash;
+			if (track->hours != NULL) {
+				track->hours[index] = track->now_hour;
+			}
+			return 1;
+		}
+		// Already recorded, skip unless the window has passed
+		if (track->ip_hashes[index] == complete_hash) {
+			if (track->hours != NULL && !dedup_live(track, index)) {
+				track->hours[index] = track->now_hour;
+				return 1;
+			}
+			return 0;
+		}
+		if (reuse == SIZE_MAX && track->hours != NULL && !dedup_live(track, index)) {
+			reuse = index;
+		}
+		// Try next index, wrapping back to 0 at the end of the table
+		index = (index + 1) % track->capacity;
+	} while (index != original_index);
+
+	// Full fixed size table
+	if (reuse != SIZE_MAX) {
+		track->ip_hashes[reuse] = complete_hash;
+		track->hours[reuse] = track->now_hour;
+		track->expired++;
+		return 1;
+	}
+	return 0;
+}
+
+/**
+ * @BRIEF Maps a snapshot written by ip_track_save
+ * @PARAM track        : Table to initialize
+ * @PARAM path         : Snapshot file
+ * @PARAM window_hours : Window for this run, may differ from the snapshot's
+ * @RETURN 0 on success, -1 when the file does not exist, 1 when it is not a snapshot,
+ *         2 when it cannot be opened or mapped (errno set)
+ *
+ * @DETAILS The file is mapped MAP_PRIVATE and used in place: pages are only read
+ *          when probed and copied on first write, the snapshot itself is never
+ *          modified. The arrays move to the heap if the table has to grow.
+ */
+int
+ip_track_load(ip_track_t *track, const char *path, uint32_t window_hours)
+{
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		return (errno == ENOENT) ? -1 : 2; // a snapshot we cannot read must not restart the history
+	}
+	struct stat st;
+	dedup_header_t header;
+	if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(header) ||
+		pread(fd, &header, sizeof(header), 0) != (ssize_t)sizeof(header) ||
+		memcmp(header.magic, DEDUP_MAGIC, sizeof(header.magic)) != 0 || header.capacity == 0 ||
+		(size_t)st.st_size != sizeof(header) + header.capacity * (sizeof(uint64_t) + sizeof(uint32_t))) {
+		close(fd);
+		return 1;
+	}
+
+	void *mapping = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (mapping == MAP_FAILED) {
+		return 2;
+	}
+
+	memset(track, 0, sizeof(*track));
+	track->mapping = mapping;
+	track->mapping_length = st.st_size;
+	track->ip_hashes = (uint64_t *)((char *)mapping + sizeof(header));
+	track->hours = (uint32_t *)(track->ip_hashes + header.capacity);
+	track->capacity = header.capacity;
+	track->count = header.count;
+	track->window_hours = window_hours;
+	track->now_hour = header.now_hour;
+	return 0;
+}
+
+/**
+ * @BRIEF Writes the table as a snapshot for the next run
+ * @PARAM track : Windowed table
+ * @PARAM path  : Snapshot file, replaced atomically
+ * @RETURN 0 on success, 1 on failure with errno set (the previous snapshot is kept)
+ */
+int
+ip_track_save(const ip_track_t *track, const char *path)
+{
+	size_t length = strlen(path);
+	char *tmp_path = (char *)malloc(length + 5);
+	if (tmp_path == NULL) {
+		return 1;
+	}
+	snprintf(tmp_path, length + 5, "%s.tmp", path);
+
+	FILE *output = fopen(tmp_path, "wb");
+	if (output == NULL) {
+		free(tmp_path);
+		return 1;
+	}
+
+	dedup_header_t header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, DEDUP_MAGIC, sizeof(header.magic));
+	header.capacity = track->capacity;
+	header.count = track->count;
+	header.window_hours = track->window_hours;
+	header.now_hour = track->now_hour;
+
+	int failed = fwrite(&header, sizeof(header), 1, output) != 1 ||
+				 fwrite(track->ip_hashes, sizeof(uint64_t), track->capacity, output) != track->capacity ||
+				 fwrite(track->hours, sizeof(uint32_t), track->capacity, output) != track->capacity ||
+				 fflush(output) != 0 || fsync(fileno(output)) != 0;
+	failed |= fclose(output) != 0;
+	if (failed || rename(tmp_path, path) != 0) {
+		int error = errno;
+		unlink(tmp_path);
+		free(tmp_path);
+		errno = error;
+		return 1;
+	}
+	free(tmp_path);
+	return 0;
+}
+// END DEDUP STATE -----------------------------------------------------------------------------
@@ -3,6 +3,13 @@
 //
 //
 #include "../include/s3lp.h"
+#include "../include/s3catalog.h"
+#include "../include/s3checkpoint.h"
+#include "../include/s3live.h"
+#include "../include/s3prefilter.h"
+#include "../include/s3redelivery.h"
+#include "../include/s3session.h"
+#include <getopt.h>
 
 /**
  * S3 Log Processor - Main Entry
@@ -11,23 +18,83 @@
  * Supports both binary and CSV output formats with configurable input/output sources.
  */
 
+// Long spellings, each maps onto its short option
+static const struct option PARSER_LONG_OPTIONS[] = {
+	{"checkpoint", required_argument, NULL, 'C'},
+	{"checkpoint-every", required_argument, NULL, 'E'},
+	{"resume", no_argument, NULL, 'R'},
+	{"catalog", required_argument, NULL, 'A'},
+	{"catalog-bucket", required_argument, NULL, 'b'},
+	{"live", required_argument, NULL, 'L'},
+	{"redelivery", required_argument, NULL, 'U'},
+	{"operation", required_argument, NULL, 'O'},
+	{"bucket", required_argument, NULL, 'B'},
+	{"status", required_argument, NULL, 'H'},
+	{"key-prefix", required_argument, NULL, 'K'},
+	{"help", no_argument, NULL, 'h'},
+	{NULL, 0, NULL, 0},
+};
+
+// -O -B -K: adds the names to the prefilter, prints why they were refused
+static int
+prefilter_option(prefilter_t *prefilter, int field, int option, const char *list)
+{
+	int status = prefilter_add(prefilter, field, list);
+	if (status == -1) {
+		perror("Prefilter: Strndup");
+	}
+	else if (status == 1) {
+		fprintf(stderr, "-%c %s: empty name, or more than %d names in all\n", option, list, PREFILTER_NAMES);
+	}
+	return status != 0;
+}
+
 int
 main(int argc, char *argv[])
 {
-	char *filename = NULL;	  // default input filename
-	char *output_file = NULL; // default output filename
-	FILE *ifp = stdin;		  // default file path to stdin
-	FILE *ofp = stdout;		  // default file path to stdout
+	char *filename = NULL;		  // default input filename
+	char *output_file = NULL;	  // default output filename
+	char *quarantine_file = NULL; // rejected lines, disabled by default
+	char *stats_file = NULL;	  // JSON run stats, disabled by default
+	char *geo_file = NULL;		  // IP -> country database, disabled by default
+	char *session_file = NULL;	  // stitched download records, disabled by default
+	int session_window = SESSION_WINDOW;
+	FILE *session_fp = NULL;
+	char *dedup_file = NULL;	  // unique listener state carried between runs, disabled by default
+	int dedup_window = DEDUP_WINDOW;
+	char *checkpoint_file = NULL;	  // resume points for long backfills, disabled by default
+	int checkpoint_every = CHECKPOINT_EVERY;
+	char *catalog_dir = NULL;		  // dataset whose manifest lists -o once written, disabled by default
+	char *catalog_bucket = NULL;	  // bucket listed for -o, default -B or the directory under catalog_dir
+	char *live_name = NULL;			  // shared memory rolling window, disabled by default
+	live_t live;
+	int redelivery_window = 0;		  // hours a request id is remembered, 0 = repeated deliveries kept
+	redelivery_t redelivery;
+	prefilter_t prefilter;			  // lines kept by operation, bucket, status, key prefix
+	int resume = 0;		  // continue from checkpoint_file
+	int resumed = 0;	  // a checkpoint was found and loaded
+	checkpoint_t checkpoint;
+	checkpoint_record_t record;
+	double stats_interval = 0;	  // seconds between stats reports, 0 = off
+	FILE *ifp = stdin;			  // default file path to stdin
+	FILE *ofp = stdout;			  // default file path to stdout
 	int err_flag = 0;
 	s_context_t context; // Contextual Flags
 
 
 	// Initialize Flags, defaults, and IP tracking hash table
 	{
-		context.ip_track.capacity = IP_HASH;
-		context.ip_track.count = 0;
-		// GTest uses cpp which requires explicit cast
-		context.ip_track.ip_hashes = (uint64_t *)calloc(IP_HASH, sizeof(uint64_t));
+		memset(&context.ip_track, 0, sizeof(context.ip_track)); // Built once -S / -W are known
+		memset(&context.stats, 0, sizeof(context.stats));
+		context.quarantine = NULL;				 // Rejected lines are dropped
+		context.geo = NULL;						 // No country lookup
+		context.sessions = NULL;				 // No download stitching
+		context.checkpoint = NULL;				 // No checkpoints
+		context.live = NULL;					 // No live window
+		context.redelivery = NULL;				 // Repeated deliveries kept
+		context.prefilter = NULL;				 // Every line parsed
+		memset(&checkpoint, 0, sizeof(checkpoint));
+		memset(&prefilter, 0, sizeof(prefilter)); // Filled by -O -B -H -K
 		context.verbose = 0;					 // Verbose output disabled
 		context.output_filetype_flag = BIN_FILE; // Default Binary File
 	}
@@ -36,7 +103,7 @@ main(int argc, char *argv[])
 	{
 		int opt = -1;
 
-		while ((opt = getopt(argc, argv, PARSER_OPTIONS)) != -1) {
+		while ((opt = getopt_long(argc, argv, PARSER_OPTIONS, PARSER_LONG_OPTIONS, NULL)) != -1) {
 			switch (opt) {
 			// File name override: defaults to stdout
 			// INPUT: -f <filename>
@@ -58,6 +125,143 @@ main(int argc, char *argv[])
 				output_file = optarg;
 				break;
 			}
+			// Quarantine file for lines that fail to parse
+			// INPUT: -q <filename>
+			case 'q': {
+				quarantine_file = optarg;
+				break;
+			}
+			// JSON stats summary at exit, "-" for stderr
+			// INPUT: -s <filename>
+			case 's': {
+				stats_file = optarg;
+				break;
+			}
+			// Periodic stats report to stderr
+			// INPUT: -i <seconds>
+			case 'i': {
+				stats_interval = atof(optarg);
+				if (stats_interval <= 0) {
+					fprintf(stderr, "-i requires a positive number of seconds\n");
+					err_flag = 1;
+				}
+				break;
+			}
+			// IP -> country database (CSV: start,end,country)
+			// INPUT: -l <filename>
+			case 'l': {
+				geo_file = optarg;
+				break;
+			}
+			// Download records, one per stitched session
+			// INPUT: -d <filename>
+			case 'd': {
+				session_file = optarg;
+				break;
+			}
+			// Download session window
+			// INPUT: -D <seconds>
+			case 'D': {
+				session_window = atoi(optarg);
+				if (session_window <= 0) {
+					fprintf(stderr, "-D requires a positive number of seconds\n");
+					err_flag = 1;
+				}
+				break;
+			}
+			// Dedup state file, loaded if present and rewritten at exit
+			// INPUT: -S <filepath>
+			case 'S': {
+				dedup_file = optarg;
+				break;
+			}
+			// Dedup window
+			// INPUT: -W <hours>
+			case 'W': {
+				dedup_window = atoi(optarg);
+				if (dedup_window <= 0) {
+					fprintf(stderr, "-W requires a positive number of hours\n");
+					err_flag = 1;
+				}
+				break;
+			}
+			// Checkpoint file for long backfills
+			// INPUT: -C <filepath>, --checkpoint <filepath>
+			case 'C': {
+				checkpoint_file = optarg;
+				break;
+			}
+			// Batches between checkpoints
+			// INPUT: -E <batches>, --checkpoint-every <batches>
+			case 'E': {
+				checkpoint_every = atoi(optarg);
+				if (checkpoint_every <= 0) {
+					fprintf(stderr, "-E requires a positive number of batches\n");
+					err_flag = 1;
+				}
+				break;
+			}
+			// Continue from the checkpoint instead of the start of the input
+			// INPUT: -R, --resume
+			case 'R': {
+				resume = 1;
+				break;
+			}
+			// Dataset the finished -o belongs to, its MANIFEST gets the file's entry
+			// INPUT: -A <dataset dir>, --catalog
+			case 'A': {
+				catalog_dir = optarg;
+				break;
+			}
+			// Bucket the manifest lists for -o, for files not kept in a <bucket>/ directory
+			// INPUT: -b <bucket>, --catalog-bucket
+			case 'b': {
+				catalog_bucket = optarg;
+				break;
+			}
+			// Shared memory segment for live dashboards (s3_live), input is read as a stream
+			// INPUT: -L <name>, --live
+			case 'L': {
+				live_name = optarg;
+				break;
+			}
+			// Drop lines repeating a request id + host id seen within the window
+			// INPUT: -U <hours>, --redelivery
+			case 'U': {
+				redelivery_window = atoi(optarg);
+				if (redelivery_window <= 0) {
+					fprintf(stderr, "-U requires a positive number of hours\n");
+					err_flag = 1;
+				}
+				break;
+			}
+			// Keep only these operations, comma separated, may repeat
+			// INPUT: -O <operations>, --operation
+			case 'O': {
+				err_flag |= prefilter_option(&prefilter, PREFILTER_FIELD_OPERATION, 'O', optarg);
+				break;
+			}
+			// Keep only these buckets
+			// INPUT: -B <buckets>, --bucket
+			case 'B': {
+				err_flag |= prefilter_option(&prefilter, PREFILTER_FIELD_BUCKET, 'B', optarg);
+				break;
+			}
+			// Keep only statuses in the range
+			// INPUT: -H <low-high>, --status
+			case 'H': {
+				if (prefilter_status(&prefilter, optarg) != 0) {
+					fprintf(stderr, "-H %s: not a status range within 200-599\n", optarg);
+					err_flag = 1;
+				}
+				break;
+			}
+			// Keep only keys starting with one of the prefixes
+			// INPUT: -K <prefixes>, --key-prefix
+			case 'K': {
+				err_flag |= prefilter_option(&prefilter, PREFILTER_FIELD_KEY, 'K', optarg);
+				break;
+			}
 			// Verbose Toggle
 			// INPUT: -v
 			case 'v': {
@@ -65,7 +269,7 @@ main(int argc, char *argv[])
 				break;
 			}
 			// Outuput file type
-			// INPUT: -t [c/b]
+			// INPUT: -t <c/b/w>, required so "-t w" and "-tw" both work
 			// NOTE: EXTRACTION WORKS SPECIFICALLY ON BINARY FILES
 			case 't': {
 				char x = *optarg;
@@ -76,6 +280,9 @@ main(int argc, char *argv[])
 				case 'b':
 					context.output_filetype_flag = BIN_FILE;
 					break;
+				case 'w':
+					context.output_filetype_flag = WIDE_FILE;
+					break;
 				default:
 					fprintf(stderr, "%c not recognized file type, binary selected as default\n", x);
 					context.output_filetype_flag = BIN_FILE;
@@ -86,11 +293,32 @@ main(int argc, char *argv[])
 			// Help / Usage information
 			// INPUT: -h
 			case 'h': {
-				fprintf(stderr, "USAGE: ./s3_lp -[vh] -f: <filepath> -o: <output_filepath> -t:: [bc]\n"
+				fprintf(stderr, "USAGE: ./s3_lp -[vh] -f: <filepath> -o: <output_filepath> -q: <filepath> -t: [bcw]\n"
 								"\t-f filepath : override default filepath from stdin\n"
 								"\t-o filepath : override default output filepath from stdout\n"
+								"\t-q filepath : write lines that fail to parse to filepath\n"
+								"\t-s filepath : write run stats as JSON to filepath at exit (- for stderr)\n"
+								"\t-i seconds  : report throughput to stderr every N seconds\n"
+								"\t-l filepath : IPv4 range -> country CSV, fills location_id\n"
+								"\t-d filepath : write one record per download (stitched GET ranges) to filepath\n"
+								"\t-D seconds  : download session window, default 86400\n"
+								"\t-S filepath : unique listener state, loaded if present and saved at exit\n"
+								"\t-W hours    : hours an ip + key pair counts once, default 24\n"
+								"\t-C filepath : --checkpoint, write resume points to filepath (needs -o, not with -d or -U)\n"
+								"\t-E batches  : --checkpoint-every, batches between checkpoints, default 100\n"
+								"\t-R          : --resume, continue from the -C checkpoint, truncating -o and -q\n"
+								"\t-A dir      : --catalog, list the finished -o in the dataset manifest of dir\n"
+								"\t-b bucket   : --catalog-bucket, bucket listed for -o (default: a single -B,\n"
+								"\t              else the directory under dir)\n"
+								"\t-L name     : --live, publish recent records and per minute totals to shared memory\n"
+								"\t-U hours    : --redelivery, drop lines repeating a request id + host id (try 1),\n"
+								"\t              at most the last 4194304 requests are known exactly\n"
+								"\t-O ops      : --operation, keep only these operations, ex: REST.GET.OBJECT,REST.HEAD.OBJECT\n"
+								"\t-B buckets  : --bucket, keep only these buckets, comma separated\n"
+								"\t-H range    : --status, keep only http statuses in range, ex: 200-299, 206, 400-\n"
+								"\t-K prefixes : --key-prefix, keep only keys starting with one of the prefixes\n"
 								"\t-v verbose output\n"
-								"\t-t file type: (b)in, (c)sv" // pgsql db insert query?
+								"\t-t type     : output file type, (b)in, (c)sv, (w)ide bin with 64 bit hashes (-t w or -tw)\n" // pgsql db insert query?
 								"\t-h display options\n");
 				err_flag = 1;
 				break;
@@ -106,7 +334,81 @@ main(int argc, char *argv[])
 
 	// Catch arg parsing error
 	if (err_flag == 1) {
-		free(context.ip_track.ip_hashes);
+		ip_track_free(&context.ip_track);
+		prefilter_free(&prefilter);
+		exit(EXIT_FAILURE);
+	}
+	// Prefilter (default: every line parsed)
+	if (prefilter.last_field != 0) {
+		context.prefilter = &prefilter;
+	}
+
+	// The manifest describes binary files inside the dataset
+	if (catalog_dir != NULL && (output_file == NULL || context.output_filetype_flag == CSV_FILE)) {
+		fprintf(stderr, "-A requires a binary -o inside the dataset\n");
+		err_flag = 1;
+	}
+	if (catalog_bucket != NULL && catalog_dir == NULL) {
+		fprintf(stderr, "-b requires -A <dataset>\n");
+		err_flag = 1;
+	}
+	// Records carry no bucket, a run kept to one bucket by -B names it
+	if (catalog_bucket == NULL && prefilter.buckets.count == 1) {
+		catalog_bucket = prefilter.buckets.names[0];
+	}
+
+	// Checkpoints: offsets only mean something in regular files, and neither open download
+	// sessions nor the redelivery filter are part of the snapshot. Checked before any file
+	// is truncated.
+	if (checkpoint_file != NULL) {
+		if (output_file == NULL || (resume && filename == NULL)) {
+			fprintf(stderr, "-C requires -o, and -R requires -f\n");
+			err_flag = 1;
+		}
+		else if (session_file != NULL) {
+			fprintf(stderr, "-C cannot be combined with -d\n");
+			err_flag = 1;
+		}
+		else if (redelivery_window > 0) {
+			fprintf(stderr, "-C cannot be combined with -U, a resumed run would count redeliveries twice\n");
+			err_flag = 1;
+		}
+		else if (checkpoint_init(&checkpoint, checkpoint_file, checkpoint_every) != 0) {
+			err_flag = 1;
+		}
+		else {
+			context.checkpoint = &checkpoint;
+		}
+	}
+	else if (resume) {
+		fprintf(stderr, "-R requires -C <checkpoint>\n");
+		err_flag = 1;
+	}
+	if (err_flag == 0 && resume) {
+		int status = checkpoint_resume(&checkpoint, &record, &context.ip_track, dedup_window);
+		if (status == -1) {
+			fprintf(stderr, "%s: no checkpoint, starting from the beginning\n", checkpoint_file);
+		}
+		else if (status != 0) {
+			err_flag = 1;
+		}
+		else if (record.output_filetype_flag != context.output_filetype_flag) {
+			fprintf(stderr, "%s: written with a different -t\n", checkpoint_file);
+			err_flag = 1;
+		}
+		else {
+			resumed = 1;
+			context.stats = record.stats;
+			if (context.verbose) {
+				fprintf(stderr, "Resuming at input byte %lu, output byte %lu (%lu lines done)\n",
+						record.input_offset, record.output_offset, record.stats.lines);
+			}
+		}
+	}
+	if (err_flag == 1) {
+		checkpoint_finish(&checkpoint, 0);
+		ip_track_free(&context.ip_track);
+		prefilter_free(&prefilter);
 		exit(EXIT_FAILURE);
 	}
 
@@ -118,32 +420,189 @@ main(int argc, char *argv[])
 			perror("fopen intake");
 			err_flag = 1;
 		}
+		// Skip what the checkpoint already covers
+		else if (resumed) {
+			struct stat st;
+			if (fstat(fileno(ifp), &st) != 0 || (uint64_t)st.st_size < record.input_offset ||
+				fseeko(ifp, record.input_offset, SEEK_SET) != 0) {
+				fprintf(stderr, "%s: shorter than the checkpoint, cannot resume\n", filename);
+				err_flag = 1;
+			}
+		}
 	}
 
 	// Open output file if provided (default: stdout)
 	if (output_file != NULL) {
-		ofp = fopen(output_file, "w");
+		ofp = resumed ? checkpoint_reopen(output_file, record.output_offset) : fopen(output_file, "w");
 		if (ofp == NULL) {
 			perror("fopen output");
 			err_flag = 1;
 		}
 	}
 
+	// Open quarantine file if provided (default: rejected lines dropped)
+	if (quarantine_file != NULL) {
+		context.quarantine = resumed ? checkpoint_reopen(quarantine_file, record.quarantine_offset)
+									 : fopen(quarantine_file, "w");
+		if (context.quarantine == NULL) {
+			perror("fopen quarantine");
+			err_flag = 1;
+		}
+	}
+
+	// Load the country database (default: location_id left unknown)
+	if (geo_file != NULL) {
+		context.geo = geo_db_load(geo_file);
+		if (context.geo == NULL) {
+			err_flag = 1;
+		}
+		else if (context.verbose) {
+			fprintf(stderr, "%zu country ranges loaded from %s\n", context.geo->count, geo_file);
+		}
+	}
+
+	// Open the download session output (default: no stitching)
+	if (session_file != NULL) {
+		session_fp = fopen(session_file, "wb");
+		if (session_fp == NULL) {
+			perror("fopen sessions");
+			err_flag = 1;
+		}
+		else {
+			context.sessions = session_table_create(SESSION_CAPACITY, session_window, session_fp);
+			if (context.sessions == NULL) {
+				err_flag = 1;
+			}
+		}
+	}
+
+	// Live window (default: none), a run that cannot publish would leave dashboards blank
+	if (err_flag == 0 && live_name != NULL) {
+		if (live_open(&live, live_name, LIVE_RECORDS) != 0) {
+			err_flag = 1;
+		}
+		else {
+			context.live = &live;
+		}
+	}
+
+	// Repeated delivery filter (default: every line kept)
+	if (err_flag == 0 && redelivery_window > 0) {
+		if (redelivery_init(&redelivery, redelivery_window) != 0) {
+			err_flag = 1;
+		}
+		else {
+			context.redelivery = &redelivery;
+		}
+	}
+
+	// Unique listener table, picks up where the last run left off when -S names a snapshot
+	// (a resumed run already has the table as of its checkpoint)
+	if (err_flag == 0 && !resumed) {
+		int loaded = (dedup_file == NULL) ? -1 : ip_track_load(&context.ip_track, dedup_file, dedup_window);
+		if (loaded == -1) {
+			loaded = ip_track_init(&context.ip_track, IP_HASH, dedup_window);
+			if (loaded != 0) {
+				perror("IP Track: Calloc");
+			}
+		}
+		else if (loaded == 1) {
+			fprintf(stderr, "%s: not a dedup snapshot\n", dedup_file);
+		}
+		else if (loaded == 2) {
+			perror(dedup_file);
+		}
+		else if (context.verbose) {
+			fprintf(stderr, "%zu unique listeners loaded from %s\n", context.ip_track.count, dedup_file);
+		}
+		if (loaded != 0) {
+			err_flag = 1;
+		}
+	}
+
 	// Exit on file opening error
 	if (err_flag == 1) {
-		free(context.ip_track.ip_hashes);
+		checkpoint_finish(&checkpoint, 0);
+		ip_track_free(&context.ip_track);
+		geo_db_free(context.geo);
+		session_table_free(context.sessions);
+		if (context.live != NULL) {
+			live_close(context.live);
+		}
+		if (context.redelivery != NULL) {
+			redelivery_free(context.redelivery);
+		}
+		prefilter_free(&prefilter);
 		exit(EXIT_FAILURE);
 	}
 
+	// Stage timers only run when someone will read them
+	stats_init(&context.perf, stats_file != NULL || stats_interval > 0, stats_interval);
+
 	// Process Input Log
 	err_flag = process_log(ifp, ofp, &context);
 
+	// Run summary
+	if (stats_file != NULL) {
+		FILE *sfp = (strcmp(stats_file, "-") == 0) ? stderr : fopen(stats_file, "w");
+		if (sfp == NULL) {
+			perror("fopen stats");
+		}
+		else {
+			stats_write_json(&context.perf, &context.stats, sfp);
+			if (sfp != stderr) {
+				fclose(sfp);
+			}
+		}
+	}
+
 	if (err_flag != 0) {
 		fprintf(stderr, "Error detected: Cleaning up\n\n");
 	}
-	// Cleanup
-	free(context.ip_track.ip_hashes);
+	// Only a complete run is saved, a failed one would skip lines the next run never sees
+	else if (dedup_file != NULL && ip_track_save(&context.ip_track, dedup_file) != 0) {
+		perror("write dedup snapshot");
+	}
+	// A finished run no longer needs its checkpoint, a failed one keeps it for -R
+	if (context.checkpoint != NULL && context.verbose) {
+		fprintf(stderr, "%lu checkpoints written, %lu deferred, %lu failed\n", checkpoint.written,
+				checkpoint.skipped, checkpoint.failed);
+	}
+	checkpoint_finish(&checkpoint, err_flag == 0);
+
+	// Cleanup, the live segment stays so dashboards still show the finished run
+	ip_track_free(&context.ip_track);
+	geo_db_free(context.geo);
+	session_table_free(context.sessions);
+	if (context.live != NULL) {
+		live_close(context.live);
+	}
+	if (context.redelivery != NULL) {
+		redelivery_free(context.redelivery);
+	}
+	if (session_fp != NULL) {
+		fclose(session_fp);
+	}
+	if (context.quarantine != NULL) {
+		fclose(context.quarantine);
+	}
 	fclose(ifp);
-	fclose(ofp);
-	exit(EXIT_SUCCESS);
+	if (fclose(ofp) != 0) {
+		perror("fclose output");
+		err_flag = 1;
+	}
+
+	// Only a complete file is listed, readers of the manifest trust its range and podcasts
+	if (catalog_dir != NULL && err_flag == 0) {
+		uint32_t record_size = (context.output_filetype_flag == WIDE_FILE) ? sizeof(s_log_wide_t) : sizeof(s_log_t);
+		if (catalog_register(catalog_dir, output_file, record_size, catalog_bucket) != 0) {
+			fprintf(stderr, "%s was written but not added to the %s manifest\n", output_file, catalog_dir);
+			err_flag = 1;
+		}
+		else if (context.verbose) {
+			fprintf(stderr, "%s listed in %s/%s\n", output_file, catalog_dir, CATALOG_MANIFEST);
+		}
+	}
+	prefilter_free(&prefilter); // after the manifest, a single -B names the bucket
+	exit(err_flag ? EXIT_FAILURE : EXIT_SUCCESS);
 }
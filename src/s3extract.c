@@ -1,131 +1,360 @@
 #include "../include/s3extract.h"
+#include "../include/s3aggregate.h"
+#include "../include/s3quantile.h"
+#include "../include/s3spill.h"
+#include "../include/s3topk.h"
 #include <stdint.h>
 #include <stdlib.h>
 
-int
-main(int argc, char *argv[])
+// LOG GROUPS ----------------------------------------------------------------------------------
+// Records of each group for the grouped log output, found through a hash index on the key.
+// Once the held records pass config->memory_budget, they and the rest of the input are
+// hash-partitioned by key into temporary files, then each partition is grouped and printed on
+// its own. A group never spans partitions: the output has the same groups, in partition order
+// instead of first sighting.
+
+typedef struct log_table_s {
+	log_group_t *groups;
+	uint32_t *index; // key -> group + 1, 0 when empty
+	uint32_t index_mask;
+	int count;
+	int capacity;
+	uint64_t bytes; // groups, index and record buffers held
+} log_table_t;
+
+static void
+print_grouped_begin(FILE *output, const extract_config_t *config)
 {
-	char *input_file = NULL;
-	char *output_file = NULL;
-	FILE *ifp = stdin;
-	FILE *ofp = stdout;
-
-	int group_by = GROUP_NONE;
-	int verbose = 0;
-	int err = 0;
-
-	{
-		int opt = 0;
-		while ((opt = getopt(argc, argv, EXTRACT_OPTIONS)) != -1) {
-			switch (opt) {
-			case 'f': {
-				if (optarg == NULL) {
-					ifp = stdin;
-				}
-				else {
-					input_file = optarg;
-				}
-				break;
-			}
-			case 'o': {
-				if (optarg == NULL) {
-					ofp = stdout;
-				}
-				else {
-					output_file = optarg;
-				}
-				break;
-			}
-			case 'g': {
-				if (optarg == NULL) {
-					fprintf(stderr, "Invalid Grouping! Use: p(odcast), i(p), t(ime), or n(one)\n");
-					exit(EXIT_FAILURE);
-				}
-				switch (*optarg) {
-				case 'p':
-					group_by = GROUP_PODCAST;
-					break;
-				case 'i':
-					group_by = GROUP_IP;
-					break;
-				case 't':
-					group_by = GROUP_TIME;
-					break;
-				case 'n':
-					group_by = GROUP_NONE;
-					break;
-				default:
-					fprintf(stderr, "Invalid Group. Use: p(odcast), i(p), t(ime), or n(one)\n");
-					exit(EXIT_FAILURE);
-				}
-				break;
-			}
-			case 'v': {
-				verbose = (verbose == 1) ? 0 : 1;
-				break;
-			}
-			case 'h': {
-				print_help();
-				exit(EXIT_FAILURE);
+	fprintf(output, "{\n");
+	fprintf(output, "  \"grouped_by\": \"%s\", \n", get_group_name(config->group_by, config));
+	fprintf(output, "  \"groups\":  {\n");
+}
+
+static void
+print_group(const log_group_t *group, FILE *output, const extract_config_t *config, int is_first)
+{
+	if (!is_first) {
+		fprintf(output, ",\n");
+	}
+
+	char *group_key_str = format_group_key(config->group_by, group->group_key, group->logs[0].flags, config);
+
+	fprintf(output, "    \"%s\": {\n", group_key_str);
+	fprintf(output, "      \"count\": %d, \n", group->count);
+	fprintf(output, "      \"logs\": [\n");
+
+	for (int j = 0; j < group->count; j++) {
+		// j == 0 provides bool for is_first variable
+		print_log_as_json(&group->logs[j], output, j == 0, config);
+	}
+
+	fprintf(output, "\n      ]\n");
+	fprintf(output, "    }");
+
+	free(group_key_str);
+}
+
+static void
+print_grouped_end(FILE *output, uint64_t group_count)
+{
+	fprintf(output, "\n  },\n");
+	fprintf(output, "  \"total_groups\": %lu\n", group_count);
+	fprintf(output, "}\n");
+}
+
+static inline uint32_t
+log_table_home(const log_table_t *table, uint64_t key)
+{
+	return (uint32_t)hash64_mix(key ^ HASH64_SECRET[0], HASH64_SECRET[1]) & table->index_mask;
+}
+
+static int
+log_table_init(log_table_t *table)
+{
+	memset(table, 0, sizeof(*table));
+	table->capacity = GROUP_THRESHOLD;
+	table->index_mask = GROUP_THRESHOLD * 2 - 1;
+	table->groups = (log_group_t *)calloc(table->capacity, sizeof(log_group_t));
+	table->index = (uint32_t *)calloc(table->index_mask + 1, sizeof(uint32_t));
+	if (table->groups == NULL || table->index == NULL) {
+		perror("calloc group");
+		return 1;
+	}
+	table->bytes = table->capacity * sizeof(log_group_t) + (table->index_mask + 1) * sizeof(uint32_t);
+	return 0;
+}
+
+static void
+log_table_free(log_table_t *table)
+{
+	for (int i = 0; table->groups != NULL && i < table->count; i++) {
+		free(table->groups[i].logs);
+	}
+	free(table->groups);
+	free(table->index);
+	memset(table, 0, sizeof(*table));
+}
+
+// Doubles the groups and their index
+static int
+log_table_grow(log_table_t *table)
+{
+	log_group_t *groups = (log_group_t *)realloc(table->groups, table->capacity * 2 * sizeof(log_group_t));
+	if (groups == NULL) {
+		perror("realloc groups");
+		return 1;
+	}
+	table->groups = groups;
+	uint32_t *index = (uint32_t *)calloc((table->index_mask + 1) * 2, sizeof(uint32_t));
+	if (index == NULL) {
+		perror("calloc group index");
+		return 1;
+	}
+	table->bytes += table->capacity * sizeof(log_group_t) + (table->index_mask + 1) * sizeof(uint32_t);
+	table->capacity *= 2;
+	free(table->index);
+	table->index = index;
+	table->index_mask = table->index_mask * 2 + 1;
+	for (int i = 0; i < table->count; i++) {
+		uint32_t slot = log_table_home(table, table->groups[i].group_key);
+		while (table->index[slot] != 0) {
+			slot = (slot + 1) & table->index_mask;
+		}
+		table->index[slot] = (uint32_t)i + 1;
+	}
+	return 0;
+}
+
+// Appends a record to its group, creating the group on first sight
+static int
+log_table_add(log_table_t *table, uint64_t key, const s_log_wide_t *log)
+{
+	uint32_t slot = log_table_home(table, key);
+	for (; table->index[slot] != 0; slot = (slot + 1) & table->index_mask) {
+		if (table->groups[table->index[slot] - 1].group_key == key) {
+			break;
+		}
+	}
+
+	if (table->index[slot] == 0) {
+		if (table->count == table->capacity) {
+			if (log_table_grow(table) != 0) {
+				return 1;
 			}
-			default:
-				print_help();
-				exit(EXIT_FAILURE);
+			slot = log_table_home(table, key);
+			while (table->index[slot] != 0) {
+				slot = (slot + 1) & table->index_mask;
 			}
 		}
-	} // End getopt scope
-
-	// Open Files
-	if (input_file) {
-		ifp = fopen(input_file, "rb");
-		if (!ifp) {
-			perror("fopen input_file");
-			exit(EXIT_FAILURE);
+		log_group_t *group = &table->groups[table->count];
+		group->group_key = key;
+		group->logs = (s_log_wide_t *)malloc(LOG_GROUP_START * sizeof(s_log_wide_t));
+		group->count = 0;
+		group->capacity = LOG_GROUP_START;
+		if (group->logs == NULL) {
+			perror("malloc group logs");
+			return 1;
 		}
+		table->bytes += LOG_GROUP_START * sizeof(s_log_wide_t);
+		table->index[slot] = (uint32_t)++table->count;
 	}
 
-	if (output_file) {
-		ofp = fopen(output_file, "w");
-		if (!ofp) {
-			perror("fopen output_file");
-			exit(EXIT_FAILURE);
+	log_group_t *group = &table->groups[table->index[slot] - 1];
+	if (group->count >= group->capacity) {
+		s_log_wide_t *logs = (s_log_wide_t *)realloc(group->logs, group->capacity * 2 * sizeof(s_log_wide_t));
+		if (logs == NULL) {
+			perror("realloc group logs");
+			return 1;
 		}
+		table->bytes += group->capacity * sizeof(s_log_wide_t);
+		group->logs = logs;
+		group->capacity *= 2;
 	}
+	group->logs[group->count++] = *log;
+	return 0;
+}
 
-	err = extract_to_json(ifp, ofp, group_by, verbose);
+// Moves every held record to its partition and empties the table
+static int
+log_table_spill(log_table_t *table, spill_t *spill, FILE *input, int level, const extract_config_t *config)
+{
+	uint32_t count = spill_partitions(input, table->bytes, config->memory_budget);
+	if (spill_open(spill, count, (uint32_t)level, sizeof(s_log_wide_t), config->memory_budget) != 0) {
+		return 1;
+	}
+	if (config->verbose) {
+		fprintf(stderr, "Groups: %d groups at the memory budget, spilling into %u partitions (level %d)\n",
+				table->count, count, level);
+	}
+	for (int i = 0; i < table->count; i++) {
+		const log_group_t *group = &table->groups[i];
+		uint32_t partition = spill_partition(spill, group->group_key, 0);
+		for (int j = 0; j < group->count; j++) {
+			if (spill_write(spill, partition, &group->logs[j]) != 0) {
+				return 1;
+			}
+		}
+	}
+	log_table_free(table);
+	return log_table_init(table);
+}
 
-	if (err == -1) {
-		fprintf(stderr, "Extract to json failed, aborting");
+/**
+ * @BRIEF Groups records and prints the groups, partitioning past the memory budget
+ * @PARAM input   : Records, the input or a partition of s_log_wide_t records
+ * @PARAM wide    : 1 when input holds s_log_wide_t records
+ * @PARAM output  : JSON destination, between print_grouped_begin and print_grouped_end
+ * @PARAM config  : Grouping and memory budget
+ * @PARAM level   : Partition depth of input
+ * @PARAM printed : Groups printed so far, over every partition
+ * @PARAM entries : Input records read, counted at level 0
+ * @RETURN 0 on success, 1 on allocation or spill failure
+ */
+static int
+group_logs(FILE *input, int wide, FILE *output, const extract_config_t *config, int level, uint64_t *printed,
+		   uint64_t *entries)
+{
+	s3_stats_t *perf = config->perf;
+	size_t record_size = wide ? sizeof(s_log_wide_t) : sizeof(s_log_t);
+	uint64_t budget = config->memory_budget;
+	log_table_t table;
+	spill_t spill;
+	memset(&spill, 0, sizeof(spill));
+	int err = log_table_init(&table);
+	int over_budget = 0; // warned that a group set could not be split further
+
+	s_log_wide_t log_entry;
+	while (!err) {
+		uint64_t timer = stats_begin(perf);
+		int got = read_record(input, wide, &log_entry);
+		stats_end(perf, STAGE_READ, timer);
+		if (got != 1) {
+			break;
+		}
+
+		timer = stats_begin(perf);
+		uint64_t group_key = extract_group_key(&log_entry, config->group_by, config);
+		if (spill.count > 0) {
+			err = spill_write(&spill, spill_partition(&spill, group_key, 0), &log_entry);
+		}
+		else {
+			err = log_table_add(&table, group_key, &log_entry);
+			if (!err && budget > 0 && table.bytes > budget) {
+				// One group cannot be split, nor can anything past SPILL_MAX_LEVEL
+				if (level < SPILL_MAX_LEVEL && table.count > 1) {
+					err = log_table_spill(&table, &spill, input, level, config);
+				}
+				else if (!over_budget) {
+					fprintf(stderr, "Groups: %d groups cannot be split to fit the memory budget, continuing over it\n",
+							table.count);
+					over_budget = 1;
+				}
+			}
+		}
+		stats_end(perf, STAGE_GROUP, timer);
+
+		if (level == 0) {
+			(*entries)++;
+			perf->lines++;
+			perf->bytes += record_size;
+			if (*entries % FLUSH_THRESHOLD == 0) {
+				stats_batch_end(perf);
+				stats_batch_begin(perf);
+				if (config->verbose == 1) {
+					fprintf(stderr, "Processed: %lu entries, %d groups\n", *entries, table.count);
+				}
+			}
+		}
 	}
 
-	if (ifp != stdin) {
-		fclose(ifp);
+	if (!err && spill.count == 0) {
+		uint64_t timer = stats_begin(perf);
+		for (int i = 0; i < table.count; i++) {
+			print_group(&table.groups[i], output, config, *printed == 0);
+			(*printed)++;
+		}
+		stats_end(perf, STAGE_WRITE, timer);
 	}
-	if (ofp != stdout) {
-		fclose(ofp);
+	log_table_free(&table);
+	for (uint32_t i = 0; !err && i < spill.count; i++) {
+		if (spill.records[i] > 0) {
+			FILE *partition = spill_rewind(&spill, i);
+			err = (partition == NULL) || group_logs(partition, 1, output, config, level + 1, printed, entries) != 0;
+		}
+		spill_release(&spill, i);
 	}
-
-	exit(EXIT_SUCCESS);
+	spill_close(&spill);
+	return err;
 }
-
+// END LOG GROUPS ------------------------------------------------------------------------------
+
+/**
+ * @BRIEF Streams a slim log file to JSON, optionally grouped
+ * @PARAM input  : Binary slim log stream
+ * @PARAM output : JSON destination
+ * @PARAM config : Grouping, record width, verbosity and stage timers
+ * @RETURN 0 on success, -1 on allocation failure
+ */
 int
-extract_to_json(FILE *input, FILE *output, int group_by, int verbose_flag)
+extract_to_json(FILE *input, FILE *output, const extract_config_t *config)
 {
-	s_log_t log_entry;
+	s_log_wide_t log_entry;
 	uint64_t entries = 0;
+	uint64_t timer;
+	int group_by = config->group_by;
+	int verbose_flag = config->verbose;
+	int wide = config->wide;
+	size_t record_size = wide ? sizeof(s_log_wide_t) : sizeof(s_log_t);
+	s3_stats_t *perf = config->perf;
+
+	// Ranked lists only, the records themselves are never printed
+	if (config->top_k > 0) {
+		stats_batch_begin(perf);
+		int err = extract_top_k(input, output, config);
+		stats_batch_end(perf);
+		return err;
+	}
+	if (config->quantile_of != QUANTILE_NONE) {
+		stats_batch_begin(perf);
+		int err = extract_quantiles(input, output, config);
+		stats_batch_end(perf);
+		return err;
+	}
+	if (config->aggregate) {
+		stats_batch_begin(perf);
+		int err = extract_aggregates(input, output, config);
+		stats_batch_end(perf);
+		return err;
+	}
 
+	stats_batch_begin(perf);
 	if (group_by == GROUP_NONE) {
 		fprintf(output, "{\n");
 		fprintf(output, "  \"logs\": [\n");
 
 		int first_entry = 1;
-		while (fread(&log_entry, sizeof(s_log_t), 1, input) == 1) {
-			print_log_as_json(&log_entry, output, first_entry);
+		for (;;) {
+			timer = stats_begin(perf);
+			int got = read_record(input, wide, &log_entry);
+			stats_end(perf, STAGE_READ, timer);
+			if (got != 1) {
+				break;
+			}
+
+			timer = stats_begin(perf);
+			print_log_as_json(&log_entry, output, first_entry, config);
+			stats_end(perf, STAGE_WRITE, timer);
 			first_entry = 0;
 			entries++;
-
-			if (verbose_flag == 1 && entries % FLUSH_THRESHOLD == 0) {
-				fprintf(stderr, "Processed: %lu entries\n", entries);
+			perf->lines++;
+			perf->bytes += record_size;
+
+			if (entries % FLUSH_THRESHOLD == 0) {
+				stats_batch_end(perf);
+				stats_batch_begin(perf);
+				if (verbose_flag == 1) {
+					fprintf(stderr, "Processed: %lu entries\n", entries);
+				}
 			}
 		}
 
@@ -134,164 +363,184 @@ extract_to_json(FILE *input, FILE *output, int group_by, int verbose_flag)
 		fprintf(output, "}\n");
 	}
 	else {
-		log_group_t *groups = NULL;
-		int group_count = 0;
-		int group_capacity = GROUP_THRESHOLD;
-
-		groups = calloc(group_capacity, sizeof(log_group_t));
-		if (!groups) {
-			perror("calloc group");
+		uint64_t printed = 0;
+		print_grouped_begin(output, config);
+		int err = group_logs(input, wide, output, config, 0, &printed, &entries);
+		print_grouped_end(output, printed);
+		if (err) {
 			return -1;
 		}
+	}
+	if (verbose_flag) {
+		fprintf(stderr, "Total entries processed: %lu\n", entries);
+	}
+	return 0;
+}
 
-		//
-		while (fread(&log_entry, sizeof(s_log_t), 1, input) == 1) {
-			uint32_t group_key;
-
-			switch (group_by) {
-			case GROUP_PODCAST:
-				group_key = log_entry.podcast_hash;
-				break;
-			case GROUP_IP:
-				group_key = log_entry.ip_hash;
-				break;
-			case GROUP_TIME:
-				group_key = log_entry.timestamp / SECONDS_IN_DAY;
-				break;
-			default:
-				group_key = 0;
-				break;
-			}
-
-			// Find Group if it exists, otherwise create
-			int group_index = -1;
-			for (int i = 0; i < group_count; i++) {
-				if (groups[i].group_key == group_key) {
-					group_index = i;
-					break;
-				}
-			}
-
-			if (group_index == -1) {
-				if (group_count >= group_capacity) {
-					group_capacity *= 2;
-					groups = realloc(groups, group_capacity * sizeof(log_group_t));
-					if (!groups) {
-						perror("realloc groups");
-						return -1;
-					}
-				}
-
-				group_index = group_count++;
-				groups[group_index].group_key = group_key;
-				groups[group_index].logs = calloc(64, sizeof(s_log_t));
-				groups[group_index].count = 0;
-				groups[group_index].capacity = 64;
-			}
+/**
+ * @BRIEF Reads the next record, widening 28 byte s_log_t records
+ * @PARAM input  : Binary slim log stream
+ * @PARAM wide   : 1 when the stream holds s_log_wide_t records
+ * @PARAM record : Output record
+ * @RETURN 1 when a record was read, 0 at EOF
+ */
+int
+read_record(FILE *input, int wide, s_log_wide_t *record)
+{
+	if (wide) {
+		return (int)fread(record, sizeof(s_log_wide_t), 1, input);
+	}
 
-			log_group_t *group = &groups[group_index];
-			if (group->count >= group->capacity) {
-				group->capacity *= 2;
-				group->logs = realloc(group->logs, group->capacity * sizeof(s_log_t));
-				if (!group->logs) {
-					perror("calloc group logs:");
-					return -1;
-				}
-			}
+	s_log_t slim;
+	if (fread(&slim, sizeof(s_log_t), 1, input) != 1) {
+		return 0;
+	}
+	widen_record(&slim, record);
+	return 1;
+}
 
-			group->logs[group->count++] = log_entry;
-			entries++;
+// s_log_t -> s_log_wide_t, hashes are zero extended
+void
+widen_record(const s_log_t *slim, s_log_wide_t *record)
+{
+	record->ip_hash = slim->ip_hash;
+	record->podcast_hash = slim->podcast_hash;
+	record->key_hash = slim->key_hash;
+	record->timestamp = slim->timestamp;
+	record->bytes_sent_kb = slim->bytes_sent_kb;
+	record->object_size_kb = slim->object_size_kb;
+	record->download_time_ms = slim->download_time_ms;
+	record->http_code = slim->http_code;
+	record->system_id = slim->system_id;
+	record->platform_id = slim->platform_id;
+	record->completion_percent = slim->completion_percent;
+	record->flags = slim->flags;
+	record->location_id = slim->location_id;
+}
 
-			if (verbose_flag == 1 && entries % FLUSH_THRESHOLD == 0) {
-				fprintf(stderr, "Processed: %lu entries, %d groups\n", entries, group_count);
-			}
+/**
+ * @BRIEF Key a record is grouped (or ranked) under
+ * @PARAM log      : Record
+ * @PARAM group_by : GROUP_*
+ * @PARAM config   : Record width and time bucket
+ * @RETURN Group key, 0 for GROUP_NONE
+ */
+uint64_t
+extract_group_key(const s_log_wide_t *log, int group_by, const extract_config_t *config)
+{
+	switch (group_by) {
+	case GROUP_PODCAST:
+		return log->podcast_hash;
+	case GROUP_IP:
+		// Narrow hashed addresses share the 32 bit space with exact IPv4, keep them apart
+		if (!config->wide && (log->flags & IP_HASHED)) {
+			return log->ip_hash | 1ull << 32;
 		}
+		return log->ip_hash;
+	case GROUP_TIME:
+		return (uint64_t)time_bucket_key(config->time_bucket, log->timestamp);
+	case GROUP_COUNTRY:
+		return log->location_id;
+	case GROUP_KEY:
+		return log->key_hash;
+	case GROUP_SYSTEM:
+		return log->system_id;
+	case GROUP_PLATFORM:
+		return log->platform_id;
+	default:
+		return 0;
+	}
+}
 
-		print_grouped_json(groups, group_count, output, group_by);
-
-		for (int i = 0; i < group_count; i++) {
-			free(groups[i].logs);
-		}
-		free(groups);
+/**
+ * @BRIEF Readable label of a group key
+ * @PARAM group_by  : GROUP_* the key came from
+ * @PARAM group_key : extract_group_key value
+ * @PARAM flags     : Flags of a record in the group (IP_HASHED picks the IP format)
+ * @PARAM config    : Record width
+ * @RETURN malloc'd label
+ */
+char *
+format_group_key(int group_by, uint64_t group_key, uint8_t flags, const extract_config_t *config)
+{
+	int wide = config->wide;
+	switch (group_by) {
+	case GROUP_TIME:
+		return format_timestamp((int64_t)group_key); // the key is local already
+	case GROUP_SYSTEM:
+	case GROUP_PLATFORM: {
+		char *id_str = malloc(8);
+		snprintf(id_str, 8, "%u", (unsigned)group_key);
+		return id_str;
 	}
-	if (verbose_flag) {
-		fprintf(stderr, "Total entries processed: %lu\n", entries);
+	case GROUP_IP: {
+		s_log_wide_t log;
+		memset(&log, 0, sizeof(log));
+		log.ip_hash = wide ? group_key : (uint32_t)group_key;
+		log.flags = flags;
+		return format_ip(&log, wide);
+	}
+	case GROUP_COUNTRY:
+		return strdup(geo_country_code((uint8_t)group_key));
+	case GROUP_NONE:
+		return strdup("all");
+	default:
+		return format_hash(group_key, wide);
 	}
-	return 0;
 }
 
 void
-print_log_as_json(s_log_t *log, FILE *output, int is_first)
+print_log_as_json(const s_log_wide_t *log, FILE *output, int is_first, const extract_config_t *config)
 {
+	int wide = config->wide;
 	if (!is_first) {
 		fprintf(output, ",\n");
 	}
 
-	char *time_str = format_timestamp(log->timestamp);
+	char *time_str = format_timestamp(time_local(config->time_bucket, log->timestamp));
+	char *ip_str = format_hash(log->ip_hash, wide);
+	char *addr_str = format_ip(log, wide);
+	char *podcast_str = format_hash(log->podcast_hash, wide);
+	char *key_str = format_hash(log->key_hash, wide);
 
 	fprintf(output, "    {\n");
 	fprintf(output, "      \"timestamp\": %u, \n", log->timestamp);
 	fprintf(output, "       \"time\": \"%s\", \n", time_str);
-	fprintf(output, "       \"ip_hash\": \"%s\", \n", format_hash(log->ip_hash));
-	fprintf(output, "       \"podcast_hash\": \"%s\", \n", format_hash(log->podcast_hash));
-	fprintf(output, "       \"key_hash\": \"%s\", \n", format_hash(log->key_hash));
+	fprintf(output, "       \"ip\": \"%s\", \n", addr_str);
+	fprintf(output, "       \"ip_hash\": \"%s\", \n", ip_str);
+	fprintf(output, "       \"podcast_hash\": \"%s\", \n", podcast_str);
+	fprintf(output, "       \"key_hash\": \"%s\", \n", key_str);
 	fprintf(output, "       \"bytes_sent_kb\": %u, \n", log->bytes_sent_kb);
 	fprintf(output, "       \"object_size_kb\": %u, \n", log->object_size_kb);
-	fprintf(output, "       \"download_time_ms: %u, \n", log->download_time_ms);
+	fprintf(output, "       \"download_time_ms\": %u, \n", log->download_time_ms);
 	fprintf(output, "       \"http_code\": %u, \n", log->http_code);
 	fprintf(output, "       \"system_id\": %u, \n", log->system_id);
 	fprintf(output, "       \"platform_id\": %u, \n", log->platform_id);
 	fprintf(output, "       \"completion_percent\": %u, \n", log->completion_percent);
 	fprintf(output, "       \"flags\": %u, \n", log->flags);
+	fprintf(output, "       \"country\": \"%s\"\n", geo_country_code(log->location_id));
 	fprintf(output, "    }");
 
 	free(time_str);
+	free(ip_str);
+	free(addr_str);
+	free(podcast_str);
+	free(key_str);
 }
 
 void
-print_grouped_json(log_group_t *groups, int group_count, FILE *output, int group_by)
+print_grouped_json(log_group_t *groups, int group_count, FILE *output, const extract_config_t *config)
 {
-	fprintf(output, "{\n");
-	fprintf(output, "  \"grouped_by\": \"%s\", \n", get_group_name(group_by));
-	fprintf(output, "  \"groups\":  {\n");
-
+	print_grouped_begin(output, config);
 	for (int i = 0; i < group_count; i++) {
-		if (i > 0) {
-			fprintf(output, ",\n");
-		}
-
-		char *group_key_str;
-		if (group_by == GROUP_TIME) {
-			time_t timestampd = groups[i].group_key * SECONDS_IN_DAY;
-			group_key_str = format_timestamp(timestampd);
-		}
-		else {
-			group_key_str = format_hash(groups[i].group_key);
-		}
-
-		fprintf(output, "    \"%s\": {\n", group_key_str);
-		fprintf(output, "      \"count\": %d, \n", groups[i].count);
-		fprintf(output, "      \"logs\": [\n");
-
-
-		for (int j = 0; j < groups[i].count; j++) {
-			// j == 0 provides bool for is_first variable
-			print_log_as_json(&groups[i].logs[j], output, j == 0);
-		}
-
-		fprintf(output, "\n      ]\n");
-		fprintf(output, "    }");
-
-		free(group_key_str);
+		print_group(&groups[i], output, config, i == 0);
 	}
-
-	fprintf(output, "\n  },\n");
-	fprintf(output, "  \"total_groups\": %d\n", group_count);
-	fprintf(output, "}\n");
+	print_grouped_end(output, (uint64_t)group_count);
 }
 
-char *
-get_group_name(int group_by)
+// Group name in the JSON, GROUP_TIME is named after its bucket width
+const char *
+get_group_name(int group_by, const extract_config_t *config)
 {
 	switch (group_by) {
 	case GROUP_PODCAST:
@@ -299,40 +548,296 @@ get_group_name(int group_by)
 	case GROUP_IP:
 		return "ip_address";
 	case GROUP_TIME:
-		return "day";
+		return (config->time_bucket != NULL) ? config->time_bucket->name : "day";
+	case GROUP_COUNTRY:
+		return "country";
+	case GROUP_KEY:
+		return "episode";
+	case GROUP_SYSTEM:
+		return "system";
+	case GROUP_PLATFORM:
+		return "platform";
 	default:
 		return "none";
 	}
 }
 
+// "YYYY-MM-DD HH:MM:SS" of a local wall clock second (time_local), no localtime per record
 char *
-format_timestamp(uint32_t timestamp)
+format_timestamp(int64_t local)
 {
 	char *time_str = malloc(32);
 	if (!time_str) {
 		return NULL;
 	}
+	format_local_time(local, time_str, 32);
+	return time_str;
+}
 
-	time_t t = (time_t)timestamp;
-	struct tm *time_info = localtime(&t);
-	if (time_info == NULL) {
-		snprintf(time_str, 32, "INVALID_TIME_%u", timestamp);
-		return time_str;
+// Hex hash, 8 digits for s_log_t input and 16 for wide records
+char *
+format_hash(uint64_t hash, int wide)
+{
+	char *hash_str = malloc(17);
+	if (wide) {
+		snprintf(hash_str, 17, "%016lx", hash);
 	}
-
-	if (strftime(time_str, 32, "%Y-%m-%d %H:%M:%S", time_info) == 0) {
-		snprintf(time_str, 32, "FORMAT_ERROR_%u", timestamp);
+	else {
+		snprintf(hash_str, 17, "%08x", (uint32_t)hash);
 	}
-	return time_str;
+	return hash_str;
 }
 
+/**
+ * @BRIEF Readable remote address of a record
+ * @PARAM log  : Record
+ * @PARAM wide : 1 for s_log_wide_t input, which keeps IPv6 /64 prefixes exactly
+ * @RETURN malloc'd dotted quad, "xxxx:xxxx:xxxx:xxxx::/64", or the hex hash
+ */
 char *
-format_hash(uint32_t hash)
+format_ip(const s_log_wide_t *log, int wide)
 {
-	char *hash_str = malloc(9);
-	snprintf(hash_str, 9, "%08x", hash);
-	return hash_str;
+	if (!(log->flags & IP_HASHED)) {
+		char *ip_str = malloc(16);
+		uint32_t ip = (uint32_t)log->ip_hash;
+		snprintf(ip_str, 16, "%u.%u.%u.%u", ip >> 24, (ip >> 16) & 0xff, (ip >> 8) & 0xff, ip & 0xff);
+		return ip_str;
+	}
+	if (wide) {
+		char *ip_str = malloc(26);
+		uint64_t prefix = log->ip_hash;
+		snprintf(ip_str, 26, "%x:%x:%x:%x::/64", (unsigned)(prefix >> 48), (unsigned)(prefix >> 32) & 0xffff,
+				 (unsigned)(prefix >> 16) & 0xffff, (unsigned)prefix & 0xffff);
+		return ip_str;
+	}
+	return format_hash(log->ip_hash, wide);
+}
+
+// QUERY OPTIONS -------------------------------------------------------------------------------
+// One reading of the query options for s3_extract's command line and s3_serve's requests, so a
+// query means the same thing, and fails the same way, wherever it is sent.
+
+// Code of a one letter value, -1 when the letter is not listed
+static int
+letter_code(const char *letters, const int *codes, const char *value)
+{
+	const char *at = (*value != '\0') ? strchr(letters, *value) : NULL;
+	return (at != NULL) ? codes[at - letters] : -1;
+}
+
+// Positive count, 0 when the value is not one
+static uint64_t
+positive_count(const char *value)
+{
+	char *end = NULL;
+	long long count = strtoll(value, &end, 10);
+	return (end == value || *end != '\0' || count <= 0) ? 0 : (uint64_t)count;
+}
+
+// Defaults: logs ungrouped, episodes ranked by requests, p50/p90/p95/p99
+void
+extract_query_init(extract_query_t *query)
+{
+	static const double QUANTILES[] = {0.5, 0.9, 0.95, 0.99};
+	memset(query, 0, sizeof(*query));
+	query->config.rank_by = GROUP_KEY;
+	query->config.metric = METRIC_REQUESTS;
+	query->config.alpha = QUANTILE_ALPHA;
+	query->config.quantile_count = 4;
+	memcpy(query->config.quantiles, QUANTILES, sizeof(QUANTILES));
+	query->order_by = -1;
+}
+
+/**
+ * @BRIEF Reads one query option
+ * @PARAM query  : Options so far
+ * @PARAM option : Letter of EXTRACT_QUERY_OPTIONS
+ * @PARAM value  : Its value, kept by pointer for -T -z --from --to --podcast
+ * @PARAM error  : EXTRACT_ERROR_MAX bytes, set on failure
+ * @RETURN 0 on success, 1 on a bad value or an option that is not a query option
+ */
+int
+extract_query_option(extract_query_t *query, int option, const char *value, char *error)
+{
+	static const int GROUPS[] = {GROUP_PODCAST, GROUP_IP, GROUP_TIME, GROUP_COUNTRY, GROUP_KEY, GROUP_SYSTEM,
+								 GROUP_PLATFORM, GROUP_TIME};
+	static const int RANKS[] = {GROUP_KEY, GROUP_PODCAST, GROUP_IP, GROUP_COUNTRY, GROUP_TIME};
+	static const int METRICS[] = {METRIC_REQUESTS, METRIC_UNIQUE, METRIC_BYTES};
+	static const int FIELDS[] = {QUANTILE_TIME, QUANTILE_BYTES};
+	static const int ORDERS[] = {ORDER_KEY, ORDER_REQUESTS, ORDER_UNIQUE, ORDER_BYTES, ORDER_TIME};
+	extract_config_t *config = &query->config;
+
+	switch (option) {
+	// Group keys, outermost first: -g p or -g p,t,s, n alone for none
+	// INPUT: -g <key[,key...]>
+	case 'g':
+		config->group_count = 0;
+		for (const char *key = value; *key != '\0'; key++) {
+			if (*key == ',' || (*key == 'n' && value[1] == '\0')) {
+				continue;
+			}
+			int group = letter_code("pitcesdh", GROUPS, key);
+			for (int i = 0; i < config->group_count && group >= 0; i++) {
+				group = (config->group_keys[i] == group) ? -1 : group;
+			}
+			if (group < 0 || config->group_count == GROUP_KEYS_MAX) {
+				snprintf(error, EXTRACT_ERROR_MAX,
+						 "-g takes n alone, or up to %d distinct keys of p(odcast), i(p), t(ime), c(ountry), "
+						 "e(pisode), s(ystem), d(evice), h(our)",
+						 GROUP_KEYS_MAX);
+				return 1;
+			}
+			query->bucket_spec = (*key == 'h') ? "h" : query->bucket_spec; // -g t -T h
+			config->group_keys[config->group_count++] = group;
+		}
+		config->group_by = (config->group_count > 0) ? config->group_keys[0] : GROUP_NONE;
+		return 0;
+	// Top K per group instead of the logs
+	// INPUT: -k <count>
+	case 'k':
+		config->top_k = (int)positive_count(value);
+		if (config->top_k <= 0) {
+			snprintf(error, EXTRACT_ERROR_MAX, "-k requires a positive count");
+			return 1;
+		}
+		return 0;
+	// Sketch counters per group, more is exact for flatter distributions
+	// INPUT: -c <counters>
+	case 'c':
+		config->counters = (int)positive_count(value);
+		if (config->counters <= 0) {
+			snprintf(error, EXTRACT_ERROR_MAX, "-c requires a positive number of counters");
+			return 1;
+		}
+		return 0;
+	// Groups printed per innermost parent
+	// INPUT: -L <count>, --limit
+	case 'L':
+		config->limit = positive_count(value);
+		if (config->limit == 0) {
+			snprintf(error, EXTRACT_ERROR_MAX, "--limit requires a positive count");
+			return 1;
+		}
+		return 0;
+	// Ranked item
+	// INPUT: -r [e/p/i/c/t]
+	case 'r':
+		config->rank_by = letter_code("epict", RANKS, value);
+		if (config->rank_by < 0) {
+			snprintf(error, EXTRACT_ERROR_MAX, "Invalid Rank. Use: e(pisode), p(odcast), i(p), c(ountry) or t(ime)");
+			return 1;
+		}
+		return 0;
+	// Ranking metric
+	// INPUT: -m [n/u/b]
+	case 'm':
+		config->metric = letter_code("nub", METRICS, value);
+		if (config->metric < 0) {
+			snprintf(error, EXTRACT_ERROR_MAX, "Invalid Metric. Use: n (requests), u(nique downloads) or b(ytes)");
+			return 1;
+		}
+		return 0;
+	// Percentiles per group instead of the logs
+	// INPUT: -q [t/b]
+	case 'q':
+		config->quantile_of = letter_code("tb", FIELDS, value);
+		if (config->quantile_of < 0) {
+			snprintf(error, EXTRACT_ERROR_MAX, "Invalid Quantile Field. Use: t(ime ms) or b(ytes kb)");
+			return 1;
+		}
+		return 0;
+	// Totals per group ordered by key or an aggregate
+	// INPUT: -O <k/n/u/b/t>, --order
+	case 'O':
+		query->order_by = letter_code("knubt", ORDERS, value);
+		if (query->order_by < 0) {
+			snprintf(error, EXTRACT_ERROR_MAX, "Invalid Order. Use: k(ey), n (requests), u(nique), b(ytes) or t(ime ms)");
+			return 1;
+		}
+		return 0;
+	// Quantile relative accuracy
+	// INPUT: -a <alpha>
+	case 'a': {
+		char *end = NULL;
+		config->alpha = strtod(value, &end);
+		if (end == value || *end != '\0' || config->alpha <= 0 || config->alpha >= 1) {
+			snprintf(error, EXTRACT_ERROR_MAX, "-a requires an accuracy between 0 and 1");
+			return 1;
+		}
+		return 0;
+	}
+	// Percentiles to print
+	// INPUT: -p <50,95,99>
+	case 'p':
+		config->quantile_count = 0;
+		for (const char *token = value; *token != '\0';) {
+			char *end = NULL;
+			double percent = strtod(token, &end);
+			if (end == token || percent < 0 || percent > 100 || config->quantile_count == QUANTILE_MAX) {
+				config->quantile_count = 0;
+				break;
+			}
+			config->quantiles[config->quantile_count++] = percent / 100;
+			token = (*end == ',') ? end + 1 : end;
+		}
+		if (config->quantile_count == 0) {
+			snprintf(error, EXTRACT_ERROR_MAX, "-p takes up to %d comma separated percentiles", QUANTILE_MAX);
+			return 1;
+		}
+		return 0;
+	// Time bucket width for -g t (or -r t)
+	// INPUT: -T <[n]m/[n]h/d/w/M>
+	case 'T':
+		query->bucket_spec = value;
+		return 0;
+	// Reporting time zone for buckets and record times
+	// INPUT: -z <UTC/+05:30/Europe/Berlin/POSIX TZ>
+	case 'z':
+		query->time_zone = value;
+		return 0;
+	// Dataset predicate, reporting zone wall clock, --to is exclusive
+	// INPUT: -F / -U <YYYY-MM-DD[ HH:MM[:SS]] / @epoch>, --from / --to
+	case 'F':
+		query->from = value;
+		return 0;
+	case 'U':
+		query->to = value;
+		return 0;
+	// INPUT: -P <show name / 0x<hash>>, --podcast
+	case 'P':
+		query->podcast = value;
+		return 0;
+	default:
+		snprintf(error, EXTRACT_ERROR_MAX, "-%c is not a query option", option);
+		return 1;
+	}
+}
+
+/**
+ * @BRIEF Checks the options together once all are read
+ * @PARAM query : Options
+ * @PARAM error : EXTRACT_ERROR_MAX bytes, set on failure
+ * @RETURN 0 on success, 1 when the options cannot be combined
+ *
+ * @DETAILS Several keys, an order or a limit ask for totals, the other reports take one key.
+ */
+int
+extract_query_finish(extract_query_t *query, char *error)
+{
+	extract_config_t *config = &query->config;
+	config->aggregate = config->group_count > 1 || query->order_by >= 0 || config->limit > 0;
+	config->order_by = (query->order_by < 0) ? ORDER_KEY : query->order_by;
+	if (config->aggregate && (config->top_k > 0 || config->quantile_of != QUANTILE_NONE)) {
+		snprintf(error, EXTRACT_ERROR_MAX, "Composite keys, -O and --limit cannot be combined with -k or -q");
+		return 1;
+	}
+	if (config->aggregate && config->group_count == 0) {
+		snprintf(error, EXTRACT_ERROR_MAX, "-O and --limit require -g");
+		return 1;
+	}
+	return 0;
 }
+// END QUERY OPTIONS ---------------------------------------------------------------------------
 
 void
 print_help(void)
@@ -342,12 +847,43 @@ print_help(void)
 	printf("Options:\n");
 	printf("    -f <file>      binary log file (default: stdin)\n");
 	printf("    -o <file>      Output JSON file (default: stdout\n");
-	printf("    -g             Group by: p(odcast), i(p), t(ime/day), n(one) [default: none]\n");
+	printf("    -g             Group by: p(odcast), i(p), t(ime/day), c(ountry), e(pisode), s(ystem), d(evice),\n");
+	printf("                   h(our), n(one) [default: none]\n");
+	printf("                   Several keys, outermost first (-g p,t,s), print nested totals per group\n");
+	printf("    -O, --order    Totals order: k(ey), n (requests), u(nique), b(ytes), t(ime ms) [default: k]\n");
+	printf("    -L, --limit    Totals printed per innermost parent [default: all]\n");
+	printf("    -M, --memory   MB groups may hold before spilling to $TMPDIR, 0 for no limit [default: half of RAM]\n");
+	printf("    -k <count>     Print the top K items of each group instead of the logs, exact counts need a -f\n");
+	printf("                   file: over -D, -S or stdin it is one pass with estimated counts\n");
+	printf("    -r             Ranked item for -k: e(pisode), p(odcast), i(p), c(ountry), t(ime) [default: e]\n");
+	printf("    -m             Metric for -k: n (requests), u(nique downloads), b(ytes) [default: n]\n");
+	printf("    -j <threads>   Top K threads over a file input [default: cores]\n");
+	printf("    -c <counters>  Top K sketch counters per group [default: 4K, at least 256]\n");
+	printf("    -q             Print percentiles per group of t(ime ms) or b(ytes kb) instead of the logs\n");
+	printf("    -a <alpha>     Percentile relative accuracy for -q [default: 0.01]\n");
+	printf("    -p <list>      Percentiles for -q [default: 50,90,95,99]\n");
+	printf("    -T <width>     Time bucket for -g t / -r t: [n]m, [n]h, d, w(eek), M(onth) [default: d]\n");
+	printf("    -z <zone>      Reporting time zone: UTC, +05:30, Europe/Berlin or a POSIX TZ [default: UTC]\n");
+	printf("    -D <dir>       Dataset written with s3lp -A, read in parallel instead of -f (-j readers)\n");
+	printf("    -F, --from     Dataset records at or after a time, YYYY-MM-DD[ HH:MM[:SS]] or @epoch in the -z zone\n");
+	printf("    -U, --to       Dataset records before a time, same forms as --from\n");
+	printf("    -P, --podcast  Dataset records of one show, by name (show-29) or 0x<hash>\n");
+	printf("    -S, --server   First option only: run the query on s3_serve at this socket instead\n");
+	printf("    -w             Input is wide records (s3lp -t w), 64 bit hashes\n");
 	printf("    -v             Verbose Output, multiple inputs will toggle the flag\n");
+	printf("    -s <file>      Write run stats as JSON at exit (- for stderr)\n");
+	printf("    -i <seconds>   Report throughput to stderr every N seconds\n");
 	printf("    -h             This page right here\n\n");
 	printf("Example usage:\n");
 	printf("\t./s3_extract -f logs.bin -o output.json          // Simple Output\n");
 	printf("\t./s3_extract -f logs.bin -o output.json -g p     // Podcast Groping\n");
 	printf("\t./s3_extract -f logs.bin -o output.json -g i     // IP Hash Grouping\n");
 	printf("\t./s3_extract -f logs.bin -o output.json -g t     // Time Grouping\n");
+	printf("\t./s3_extract -f logs.bin -g p -k 50 -m u         // Top 50 episodes by unique downloads per show\n");
+	printf("\t./s3_extract -f logs.bin -g s -q t -p 50,99      // Download time p50 and p99 per app\n");
+	printf("\t./s3_extract -f logs.bin -g p,t,s -O n --limit 3 // Top 3 apps per show per day\n");
+	printf("\t./s3_extract -f month.bin -g i,p -M 2048          // Per listener totals in 2 GB\n");
+	printf("\t./s3_extract -f logs.bin -g t -T 5m -z Europe/Berlin -q t // 5 minute latency, Berlin time\n");
+	printf("\t./s3_extract -D archive -F 2025-05-03 -U 2025-05-05 -g p,t // Two days of a dataset\n");
+	printf("\t./s3_extract -S /tmp/s3.sock -F 2025-05-03 -g p,t   // The same on s3_serve -D archive\n");
 }
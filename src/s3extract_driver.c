@@ -0,0 +1,305 @@
+// S3 Log Extract
+//
+//
+//
+#include "../include/s3extract.h"
+#include "../include/s3aggregate.h"
+#include "../include/s3catalog.h"
+#include "../include/s3quantile.h"
+#include "../include/s3serve.h"
+#include "../include/s3spill.h"
+#include "../include/s3topk.h"
+#include <getopt.h>
+
+static const struct option EXTRACT_LONG_OPTIONS[] = {
+	{"order", required_argument, NULL, 'O'},
+	{"limit", required_argument, NULL, 'L'},
+	{"memory", required_argument, NULL, 'M'},
+	{"dataset", required_argument, NULL, 'D'},
+	{"from", required_argument, NULL, 'F'},
+	{"to", required_argument, NULL, 'U'},
+	{"podcast", required_argument, NULL, 'P'},
+	{"server", required_argument, NULL, 'S'},
+	{"help", no_argument, NULL, 'h'},
+	{NULL, 0, NULL, 0},
+};
+
+/**
+ * S3 Log Extract - Main Entry
+ *
+ * Converts binary slim logs written by s3lp into JSON, optionally grouped.
+ */
+
+int
+main(int argc, char *argv[])
+{
+	char *input_file = NULL;
+	char *output_file = NULL;
+	FILE *ifp = stdin;
+	FILE *ofp = stdout;
+
+	extract_query_t request; // -g -k -r -m -c -q -a -p -T -z -O -L -F -U -P, read as s3_serve reads them
+	char error[EXTRACT_ERROR_MAX];
+	uint64_t memory_budget = spill_default_budget();
+	int verbose = 0;
+	int wide = 0;
+	int threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+	char *dataset = NULL; // -f (or stdin) unless a catalog is named
+	catalog_t catalog;
+	catalog_scan_t scan;
+	catalog_query_t query = {0, UINT32_MAX, 0, 0, 0};
+	time_bucket_t time_bucket;
+	int err = 0;
+	char *stats_file = NULL;
+	double stats_interval = 0;
+	s3_stats_t perf;
+
+	// Query on s3_serve: the options are sent as given, -v stays here
+	// INPUT: -S <socket> [-v] <query options>, --server
+	if (argc > 2 && (strcmp(argv[1], "-S") == 0 || strcmp(argv[1], "--server") == 0)) {
+		char **options = argv + 3;
+		int count = 0;
+		for (int i = 3; i < argc; i++) {
+			if (strcmp(argv[i], "-v") == 0) {
+				verbose = 1;
+				continue;
+			}
+			options[count++] = argv[i];
+		}
+		exit(serve_request(argv[2], count, options, stdout, verbose) ? EXIT_FAILURE : EXIT_SUCCESS);
+	}
+
+	extract_query_init(&request);
+	{
+		int opt = 0;
+		while ((opt = getopt_long(argc, argv, EXTRACT_OPTIONS, EXTRACT_LONG_OPTIONS, NULL)) != -1) {
+			switch (opt) {
+			case 'f': {
+				if (optarg == NULL) {
+					ifp = stdin;
+				}
+				else {
+					input_file = optarg;
+				}
+				break;
+			}
+			case 'o': {
+				if (optarg == NULL) {
+					ofp = stdout;
+				}
+				else {
+					output_file = optarg;
+				}
+				break;
+			}
+			// Query options, extract_query_option documents each
+			// INPUT: -g -k -c -r -m -q -a -p -T -z -O -L, -F / --from, -U / --to, -P / --podcast
+			case 'g':
+			case 'k':
+			case 'c':
+			case 'r':
+			case 'm':
+			case 'q':
+			case 'a':
+			case 'p':
+			case 'T':
+			case 'z':
+			case 'O':
+			case 'L':
+			case 'F':
+			case 'U':
+			case 'P': {
+				if (extract_query_option(&request, opt, optarg, error) != 0) {
+					fprintf(stderr, "%s\n", error);
+					exit(EXIT_FAILURE);
+				}
+				break;
+			}
+			// Top K worker threads
+			// INPUT: -j <threads>
+			case 'j': {
+				threads = atoi(optarg);
+				if (threads <= 0) {
+					fprintf(stderr, "-j requires a positive number of threads\n");
+					exit(EXIT_FAILURE);
+				}
+				break;
+			}
+			// Memory for groups before they spill to $TMPDIR, 0 for no limit
+			// INPUT: -M <MB>, --memory
+			case 'M': {
+				char *end = NULL;
+				double megabytes = strtod(optarg, &end);
+				if (end == optarg || megabytes < 0) {
+					fprintf(stderr, "--memory requires a size in MB, 0 for no limit\n");
+					exit(EXIT_FAILURE);
+				}
+				memory_budget = (uint64_t)(megabytes * 1024 * 1024);
+				break;
+			}
+			// Dataset directory with a MANIFEST (s3lp -A), pruned by --from, --to and --podcast
+			// INPUT: -D <dir>, --dataset
+			case 'D': {
+				dataset = optarg;
+				break;
+			}
+			case 'S': {
+				fprintf(stderr, "-S must be the first option, the others are sent to the server\n");
+				exit(EXIT_FAILURE);
+			}
+			case 'v': {
+				verbose = (verbose == 1) ? 0 : 1;
+				break;
+			}
+			// Input written by s3lp -t w
+			case 'w': {
+				wide = 1;
+				break;
+			}
+			case 's': {
+				stats_file = optarg;
+				break;
+			}
+			case 'i': {
+				stats_interval = atof(optarg);
+				if (stats_interval <= 0) {
+					fprintf(stderr, "-i requires a positive number of seconds\n");
+					exit(EXIT_FAILURE);
+				}
+				break;
+			}
+			case 'h': {
+				print_help();
+				exit(EXIT_FAILURE);
+			}
+			default:
+				print_help();
+				exit(EXIT_FAILURE);
+			}
+		}
+	} // End getopt scope
+
+	if (extract_query_finish(&request, error) != 0) {
+		fprintf(stderr, "%s\n", error);
+		exit(EXIT_FAILURE);
+	}
+	if (time_bucket_init(&time_bucket, request.bucket_spec, request.time_zone) != 0) {
+		exit(EXIT_FAILURE);
+	}
+
+	// Dataset predicate, times in the reporting zone
+	if ((request.from != NULL || request.to != NULL || request.podcast != NULL) && dataset == NULL) {
+		fprintf(stderr, "--from, --to and --podcast require -D <dataset>\n");
+		exit(EXIT_FAILURE);
+	}
+	if (dataset != NULL && input_file != NULL) {
+		fprintf(stderr, "-D and -f cannot be combined\n");
+		exit(EXIT_FAILURE);
+	}
+	{
+		int64_t utc = 0;
+		if (request.from != NULL) {
+			if (time_parse(request.from, &time_bucket.zone, &utc) != 0) {
+				fprintf(stderr, "--from takes YYYY-MM-DD[ HH:MM[:SS]] or @seconds\n");
+				exit(EXIT_FAILURE);
+			}
+			query.from = (utc < 0) ? 0 : (utc > UINT32_MAX) ? UINT32_MAX : (uint32_t)utc;
+		}
+		if (request.to != NULL) {
+			if (time_parse(request.to, &time_bucket.zone, &utc) != 0) {
+				fprintf(stderr, "--to takes YYYY-MM-DD[ HH:MM[:SS]] or @seconds\n");
+				exit(EXIT_FAILURE);
+			}
+			query.to = (utc < 0) ? 0 : (utc > UINT32_MAX) ? UINT32_MAX : (uint32_t)utc;
+		}
+		if (request.podcast != NULL && catalog_query_podcast(&query, request.podcast) != 0) {
+			fprintf(stderr, "--podcast takes a show name or 0x<hash>\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	// Open Files
+	if (dataset != NULL) {
+		// A missing MANIFEST is an empty dataset, a missing directory is a typo
+		if (access(dataset, R_OK | X_OK) != 0) {
+			perror(dataset);
+			exit(EXIT_FAILURE);
+		}
+		if (catalog_load(&catalog, dataset) != 0) {
+			exit(EXIT_FAILURE);
+		}
+		ifp = catalog_scan_start(&scan, &catalog, &query, threads);
+		if (ifp == NULL) {
+			exit(EXIT_FAILURE);
+		}
+		wide = (scan.record_size == sizeof(s_log_wide_t));
+		if (verbose) {
+			fprintf(stderr, "Dataset: %u of %u files kept, %d readers\n", scan.file_count, catalog.count,
+					scan.threads);
+		}
+	}
+	if (input_file) {
+		ifp = fopen(input_file, "rb");
+		if (!ifp) {
+			perror("fopen input_file");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	if (output_file) {
+		ofp = fopen(output_file, "w");
+		if (!ofp) {
+			perror("fopen output_file");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	stats_init(&perf, stats_file != NULL || stats_interval > 0, stats_interval);
+
+	extract_config_t config = request.config;
+	config.verbose = verbose;
+	config.wide = wide;
+	config.perf = &perf;
+	config.threads = threads;
+	config.time_bucket = &time_bucket;
+	config.memory_budget = memory_budget;
+	err = extract_to_json(ifp, ofp, &config);
+
+	if (err == -1) {
+		fprintf(stderr, "Extract to json failed, aborting");
+	}
+
+	if (stats_file != NULL) {
+		FILE *sfp = (strcmp(stats_file, "-") == 0) ? stderr : fopen(stats_file, "w");
+		if (sfp == NULL) {
+			perror("fopen stats_file");
+		}
+		else {
+			stats_write_json(&perf, NULL, sfp);
+			if (sfp != stderr) {
+				fclose(sfp);
+			}
+		}
+	}
+
+	time_bucket_free(&time_bucket);
+	if (ifp != stdin) {
+		fclose(ifp);
+	}
+	// Closed first, so workers still writing to a reader that stopped fail instead of blocking
+	if (dataset != NULL) {
+		if (catalog_scan_finish(&scan) != 0) {
+			fprintf(stderr, "Dataset scan failed, output is incomplete\n");
+			err = -1;
+		}
+		if (verbose) {
+			fprintf(stderr, "Dataset: %lu records read, %lu matched\n", scan.scanned, scan.matched);
+		}
+		catalog_free(&catalog);
+	}
+	if (ofp != stdout) {
+		fclose(ofp);
+	}
+
+	exit((err == -1) ? EXIT_FAILURE : EXIT_SUCCESS);
+}
@@ -0,0 +1,273 @@
+#include "../include/s3geo.h"
+#include "../include/s3lp.h"
+#include <pthread.h>
+
+// GEO LOOKUP ----------------------------------------------------------------------------------
+// location_id is 1 + the index of the country in this list, 0 is unknown.
+// ISO 3166-1 alpha-2 in order, then the non-ISO codes common in free databases.
+// APPEND ONLY: ids are stored in .bin files.
+static const char COUNTRY_CODES[] = "AD" "AE" "AF" "AG" "AI" "AL" "AM" "AO" "AQ" "AR" "AS" "AT" "AU" "AW" "AX" "AZ"
+									"BA" "BB" "BD" "BE" "BF" "BG" "BH" "BI" "BJ" "BL" "BM" "BN" "BO" "BQ" "BR" "BS"
+									"BT" "BV" "BW" "BY" "BZ" "CA" "CC" "CD" "CF" "CG" "CH" "CI" "CK" "CL" "CM" "CN"
+									"CO" "CR" "CU" "CV" "CW" "CX" "CY" "CZ" "DE" "DJ" "DK" "DM" "DO" "DZ" "EC" "EE"
+									"EG" "EH" "ER" "ES" "ET" "FI" "FJ" "FK" "FM" "FO" "FR" "GA" "GB" "GD" "GE" "GF"
+									"GG" "GH" "GI" "GL" "GM" "GN" "GP" "GQ" "GR" "GS" "GT" "GU" "GW" "GY" "HK" "HM"
+									"HN" "HR" "HT" "HU" "ID" "IE" "IL" "IM" "IN" "IO" "IQ" "IR" "IS" "IT" "JE" "JM"
+									"JO" "JP" "KE" "KG" "KH" "KI" "KM" "KN" "KP" "KR" "KW" "KY" "KZ" "LA" "LB" "LC"
+									"LI" "LK" "LR" "LS" "LT" "LU" "LV" "LY" "MA" "MC" "MD" "ME" "MF" "MG" "MH" "MK"
+									"ML" "MM" "MN" "MO" "MP" "MQ" "MR" "MS" "MT" "MU" "MV" "MW" "MX" "MY" "MZ" "NA"
+									"NC" "NE" "NF" "NG" "NI" "NL" "NO" "NP" "NR" "NU" "NZ" "OM" "PA" "PE" "PF" "PG"
+									"PH" "PK" "PL" "PM" "PN" "PR" "PS" "PT" "PW" "PY" "QA" "RE" "RO" "RS" "RU" "RW"
+									"SA" "SB" "SC" "SD" "SE" "SG" "SH" "SI" "SJ" "SK" "SL" "SM" "SN" "SO" "SR" "SS"
+									"ST" "SV" "SX" "SY" "SZ" "TC" "TD" "TF" "TG" "TH" "TJ" "TK" "TL" "TM" "TN" "TO"
+									"TR" "TT" "TV" "TW" "TZ" "UA" "UG" "UM" "US" "UY" "UZ" "VA" "VC" "VE" "VG" "VI"
+									"VN" "VU" "WF" "WS" "YE" "YT" "ZA" "ZM" "ZW" "EU" "AP" "XK";
+#define COUNTRY_COUNT ((int)(sizeof(COUNTRY_CODES) - 1) / 2)
+
+// One database row before it is laid out
+typedef struct geo_range_s {
+	uint32_t start;
+	uint32_t end;
+	uint8_t country;
+} geo_range_t;
+
+// Lookup tables, built once for every thread (libs3lp callers, the catalog scan)
+static pthread_once_t country_once = PTHREAD_ONCE_INIT;
+static uint8_t country_ids[26 * 26];			// letter pair -> location_id
+static char country_codes[COUNTRY_COUNT + 1][3]; // location_id -> NUL terminated code
+
+static void
+country_tables_build(void)
+{
+	for (int i = 0; i < COUNTRY_COUNT; i++) {
+		char first = COUNTRY_CODES[2 * i];
+		char second = COUNTRY_CODES[2 * i + 1];
+		country_ids[(first - 'A') * 26 + (second - 'A')] = (uint8_t)(i + 1);
+		country_codes[i + 1][0] = first;
+		country_codes[i + 1][1] = second;
+	}
+}
+
+/**
+ * @BRIEF Two letter country code -> location_id
+ * @PARAM code : Code, case insensitive, only the first two chars are read
+ * @RETURN location_id, GEO_UNKNOWN for codes not in the list
+ */
+uint8_t
+geo_country_id(const char *code)
+{
+	pthread_once(&country_once, country_tables_build);
+	int a = (code[0] | 0x20) - 'a';
+	int b = (code[0] == '\0') ? -1 : (code[1] | 0x20) - 'a';
+	if (a < 0 || a >= 26 || b < 0 || b >= 26) {
+		return GEO_UNKNOWN;
+	}
+	return country_ids[a * 26 + b];
+}
+
+// location_id -> two letter code, "--" for unknown
+const char *
+geo_country_code(uint8_t location_id)
+{
+	if (location_id == GEO_UNKNOWN || location_id > COUNTRY_COUNT) {
+		return "--";
+	}
+	pthread_once(&country_once, country_tables_build);
+	return country_codes[location_id];
+}
+
+// Splits the next comma separated field in place, stripping quotes
+static char *
+next_field(char **cursor)
+{
+	char *field = *cursor;
+	if (field == NULL) {
+		return NULL;
+	}
+	char *comma = strchr(field, ',');
+	if (comma != NULL) {
+		*comma = '\0';
+		*cursor = comma + 1;
+	}
+	else {
+		*cursor = NULL;
+	}
+	size_t length = strcspn(field, "\r\n");
+	field[length] = '\0';
+	if (length >= 2 && field[0] == '"' && field[length - 1] == '"') {
+		field[length - 1] = '\0';
+		field++;
+	}
+	return field;
+}
+
+// Range bound as a dotted quad or a decimal integer, -1 for IPv6 or anything else
+static int
+parse_bound(const char *field, uint32_t *ip)
+{
+	if (strchr(field, '.') != NULL) {
+		return parse_ipv4(field, strlen(field), ip);
+	}
+	if (*field < '0' || *field > '9') {
+		return -1;
+	}
+	int64_t val = fast_atol(field);
+	if (val > UINT32_MAX || field[strspn(field, "0123456789")] != '\0') {
+		return -1;
+	}
+	*ip = (uint32_t)val;
+	return 0;
+}
+
+static int
+compare_range(const void *a, const void *b)
+{
+	const geo_range_t *x = (const geo_range_t *)a;
+	const geo_range_t *y = (const geo_range_t *)b;
+	return (x->start > y->start) - (x->start < y->start);
+}
+
+// In order walk of the implicit tree, sorted position i -> Eytzinger node k
+static size_t
+eytzinger_fill(geo_db_t *db, const geo_range_t *sorted, size_t i, size_t k)
+{
+	if (k <= db->count) {
+		i = eytzinger_fill(db, sorted, i, 2 * k);
+		db->range_end[k] = sorted[i].end;
+		db->leaf[k].start = sorted[i].start;
+		db->leaf[k].country = sorted[i].country;
+		i = eytzinger_fill(db, sorted, i + 1, 2 * k + 1);
+	}
+	return i;
+}
+
+/**
+ * @BRIEF Loads an IPv4 range -> country CSV into a lookup table
+ * @PARAM path : CSV with rows "start,end,country[,...]"
+ * @RETURN Lookup table, NULL on open or allocation failure
+ *
+ * @DETAILS start/end may be dotted quads or integers, quoted or not (DB-IP and
+ *          IP2Location LITE country files load as is). Header rows, IPv6 rows and
+ *          unknown country codes are skipped. Overlapping rows keep the first
+ *          range, adjacent rows with the same country are merged.
+ */
+geo_db_t *
+geo_db_load(const char *path)
+{
+	FILE *input = fopen(path, "r");
+	if (input == NULL) {
+		perror("fopen geo database");
+		return NULL;
+	}
+
+	size_t count = 0;
+	size_t capacity = 1 << 16;
+	geo_range_t *ranges = (geo_range_t *)malloc(capacity * sizeof(geo_range_t));
+	geo_db_t *db = (geo_db_t *)calloc(1, sizeof(geo_db_t));
+	if (ranges == NULL || db == NULL) {
+		perror("Geo Load: Malloc");
+		free(ranges);
+		free(db);
+		fclose(input);
+		return NULL;
+	}
+
+	char line[GEO_LINE_MAX];
+	while (fgets(line, sizeof(line), input) != NULL) {
+		char *cursor = line;
+		char *start = next_field(&cursor);
+		char *end = next_field(&cursor);
+		char *code = next_field(&cursor);
+		geo_range_t range;
+
+		if (code == NULL || strlen(code) != 2 || parse_bound(start, &range.start) != 0 ||
+			parse_bound(end, &range.end) != 0 || range.end < range.start ||
+			(range.country = geo_country_id(code)) == GEO_UNKNOWN) {
+			continue;
+		}
+		if (count == capacity) {
+			capacity *= 2;
+			geo_range_t *grown = (geo_range_t *)realloc(ranges, capacity * sizeof(geo_range_t));
+			if (grown == NULL) {
+				perror("Geo Load: Realloc");
+				free(ranges);
+				free(db);
+				fclose(input);
+				return NULL;
+			}
+			ranges = grown;
+		}
+		ranges[count++] = range;
+	}
+	fclose(input);
+
+	// Sort, drop overlaps, merge neighbours
+	qsort(ranges, count, sizeof(geo_range_t), compare_range);
+	size_t kept = 0;
+	for (size_t i = 0; i < count; i++) {
+		if (kept > 0 && ranges[i].start <= ranges[kept - 1].end) {
+			continue;
+		}
+		if (kept > 0 && ranges[i].start == ranges[kept - 1].end + 1 && ranges[i].country == ranges[kept - 1].country) {
+			ranges[kept - 1].end = ranges[i].end;
+			continue;
+		}
+		ranges[kept++] = ranges[i];
+	}
+
+	// Eytzinger arrays, 1 based and cache line aligned so node k's children share a line
+	size_t bytes = ((kept + 1) * sizeof(uint32_t) + 63) & ~(size_t)63;
+	db->count = kept;
+	db->range_end = (uint32_t *)aligned_alloc(64, bytes);
+	db->leaf = (geo_leaf_t *)malloc((kept + 1) * sizeof(geo_leaf_t));
+	if (db->range_end == NULL || db->leaf == NULL) {
+		perror("Geo Load: Malloc");
+		free(ranges);
+		geo_db_free(db);
+		return NULL;
+	}
+	eytzinger_fill(db, ranges, 0, 1);
+	free(ranges);
+	return db;
+}
+
+void
+geo_db_free(geo_db_t *db)
+{
+	if (db == NULL) {
+		return;
+	}
+	free(db->range_end);
+	free(db->leaf);
+	free(db);
+}
+
+/**
+ * @BRIEF IPv4 address -> location_id
+ * @PARAM ip : Exact address, first octet in the high byte
+ * @PARAM db : Table from geo_db_load
+ * @RETURN location_id, GEO_UNKNOWN when no range holds ip
+ *
+ * @DETAILS Branchless lower bound on the range ends: the descent always runs
+ *          log2(n) levels and prefetches GEO_PREFETCH levels ahead, then the
+ *          trailing right turns are undone to recover the answer node.
+ */
+uint8_t
+extract_location(uint32_t ip, const geo_db_t *db)
+{
+	const uint32_t *range_end = db->range_end;
+	size_t n = db->count;
+	size_t k = 1;
+
+	while (k <= n) {
+		__builtin_prefetch(range_end + (k << GEO_PREFETCH));
+		k = 2 * k + (range_end[k] < ip);
+	}
+	k >>= __builtin_ffsll(~(long long)k);
+
+	if (k == 0 || db->leaf[k].start > ip) {
+		return GEO_UNKNOWN;
+	}
+	return (uint8_t)db->leaf[k].country;
+}
+// END GEO LOOKUP ------------------------------------------------------------------------------
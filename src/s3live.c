@@ -0,0 +1,359 @@
+#include "../include/s3live.h"
+#include <fcntl.h>
+#include <math.h>
+#include <sched.h>
+#include <sys/mman.h>
+
+// LIVE WINDOW ---------------------------------------------------------------------------------
+// s3lp -L publishes what it has parsed to a POSIX shared memory segment: a ring of the most
+// recent slim records and an hour of per minute totals. The writer builds the totals in a
+// private copy and only copies the ring slots and minutes it changed, between the two
+// sequence bumps of a seqlock. Readers retry a copy that overlapped a publish, so a dashboard
+// refresh costs the parser nothing but the chance of a retry on the reader's side.
+
+// shm_open wants "/name", s3lp -L takes it with or without the slash
+static char *
+segment_name(const char *name)
+{
+	size_t length = strlen(name) + 2;
+	char *path = (char *)malloc(length);
+	if (path != NULL) {
+		snprintf(path, length, "%s%s", (*name == '/') ? "" : "/", name);
+	}
+	return path;
+}
+
+static size_t
+segment_length(uint32_t capacity)
+{
+	return sizeof(live_header_t) + (size_t)capacity * sizeof(s_log_t);
+}
+
+// Adds one record to the writer's private minute table
+static void
+live_count(live_t *live, const s_log_t *log)
+{
+	uint32_t minute = log->timestamp / 60;
+	if (minute > live->newest) {
+		live->newest = minute;
+	}
+	// The slot now belongs to a newer minute
+	if (minute + LIVE_MINUTES <= live->newest) {
+		live->late++;
+		return;
+	}
+	int index = minute % LIVE_MINUTES;
+	live_minute_t *slot = &live->minutes[index];
+	if (slot->minute != minute) {
+		memset(slot, 0, sizeof(*slot));
+		slot->minute = minute;
+	}
+	slot->requests++;
+	slot->downloads += (log->flags & UNIQUE_IP) ? 1 : 0;
+	slot->bytes_kb += log->bytes_sent_kb;
+
+	// HyperLogLog: top bits pick the register, the rest give the rank of the first set bit
+	uint64_t hash = hash64_mix(log->ip_hash ^ HASH64_SECRET[0], HASH64_SECRET[1]);
+	uint32_t reg = (uint32_t)(hash >> (64 - LIVE_SKETCH_BITS));
+	uint8_t rank = (uint8_t)(__builtin_clzll((hash << LIVE_SKETCH_BITS) | (1ull << (LIVE_SKETCH_BITS - 1))) + 1);
+	if (rank > slot->sketch[reg]) {
+		slot->sketch[reg] = rank;
+	}
+	live->dirty |= 1ull << index;
+}
+
+/**
+ * @BRIEF Creates the shared segment s3lp publishes to
+ * @PARAM live     : Writer to initialize
+ * @PARAM name     : Segment name, a leading '/' is added when missing
+ * @PARAM capacity : Records kept in the ring
+ * @RETURN 0 on success, 1 on failure
+ *
+ * @DETAILS A segment left by an earlier run is unlinked and replaced, readers still mapping
+ *          it keep the old copy until they attach again.
+ */
+int
+live_open(live_t *live, const char *name, uint32_t capacity)
+{
+	memset(live, 0, sizeof(*live));
+	live->name = segment_name(name);
+	if (live->name == NULL || capacity == 0) {
+		fprintf(stderr, "Live: bad segment %s\n", name);
+		free(live->name);
+		return 1;
+	}
+	shm_unlink(live->name);
+	int fd = shm_open(live->name, O_CREAT | O_EXCL | O_RDWR, 0644);
+	if (fd < 0) {
+		perror(live->name);
+		free(live->name);
+		return 1;
+	}
+	live->length = segment_length(capacity);
+	void *mapping = MAP_FAILED;
+	if (ftruncate(fd, (off_t)live->length) == 0) {
+		mapping = mmap(NULL, live->length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	}
+	close(fd);
+	if (mapping == MAP_FAILED) {
+		perror(live->name);
+		shm_unlink(live->name);
+		free(live->name);
+		return 1;
+	}
+
+	// ftruncate zeroed it, the magic goes last so a reader never attaches half set up
+	live->shared = (live_header_t *)mapping;
+	live->ring = (s_log_t *)(live->shared + 1);
+	live->shared->capacity = capacity;
+	live->shared->pid = (int32_t)getpid();
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	memcpy(live->shared->magic, LIVE_MAGIC, sizeof(live->shared->magic));
+	return 0;
+}
+
+/**
+ * @BRIEF Publishes parsed records to the ring and the minute table
+ * @PARAM live    : Writer
+ * @PARAM records : Records in parse order
+ * @PARAM count   : Number of records
+ *
+ * @DETAILS The minute totals are counted before the sequence goes odd, the odd window only
+ *          covers the copies of the new ring slots and the changed minutes.
+ */
+void
+live_publish(live_t *live, const s_log_t *records, size_t count)
+{
+	if (count == 0) {
+		return;
+	}
+	for (size_t i = 0; i < count; i++) {
+		live_count(live, &records[i]);
+	}
+
+	live_header_t *shared = live->shared;
+	uint32_t capacity = shared->capacity;
+	uint64_t sequence = shared->sequence;
+	__atomic_store_n(&shared->sequence, sequence + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	// Only the newest capacity records can survive this publish
+	size_t skip = (count > capacity) ? count - capacity : 0;
+	size_t left = count - skip;
+	size_t slot = (live->written + skip) % capacity;
+	const s_log_t *from = records + skip;
+	while (left > 0) {
+		size_t run = (left < capacity - slot) ? left : capacity - slot;
+		memcpy(&live->ring[slot], from, run * sizeof(s_log_t));
+		from += run;
+		left -= run;
+		slot = 0;
+	}
+	for (uint64_t dirty = live->dirty; dirty != 0; dirty &= dirty - 1) {
+		int index = __builtin_ctzll(dirty);
+		memcpy(&shared->minutes[index], &live->minutes[index], sizeof(live_minute_t));
+	}
+	live->dirty = 0;
+	live->written += count;
+	shared->written = live->written;
+	shared->late = live->late;
+	shared->newest = live->newest;
+	shared->published = (uint64_t)time(NULL);
+
+	__atomic_store_n(&shared->sequence, sequence + 2, __ATOMIC_RELEASE);
+	live->publishes++;
+}
+
+/**
+ * @BRIEF Unmaps the segment, which stays for readers until the next live_open of its name
+ * @PARAM live : Writer
+ */
+void
+live_close(live_t *live)
+{
+	if (live->shared != NULL) {
+		munmap(live->shared, live->length);
+	}
+	free(live->name);
+	memset(live, 0, sizeof(*live));
+}
+
+/**
+ * @BRIEF Maps a segment written by s3lp -L, read only
+ * @PARAM view : Reader mapping
+ * @PARAM name : Segment name, as given to s3lp -L
+ * @RETURN 0 on success, 1 on failure
+ */
+int
+live_attach(live_view_t *view, const char *name)
+{
+	memset(view, 0, sizeof(*view));
+	char *path = segment_name(name);
+	if (path == NULL) {
+		return 1;
+	}
+	int fd = shm_open(path, O_RDONLY, 0);
+	if (fd < 0) {
+		perror(path);
+		free(path);
+		return 1;
+	}
+	struct stat st;
+	void *mapping = MAP_FAILED;
+	if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(live_header_t)) {
+		mapping = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	}
+	close(fd);
+	if (mapping == MAP_FAILED) {
+		fprintf(stderr, "%s: not a live segment\n", path);
+		free(path);
+		return 1;
+	}
+
+	const live_header_t *shared = (const live_header_t *)mapping;
+	if (memcmp(shared->magic, LIVE_MAGIC, sizeof(shared->magic)) != 0 ||
+		segment_length(shared->capacity) > (size_t)st.st_size) {
+		fprintf(stderr, "%s: not a live segment\n", path);
+		munmap(mapping, (size_t)st.st_size);
+		free(path);
+		return 1;
+	}
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	free(path);
+	view->shared = shared;
+	view->ring = (const s_log_t *)(shared + 1);
+	view->length = (size_t)st.st_size;
+	return 0;
+}
+
+/**
+ * @BRIEF Consistent copy of the header and the newest records
+ * @PARAM view   : Reader mapping
+ * @PARAM header : Header and minute table out
+ * @PARAM recent : Room for *count records, oldest first, NULL when *count is 0
+ * @PARAM count  : Records wanted in, records copied out
+ * @RETURN 0 on success, -1 when every try overlapped a publish
+ */
+int
+live_snapshot(const live_view_t *view, live_header_t *header, s_log_t *recent, uint32_t *count)
+{
+	const live_header_t *shared = view->shared;
+	uint32_t wanted = *count;
+	for (int attempt = 0; attempt < LIVE_RETRIES; attempt++) {
+		uint64_t sequence = __atomic_load_n(&shared->sequence, __ATOMIC_ACQUIRE);
+		if (sequence & 1) {
+			sched_yield();
+			continue;
+		}
+		memcpy(header, shared, sizeof(*header));
+
+		uint32_t capacity = header->capacity;
+		uint64_t have = (header->written < capacity) ? header->written : capacity;
+		uint32_t copied = (wanted < have) ? wanted : (uint32_t)have;
+		size_t slot = (header->written - copied) % capacity;
+		for (uint32_t done = 0; done < copied;) {
+			uint32_t run = copied - done;
+			if (run > capacity - slot) {
+				run = (uint32_t)(capacity - slot);
+			}
+			memcpy(&recent[done], &view->ring[slot], run * sizeof(s_log_t));
+			done += run;
+			slot = 0;
+		}
+
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&shared->sequence, __ATOMIC_RELAXED) == sequence) {
+			*count = copied;
+			return 0;
+		}
+	}
+	*count = 0;
+	return -1;
+}
+
+/**
+ * @BRIEF Distinct values counted by a HyperLogLog sketch
+ * @PARAM sketch : LIVE_SKETCH registers
+ * @RETURN Estimate, linear counting while many registers are still empty
+ */
+double
+live_estimate(const uint8_t *sketch)
+{
+	double m = LIVE_SKETCH;
+	double sum = 0;
+	int zeros = 0;
+	for (int i = 0; i < LIVE_SKETCH; i++) {
+		sum += ldexp(1.0, -sketch[i]);
+		zeros += (sketch[i] == 0);
+	}
+	if (zeros == LIVE_SKETCH) {
+		return 0;
+	}
+	double estimate = 0.7213 / (1 + 1.079 / m) * m * m / sum;
+	if (estimate <= 2.5 * m && zeros > 0) {
+		estimate = m * log(m / zeros);
+	}
+	return estimate;
+}
+
+/**
+ * @BRIEF Totals of the last minutes of a snapshot
+ * @PARAM header  : Snapshot from live_snapshot
+ * @PARAM minutes : Minutes ending at the newest one, at most LIVE_MINUTES
+ * @PARAM window  : Totals out
+ *
+ * @DETAILS Minutes are record time, not wall clock: S3 delivers logs late, so "the last 15
+ *          minutes" are the 15 before the newest record parsed. Listeners merge the
+ *          sketches, a listener active in several of the minutes counts once.
+ */
+void
+live_window(const live_header_t *header, uint32_t minutes, live_window_t *window)
+{
+	memset(window, 0, sizeof(*window));
+	if (header->newest == 0) {
+		return;
+	}
+	minutes = (minutes == 0) ? 1 : (minutes > LIVE_MINUTES) ? LIVE_MINUTES : minutes;
+	window->last = header->newest;
+	window->first = (header->newest >= minutes) ? header->newest - minutes + 1 : 1;
+
+	uint8_t merged[LIVE_SKETCH];
+	memset(merged, 0, sizeof(merged));
+	for (uint32_t minute = window->first; minute <= window->last; minute++) {
+		const live_minute_t *slot = &header->minutes[minute % LIVE_MINUTES];
+		if (slot->minute != minute) {
+			continue; // no records that minute
+		}
+		window->requests += slot->requests;
+		window->downloads += slot->downloads;
+		window->bytes_kb += slot->bytes_kb;
+		for (int i = 0; i < LIVE_SKETCH; i++) {
+			merged[i] = (slot->sketch[i] > merged[i]) ? slot->sketch[i] : merged[i];
+		}
+	}
+	window->listeners = live_estimate(merged);
+}
+
+void
+live_detach(live_view_t *view)
+{
+	if (view->shared != NULL) {
+		munmap((void *)view->shared, view->length);
+	}
+	memset(view, 0, sizeof(*view));
+}
+
+void
+print_live_help(void)
+{
+	fprintf(stderr, "USAGE: ./s3_live -L <name> [-m minutes] [-r records] [-w seconds]\n"
+					"\t-L name    : --live, segment written by s3lp -L name\n"
+					"\t-m minutes : --minutes, window summed, default %d, at most %d\n"
+					"\t-r records : --recent, newest records printed, default 0\n"
+					"\t-w seconds : --watch, print again every N seconds until interrupted\n"
+					"\t-h display options\n"
+					"\nEXAMPLE: tail -F access.log | ./s3lp -L s3lp -o today.bin &\n"
+					"         ./s3_live -L s3lp -m 15 -w 5\n",
+			LIVE_WINDOW, LIVE_MINUTES);
+}
+// END LIVE WINDOW -----------------------------------------------------------------------------
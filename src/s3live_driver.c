@@ -0,0 +1,164 @@
+// S3 Log Live
+//
+//
+//
+#include "../include/s3live.h"
+#include <errno.h>
+#include <getopt.h>
+#include <signal.h>
+
+static const struct option LIVE_LONG_OPTIONS[] = {
+	{"live", required_argument, NULL, 'L'},
+	{"minutes", required_argument, NULL, 'm'},
+	{"recent", required_argument, NULL, 'r'},
+	{"watch", required_argument, NULL, 'w'},
+	{"help", no_argument, NULL, 'h'},
+	{NULL, 0, NULL, 0},
+};
+
+// Prints one snapshot as JSON, 0 on success
+static int
+print_snapshot(const char *name, uint32_t minutes, uint32_t recent_max, s_log_t *recent, FILE *output)
+{
+	live_view_t view;
+	live_header_t header;
+	uint32_t count = recent_max;
+	if (live_attach(&view, name) != 0) {
+		return 1;
+	}
+	int status = live_snapshot(&view, &header, recent, &count);
+	live_detach(&view);
+	if (status != 0) {
+		fprintf(stderr, "%s: writer kept publishing through %d tries\n", name, LIVE_RETRIES);
+		return 1;
+	}
+
+	live_window_t window;
+	live_window(&header, minutes, &window);
+	int running = (kill(header.pid, 0) == 0 || errno == EPERM);
+	fprintf(output, "{\n  \"writer\": %d,\n  \"running\": %s,\n  \"records\": %lu,\n  \"late\": %lu,\n", header.pid,
+			running ? "true" : "false", header.written, header.late);
+	fprintf(output, "  \"published\": %lu,\n  \"newest\": %lu,\n", header.published, (uint64_t)header.newest * 60);
+	fprintf(output,
+			"  \"window\": {\"from\": %lu, \"to\": %lu, \"requests\": %lu, \"downloads\": %lu, \"bytes_kb\": %lu, "
+			"\"listeners\": %.0f},\n",
+			(uint64_t)window.first * 60, (uint64_t)window.last * 60 + 59, window.requests, window.downloads,
+			window.bytes_kb, window.listeners);
+
+	// Newest minute first
+	fprintf(output, "  \"minutes\": [");
+	int first = 1;
+	for (uint32_t minute = window.last; window.last != 0 && minute >= window.first; minute--) {
+		const live_minute_t *slot = &header.minutes[minute % LIVE_MINUTES];
+		if (slot->minute != minute) {
+			continue;
+		}
+		fprintf(output, "%s\n    {\"minute\": %lu, \"requests\": %u, \"downloads\": %u, \"bytes_kb\": %lu, "
+						"\"listeners\": %.0f}",
+				first ? "" : ",", (uint64_t)minute * 60, slot->requests, slot->downloads, slot->bytes_kb,
+				live_estimate(slot->sketch));
+		first = 0;
+	}
+	fprintf(output, "%s]", first ? "" : "\n  ");
+
+	if (recent_max > 0) {
+		fprintf(output, ",\n  \"recent\": [");
+		for (uint32_t i = 0; i < count; i++) {
+			const s_log_t *log = &recent[count - 1 - i];
+			fprintf(output,
+					"%s\n    {\"timestamp\": %u, \"ip_hash\": \"%08x\", \"podcast_hash\": \"%08x\", \"key_hash\": "
+					"\"%08x\", \"bytes_sent_kb\": %u, \"http_code\": %u, \"system_id\": %u, \"flags\": %u}",
+					i == 0 ? "" : ",", log->timestamp, log->ip_hash, log->podcast_hash, log->key_hash,
+					log->bytes_sent_kb, log->http_code, log->system_id, log->flags);
+		}
+		fprintf(output, "%s]", count == 0 ? "" : "\n  ");
+	}
+	fprintf(output, "\n}\n");
+	fflush(output);
+	return 0;
+}
+
+/**
+ * S3 Log Live - Main Entry
+ *
+ * Reads the rolling window an s3lp -L run publishes and prints it as JSON, once or every -w seconds.
+ */
+
+int
+main(int argc, char *argv[])
+{
+	char *name = NULL;
+	uint32_t minutes = LIVE_WINDOW;
+	uint32_t recent_max = 0;
+	int watch = 0;
+
+	{
+		int opt = 0;
+		while ((opt = getopt_long(argc, argv, LIVE_OPTIONS, LIVE_LONG_OPTIONS, NULL)) != -1) {
+			switch (opt) {
+			// INPUT: -L <name>, --live
+			case 'L': {
+				name = optarg;
+				break;
+			}
+			// Minutes summed into the window, ending at the newest record
+			// INPUT: -m <minutes>, --minutes
+			case 'm': {
+				int value = atoi(optarg);
+				if (value <= 0 || value > LIVE_MINUTES) {
+					fprintf(stderr, "-m requires 1 to %d minutes\n", LIVE_MINUTES);
+					exit(EXIT_FAILURE);
+				}
+				minutes = (uint32_t)value;
+				break;
+			}
+			// Newest records printed
+			// INPUT: -r <records>, --recent
+			case 'r': {
+				int value = atoi(optarg);
+				if (value < 0 || value > LIVE_RECORDS) {
+					fprintf(stderr, "-r requires 0 to %d records\n", LIVE_RECORDS);
+					exit(EXIT_FAILURE);
+				}
+				recent_max = (uint32_t)value;
+				break;
+			}
+			// INPUT: -w <seconds>, --watch
+			case 'w': {
+				watch = atoi(optarg);
+				if (watch <= 0) {
+					fprintf(stderr, "-w requires a positive number of seconds\n");
+					exit(EXIT_FAILURE);
+				}
+				break;
+			}
+			case 'h':
+			default:
+				print_live_help();
+				exit(EXIT_FAILURE);
+			}
+		}
+	} // End getopt scope
+
+	if (name == NULL) {
+		print_live_help();
+		exit(EXIT_FAILURE);
+	}
+	s_log_t *recent = NULL;
+	if (recent_max > 0) {
+		recent = (s_log_t *)malloc(recent_max * sizeof(s_log_t));
+		if (recent == NULL) {
+			perror("Live: Malloc");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	// Attached again each time, a restarted s3lp replaces the segment
+	int err = print_snapshot(name, minutes, recent_max, recent, stdout);
+	while (watch > 0 && err == 0) {
+		sleep(watch);
+		err = print_snapshot(name, minutes, recent_max, recent, stdout);
+	}
+	free(recent);
+	exit(err ? EXIT_FAILURE : EXIT_SUCCESS);
+}
@@ -1,4 +1,13 @@
 #include "../include/s3lp.h"
+#include "../include/s3checkpoint.h"
+#include "../include/s3live.h"
+#include "../include/s3prefilter.h"
+#include "../include/s3redelivery.h"
+#include "../include/s3session.h"
+#include <errno.h>
+
+static const char *show_prefix(const char *key, size_t length, size_t *prefix_length);
+static void store_ip(p_log_t *full_logs, const char *field, size_t length);
 
 // LOG PROCESSING DRIVER -----------------------------------------------------------------------
 /**
@@ -13,350 +22,1106 @@
  *          Processes logs in two phases:
  *              Parsing -> Extraction -> Binary Compression
  *
+ *          Each line is parsed into a single reused p_log_t (spans over the line
+ *          buffer) and immediately extracted, only the 28 byte slim logs are batched.
+ *
  *          Outputs result in desired format.
  */
 
 int
 process_log(FILE *log, FILE *output, s_context_t *context)
 {
-	// Line-by-Line entry processing buffer
-	char log_entry[LOG_DEFAULT];
+	// Line reader, its buffer doubles as the parser's line arena
+	line_reader_t reader;
+	char *log_entry;
+	size_t length;
 
-	// MEMORY ALLOCATION: batch processing arrays
-	// Initialize batch_parsed_logs to hold BATCH SIZE addresses to p_log_t
-	p_log_t *batch_parsed_logs = (p_log_t *)calloc(BATCH_SIZE, sizeof(p_log_t));
-	if (batch_parsed_logs == NULL) {
-		perror("Process Log: Calloc - parsed logs");
-		return 1; // Early return due to calloc failure
+	// Parsed view of the current line, reused for every line
+	p_log_t parsed_log;
+
+	// Stage timers, each is a single branch when stats are disabled
+	s3_stats_t *perf = &context->perf;
+	uint64_t timer;
+
+	if (line_reader_init(&reader, log) != 0) {
+		perror("Line Reader: Malloc");
+		return 1; // Early return due to malloc failure
 	}
-	// Initialize slim logs to hold the same amount of addresses
+	// A live window is only worth keeping while lines trickle in, publish before every wait
+	reader.stream = (context->live != NULL);
+
+	// MEMORY ALLOCATION: batch processing array
 	s_log_t *batch_slim_logs = (s_log_t *)calloc(BATCH_SIZE, sizeof(s_log_t));
 	if (batch_slim_logs == NULL) {
 		perror("Process Log: Calloc");
-		free(batch_parsed_logs); // Cleanup
-		return 1;				 // Early return due to calloc failure
+		line_reader_free(&reader);
+		return 1; // Early return due to calloc failure
+	}
+
+	// Wide records keep the full 64 bit hashes, only allocated for -t w
+	int wide = (context->output_filetype_flag == WIDE_FILE);
+	s_log_wide_t *batch_wide_logs = NULL;
+	if (wide) {
+		batch_wide_logs = (s_log_wide_t *)calloc(BATCH_SIZE, sizeof(s_log_wide_t));
+		if (batch_wide_logs == NULL) {
+			perror("Process Log: Calloc");
+			free(batch_slim_logs);
+			line_reader_free(&reader);
+			return 1;
+		}
+	}
+
+	// CSV header once per output file, a resumed run appends to a file that already has it
+	if (context->output_filetype_flag == CSV_FILE && line_reader_offset(&reader) == 0) {
+		output_CSV_header(output);
 	}
 
 	// PROCESSING COUNTERS
-	int count = 0;			 // Current Batch size
-	int total_processed = 0; // Total Lines processed
+	int count = 0;				  // Current Batch size
+	uint64_t total_processed = 0; // Total Lines processed
+	int published = 0;			  // Records of the batch already in the live window
 
 	// MAIN PROCESSING LOGIC
-	// Read and Process the logfile line by line
-	while (fgets(log_entry, sizeof(log_entry), log)) {
+	// Read and Process the logfile line by line, lines of any length are kept whole
+	stats_batch_begin(perf);
+	for (;;) {
+		timer = stats_begin(perf);
+		log_entry = read_line(&reader, &length);
+		stats_end(perf, STAGE_READ, timer);
+		if (log_entry == NULL) {
+			if (reader.error) {
+				break; // lines read so far are still written, the run fails below
+			}
+			if (reader.drained) {
+				live_publish(context->live, &batch_slim_logs[published], count - published);
+				published = count;
+				continue;
+			}
+			break;
+		}
+
+		context->stats.lines++;
+		perf->lines++;
+		perf->bytes += length + 1;
+		if (length >= LOG_DEFAULT) {
+			context->stats.long_lines++;
+		}
 
 		// STAGE 1: Parse Raw Logs into structured format
-		parse_log_entry(log_entry, &batch_parsed_logs[count], context);
+		timer = stats_begin(perf);
+		int status = parse_log_entry(log_entry, &parsed_log, context);
+		stats_end(perf, STAGE_TOKENIZE, timer);
+		if (status == PARSE_FILTERED) {
+			context->stats.filtered++;
+			continue;
+		}
+		if (status != PARSE_OK) {
+			// Rejected lines never reach the slim logs
+			context->stats.malformed++;
+			context->stats.rejected[status]++;
+			quarantine_log(&parsed_log, status, context);
+			continue;
+		}
+
+		// Repeated deliveries go before anything counts them
+		if (context->redelivery != NULL) {
+			timer = stats_begin(perf);
+			int repeated = redelivery_seen(context->redelivery, &parsed_log);
+			stats_end(perf, STAGE_REDELIVERY, timer);
+			if (repeated) {
+				context->stats.duplicates++;
+				continue;
+			}
+		}
 
 		// STAGE 2: Extract relevant data
-		extract_log_entry(&batch_parsed_logs[count], &batch_slim_logs[count], context);
+		extract_log_entry(&parsed_log, &batch_slim_logs[count], context);
+		if (context->sessions != NULL) {
+			timer = stats_begin(perf);
+			session_track(context->sessions, &parsed_log, &batch_slim_logs[count]);
+			stats_end(perf, STAGE_SESSION, timer);
+		}
+		if (wide) {
+			widen_log_entry(&parsed_log, &batch_slim_logs[count], &batch_wide_logs[count]);
+		}
 		++count;
 
 		// BATCH PROCESSING: Process batch when we've reached BATCH_SIZE
 		if (count >= BATCH_SIZE) {
-			process_slim_logs(batch_slim_logs, count, output, context);
+			if (context->live != NULL) {
+				live_publish(context->live, &batch_slim_logs[published], count - published);
+				published = 0;
+			}
+			if (wide) {
+				process_wide_logs(batch_wide_logs, count, output, context);
+			}
+			else {
+				process_slim_logs(batch_slim_logs, count, output, context);
+			}
 			total_processed += count;
 			count = 0; // Reset Batch Counter
+
+			// Batch boundary: every line read so far is in the output
+			if (context->checkpoint != NULL) {
+				timer = stats_begin(perf);
+				checkpoint_batch(context->checkpoint, context, line_reader_offset(&reader), log, output);
+				stats_end(perf, STAGE_WRITE, timer);
+			}
+
+			perf->dedup_load = (double)context->ip_track.count / context->ip_track.capacity;
+			stats_batch_end(perf);
+			stats_batch_begin(perf);
 		}
 	}
 
 	// BATCH PROCESSING: Pre-Processing Sucessful -> Write to output
 	if (count > 0) {
-		process_slim_logs(batch_slim_logs, count, output, context);
+		if (context->live != NULL) {
+			live_publish(context->live, &batch_slim_logs[published], count - published);
+		}
+		if (wide) {
+			process_wide_logs(batch_wide_logs, count, output, context);
+		}
+		else {
+			process_slim_logs(batch_slim_logs, count, output, context);
+		}
 		total_processed += count;
+
+		perf->dedup_load = (double)context->ip_track.count / context->ip_track.capacity;
+		stats_batch_end(perf);
+	}
+
+	// Close the sessions still open at end of input
+	if (context->sessions != NULL) {
+		session_flush(context->sessions);
 	}
 
 	// Verbose Outpupt
 	if (context->verbose) {
-		fprintf(stderr, "%d Lines Processed", total_processed);
+		fprintf(stderr, "%lu Lines Processed, %lu malformed, %lu over %d bytes\n", total_processed,
+				context->stats.malformed, context->stats.long_lines, LOG_DEFAULT);
+		for (int i = PARSE_OK + 1; i < PARSE_STATUS_COUNT; i++) {
+			if (context->stats.rejected[i] > 0) {
+				fprintf(stderr, "\t%s: %lu\n", parse_status_name(i), context->stats.rejected[i]);
+			}
+		}
+		if (context->sessions != NULL) {
+			fprintf(stderr, "%lu GET requests stitched into %lu downloads (%lu closed early, %lu gaps merged)\n",
+					context->sessions->requests, context->sessions->downloads, context->sessions->forced,
+					context->sessions->merged);
+		}
+		fprintf(stderr, "%zu unique listeners tracked in %zu slots, %lu expired\n", context->ip_track.count,
+				context->ip_track.capacity, context->ip_track.expired);
+		if (context->prefilter != NULL) {
+			fprintf(stderr, "%lu lines skipped by the prefilter\n", context->stats.filtered);
+		}
+		if (context->redelivery != NULL) {
+			fprintf(stderr, "%lu repeated deliveries dropped, %lu filter hits not in the exact window kept (%u requests, %lu forgotten at the cap)\n",
+					context->stats.duplicates, context->redelivery->unconfirmed, context->redelivery->capacity,
+					context->redelivery->forgotten);
+		}
+		if (context->live != NULL) {
+			fprintf(stderr, "%lu records published to %s in %lu updates, %lu too old for the minute table\n",
+					context->live->written, context->live->name, context->live->publishes, context->live->late);
+		}
 	}
 
 	// Cleanup
-	free(batch_parsed_logs);
 	free(batch_slim_logs);
+	free(batch_wide_logs);
+	line_reader_free(&reader);
+	if (context->ip_track.grow_failed) {
+		fprintf(stderr, "Process Log: unique listener table could not grow, %zu pairs in %zu slots\n",
+				context->ip_track.count, context->ip_track.capacity);
+	}
+	if (reader.error) {
+		fprintf(stderr, "Process Log: input unreadable after %lu lines, output is incomplete: %s\n",
+				context->stats.lines, strerror(reader.error));
+		return 1;
+	}
 	return 0;
 }
 
-// PARSE LOG LINE -> FULL LOG STRUCT
-// ----------------------------------------------------------------------
 /**
- * @BRIEF S3 bucket Access log parser for each individual log
- * @PARAM in_log    : Input log entry string (Pointer to the SINGLE log entry)
- * @PARAM full_logs : Output structure used to carry extracted log information
- * @PARAM context   : Processing context containing configuration info and IP tracking
+ * @BRIEF Writes a rejected log line, as it was read, to the quarantine file
+ * @PARAM full_log : Parsed (possibly partial) log whose line should be kept
+ * @PARAM status   : PARSE_* code the line was rejected with
+ * @PARAM context  : Processing context holding the quarantine stream
  *
- * @DETAILS Parser for AWS S3 access log formatting.
- *          Handles each field using space-delimiters, quoted string handling,
- *          bracketed timestamps, and HTTP 206 range requests.
+ * @DETAILS Output is "<reason>\t<raw line>". The tokenizer only ever replaces
+ *          spaces with '\0' and stops at the first bad field, so the raw line is
+ *          restored by putting the spaces back up to where parsing stopped.
  */
 void
-parse_log_entry(char *in_log, p_log_t *full_logs, s_context_t *context)
+quarantine_log(p_log_t *full_log, int status, s_context_t *context)
 {
-	// STATE VARIABLES
-	char *source = in_log;
-	char *dest = full_logs->buffer;
-	char *field = full_logs->buffer;
-	int field_index = 0;
-	int in_quote = 0;
-	int in_bracket = 0;
-
-	// MAIN PARSING Logic: Process each space delimted field
-	// AWS S3 logs have 25 fields, +1 optional range field for HTTP 206
-	while (*source && field_index <= 26) {
-		// Quote Handler
-		if (*source == '"') {
-			in_quote = !in_quote;
-			*dest++ = *source++;
-			continue;
+	if (context->quarantine == NULL) {
+		return;
+	}
+	for (size_t i = 0; i < full_log->length; i++) {
+		if (full_log->line[i] == '\0') {
+			full_log->line[i] = ' ';
 		}
-		// Bracket Handler
-		if (*source == '[') {
-			in_bracket++;
-			*dest++ = *source++;
-			continue;
+	}
+	fprintf(context->quarantine, "%s\t%s\n", parse_status_name(status), full_log->line);
+}
+
+// Reason codes used in the quarantine file and verbose summary
+const char *
+parse_status_name(int status)
+{
+	switch (status) {
+	case PARSE_OK:
+		return "ok";
+	case PARSE_SHORT_LINE:
+		return "short_line";
+	case PARSE_BAD_STATUS:
+		return "bad_status";
+	case PARSE_TIME_FAIL:
+		return "bad_timestamp";
+	case PARSE_BAD_RANGE:
+		return "bad_range";
+	default:
+		return "unknown";
+	}
+}
+
+// LINE READER ----------------------------------------------------------------------------------
+/**
+ * @BRIEF Sets up a chunked line reader over an input stream
+ * @PARAM reader : Reader to initialize
+ * @PARAM input  : Stream the lines are read from
+ * @RETURN 0 on success, 1 on allocation failure
+ */
+int
+line_reader_init(line_reader_t *reader, FILE *input)
+{
+	reader->input = input;
+	reader->capacity = READ_CHUNK;
+	reader->start = 0;
+	reader->end = 0;
+	reader->eof = 0;
+	reader->stream = 0;
+	reader->drained = 0;
+	reader->error = 0;
+	// Resuming seeks the input first, pipes start at 0
+	off_t position = ftello(input);
+	reader->base = (position < 0) ? 0 : (uint64_t)position;
+	reader->buffer = (char *)malloc(reader->capacity);
+	if (reader->buffer == NULL) {
+		return 1;
+	}
+	return 0;
+}
+
+/**
+ * @BRIEF Returns the next line with its newline replaced by '\0'
+ * @PARAM reader : Line reader
+ * @PARAM length : Set to the line length, excluding the newline
+ * @RETURN pointer into the reader's buffer, valid until the next call. NULL at EOF,
+ *         in stream mode once before a refill that may block (reader->drained set),
+ *         or when the input cannot be read or a line cannot be buffered (reader->error
+ *         set to the errno value, nothing is printed)
+ *
+ * @DETAILS Lines are located with memchr over large fread chunks and returned in
+ *          place, the only copy is the memmove of a partial line to the front of
+ *          the buffer on refill. The buffer doubles when one line outgrows it.
+ *          A stream reader (tail -F | s3lp) hands out what read(2) returned instead
+ *          of waiting for a full chunk, and tells the caller before it waits.
+ */
+char *
+read_line(line_reader_t *reader, size_t *length)
+{
+	for (;;) {
+		char *line = reader->buffer + reader->start;
+		size_t avail = reader->end - reader->start;
+		char *newline = (char *)memchr(line, '\n', avail);
+
+		// Fast path: full line already buffered
+		if (newline != NULL) {
+			size_t len = newline - line;
+			*newline = '\0';
+			reader->start += len + 1;
+			if (len > 0 && line[len - 1] == '\r') {
+				line[--len] = '\0';
+			}
+			*length = len;
+			return line;
 		}
-		if (*source == ']') {
-			in_bracket--;
-			*dest++ = *source++;
-			continue;
+
+		// Last line without a trailing newline
+		if (reader->eof) {
+			if (avail == 0) {
+				return NULL;
+			}
+			// Compaction below always leaves room for the terminator
+			line[avail] = '\0';
+			reader->start = reader->end;
+			*length = avail;
+			return line;
 		}
 
+		// Stream: let the caller publish what it has before a read that may block
+		if (reader->stream && !reader->drained) {
+			reader->drained = 1;
+			return NULL;
+		}
+		reader->drained = 0;
+
+		// Move the partial line to the front, grow only if it fills the whole buffer
+		if (reader->start > 0) {
+			memmove(reader->buffer, line, avail);
+			reader->base += reader->start;
+			reader->start = 0;
+			reader->end = avail;
+		}
+		if (reader->end + 1 >= reader->capacity) {
+			size_t capacity = reader->capacity * 2;
+			char *buffer = (char *)realloc(reader->buffer, capacity);
+			if (buffer == NULL) {
+				reader->error = ENOMEM;
+				return NULL;
+			}
+			reader->buffer = buffer;
+			reader->capacity = capacity;
+		}
 
-		// Field Delimiter (Space separated when not in bracket or quote)
-		if (*source == ' ' && !in_quote && !in_bracket) {
-			*dest++ = '\0'; // Set Dest address that holds space to \0 and post-increment
+		// Refill, keeping one byte spare for the final terminator
+		size_t room = reader->capacity - reader->end - 1;
+		size_t got = 0;
+		if (reader->stream) {
+			ssize_t status;
+			do {
+				status = read(fileno(reader->input), reader->buffer + reader->end, room);
+			} while (status < 0 && errno == EINTR);
+			if (status < 0) {
+				reader->error = errno;
+				return NULL;
+			}
+			got = (size_t)status;
+		}
+		else {
+			errno = 0;
+			got = fread(reader->buffer + reader->end, 1, room, reader->input);
+			if (got == 0 && ferror(reader->input)) {
+				reader->error = (errno != 0) ? errno : EIO;
+				return NULL;
+			}
+		}
+		reader->end += got;
+		if (got == 0) {
+			reader->eof = 1;
+		}
+	}
+}
 
-			// Field Handler: Assign parsed field to struct member
-			switch (field_index) {
+void
+line_reader_free(line_reader_t *reader)
+{
+	free(reader->buffer);
+	reader->buffer = NULL;
+}
+// END LINE READER ------------------------------------------------------------------------------
 
-			// FIELD 0: Bucket Owner
-			// ex: 79a59df900b949e55d96a1e698fbacedfd6e09d98eacf8f8d5218e7cd47ef2be
-			case 0:
-				full_logs->bucket_owner = field;
-				break;
+// PARSE LOG LINE -> FULL LOG STRUCT
+// ----------------------------------------------------------------------
+/**
+ * @BRIEF Assigns one delimited field to its p_log_t member
+ * @PARAM full_logs   : Parsed log receiving the field
+ * @PARAM field_index : Position of the field in the S3 log format
+ * @PARAM span        : Offset and length of the field inside full_logs->line
+ * @PARAM perf        : Stage timers
+ * @RETURN PARSE_OK, or the PARSE_* code of the failed validation
+ */
+static int
+store_field(p_log_t *full_logs, int field_index, span_t span, s3_stats_t *perf)
+{
+	char *field = full_logs->line + span.off;
+
+	switch (field_index) {
+
+	// FIELD 0: Bucket Owner
+	// ex: 79a59df900b949e55d96a1e698fbacedfd6e09d98eacf8f8d5218e7cd47ef2be
+	case 0:
+		full_logs->bucket_owner = span;
+		break;
+
+	// FIELD 1: Bucket Name
+	// amzn-s3-demo-bucket1
+	case 1:
+		full_logs->bucket_name = span;
+		break;
+
+	// FIELD 2: Time
+	// ex: [06/Feb/2019:00:00:38 +0000]
+	case 2: {
+		uint64_t timer = stats_begin(perf);
+		int bad_time = parse_timestamp(field, span.len, &full_logs->timestamp);
+		stats_end(perf, STAGE_TIMESTAMP, timer);
+		if (bad_time != 0) {
+			return PARSE_TIME_FAIL;
+		}
+	} break;
+
+	// FIELD 3: Remote IP
+	// ex: 192.0.2.3
+	case 3:
+		full_logs->remote_ip = span;
+		store_ip(full_logs, field, span.len);
+		break;
+
+	// FIELD 4: Requester ID
+	// ex: 79a59df900b949e55d96a1e698fbacedfd6e09d98eacf8f8d5218e7cd47ef2be
+	// ex: arn:aws:sts::123456789012:assumed-role/roleName/test-role
+	case 4:
+		full_logs->requester_id = span;
+		break;
+
+	// FIELD 5: Request ID
+	// ex: 3E57427F33A59F07
+	case 5:
+		full_logs->request_id = span;
+		break;
+
+	// FIELD 6: Operation
+	// ex: REST.PUT.OBJECT
+	//     REST.GET.OBJECT
+	case 6:
+		full_logs->operation = span;
+		break;
+
+	// FIELD 7: Key
+	// ex: /photos/2019/08/puppy.jpg
+	// Hashed while the field is still in L1, extract_log_entry never walks the key again
+	case 7: {
+		size_t prefix_length;
+		const char *prefix = show_prefix(field, span.len, &prefix_length);
+		full_logs->key = span;
+		full_logs->key_hash64 = hash64(field, span.len);
+		full_logs->podcast_hash64 = hash64(prefix, prefix_length);
+	} break;
+
+	// FIELD 8: Request URI
+	// ex: "GET /amzn-s3-demo-bucket1/photos/2019/08/puppy.jpg?x-foo=bar HTTP/1.1"
+	case 8:
+		full_logs->request_uri = span;
+		break;
+
+	// FIELD 9: HTTP Status
+	// ex: 200, 404, 403, 500
+	case 9: {
+		int temp = fast_atoi(field);
+		if (span.len != 3 || temp > 599 || temp < 200) { // Should be in appropriate form
+			return PARSE_BAD_STATUS;
+		}
+		full_logs->http_code = temp;
+		break;
+	}
 
-			// FIELD 1: Bucket Name
-			// amzn-s3-demo-bucket1
-			case 1:
-				full_logs->bucket_name = field;
-				break;
+	// Field 10: S3 Error Codes
+	// ex: NoSuchBucket, AccessDenied, InternalError
+	case 10:
+		full_logs->err_code = span;
+		break;
+
+	// FIELD 11: Bytes Sent (response size)
+	// ex: 2662992
+	case 11:
+		full_logs->bytes_sent = fast_atol(field);
+		break;
+
+	// FIELD 12: Object Size (total object size)
+	// ex: 3462992
+	case 12:
+		full_logs->object_size = fast_atol(field);
+		break;
+
+	// FIELD 13: Total Time - Number of Miliseconds
+	// ex: 70
+	case 13:
+		full_logs->ms_ttime = fast_atol(field);
+		break;
+
+	// FIELD 14: Turn Around Time - Number of Miliseconds
+	// ex: 10
+	case 14:
+		full_logs->ms_tatime = fast_atoi(field);
+		break;
+
+	// FIELD 15: HTTP Referer header
+	// ex: "http://www.example.com/webservices"
+	case 15:
+		full_logs->referer = span;
+		break;
+
+	// FIELD 16: User Agent
+	// ex: "curl/7.15.1"
+	case 16:
+		full_logs->user_agent = span;
+		break;
+
+	// FIELD 17: Version ID
+	// ex: 3HL4kqtJvjVBH40Nrjfkd
+	case 17:
+		full_logs->ver_id = span;
+		break;
+
+	// FIELD 18: Host ID
+	// ex: s9lzHYrFp76ZVxRcpX9+5cjAnEH2ROuNkd2BHfIa6UkFVdtjf5mKR3/eTPFvsiP/XV/VLi31234=
+	case 18:
+		full_logs->host_id = span;
+		break;
+
+	// FIELD 19: Authentication Signature
+	// ex: SigV2
+	case 19:
+		full_logs->auth_sig = span;
+		break;
+
+	// FIELD 20: Cipher Suite
+	// ex: ECDHE-RSA-AES128-GCM-SHA256
+	case 20:
+		full_logs->cipher_suite = span;
+		break;
+
+	// FIELD 21: Authentication Type
+	// ex: AuthHeader
+	case 21:
+		full_logs->auth_type = span;
+		break;
+
+	// FIELD 22: Host Header
+	// ex: s3.us-west-2.amazonaws.com
+	case 22:
+		full_logs->host_header = span;
+		break;
+
+	// FIELD 23: TLS Version
+	// ex: TLSv1.2
+	case 23:
+		full_logs->TLS_ver = span;
+		break;
+	// FIELD 24: ARN Access Point
+	// ex: arn:aws:s3:us-east-1:123456789012:accesspoint/example-AP
+	case 24:
+		full_logs->ARN_ap = span;
+		break;
+
+	// FIELD 25: ACL Required Flag
+	case 25:
+		full_logs->acl_required = span;
+		break;
+
+	// HTTP 206: Range handler
+	// FIELD 26: Range Specification for partial downloads
+	// https://docs.aws.amazon.com/AmazonCloudFront/latest/DeveloperGuide/RangeGETs.html
+	case 26:
+		if (full_logs->http_code == 206) {
+			full_logs->range_get = span;
+			if (parse_range(field, span.len, &full_logs->byte_start, &full_logs->byte_end) != 0) {
+				return PARSE_BAD_RANGE;
+			}
+			// Open ended range: bytes=start-
+			if (full_logs->byte_end == SIZE_MAX && full_logs->object_size > 0) {
+				full_logs->byte_end = full_logs->object_size - 1;
+			}
+			if (full_logs->object_size > 0 && full_logs->byte_end >= full_logs->object_size) {
+				return PARSE_BAD_RANGE;
+			}
+		}
+		break;
 
-			// FIELD 2: Time
-			// ex: [06/Feb/2019:00:00:38 +0000]
-			case 2: {
-				// Timestamp parsing buffers
-				char *strip_time;
-				char time_buffer[32]; // allocate time buffer
-				struct tm temp_time = {0};
-				size_t i = 0;
-
-				// Timestamp extraction
-				const char *start = field + 1;
-				while (*start && *start != ']' && i < sizeof(time_buffer) - 1) {
-					time_buffer[i++] = *start++;
-				}
-				time_buffer[i] = '\0';
+	default: // parse_log_entry only stores the fields above
+		break;
+	}
+	return PARSE_OK;
+}
 
-				// strptime: "01/Jan/1970:00:00:00 +0000"
-				strip_time = strptime(time_buffer, "%d/%b/%Y:%H:%M:%S %z", &temp_time);
-				if (strip_time != NULL) {
-					full_logs->time = temp_time;
-				}
-				else {
-					// set time struct to 0, error
-					memset(&full_logs->time, 0, sizeof(full_logs->time));
-					if (context->verbose) {
-						fprintf(stderr, "Failed to set time for: %d\n", field_index);
-					}
-				}
-			} break;
+// Month lookup for the access log timestamp, returns 1-12 or 0
+static int
+parse_month(const char *mon)
+{
+	switch (mon[0]) {
+	case 'J':
+		if (mon[1] == 'a' && mon[2] == 'n')
+			return 1;
+		if (mon[1] == 'u' && mon[2] == 'n')
+			return 6;
+		if (mon[1] == 'u' && mon[2] == 'l')
+			return 7;
+		return 0;
+	case 'F':
+		return (mon[1] == 'e' && mon[2] == 'b') ? 2 : 0;
+	case 'M':
+		if (mon[1] == 'a' && mon[2] == 'r')
+			return 3;
+		if (mon[1] == 'a' && mon[2] == 'y')
+			return 5;
+		return 0;
+	case 'A':
+		if (mon[1] == 'p' && mon[2] == 'r')
+			return 4;
+		if (mon[1] == 'u' && mon[2] == 'g')
+			return 8;
+		return 0;
+	case 'S':
+		return (mon[1] == 'e' && mon[2] == 'p') ? 9 : 0;
+	case 'O':
+		return (mon[1] == 'c' && mon[2] == 't') ? 10 : 0;
+	case 'N':
+		return (mon[1] == 'o' && mon[2] == 'v') ? 11 : 0;
+	case 'D':
+		return (mon[1] == 'e' && mon[2] == 'c') ? 12 : 0;
+	default:
+		return 0;
+	}
+}
 
-			// FIELD 3: Remote IP
-			// ex: 192.0.2.3
-			case 3:
-				full_logs->remote_ip = field;
-				break;
+// Reads exactly n digits, -1 if any char is not a digit
+static inline int
+fixed_digits(const char *str, int n)
+{
+	int val = 0;
+	for (int i = 0; i < n; i++) {
+		if (str[i] < '0' || str[i] > '9') {
+			return -1;
+		}
+		val = val * 10 + (str[i] - '0');
+	}
+	return val;
+}
 
-			// FIELD 4: Requester ID
-			// ex: 79a59df900b949e55d96a1e698fbacedfd6e09d98eacf8f8d5218e7cd47ef2be
-			// ex: arn:aws:sts::123456789012:assumed-role/roleName/test-role
-			case 4:
-				full_logs->requester_id = field;
-				break;
+/**
+ * @BRIEF Fixed format access log timestamp -> unix time
+ * @PARAM field     : Timestamp field, ex: [06/Feb/2019:00:00:38 +0000]
+ * @PARAM length    : Field length
+ * @PARAM timestamp : Set to seconds since epoch (UTC)
+ * @RETURN 0 on success, -1 when any component is malformed or out of range
+ *
+ * @DETAILS Replaces strptime + mktime: validates every component and converts
+ *          with days-from-civil arithmetic, honouring the +zzzz offset instead
+ *          of the host's local timezone.
+ */
+int
+parse_timestamp(const char *field, size_t length, time_t *timestamp)
+{
+	// [dd/Mon/yyyy:HH:MM:SS +zzzz]
+	// 0123456789012345678901234567
+	if (length != 28 || field[0] != '[' || field[3] != '/' || field[7] != '/' || field[12] != ':' ||
+		field[15] != ':' || field[18] != ':' || field[21] != ' ' || field[27] != ']') {
+		return -1;
+	}
+	static const uint8_t days_in_month[13] = {0, 31, 29, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31};
+
+	int day = fixed_digits(field + 1, 2);
+	int month = parse_month(field + 4);
+	int year = fixed_digits(field + 8, 4);
+	int hour = fixed_digits(field + 13, 2);
+	int min = fixed_digits(field + 16, 2);
+	int sec = fixed_digits(field + 19, 2);
+	int tz_hour = fixed_digits(field + 23, 2);
+	int tz_min = fixed_digits(field + 25, 2);
+	char sign = field[22];
+
+	int leap = (year % 4 == 0 && year % 100 != 0) || year % 400 == 0;
+	if (month == 0 || year < 1970 || day < 1 || day > days_in_month[month] || (month == 2 && day == 29 && !leap) ||
+		hour < 0 || hour > 23 || min < 0 || min > 59 || sec < 0 || sec > 60 || tz_hour < 0 || tz_hour > 14 ||
+		tz_min < 0 || tz_min > 59 || (sign != '+' && sign != '-')) {
+		return -1;
+	}
 
-			// FIELD 5: Request ID
-			// ex: 3E57427F33A59F07
-			case 5:
-				full_logs->request_id = field;
-				break;
+	// days_from_civil (Howard Hinnant), March based year
+	int y = year - (month <= 2);
+	int era = y / 400;
+	int yoe = y - era * 400;
+	int doy = (153 * (month + (month > 2 ? -3 : 9)) + 2) / 5 + day - 1;
+	int doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+	int64_t days = (int64_t)era * 146097 + doe - 719468;
 
-			// FIELD 6: Operation
-			// ex: REST.PUT.OBJECT
-			//     REST.GET.OBJECT
-			case 6:
-				full_logs->operation = field;
-				break;
+	int64_t offset = (tz_hour * 3600 + tz_min * 60) * (sign == '-' ? -1 : 1);
+	*timestamp = (time_t)(days * SECONDS_IN_DAY + hour * 3600 + min * 60 + sec - offset);
+	return 0;
+}
 
-			// FIELD 7: Key
-			// ex: /photos/2019/08/puppy.jpg
-			case 7:
-				full_logs->key = field;
-				break;
+/**
+ * @BRIEF Range header -> first and last byte
+ * @PARAM field      : Range field, ex: "bytes=0-1023" (quotes optional)
+ * @PARAM length     : Field length
+ * @PARAM byte_start : Set to the first byte
+ * @PARAM byte_end   : Set to the last byte, SIZE_MAX for an open range (bytes=N-)
+ * @RETURN 0 on success, -1 when malformed
+ *
+ * @DETAILS A "-" placeholder means no range was logged, leaves both at 0
+ */
+int
+parse_range(const char *field, size_t length, size_t *byte_start, size_t *byte_end)
+{
+	const char *end = field + length;
 
-			// FIELD 8: Request URI
-			// ex: "GET /amzn-s3-demo-bucket1/photos/2019/08/puppy.jpg?x-foo=bar HTTP/1.1"
-			case 8:
-				full_logs->request_uri = field;
-				break;
+	if (length > 0 && *field == '"') {
+		if (length < 2 || end[-1] != '"') {
+			return -1;
+		}
+		field++;
+		end--;
+	}
+	if (end - field == 1 && *field == '-') {
+		return 0;
+	}
+	if (end - field < 8 || memcmp(field, "bytes=", 6) != 0) {
+		return -1;
+	}
+	field += 6;
 
-			// FIELD 9: HTTP Status
-			// ex: 200, 404, 403, 500
-			case 9: {
-				int temp = fast_atoi(field);
-				if (temp > 599 || temp < 200) { // Should be in appropriate form
-					full_logs->http_code = 0;
-				}
-				else {
-					full_logs->http_code = fast_atoi(field);
-				}
-				break;
-			}
+	// start digits
+	const char *digits = field;
+	size_t start = 0;
+	while (field < end && *field >= '0' && *field <= '9') {
+		start = start * 10 + (*field++ - '0');
+	}
+	if (field == digits || field == end || *field != '-') {
+		return -1;
+	}
+	field++;
 
-			// Field 10: S3 Error Codes
-			// ex: NoSuchBucket, AccessDenied, InternalError
-			case 10:
-				full_logs->err_code = field;
-				break;
+	// end digits, may be empty for an open range
+	digits = field;
+	size_t last = 0;
+	while (field < end && *field >= '0' && *field <= '9') {
+		last = last * 10 + (*field++ - '0');
+	}
+	if (field != end) {
+		return -1;
+	}
+	if (field == digits) {
+		last = SIZE_MAX;
+	}
+	if (last < start) {
+		return -1;
+	}
 
-			// FIELD 11: Bytes Sent (response size)
-			// ex: 2662992
-			case 11:
-				full_logs->bytes_sent = fast_atol(field);
-				break;
+	*byte_start = start;
+	*byte_end = last;
+	return 0;
+}
 
-			// FIELD 12: Object Size (total object size)
-			// ex: 3462992
-			case 12:
-				full_logs->object_size = fast_atol(field);
-				break;
+// SWAR helpers: 8 byte lanes, flags are the high bit of each lane
+#define SWAR_ONES 0x0101010101010101ull
+#define SWAR_HIGH 0x8080808080808080ull
 
-			// FIELD 13: Total Time - Number of Miliseconds
-			// ex: 70
-			case 13:
-				full_logs->ms_ttime = fast_atol(field);
-				break;
+// High bit set in exactly the lanes equal to c (no carries between lanes)
+static inline uint64_t
+swar_equal(uint64_t word, char c)
+{
+	uint64_t x = word ^ (SWAR_ONES * (uint8_t)c);
+	return ~(((x & ~SWAR_HIGH) + ~SWAR_HIGH) | x) & SWAR_HIGH;
+}
 
-			// FIELD 14: Turn Around Time - Number of Miliseconds
-			// ex: 10
-			case 14:
-				full_logs->ms_tatime = fast_atoi(field);
-				break;
+// Lane flags -> 8 bit mask, bit i for lane i
+static inline unsigned
+swar_movemask(uint64_t flags)
+{
+	return (unsigned)(((flags >> 7) * 0x0102040810204080ull) >> 56);
+}
 
-			// FIELD 15: HTTP Referer header
-			// ex: "http://www.example.com/webservices"
-			case 15:
-				full_logs->referer = field;
-				break;
+// Digits of one dotted quad octet, -1 above 255
+static inline int
+ipv4_octet(const uint8_t *digits, size_t n)
+{
+	int val = digits[0] - '0';
+	if (n > 1) {
+		val = val * 10 + (digits[1] - '0');
+	}
+	if (n > 2) {
+		val = val * 10 + (digits[2] - '0');
+	}
+	return (val > 255) ? -1 : val;
+}
 
-			// FIELD 16: User Agent
-			// ex: "curl/7.15.1"
-			case 16:
-				full_logs->user_agent = field;
-				break;
+/**
+ * @BRIEF Dotted quad -> exact 32 bit address
+ * @PARAM field  : Address text, ex: 192.0.2.3
+ * @PARAM length : Field length
+ * @PARAM ip     : Set to the address, first octet in the high byte
+ * @RETURN 0 on success, -1 when not a valid IPv4 address
+ *
+ * @DETAILS SWAR: the field is loaded as two 8 byte words, all 16 lanes are
+ *          checked for digits and the dots found with a single compare each,
+ *          leaving only the three dot positions and four octet folds scalar.
+ */
+int
+parse_ipv4(const char *field, size_t length, uint32_t *ip)
+{
+	if (length < 7 || length > 15) {
+		return -1;
+	}
+	// Pad with '0' so the unused lanes pass the digit check
+	uint8_t buffer[16];
+	memset(buffer, '0', sizeof(buffer));
+	memcpy(buffer, field, length);
+
+	uint64_t words[2];
+	memcpy(words, buffer, sizeof(words));
+	unsigned dot_mask = 0;
+	for (int i = 0; i < 2; i++) {
+		uint64_t dots = swar_equal(words[i], '.');
+		uint64_t fill = (dots >> 7) * 0xff;
+		uint64_t digits = (words[i] & ~fill) | (0x3030303030303030ull & fill);
+
+		// Any lane outside '0'-'9' sets its high bit in one of the three terms
+		if (((digits + 0x4646464646464646ull) | (digits - 0x3030303030303030ull) | digits) & SWAR_HIGH) {
+			return -1;
+		}
+		dot_mask |= swar_movemask(dots) << (8 * i);
+	}
+	if (__builtin_popcount(dot_mask) != 3) {
+		return -1;
+	}
 
-			// FIELD 17: Version ID
-			// ex: 3HL4kqtJvjVBH40Nrjfkd
-			case 17:
-				full_logs->ver_id = field;
-				break;
+	size_t start = 0;
+	uint32_t addr = 0;
+	for (int octet = 0; octet < 4; octet++) {
+		size_t end = (octet < 3) ? (size_t)__builtin_ctz(dot_mask) : length;
+		dot_mask &= dot_mask - 1;
+		size_t n = end - start;
+		if (n < 1 || n > 3) {
+			return -1;
+		}
+		int val = ipv4_octet(buffer + start, n);
+		if (val < 0) {
+			return -1;
+		}
+		addr = (addr << 8) | (uint32_t)val;
+		start = end + 1;
+	}
+	*ip = addr;
+	return 0;
+}
 
-			// FIELD 18: Host ID
-			// ex: s9lzHYrFp76ZVxRcpX9+5cjAnEH2ROuNkd2BHfIa6UkFVdtjf5mKR3/eTPFvsiP/XV/VLi31234=
-			case 18:
-				full_logs->host_id = field;
-				break;
+static inline int
+hex_digit(char c)
+{
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	if (c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+	if (c >= 'A' && c <= 'F')
+		return c - 'A' + 10;
+	return -1;
+}
 
-			// FIELD 19: Authentication Signature
-			// ex: SigV2
-			case 19:
-				full_logs->auth_sig = field;
-				break;
+/**
+ * @BRIEF IPv6 text -> eight 16 bit groups
+ * @PARAM field  : Address text, ex: 2001:db8::1 or ::ffff:192.0.2.3
+ * @PARAM length : Field length
+ * @PARAM groups : Set to the groups, most significant first
+ * @RETURN 0 on success, -1 when not a valid IPv6 address
+ *
+ * @DETAILS Handles one "::" run of zero groups and a dotted quad in the last 32 bits.
+ */
+int
+parse_ipv6(const char *field, size_t length, uint16_t groups[8])
+{
+	uint16_t parsed[8];
+	int count = 0;
+	int gap = -1; // index in parsed where the "::" run goes
+	const char *pos = field;
+	const char *end = field + length;
+
+	if (length < 2) {
+		return -1;
+	}
+	if (pos[0] == ':') {
+		if (pos[1] != ':') {
+			return -1;
+		}
+		gap = 0;
+		pos += 2;
+	}
+	while (pos < end) {
+		// Dotted quad tail
+		const char *next = pos;
+		int val = 0;
+		while (next < end && next - pos < 5 && hex_digit(*next) >= 0) {
+			val = (val << 4) | hex_digit(*next++);
+		}
+		if (next < end && *next == '.') {
+			uint32_t ip;
+			if (count > 6 || parse_ipv4(pos, end - pos, &ip) != 0) {
+				return -1;
+			}
+			parsed[count++] = (uint16_t)(ip >> 16);
+			parsed[count++] = (uint16_t)ip;
+			break;
+		}
+		if (next == pos || next - pos > 4 || count == 8) {
+			return -1;
+		}
+		parsed[count++] = (uint16_t)val;
+		pos = next;
+		if (pos == end) {
+			break;
+		}
+		if (*pos++ != ':' || pos == end) {
+			return -1;
+		}
+		if (*pos == ':') {
+			if (gap >= 0) {
+				return -1;
+			}
+			gap = count;
+			pos++;
+		}
+	}
+	if ((gap < 0 && count != 8) || (gap >= 0 && count > 7)) {
+		return -1;
+	}
 
-			// FIELD 20: Cipher Suite
-			// ex: ECDHE-RSA-AES128-GCM-SHA256
-			case 20:
-				full_logs->cipher_suite = field;
-				break;
+	// Expand the "::" run
+	int zeros = 8 - count;
+	for (int i = 0, j = 0; i < 8; i++) {
+		if (gap >= 0 && i >= gap && i < gap + zeros) {
+			groups[i] = 0;
+		}
+		else {
+			groups[i] = parsed[j++];
+		}
+	}
+	return 0;
+}
 
-			// FIELD 21: Authentication Type
-			// ex: AuthHeader
-			case 21:
-				full_logs->auth_type = field;
-				break;
+/**
+ * @BRIEF Remote IP field -> p_log_t::ip_addr
+ * @PARAM full_logs : Parsed log receiving the address
+ * @PARAM field     : Remote IP text
+ * @PARAM length    : Field length
+ *
+ * @DETAILS IPv4 (and IPv4 mapped IPv6) is stored exactly. IPv6 keeps its /64
+ *          prefix, which identifies the listener's network. Anything else is
+ *          hashed. Both of the latter set ip_hashed.
+ */
+static void
+store_ip(p_log_t *full_logs, const char *field, size_t length)
+{
+	uint32_t ip;
+	uint16_t groups[8];
 
-			// FIELD 22: Host Header
-			// ex: s3.us-west-2.amazonaws.com
-			case 22:
-				full_logs->host_header = field;
-				break;
+	full_logs->ip_hashed = 0;
+	if (parse_ipv4(field, length, &ip) == 0) {
+		full_logs->ip_addr = ip;
+		return;
+	}
+	full_logs->ip_hashed = 1;
+	if (memchr(field, ':', length) != NULL && parse_ipv6(field, length, groups) == 0) {
+		// ::ffff:a.b.c.d
+		if (groups[0] == 0 && groups[1] == 0 && groups[2] == 0 && groups[3] == 0 && groups[4] == 0 &&
+			groups[5] == 0xffff) {
+			full_logs->ip_addr = ((uint32_t)groups[6] << 16) | groups[7];
+			full_logs->ip_hashed = 0;
+			return;
+		}
+		full_logs->ip_addr = ((uint64_t)groups[0] << 48) | ((uint64_t)groups[1] << 32) |
+							 ((uint64_t)groups[2] << 16) | groups[3];
+		return;
+	}
+	full_logs->ip_addr = hash64(field, length);
+}
 
-			// FIELD 23: TLS Version
-			// ex: TLSv1.2
-			case 23:
-				full_logs->TLS_ver = field;
-				break;
-			// FIELD 24: ARN Access Point
-			// ex: arn:aws:s3:us-east-1:123456789012:accesspoint/example-AP
-			case 24:
-				full_logs->ARN_ap = field;
-				break;
+/**
+ * @BRIEF S3 bucket Access log parser for each individual log
+ * @PARAM in_log    : Input log entry string (Pointer to the SINGLE log entry)
+ * @PARAM full_logs : Output structure used to carry extracted log information
+ * @PARAM context   : Processing context containing configuration info and IP tracking
+ * @RETURN PARSE_OK, the PARSE_* code of the first field that failed validation, or
+ *         PARSE_FILTERED as soon as a field fails context->prefilter
+ *
+ * @DETAILS Parser for AWS S3 access log formatting.
+ *          Handles each field using space-delimiters, quoted string handling,
+ *          bracketed timestamps, and HTTP 206 range requests.
+ *
+ *          Tokenizes in_log in place: delimiters are overwritten with '\0' and
+ *          each field is recorded as a span, so in_log must outlive full_logs.
+ *          Parsing stops at the first invalid field.
+ */
+int
+parse_log_entry(char *in_log, p_log_t *full_logs, s_context_t *context)
+{
+	// STATE VARIABLES
+	uint32_t pos = 0;	// Current char in the line
+	uint32_t field = 0; // Start of the current field
+	int field_index = 0;
+	int in_quote = 0;
+	int in_bracket = 0;
+	int status = PARSE_OK;
+	const prefilter_t *prefilter = context->prefilter;
 
-			// FIELD 25: ACL Required Flag
-			case 25:
-				full_logs->acl_required = field;
-				break;
+	// Reset spans left over from the previous line that used this struct
+	memset(full_logs, 0, sizeof(*full_logs));
+	full_logs->line = in_log;
 
-			default:
-				fprintf(stderr, "Error, outside the acceptable bounds of this intake function");
-			}
-			field_index++; // When field is set we need to increment
-			source++;	   // Increment source separately
+	// MAIN PARSING Logic: Process each space delimted field
+	// AWS S3 logs have 25 fields, +1 optional range field for HTTP 206
+	while (in_log[pos] && field_index <= 26) {
+		char c = in_log[pos];
 
-			// Set field to dest current address (start of next log field)
-			field = dest;
+		// Quote Handler
+		if (c == '"') {
+			in_quote = !in_quote;
+			pos++;
 			continue;
 		}
-		// HTTP 206: Range handler
-		// FIELD 26: Range Specification for partial downloads
-		// https://docs.aws.amazon.com/AmazonCloudFront/latest/DeveloperGuide/RangeGETs.html
-		if (*source == ' ' && field_index == 26 && full_logs->http_code == 206 && !in_quote) {
-			full_logs->range_get = field;
-			sscanf(full_logs->range_get, "\"bytes%lu-%lu\"", &full_logs->byte_start, &full_logs->byte_end);
-
-			field_index++;
-			source++;
-			field = dest;
+		// Bracket Handler
+		if (c == '[') {
+			in_bracket++;
+			pos++;
+			continue;
+		}
+		if (c == ']') {
+			in_bracket--;
+			pos++;
 			continue;
 		}
 
-		// Exit Condition
-		if (field_index > 26) {
-			break;
+		// Field Delimiter (Space separated when not in bracket or quote, newline ends the log)
+		if ((c == ' ' || c == '\n') && !in_quote && !in_bracket) {
+			in_log[pos] = '\0';
+			// Prefiltered out before the field is parsed or hashed, later fields are never read
+			if (prefilter != NULL && field_index <= prefilter->last_field &&
+				prefilter_field(prefilter, field_index, in_log + field, pos - field)) {
+				status = PARSE_FILTERED;
+				break;
+			}
+			status = store_field(full_logs, field_index, (span_t){field, pos - field}, &context->perf);
+			field_index++; // When field is set we need to increment
+			field = ++pos; // Start of next log field
+			if (status != PARSE_OK) {
+				break;
+			}
+			// Request id and host id known, the filter's cache misses overlap the remaining fields
+			if (field_index == 19 && context->redelivery != NULL) {
+				redelivery_prefetch(context->redelivery, full_logs);
+			}
+			if (c == '\n') {
+				break;
+			}
+			continue;
 		}
 
-		// Copy Char to Output buffer (Every iteration)
-		*dest++ = *source++;
+		pos++;
 	}
 
-	// Final Step
-	*dest = '\0';								  // set final address to null
-	full_logs->length = dest - full_logs->buffer; // last memory address - first memory address = size
+	// Final field when the line had no trailing newline
+	if (status == PARSE_OK && pos > field && field_index <= 26) {
+		status = store_field(full_logs, field_index, (span_t){field, pos - field}, &context->perf);
+		field_index++;
+	}
+	full_logs->length = pos;
 
-	// VERBOSE OUPUT
-	if (context->verbose) {
-		fprintf(stderr, "Log->Struct:%s %s FieldInd:%d http:%d\n", full_logs->bucket_name, full_logs->key, field_index,
-				full_logs->http_code);
+	// Fields 0-25 are mandatory, the range header is optional
+	if (status == PARSE_OK && field_index < 26) {
+		status = PARSE_SHORT_LINE;
 	}
+	return status;
 } // END - PARSE LOG LINE -> FULL LOG STRUCT ----------------------------
 
 // EXTRACT FULL LOG -> SLIM LOG ---------------------------------------
@@ -373,40 +1138,83 @@ void
 extract_log_entry(p_log_t *full_log, s_log_t *slim_log, s_context_t *context)
 {
 	// STRUCTURE CONVERSION AND COMPRESSION
-	slim_log->timestamp = mktime(&full_log->time);
-	slim_log->ip_hash = hash_key(full_log->remote_ip);
-	slim_log->key_hash = hash_key(full_log->key);
-	slim_log->podcast_hash = extract_path(full_log->key);
+	slim_log->timestamp = full_log->timestamp;
+	slim_log->ip_hash = full_log->ip_hashed ? hash_fold32(hash64(&full_log->ip_addr, sizeof(uint64_t)))
+											: (uint32_t)full_log->ip_addr;
+	slim_log->key_hash = hash_fold32(full_log->key_hash64);
+	slim_log->podcast_hash = hash_fold32(full_log->podcast_hash64);
 	slim_log->bytes_sent_kb = (full_log->bytes_sent / 1024);
 	slim_log->object_size_kb = (full_log->object_size / 1024);
 	slim_log->download_time_ms = full_log->ms_ttime;
 	slim_log->http_code = full_log->http_code;
-	slim_log->system_id = extract_system(full_log->user_agent);
-	slim_log->platform_id = extract_platform(full_log->user_agent);
+	uint64_t timer = stats_begin(&context->perf);
+	slim_log->system_id = extract_system(LOG_FIELD(full_log, user_agent));
+	slim_log->platform_id = extract_platform(LOG_FIELD(full_log, user_agent));
+	stats_end(&context->perf, STAGE_UA, timer);
 	slim_log->completion_percent =
 		(full_log->object_size == 0) ? 0 : (100 * full_log->bytes_sent) / full_log->object_size;
 
 	// Flags indicating where in the downnloads the 206 Range was in: Start, Mid, End
 	// Only need to call set flags if its a multi-file DL
 	if (slim_log->http_code == 206) {
+		timer = stats_begin(&context->perf);
 		slim_log->flags = set_flags(full_log, slim_log, context);
+		stats_end(&context->perf, STAGE_DEDUP, timer);
 	}
 	// No flags for other HTTP Codes
 	else {
 		slim_log->flags = 0;
 	}
+	if (full_log->ip_hashed) {
+		slim_log->flags |= IP_HASHED;
+	}
 
-	// VERBOSE DIALOG
-	if (context->verbose) {
-		time_t t;
-		struct tm *local_time;
-		t = time(NULL);
-		local_time = localtime(&t);
-		fprintf(stderr, "Full->Slim:[%02d:%02d:%02d] %x\n", local_time->tm_hour, local_time->tm_min, local_time->tm_sec,
-				slim_log->key_hash);
+	// Country lookup, IPv4 only
+	slim_log->location_id = GEO_UNKNOWN;
+	if (context->geo != NULL && !full_log->ip_hashed) {
+		timer = stats_begin(&context->perf);
+		slim_log->location_id = extract_location((uint32_t)full_log->ip_addr, context->geo);
+		stats_end(&context->perf, STAGE_GEO, timer);
 	}
 }
 
+/**
+ * @BRIEF Copies the slim log into its wide form with the parser's full 64 bit hashes
+ * @PARAM full_log : Parsed log the slim log was extracted from
+ * @PARAM slim_log : Extracted slim log
+ * @PARAM wide_log : Output wide record
+ */
+void
+widen_log_entry(const p_log_t *full_log, const s_log_t *slim_log, s_log_wide_t *wide_log)
+{
+	wide_log->ip_hash = full_log->ip_addr;
+	wide_log->podcast_hash = full_log->podcast_hash64;
+	wide_log->key_hash = full_log->key_hash64;
+	wide_log->timestamp = slim_log->timestamp;
+	wide_log->bytes_sent_kb = slim_log->bytes_sent_kb;
+	wide_log->object_size_kb = slim_log->object_size_kb;
+	wide_log->download_time_ms = slim_log->download_time_ms;
+	wide_log->http_code = slim_log->http_code;
+	wide_log->system_id = slim_log->system_id;
+	wide_log->platform_id = slim_log->platform_id;
+	wide_log->completion_percent = slim_log->completion_percent;
+	wide_log->flags = slim_log->flags;
+	wide_log->location_id = slim_log->location_id;
+}
+
+// Show name inside a key: the directory after the optional leading /
+static const char *
+show_prefix(const char *key, size_t length, size_t *prefix_length)
+{
+	if (length > 0 && *key == '/') {
+		key++;
+		length--;
+	}
+	const char *slash = (const char *)memchr(key, '/', length);
+	*prefix_length = (slash == NULL) ? length : (size_t)(slash - key);
+	return key;
+}
+
 /**
  * @BRIEF Hashing function for organization of unique podcast names
  * @PARAM key : Podcast URL path
@@ -416,64 +1224,30 @@ extract_log_entry(p_log_t *full_log, s_log_t *slim_log, s_context_t *context)
  *          after the leading /.
  *          For use with URLs of the following form:
  *          /showname/episode12345.mp3
+ *          Matches the podcast_hash the tokenizer computes for the same key.
  */
 uint32_t // /showname/#.mp3
 extract_path(const char *key)
 {
-	// INPUT VALIDATION
-	// handle NULL & empty strings
-	if (key == NULL || *key == '\0') {
-		return DJB2HASH; // Default hash value returned
-	}
-
-	// MEMORY ALLOC: Temp buffer for key
-	size_t key_len = strlen(key);
-	char temp[key_len + 1];
-
-	// SETUP PARSE
-	const char *source = key;
-	char *dest = temp;
-
-	// Skip initial /
-	if (*source == '/') {
-		source++;
-	}
-
-	// EXTRACT SHOW NAME
-	// copies characters until /
-	while (*source && (*source != '/')) {
-		*dest++ = *source++;
+	if (key == NULL) {
+		key = "";
 	}
-	*dest = '\0'; // Null term '\0'
-
-	// Hash show name
-	return hash_key(temp);
+	size_t prefix_length;
+	const char *prefix = show_prefix(key, strlen(key), &prefix_length);
+	return hash_fold32(hash64(prefix, prefix_length));
 }
 
 /**
- * @BRIEF DJB2 Hash implementation
+ * @BRIEF 32 bit string hash, hash64() folded
  * @PARAMS key : Input string to be hashed
- *
- * @DETAILS Implement DJB2 Hash by Dan Bernstein
- *          Formula = ((hash << 5) + hash) + c
- *          Bit Shift << 5 is == *32
  */
 uint32_t
 hash_key(const char *key)
 {
-	// INPUT VALIDATION
 	if (key == NULL) {
-		return DJB2HASH; // default hash return
-	}
-
-	// Init Hash
-	uint32_t hash = DJB2HASH;
-
-	// Run DJB2: Hash each char
-	for (const char *ptr = key; *ptr != '\0'; ptr++) {
-		hash = (((hash << 5) + hash) + *ptr);
+		key = "";
 	}
-	return hash;
+	return hash_fold32(hash64(key, strlen(key)));
 }
 
 /**
@@ -599,7 +1373,8 @@ set_flags(p_log_t *full_log, s_log_t *slim_log, s_context_t *context)
 	if (full_log->byte_start == 0) {
 		flags |= STRT_206DL; // Set bit 00000010 to signify start of request
 
-		// Check if ip is unique against ip_tracker
+		// Check if ip is unique against ip_tracker, windows are counted in log time
+		context->ip_track.now_hour = slim_log->timestamp / 3600;
 		// Might want another wrapper around is_unique_ip that updates a analytics struct
 		if (1 == is_unique_ip(slim_log->ip_hash, slim_log->key_hash, context)) {
 			flags |= UNIQUE_IP; // Set bit 00000011
@@ -618,46 +1393,9 @@ set_flags(p_log_t *full_log, s_log_t *slim_log, s_context_t *context)
 		flags = MID_206DL; // Set bit 00000100 to signify mid-portion of file
 	}
 
-
-	if (context->verbose == 1) {
-		fprintf(stderr, "%u: Flag Set\n", slim_log->key_hash);
-	}
 	return flags;
 }
 
-int
-is_unique_ip(uint32_t ip_hash, uint32_t key_hash, s_context_t *context)
-{
-	// Combine ip hash and key hash to generate unique id
-	uint64_t complete_hash = (((uint64_t)ip_hash << 32) | key_hash);
-
-	// Ensure Hash isnt 0
-	if (complete_hash == 0) {
-		complete_hash = 1;
-	}
-
-	// Normalize that Hash to be within index range
-	uint32_t index = complete_hash % context->ip_track.capacity; // Capacity is Hashing value
-	uint32_t original_index = index;
-
-	do {
-		// Index empty
-		if ((context->ip_track.ip_hashes[index]) == 0) {
-			context->ip_track.ip_hashes[index] = complete_hash;
-			context->ip_track.count += 1;
-			return 1;
-		}
-		// Already recorded, skip
-		if (context->ip_track.ip_hashes[index] == complete_hash) {
-			return 0;
-		}
-		// Try next index, if index was miraculously IP_HASH we return back to 0
-		// then 1
-		index = (index + 1) % IP_HASH;
-	} while (index != original_index);
-	return 0;
-}
-
 // Pattern Matching using char checker for flag matching
 int
 check_pattern(const char *check_str, const char *pattern)
@@ -685,6 +1423,7 @@ check_pattern(const char *check_str, const char *pattern)
 void
 process_slim_logs(s_log_t *slim_log, int num_entries, FILE *output, s_context_t *context)
 {
+	uint64_t timer = stats_begin(&context->perf);
 	if (context->output_filetype_flag == CSV_FILE) {
 		output_CSV(slim_log, num_entries, output, context);
 	}
@@ -692,28 +1431,38 @@ process_slim_logs(s_log_t *slim_log, int num_entries, FILE *output, s_context_t
 		for (int i = 0; i < num_entries; i++) {
 			fwrite(&slim_log[i], sizeof(s_log_t), 1, output);
 		}
-		if (context->verbose) {
-			fprintf(stderr, "Batch Extracted\n");
-		}
 	}
+	stats_end(&context->perf, STAGE_WRITE, timer);
 }
 
+// Column names, written once at the start of a CSV output file
 void
-output_CSV(s_log_t *slim_log, int num_entries, FILE *output, s_context_t *context)
+output_CSV_header(FILE *output)
 {
 	fprintf(output, "timestamp,ip_hash,podcast_hash,key_hash"
 					",bytes_sent_kb,object_size_kb,download_time_ms,"
-					"status_code,system_id,platform-id,completion_percent,flags\n");
+					"status_code,system_id,platform-id,completion_percent,flags,country\n");
+}
 
+void
+output_CSV(s_log_t *slim_log, int num_entries, FILE *output, s_context_t *context)
+{
 	for (int i = 0; i < num_entries; i++) {
-		fprintf(output, "%u,%u,%u,%u,%u,%u,%u,%u,%u,%u,%u,%u\n", slim_log->timestamp, slim_log->ip_hash,
-				slim_log->podcast_hash, slim_log->key_hash, slim_log->bytes_sent_kb, slim_log->object_size_kb,
-				slim_log->download_time_ms, slim_log->http_code, slim_log->system_id, slim_log->platform_id,
-				slim_log->completion_percent, slim_log->flags);
-	}
-	if (context->verbose) {
-		fprintf(stderr, "Batch Extracted\n");
+		const s_log_t *log = &slim_log[i];
+		fprintf(output, "%u,%u,%u,%u,%u,%u,%u,%u,%u,%u,%u,%u,%s\n", log->timestamp, log->ip_hash, log->podcast_hash,
+				log->key_hash, log->bytes_sent_kb, log->object_size_kb, log->download_time_ms, log->http_code,
+				log->system_id, log->platform_id, log->completion_percent, log->flags,
+				geo_country_code(log->location_id));
 	}
+	(void)context;
+}
+
+void
+process_wide_logs(s_log_wide_t *wide_log, int num_entries, FILE *output, s_context_t *context)
+{
+	uint64_t timer = stats_begin(&context->perf);
+	fwrite(wide_log, sizeof(s_log_wide_t), num_entries, output);
+	stats_end(&context->perf, STAGE_WRITE, timer);
 }
 
 // END PROCESS SLIM LOG -> OUTPUT
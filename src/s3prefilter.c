@@ -0,0 +1,89 @@
+#include "../include/s3prefilter.h"
+
+// PREFILTER -----------------------------------------------------------------------------------
+// Mixed traffic buckets also log PUT, HEAD, LIST and lifecycle operations that s3lp would
+// otherwise tokenize, time parse and extract in full. The options only describe which lines
+// to keep, prefilter_field in the header does the per field check. libs3lp builds these from
+// s3lp_options_t too, so nothing here prints, the caller reports a bad value.
+
+/**
+ * @BRIEF Adds a comma separated list of names to the set checked on a field
+ * @PARAM filter : Prefilter
+ * @PARAM field  : PREFILTER_FIELD_BUCKET, _OPERATION or _KEY (names are key prefixes)
+ * @PARAM list   : Names, ex: REST.GET.OBJECT,REST.HEAD.OBJECT
+ * @RETURN 0 on success, 1 on an empty name or a full set, -1 on allocation failure
+ */
+int
+prefilter_add(prefilter_t *filter, int field, const char *list)
+{
+	prefilter_set_t *set = (field == PREFILTER_FIELD_BUCKET)	  ? &filter->buckets
+						   : (field == PREFILTER_FIELD_OPERATION) ? &filter->operations
+																  : &filter->key_prefixes;
+	const char *name = list;
+	for (;;) {
+		const char *end = strchr(name, ',');
+		size_t length = (end == NULL) ? strlen(name) : (size_t)(end - name);
+		if (length == 0 || set->count == PREFILTER_NAMES) {
+			return 1;
+		}
+		char *copy = strndup(name, length);
+		if (copy == NULL) {
+			return -1;
+		}
+		set->names[set->count] = copy;
+		set->lengths[set->count] = (uint32_t)length;
+		set->count++;
+		if (end == NULL) {
+			break;
+		}
+		name = end + 1;
+	}
+	if (field > filter->last_field) {
+		filter->last_field = field;
+	}
+	return 0;
+}
+
+/**
+ * @BRIEF Keeps lines whose http status is in a range
+ * @PARAM filter : Prefilter
+ * @PARAM range  : "200-299", "206", or open ended "400-"
+ * @RETURN 0 on success, 1 when the range is not inside 200-599, the statuses s3lp accepts
+ */
+int
+prefilter_status(prefilter_t *filter, const char *range)
+{
+	char *end = NULL;
+	long low = strtol(range, &end, 10);
+	long high = low;
+	if (end != range && *end == '-') {
+		char *upper = end + 1;
+		high = 599; // open ended
+		end = upper;
+		if (*upper != '\0') {
+			high = strtol(upper, &end, 10);
+		}
+	}
+	if (end == range || *end != '\0' || low < 200 || high > 599 || low > high) {
+		return 1;
+	}
+	filter->status_min = (int)low;
+	filter->status_max = (int)high;
+	if (PREFILTER_FIELD_STATUS > filter->last_field) {
+		filter->last_field = PREFILTER_FIELD_STATUS;
+	}
+	return 0;
+}
+
+void
+prefilter_free(prefilter_t *filter)
+{
+	prefilter_set_t *sets[] = {&filter->buckets, &filter->operations, &filter->key_prefixes};
+	for (int s = 0; s < 3; s++) {
+		for (uint32_t i = 0; i < sets[s]->count; i++) {
+			free(sets[s]->names[i]);
+		}
+		sets[s]->count = 0;
+	}
+}
+// END PREFILTER -------------------------------------------------------------------------------
@@ -0,0 +1,429 @@
+#include "../include/s3quantile.h"
+#include <math.h>
+
+// QUANTILE SKETCHES ---------------------------------------------------------------------------
+// DDSketch: values fall into logarithmic bins, bin i holds (gamma^(i-1), gamma^i], so
+// every value in a bin is within alpha of the bin's midpoint. Any quantile is then off by
+// at most alpha relative, sketches merge by adding bins, and the few hundred bins that
+// cover 1..65535 ms fit in a few KB.
+
+/**
+ * @BRIEF Builds the value -> bin mapping for an accuracy
+ * @PARAM mapping : Mapping to initialize
+ * @PARAM alpha   : Relative accuracy, (0, 1)
+ * @RETURN 0 on success, 1 on a bad alpha or allocation failure
+ */
+int
+dd_mapping_init(dd_mapping_t *mapping, double alpha)
+{
+	memset(mapping, 0, sizeof(*mapping));
+	if (!(alpha > 0 && alpha < 1)) {
+		fprintf(stderr, "Quantile accuracy must be in (0, 1)\n");
+		return 1;
+	}
+	mapping->alpha = alpha;
+	mapping->gamma = (1 + alpha) / (1 - alpha);
+	mapping->log_gamma = log(mapping->gamma);
+	if (ceil(log(QUANTILE_TABLE - 1) / mapping->log_gamma) > INT16_MAX) {
+		fprintf(stderr, "Quantile accuracy %g is too fine\n", alpha);
+		return 1;
+	}
+
+	mapping->table = (int16_t *)malloc(QUANTILE_TABLE * sizeof(int16_t));
+	if (mapping->table == NULL) {
+		perror("Quantile: Malloc");
+		return 1;
+	}
+	mapping->table[0] = 0; // zeros are counted apart
+	for (uint32_t value = 1; value < QUANTILE_TABLE; value++) {
+		mapping->table[value] = (int16_t)ceil(log((double)value) / mapping->log_gamma);
+	}
+	return 0;
+}
+
+void
+dd_mapping_free(dd_mapping_t *mapping)
+{
+	free(mapping->table);
+	mapping->table = NULL;
+}
+
+static inline int32_t
+dd_bin(const dd_mapping_t *mapping, uint64_t value)
+{
+	if (value < QUANTILE_TABLE) {
+		return mapping->table[value];
+	}
+	return (int32_t)ceil(log((double)value) / mapping->log_gamma);
+}
+
+void
+dd_sketch_init(dd_sketch_t *sketch, const dd_mapping_t *mapping)
+{
+	memset(sketch, 0, sizeof(*sketch));
+	sketch->mapping = mapping;
+	sketch->min = UINT64_MAX;
+}
+
+void
+dd_sketch_free(dd_sketch_t *sketch)
+{
+	free(sketch->bins);
+	sketch->bins = NULL;
+	sketch->bin_count = 0;
+}
+
+// Widens the bins to cover [low, high] plus some slack so a growing range reallocates rarely.
+// Past QUANTILE_MAX_BINS the lowest bins are folded into one, callers clamp to offset.
+static int
+dd_reserve(dd_sketch_t *sketch, int32_t low, int32_t high)
+{
+	int32_t top = sketch->offset + (int32_t)sketch->bin_count - 1;
+	if (sketch->bin_count > 0) {
+		if (low >= sketch->offset && high <= top) {
+			return 0;
+		}
+		if (high < top) {
+			high = top;
+		}
+		if (low > sketch->offset) {
+			low = sketch->offset;
+		}
+	}
+	if (high - low + 1 > QUANTILE_MAX_BINS) {
+		low = high - QUANTILE_MAX_BINS + 1;
+	}
+
+	uint32_t count = (uint32_t)(high - low + 1) + QUANTILE_SLACK_BINS;
+	if (count > QUANTILE_MAX_BINS) {
+		count = QUANTILE_MAX_BINS;
+	}
+	// Slack goes on the side that grew, around the first value of a new sketch
+	int32_t offset = high - (int32_t)count + 1;
+	if (sketch->bin_count == 0) {
+		offset = low - (int32_t)(count - (uint32_t)(high - low + 1)) / 2;
+	}
+	else if (high > top) {
+		offset = low;
+	}
+
+	uint64_t *bins = (uint64_t *)calloc(count, sizeof(uint64_t));
+	if (bins == NULL) {
+		perror("Quantile: Calloc");
+		return 1;
+	}
+	for (uint32_t i = 0; i < sketch->bin_count; i++) {
+		int32_t bin = sketch->offset + (int32_t)i;
+		bins[(bin < offset) ? 0 : bin - offset] += sketch->bins[i];
+	}
+	free(sketch->bins);
+	sketch->bins = bins;
+	sketch->offset = offset;
+	sketch->bin_count = count;
+	return 0;
+}
+
+/**
+ * @BRIEF Adds one value to a sketch
+ * @RETURN 0 on success, 1 on allocation failure
+ */
+int
+dd_sketch_add(dd_sketch_t *sketch, uint64_t value)
+{
+	if (value == 0) {
+		sketch->zero_count++;
+	}
+	else {
+		int32_t bin = dd_bin(sketch->mapping, value);
+		if (dd_reserve(sketch, bin, bin) != 0) {
+			return 1;
+		}
+		sketch->bins[(bin < sketch->offset) ? 0 : bin - sketch->offset]++;
+	}
+	sketch->count++;
+	sketch->sum += value;
+	if (value < sketch->min) {
+		sketch->min = value;
+	}
+	if (value > sketch->max) {
+		sketch->max = value;
+	}
+	return 0;
+}
+
+/**
+ * @BRIEF Adds src into dst, both built on the same mapping
+ * @RETURN 0 on success, 1 on allocation failure
+ */
+int
+dd_sketch_merge(dd_sketch_t *dst, const dd_sketch_t *src)
+{
+	if (src->bin_count > 0 && dd_reserve(dst, src->offset, src->offset + (int32_t)src->bin_count - 1) != 0) {
+		return 1;
+	}
+	for (uint32_t i = 0; i < src->bin_count; i++) {
+		int32_t bin = src->offset + (int32_t)i;
+		dst->bins[(bin < dst->offset) ? 0 : bin - dst->offset] += src->bins[i];
+	}
+	dst->zero_count += src->zero_count;
+	dst->count += src->count;
+	dst->sum += src->sum;
+	if (src->min < dst->min) {
+		dst->min = src->min;
+	}
+	if (src->max > dst->max) {
+		dst->max = src->max;
+	}
+	return 0;
+}
+
+/**
+ * @BRIEF Estimates a quantile
+ * @PARAM sketch : Sketch with at least one value
+ * @PARAM q      : Quantile in [0, 1]
+ * @RETURN Value of rank q * (count - 1), within alpha relative error
+ */
+double
+dd_sketch_quantile(const dd_sketch_t *sketch, double q)
+{
+	if (sketch->count == 0) {
+		return 0;
+	}
+	if (q <= 0) {
+		return (double)sketch->min;
+	}
+	if (q >= 1) {
+		return (double)sketch->max;
+	}
+
+	double rank = q * (double)(sketch->count - 1);
+	uint64_t seen = sketch->zero_count;
+	if (rank < (double)seen) {
+		return 0;
+	}
+	const dd_mapping_t *mapping = sketch->mapping;
+	for (uint32_t i = 0; i < sketch->bin_count; i++) {
+		seen += sketch->bins[i];
+		if (rank < (double)seen) {
+			double value = 2 * pow(mapping->gamma, sketch->offset + (int32_t)i) / (mapping->gamma + 1);
+			if (value < (double)sketch->min) {
+				return (double)sketch->min;
+			}
+			return (value > (double)sketch->max) ? (double)sketch->max : value;
+		}
+	}
+	return (double)sketch->max;
+}
+// END QUANTILE SKETCHES -----------------------------------------------------------------------
+
+// QUANTILE EXTRACT ----------------------------------------------------------------------------
+// One pass over the records, a sketch per group, the overall sketch is their merge.
+
+typedef struct quantile_group_s {
+	uint64_t key;
+	uint8_t flags; // flags of a record in the group, for formatting IP keys
+	dd_sketch_t sketch;
+} quantile_group_t;
+
+// Group key -> sketch
+typedef struct quantile_table_s {
+	quantile_group_t *groups;
+	uint32_t *index; // open addressing key -> group + 1
+	uint32_t index_mask;
+	uint32_t count;
+	uint32_t capacity;
+} quantile_table_t;
+
+static inline uint32_t
+quantile_home(const quantile_table_t *table, uint64_t key)
+{
+	return (uint32_t)hash64_mix(key ^ HASH64_SECRET[2], HASH64_SECRET[1]) & table->index_mask;
+}
+
+static int
+quantile_table_init(quantile_table_t *table)
+{
+	memset(table, 0, sizeof(*table));
+	table->capacity = GROUP_THRESHOLD;
+	table->index_mask = GROUP_THRESHOLD * 2 - 1;
+	table->groups = (quantile_group_t *)malloc(table->capacity * sizeof(quantile_group_t));
+	table->index = (uint32_t *)calloc(table->index_mask + 1, sizeof(uint32_t));
+	if (table->groups == NULL || table->index == NULL) {
+		perror("Quantile: Malloc");
+		return 1;
+	}
+	return 0;
+}
+
+static void
+quantile_table_free(quantile_table_t *table)
+{
+	for (uint32_t i = 0; i < table->count; i++) {
+		dd_sketch_free(&table->groups[i].sketch);
+	}
+	free(table->groups);
+	free(table->index);
+	memset(table, 0, sizeof(*table));
+}
+
+// Group for key, created empty on first use. NULL on allocation failure
+static quantile_group_t *
+quantile_get(quantile_table_t *table, const dd_mapping_t *mapping, uint64_t key, uint8_t flags)
+{
+	uint32_t slot = quantile_home(table, key);
+	for (; table->index[slot] != 0; slot = (slot + 1) & table->index_mask) {
+		quantile_group_t *group = &table->groups[table->index[slot] - 1];
+		if (group->key == key) {
+			return group;
+		}
+	}
+
+	if (table->count == table->capacity) {
+		quantile_group_t *groups =
+			(quantile_group_t *)realloc(table->groups, table->capacity * 2 * sizeof(quantile_group_t));
+		uint32_t *index = (uint32_t *)calloc((table->index_mask + 1) * 2, sizeof(uint32_t));
+		if (groups == NULL || index == NULL) {
+			perror("Quantile: Realloc");
+			free(index);
+			if (groups != NULL) {
+				table->groups = groups;
+			}
+			return NULL;
+		}
+		table->groups = groups;
+		table->capacity *= 2;
+		free(table->index);
+		table->index = index;
+		table->index_mask = table->index_mask * 2 + 1;
+		for (uint32_t i = 0; i < table->count; i++) {
+			uint32_t home = quantile_home(table, table->groups[i].key);
+			while (table->index[home] != 0) {
+				home = (home + 1) & table->index_mask;
+			}
+			table->index[home] = i + 1;
+		}
+		slot = quantile_home(table, key);
+		while (table->index[slot] != 0) {
+			slot = (slot + 1) & table->index_mask;
+		}
+	}
+
+	quantile_group_t *group = &table->groups[table->count];
+	group->key = key;
+	group->flags = flags;
+	dd_sketch_init(&group->sketch, mapping);
+	table->index[slot] = ++table->count;
+	return group;
+}
+
+static const char *
+quantile_field_name(int quantile_of)
+{
+	return (quantile_of == QUANTILE_BYTES) ? "bytes_sent_kb" : "download_time_ms";
+}
+
+// Largest groups first
+static int
+compare_quantile_group(const void *a, const void *b)
+{
+	uint64_t count_a = ((const quantile_group_t *)a)->sketch.count;
+	uint64_t count_b = ((const quantile_group_t *)b)->sketch.count;
+	return (count_a < count_b) - (count_a > count_b);
+}
+
+static void
+print_sketch(FILE *output, const dd_sketch_t *sketch, const extract_config_t *config)
+{
+	fprintf(output, "{\"count\": %lu, \"min\": %lu, \"max\": %lu, \"mean\": %.2f", sketch->count,
+			sketch->count ? sketch->min : 0, sketch->max,
+			sketch->count ? (double)sketch->sum / (double)sketch->count : 0.0);
+	for (int i = 0; i < config->quantile_count; i++) {
+		fprintf(output, ", \"p%g\": %.1f", config->quantiles[i] * 100,
+				dd_sketch_quantile(sketch, config->quantiles[i]));
+	}
+	fprintf(output, "}");
+}
+
+/**
+ * @BRIEF Percentiles of download time or size per group
+ * @PARAM input  : Binary slim (or wide) log stream
+ * @PARAM output : JSON destination
+ * @PARAM config : Grouping, summarized field, accuracy and quantiles
+ * @RETURN 0 on success, -1 on allocation failure
+ *
+ * @DETAILS Every reported quantile is within config->alpha of the exact value,
+ *          relative, using at most QUANTILE_MAX_BINS bins per group. Groups are
+ *          printed largest first, "all" is the merge of every group.
+ */
+int
+extract_quantiles(FILE *input, FILE *output, const extract_config_t *config)
+{
+	s3_stats_t *perf = config->perf;
+	size_t record_size = config->wide ? sizeof(s_log_wide_t) : sizeof(s_log_t);
+	dd_mapping_t mapping;
+	quantile_table_t table;
+	if (dd_mapping_init(&mapping, config->alpha) != 0) {
+		return -1;
+	}
+	if (quantile_table_init(&table) != 0) {
+		quantile_table_free(&table);
+		dd_mapping_free(&mapping);
+		return -1;
+	}
+
+	uint64_t timer = stats_begin(perf);
+	int err = 0;
+	s_log_wide_t log;
+	while (!err && read_record(input, config->wide, &log) == 1) {
+		uint64_t key = extract_group_key(&log, config->group_by, config);
+		quantile_group_t *group = quantile_get(&table, &mapping, key, log.flags);
+		uint64_t value = (config->quantile_of == QUANTILE_BYTES) ? log.bytes_sent_kb : log.download_time_ms;
+		err = (group == NULL) || dd_sketch_add(&group->sketch, value) != 0;
+		perf->lines++;
+		perf->bytes += record_size;
+	}
+	dd_sketch_t all;
+	dd_sketch_init(&all, &mapping);
+	for (uint32_t i = 0; !err && i < table.count; i++) {
+		err = dd_sketch_merge(&all, &table.groups[i].sketch);
+	}
+	stats_end(perf, STAGE_GROUP, timer);
+
+	if (!err) {
+		timer = stats_begin(perf);
+		qsort(table.groups, table.count, sizeof(quantile_group_t), compare_quantile_group);
+		fprintf(output, "{\n");
+		fprintf(output, "  \"quantiles_of\": \"%s\", \n", quantile_field_name(config->quantile_of));
+		fprintf(output, "  \"alpha\": %g, \n", mapping.alpha);
+		fprintf(output, "  \"grouped_by\": \"%s\", \n", get_group_name(config->group_by, config));
+		if (config->group_by != GROUP_NONE) {
+			fprintf(output, "  \"groups\":  {\n");
+			for (uint32_t i = 0; i < table.count; i++) {
+				quantile_group_t *group = &table.groups[i];
+				char *group_key_str = format_group_key(config->group_by, group->key, group->flags, config);
+				fprintf(output, "%s    \"%s\": ", (i > 0) ? ",\n" : "", group_key_str);
+				print_sketch(output, &group->sketch, config);
+				free(group_key_str);
+			}
+			fprintf(output, "\n  },\n");
+		}
+		fprintf(output, "  \"all\": ");
+		print_sketch(output, &all, config);
+		fprintf(output, ",\n  \"total_groups\": %u\n", table.count);
+		fprintf(output, "}\n");
+		stats_end(perf, STAGE_WRITE, timer);
+	}
+	else {
+		fprintf(stderr, "Quantile: out of memory\n");
+	}
+	if (config->verbose) {
+		fprintf(stderr, "Quantiles: %lu records, %u groups, %u bins overall\n", all.count, table.count,
+				all.bin_count);
+	}
+
+	dd_sketch_free(&all);
+	quantile_table_free(&table);
+	dd_mapping_free(&mapping);
+	return err ? -1 : 0;
+}
+// END QUANTILE EXTRACT ------------------------------------------------------------------------
@@ -0,0 +1,67 @@
+#include "../include/s3query.hpp"
+
+// QUERY DISPATCH ------------------------------------------------------------------------------
+// s3_extract learns its keys at run time. Each key and record width has a prebuilt column
+// kernel, picked once per level of a batch instead of switching on group_by per record.
+
+namespace {
+
+typedef void (*column_fn)(const void *records, size_t count, const s3q::KeyContext &context, int shift,
+						  packed_key_t *keys);
+
+template <class Key, class Log>
+void
+column(const void *records, size_t count, const s3q::KeyContext &context, int shift, packed_key_t *keys)
+{
+	s3q::pack_column<Key>((const Log *)records, count, context, shift, keys);
+}
+
+template <class Log>
+column_fn
+column_for(int group_by)
+{
+	switch (group_by) {
+	case GROUP_PODCAST:
+		return column<s3q::PodcastKey, Log>;
+	case GROUP_IP:
+		return column<s3q::IpKey, Log>;
+	case GROUP_TIME:
+		return column<s3q::TimeKey, Log>;
+	case GROUP_COUNTRY:
+		return column<s3q::CountryKey, Log>;
+	case GROUP_KEY:
+		return column<s3q::EpisodeKey, Log>;
+	case GROUP_SYSTEM:
+		return column<s3q::SystemKey, Log>;
+	case GROUP_PLATFORM:
+		return column<s3q::PlatformKey, Log>;
+	default:
+		return NULL;
+	}
+}
+
+} // namespace
+
+/**
+ * @BRIEF Packed keys of a batch of records, composite_key_pack for many records at once
+ * @PARAM layout  : Keys from composite_key_init
+ * @PARAM config  : Record width and time bucket
+ * @PARAM records : s_log_t, or s_log_wide_t when config->wide
+ * @PARAM count   : Number of records
+ * @PARAM keys    : count packed keys out
+ */
+extern "C" void
+query_pack_keys(const composite_key_t *layout, const extract_config_t *config, const void *records, size_t count,
+				packed_key_t *keys)
+{
+	s3q::KeyContext context(config);
+	memset(keys, 0, count * sizeof(packed_key_t));
+	for (int level = 0; level < layout->count; level++) {
+		column_fn pack = config->wide ? column_for<s_log_wide_t>(layout->group_by[level])
+									  : column_for<s_log_t>(layout->group_by[level]);
+		if (pack != NULL) {
+			pack(records, count, context, layout->shift[level], keys);
+		}
+	}
+}
+// END QUERY DISPATCH --------------------------------------------------------------------------
@@ -0,0 +1,291 @@
+#include "../include/s3redelivery.h"
+
+// REDELIVERY ----------------------------------------------------------------------------------
+// S3 server access logging is best effort and now and then delivers a record twice. The copy
+// carries the same request id and host id, so a line whose pair was already seen is dropped
+// before it is extracted and counted. The filters are a fixed 16 MB that rotate on the log's
+// clock, the exact window is a ring of the keys they cover and grows with the request rate.
+
+/**
+ * @BRIEF Allocates an empty filter
+ * @PARAM filter       : Filter to initialize
+ * @PARAM window_hours : Hours of log time a request is remembered by the Bloom filters
+ * @RETURN 0 on success, 1 on allocation failure
+ */
+int
+redelivery_init(redelivery_t *filter, uint32_t window_hours)
+{
+	memset(filter, 0, sizeof(*filter));
+	// All filters but the one being filled cover the window
+	filter->span = (window_hours * 3600 + REDELIVERY_GENERATIONS - 2) / (REDELIVERY_GENERATIONS - 1);
+	if (filter->span == 0) {
+		filter->span = 1;
+	}
+	// Cache line aligned, or every block would straddle two lines
+	size_t filter_bytes = (size_t)REDELIVERY_BLOCKS * 8 * sizeof(uint64_t);
+	if (posix_memalign((void **)&filter->filters, 64, filter_bytes) != 0) {
+		filter->filters = NULL;
+	}
+	filter->stamps = (uint32_t *)calloc(REDELIVERY_BLOCKS, sizeof(uint32_t));
+	filter->capacity = REDELIVERY_CONFIRM;
+	filter->slots = (redelivery_slot_t *)calloc(filter->capacity, sizeof(redelivery_slot_t));
+	filter->buckets = (uint32_t *)malloc(filter->capacity * sizeof(uint32_t));
+	if (filter->filters == NULL || filter->stamps == NULL || filter->slots == NULL || filter->buckets == NULL) {
+		perror("Redelivery: Calloc");
+		redelivery_free(filter);
+		return 1;
+	}
+	memset(filter->filters, 0, filter_bytes);
+	memset(filter->buckets, 0xff, filter->capacity * sizeof(uint32_t));
+	return 0;
+}
+
+void
+redelivery_free(redelivery_t *filter)
+{
+	free(filter->filters);
+	free(filter->stamps);
+	free(filter->slots);
+	free(filter->buckets);
+	filter->filters = NULL;
+	filter->stamps = NULL;
+	filter->slots = NULL;
+	filter->buckets = NULL;
+}
+
+/**
+ * @BRIEF Finds the key's cache line and brings it up to the current generations
+ * @PARAM filter : Filter
+ * @PARAM hash   : request_hash of the key
+ * @RETURN the line, the block of generation g at (g % REDELIVERY_GENERATIONS) * 2
+ *
+ * @DETAILS A block whose generation rotated in after the line's stamp still holds bits of the
+ *          generation it replaced and is cleared here, so filter_rotate never walks the 16 MB.
+ */
+static inline uint64_t *
+filter_line(redelivery_t *filter, uint64_t hash)
+{
+	size_t line = (size_t)(hash >> (64 - REDELIVERY_BLOCK_BITS));
+	uint64_t *blocks = filter->filters + line * 8;
+	uint32_t *stamp = &filter->stamps[line];
+	if (*stamp != filter->newest) {
+		for (int g = 0; g < REDELIVERY_GENERATIONS; g++) {
+			if (filter->generation[g] > *stamp) {
+				blocks[g * 2] = 0;
+				blocks[g * 2 + 1] = 0;
+			}
+		}
+		*stamp = filter->newest;
+	}
+	return blocks;
+}
+
+// Bit i of the block, from 7 bits of the hash each
+static inline int
+block_contains(const uint64_t *block, uint64_t hash)
+{
+	for (int i = 0; i < REDELIVERY_PROBES; i++) {
+		uint32_t bit = (hash >> (7 * i)) & 127;
+		if ((block[bit >> 6] & (1ull << (bit & 63))) == 0) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+static inline void
+block_insert(uint64_t *block, uint64_t hash)
+{
+	for (int i = 0; i < REDELIVERY_PROBES; i++) {
+		uint32_t bit = (hash >> (7 * i)) & 127;
+		block[bit >> 6] |= 1ull << (bit & 63);
+	}
+}
+
+// Moves the newest generation up to the line's, filter_line clears what it takes over
+static void
+filter_rotate(redelivery_t *filter, uint32_t generation)
+{
+	if (filter->newest == 0) {
+		filter->newest = generation;
+		filter->generation[generation % REDELIVERY_GENERATIONS] = generation;
+		return;
+	}
+	if (generation <= filter->newest) {
+		return; // out of order lines go to the newest filter
+	}
+	uint32_t from = filter->newest + 1;
+	if (generation - from >= REDELIVERY_GENERATIONS) {
+		from = generation - REDELIVERY_GENERATIONS + 1;
+	}
+	for (uint32_t g = from; g <= generation; g++) {
+		filter->generation[g % REDELIVERY_GENERATIONS] = g;
+	}
+	filter->newest = generation;
+}
+
+// Exact window lookup, chains run newest first so a slot reused by a newer key ends the walk
+static int
+confirm_find(const redelivery_t *filter, const redelivery_key_t *key)
+{
+	uint32_t index = filter->buckets[key->id & (filter->capacity - 1)];
+	uint64_t previous = UINT64_MAX;
+	while (index != REDELIVERY_END) {
+		const redelivery_slot_t *slot = &filter->slots[index];
+		if (slot->sequence >= previous) {
+			break;
+		}
+		if (slot->key.id == key->id && slot->key.host == key->host) {
+			return 1;
+		}
+		previous = slot->sequence;
+		index = slot->next;
+	}
+	return 0;
+}
+
+// Doubles the ring, re-linking oldest first so every chain still runs newest first
+static int
+confirm_grow(redelivery_t *filter)
+{
+	uint32_t capacity = filter->capacity * 2;
+	redelivery_slot_t *slots = (redelivery_slot_t *)calloc(capacity, sizeof(redelivery_slot_t));
+	uint32_t *buckets = (uint32_t *)malloc(capacity * sizeof(uint32_t));
+	if (slots == NULL || buckets == NULL) {
+		free(slots);
+		free(buckets);
+		return 1;
+	}
+	memset(buckets, 0xff, capacity * sizeof(uint32_t));
+
+	// Sequence s lives in slot (s - 1) % capacity, in the old ring and the new one
+	uint64_t count = (filter->inserted < filter->capacity) ? filter->inserted : filter->capacity;
+	for (uint64_t sequence = filter->inserted - count + 1; sequence <= filter->inserted; sequence++) {
+		const redelivery_slot_t *old = &filter->slots[(sequence - 1) % filter->capacity];
+		uint32_t index = (uint32_t)((sequence - 1) % capacity);
+		uint32_t *head = &buckets[old->key.id & (capacity - 1)];
+		slots[index] = *old;
+		slots[index].next = *head;
+		*head = index;
+	}
+	free(filter->slots);
+	free(filter->buckets);
+	filter->slots = slots;
+	filter->buckets = buckets;
+	filter->capacity = capacity;
+	return 0;
+}
+
+/**
+ * @BRIEF Adds a key to the exact window
+ * @PARAM filter : Filter
+ * @PARAM key    : Request
+ *
+ * @DETAILS The slot to reuse holds the oldest key. While the filters still cover it the ring
+ *          doubles instead, so the exact window spans the same hours as the filters. Past
+ *          REDELIVERY_CONFIRM_MAX, or when growing fails, the oldest key is forgotten.
+ */
+static void
+confirm_insert(redelivery_t *filter, const redelivery_key_t *key)
+{
+	redelivery_slot_t *slot = &filter->slots[filter->inserted % filter->capacity];
+	if (slot->sequence != 0 && slot->generation + REDELIVERY_GENERATIONS - 1 >= filter->newest) {
+		if (filter->capacity < REDELIVERY_CONFIRM_MAX && confirm_grow(filter) == 0) {
+			slot = &filter->slots[filter->inserted % filter->capacity];
+		}
+		else {
+			filter->forgotten++;
+		}
+	}
+	uint32_t index = (uint32_t)(filter->inserted % filter->capacity);
+	uint32_t *head = &filter->buckets[key->id & (filter->capacity - 1)];
+	slot->key = *key;
+	slot->sequence = ++filter->inserted;
+	slot->generation = filter->newest;
+	slot->next = *head;
+	*head = index;
+}
+
+// Line without a request id, S3 writes "-"
+static inline int
+request_missing(const p_log_t *full_log)
+{
+	return full_log->request_id.len == 0 ||
+		   (full_log->request_id.len == 1 && full_log->line[full_log->request_id.off] == '-');
+}
+
+static inline uint64_t
+request_hash(const redelivery_key_t *key)
+{
+	return hash64_mix(key->id ^ HASH64_SECRET[2], key->host ^ HASH64_SECRET[3]);
+}
+
+/**
+ * @BRIEF Hashes the request and starts loading its filter line and chain head
+ * @PARAM filter   : Filter
+ * @PARAM full_log : Line being parsed, host_id just closed
+ *
+ * @DETAILS parse_log_entry calls this as soon as host_id is known, so both cache misses
+ *          overlap the fields still to tokenize and redelivery_seen finds them loaded.
+ */
+void
+redelivery_prefetch(const redelivery_t *filter, p_log_t *full_log)
+{
+	if (request_missing(full_log)) {
+		return;
+	}
+	redelivery_key_t key;
+	key.id = full_log->request_hash64 = hash64(LOG_FIELD(full_log, request_id), full_log->request_id.len);
+	key.host = full_log->host_hash64 = hash64(LOG_FIELD(full_log, host_id), full_log->host_id.len);
+	uint64_t hash = request_hash(&key);
+	__builtin_prefetch(filter->filters + (hash >> (64 - REDELIVERY_BLOCK_BITS)) * 8, 1);
+	__builtin_prefetch(&filter->stamps[hash >> (64 - REDELIVERY_BLOCK_BITS)], 1);
+	__builtin_prefetch(&filter->buckets[key.id & (filter->capacity - 1)], 1);
+}
+
+/**
+ * @BRIEF Checks a parsed line against the requests seen so far, and remembers it
+ * @PARAM filter   : Filter
+ * @PARAM full_log : Line parsed by parse_log_entry
+ * @RETURN 1 when the line repeats a request in the exact window and should be dropped, else 0
+ *
+ * @DETAILS Lines without a request id ("-") are never dropped. A filter hit that is not in
+ *          the exact window is kept: it is a false positive, or a copy of a request the
+ *          exact window had to forget at REDELIVERY_CONFIRM_MAX (counted in forgotten).
+ */
+int
+redelivery_seen(redelivery_t *filter, p_log_t *full_log)
+{
+	filter->checked++;
+	if (request_missing(full_log)) {
+		filter->missing++;
+		return 0;
+	}
+	// Parsed without redelivery_prefetch
+	if (full_log->request_hash64 == 0) {
+		full_log->request_hash64 = hash64(LOG_FIELD(full_log, request_id), full_log->request_id.len);
+		full_log->host_hash64 = hash64(LOG_FIELD(full_log, host_id), full_log->host_id.len);
+	}
+	redelivery_key_t key = {full_log->request_hash64, full_log->host_hash64};
+	uint64_t hash = request_hash(&key);
+
+	filter_rotate(filter, (uint32_t)(full_log->timestamp / filter->span));
+	uint64_t *blocks = filter_line(filter, hash);
+	for (int g = 0; g < REDELIVERY_GENERATIONS; g++) {
+		if (filter->generation[g] == 0) {
+			continue; // not reached yet
+		}
+		if (block_contains(blocks + g * 2, hash)) {
+			if (confirm_find(filter, &key)) {
+				filter->duplicates++;
+				return 1;
+			}
+			filter->unconfirmed++;
+			break;
+		}
+	}
+	block_insert(blocks + (filter->newest % REDELIVERY_GENERATIONS) * 2, hash);
+	confirm_insert(filter, &key);
+	return 0;
+}
+// END REDELIVERY ------------------------------------------------------------------------------
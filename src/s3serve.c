@@ -0,0 +1,798 @@
+#include "../include/s3serve.h"
+#include "../include/s3aggregate.h"
+#include "../include/s3quantile.h"
+#include "../include/s3spill.h"
+#include "../include/s3topk.h"
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+// s3_serve keeps one dataset loaded: its manifest parsed and its files mapped. A request is a
+// line of s3_extract query options ("-g p,t -F 2025-05-01 -P 0x1234"), the reply the JSON
+// s3_extract would print for the same options over -D. Workers answer connections from a
+// queue, each scan reads the mapped files on its own threads. Results are cached by request
+// and manifest generation, so a new file registered by s3lp -A is picked up on the next
+// request and no stale result is ever served.
+
+// SNAPSHOTS -----------------------------------------------------------------------------------
+// A reload builds a new snapshot beside the old one and swaps it in, queries still scanning the
+// old one keep their reference and the last of them unmaps it.
+
+// Parses the manifest and maps its files, NULL on failure
+static serve_snapshot_t *
+snapshot_load(serve_t *server, uint64_t generation)
+{
+	serve_snapshot_t *snapshot = (serve_snapshot_t *)calloc(1, sizeof(serve_snapshot_t));
+	if (snapshot == NULL) {
+		perror("Serve: Malloc");
+		return NULL;
+	}
+	snapshot->present = stat(server->manifest_path, &snapshot->manifest) == 0;
+	if (catalog_load(&snapshot->catalog, server->dataset) != 0 || catalog_map(&snapshot->catalog) != 0) {
+		catalog_free(&snapshot->catalog);
+		free(snapshot);
+		return NULL;
+	}
+	snapshot->generation = generation;
+	snapshot->refs = 1; // the server's
+	return snapshot;
+}
+
+static void
+snapshot_release(serve_t *server, serve_snapshot_t *snapshot)
+{
+	pthread_mutex_lock(&server->lock);
+	int last = (--snapshot->refs == 0);
+	pthread_mutex_unlock(&server->lock);
+	if (last) {
+		catalog_free(&snapshot->catalog);
+		free(snapshot);
+	}
+}
+
+// 1 when the manifest on disk is not the one the snapshot was loaded from
+static int
+manifest_changed(const serve_snapshot_t *snapshot, const struct stat *st, int present)
+{
+	if (present != snapshot->present) {
+		return 1;
+	}
+	return present && (st->st_ino != snapshot->manifest.st_ino || st->st_size != snapshot->manifest.st_size ||
+					   st->st_mtim.tv_sec != snapshot->manifest.st_mtim.tv_sec ||
+					   st->st_mtim.tv_nsec != snapshot->manifest.st_mtim.tv_nsec);
+}
+
+/**
+ * @BRIEF Current snapshot, reloaded first when the manifest changed
+ * @PARAM server : Server
+ * @RETURN Snapshot to pass to snapshot_release
+ *
+ * @DETAILS One stat per request. A reload that fails keeps the old snapshot, the next
+ *          request tries again.
+ */
+static serve_snapshot_t *
+snapshot_acquire(serve_t *server)
+{
+	struct stat st;
+	int present = stat(server->manifest_path, &st) == 0;
+	pthread_mutex_lock(&server->lock);
+	serve_snapshot_t *snapshot = server->snapshot;
+	int stale = manifest_changed(snapshot, &st, present);
+	if (!stale) {
+		snapshot->refs++;
+	}
+	pthread_mutex_unlock(&server->lock);
+	if (!stale) {
+		return snapshot;
+	}
+
+	// One worker reloads, the others wait for it and take its snapshot
+	pthread_mutex_lock(&server->reload);
+	pthread_mutex_lock(&server->lock);
+	stale = manifest_changed(server->snapshot, &st, present);
+	uint64_t generation = server->snapshot->generation + 1;
+	pthread_mutex_unlock(&server->lock);
+	if (stale) {
+		serve_snapshot_t *fresh = snapshot_load(server, generation);
+		if (fresh != NULL) {
+			pthread_mutex_lock(&server->lock);
+			serve_snapshot_t *old = server->snapshot;
+			server->snapshot = fresh;
+			server->reloads++;
+			pthread_mutex_unlock(&server->lock);
+			snapshot_release(server, old);
+			if (server->verbose) {
+				fprintf(stderr, "Serve: manifest generation %lu, %u files\n", generation, fresh->catalog.count);
+			}
+		}
+	}
+	pthread_mutex_lock(&server->lock);
+	snapshot = server->snapshot;
+	snapshot->refs++;
+	pthread_mutex_unlock(&server->lock);
+	pthread_mutex_unlock(&server->reload);
+	return snapshot;
+}
+// END SNAPSHOTS -------------------------------------------------------------------------------
+
+// RESULT CACHE --------------------------------------------------------------------------------
+// At most SERVE_CACHE_ENTRIES results and cache_budget bytes, least recently used out first.
+// Entries of an older generation can never hit again and go as soon as a newer result comes in.
+
+// Drops entry i, under the lock
+static void
+cache_drop(serve_t *server, int i)
+{
+	serve_entry_t *entry = &server->cache[i];
+	server->cache_bytes -= entry->length + strlen(entry->key);
+	free(entry->key);
+	free(entry->body);
+	server->cache[i] = server->cache[--server->cache_count];
+}
+
+// Copies a cached result into reply, 1 on a hit
+static int
+cache_get(serve_t *server, const char *key, uint64_t generation, serve_reply_t *reply)
+{
+	int hit = 0;
+	pthread_mutex_lock(&server->lock);
+	for (int i = 0; i < server->cache_count; i++) {
+		serve_entry_t *entry = &server->cache[i];
+		if (entry->generation != generation || strcmp(entry->key, key) != 0) {
+			continue;
+		}
+		reply->body = (char *)malloc(entry->length + 1);
+		if (reply->body != NULL) {
+			memcpy(reply->body, entry->body, entry->length);
+			reply->body[entry->length] = '\0';
+			reply->length = entry->length;
+			reply->cached = 1;
+			entry->used = ++server->cache_clock;
+			hit = 1;
+		}
+		break;
+	}
+	pthread_mutex_unlock(&server->lock);
+	return hit;
+}
+
+// Keeps a copy of a result, skipped when it alone would take a quarter of the budget
+static void
+cache_put(serve_t *server, const char *key, uint64_t generation, const char *body, size_t length)
+{
+	uint64_t size = length + strlen(key);
+	if (size > server->cache_budget / 4) {
+		return;
+	}
+	char *key_copy = strdup(key);
+	char *body_copy = (char *)malloc(length + 1);
+	if (key_copy == NULL || body_copy == NULL) {
+		free(key_copy);
+		free(body_copy);
+		return;
+	}
+	memcpy(body_copy, body, length);
+
+	pthread_mutex_lock(&server->lock);
+	int keep = (generation == server->snapshot->generation);
+	for (int i = 0; keep && i < server->cache_count;) {
+		if (server->cache[i].generation < generation) {
+			cache_drop(server, i);
+			continue;
+		}
+		// Two workers missed on the same request
+		keep = strcmp(server->cache[i].key, key) != 0;
+		i++;
+	}
+	while (keep && server->cache_count > 0 &&
+		   (server->cache_count == SERVE_CACHE_ENTRIES || server->cache_bytes + size > server->cache_budget)) {
+		int oldest = 0;
+		for (int i = 1; i < server->cache_count; i++) {
+			oldest = (server->cache[i].used < server->cache[oldest].used) ? i : oldest;
+		}
+		cache_drop(server, oldest);
+	}
+	if (keep) {
+		serve_entry_t entry = {key_copy, generation, body_copy, length, ++server->cache_clock};
+		server->cache[server->cache_count++] = entry;
+		server->cache_bytes += size;
+	}
+	pthread_mutex_unlock(&server->lock);
+	if (!keep) {
+		free(key_copy);
+		free(body_copy);
+	}
+}
+// END RESULT CACHE ----------------------------------------------------------------------------
+
+// REQUESTS ------------------------------------------------------------------------------------
+
+static const struct {
+	const char *name;
+	int letter;
+} REQUEST_LONG_OPTIONS[] = {{"order", 'O'}, {"limit", 'L'}, {"from", 'F'}, {"to", 'U'}, {"podcast", 'P'}};
+
+/**
+ * @BRIEF Splits a request line into words in place
+ * @PARAM line  : Request, "double quotes" keep spaces in a word, \ escapes the next character
+ * @PARAM words : Filled with pointers into line
+ * @PARAM max   : Room in words
+ * @RETURN Number of words, -1 for too many words or an open quote
+ */
+static int
+request_words(char *line, char **words, int max)
+{
+	int count = 0;
+	char *in = line;
+	for (;;) {
+		while (*in == ' ' || *in == '\t' || *in == '\r' || *in == '\n') {
+			in++;
+		}
+		if (*in == '\0') {
+			return count;
+		}
+		if (count == max) {
+			return -1;
+		}
+		char *out = in;
+		words[count++] = out;
+		int quoted = 0;
+		while (*in != '\0' && (quoted || strchr(" \t\r\n", *in) == NULL)) {
+			if (*in == '"') {
+				quoted = !quoted;
+				in++;
+				continue;
+			}
+			if (*in == '\\' && in[1] != '\0') {
+				in++;
+			}
+			*out++ = *in++;
+		}
+		if (quoted) {
+			return -1;
+		}
+		int end = (*in == '\0');
+		*out = '\0';
+		in += !end;
+	}
+}
+
+/**
+ * @BRIEF Reads the query options of a request, with s3_extract's meaning and checks
+ * @PARAM words   : Request words
+ * @PARAM count   : Number of words
+ * @PARAM request : Options, values point into words
+ * @PARAM error   : SERVE_ERROR_MAX bytes, set on failure
+ * @RETURN 0 on success, 1 on a bad request
+ *
+ * @DETAILS Only the word splitting is the server's, each option goes to extract_query_option.
+ */
+static int
+request_parse(char **words, int count, extract_query_t *request, char *error)
+{
+	extract_query_init(request);
+	for (int i = 0; i < count; i++) {
+		const char *word = words[i];
+		const char *value = NULL;
+		int option = 0;
+		if (strncmp(word, "--", 2) == 0) {
+			size_t length = strcspn(word + 2, "=");
+			for (size_t j = 0; j < sizeof(REQUEST_LONG_OPTIONS) / sizeof(REQUEST_LONG_OPTIONS[0]); j++) {
+				if (strlen(REQUEST_LONG_OPTIONS[j].name) == length &&
+					strncmp(REQUEST_LONG_OPTIONS[j].name, word + 2, length) == 0) {
+					option = REQUEST_LONG_OPTIONS[j].letter;
+				}
+			}
+			value = (word[2 + length] == '=') ? word + 3 + length : NULL;
+		}
+		else if (word[0] == '-' && word[1] != '\0') {
+			option = word[1];
+			value = (word[2] != '\0') ? word + 2 : NULL;
+		}
+		if (option == 0 || strchr(EXTRACT_QUERY_OPTIONS, option) == NULL) {
+			snprintf(error, SERVE_ERROR_MAX, "%s is not a query option", word);
+			return 1;
+		}
+		if (value == NULL) {
+			if (++i == count) {
+				snprintf(error, SERVE_ERROR_MAX, "%s requires a value", word);
+				return 1;
+			}
+			value = words[i];
+		}
+		if (extract_query_option(request, option, value, error) != 0) {
+			return 1;
+		}
+	}
+	return extract_query_finish(request, error);
+}
+
+static double
+elapsed_micros(const struct timespec *start)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) * 1e6 + (now.tv_nsec - start->tv_nsec) / 1e3;
+}
+
+// Runs a parsed request over a snapshot, the body is malloc'd
+static int
+request_run(serve_t *server, const serve_snapshot_t *snapshot, extract_query_t *request, serve_reply_t *reply)
+{
+	time_bucket_t time_bucket;
+	if (time_bucket_init(&time_bucket, request->bucket_spec, request->time_zone) != 0) {
+		snprintf(reply->error, SERVE_ERROR_MAX, "bad time bucket or zone");
+		return 1;
+	}
+	catalog_query_t query = {0, UINT32_MAX, 0, 0, 0};
+	int64_t utc = 0;
+	int err = 0;
+	if (request->from != NULL && !(err = time_parse(request->from, &time_bucket.zone, &utc) != 0)) {
+		query.from = (utc < 0) ? 0 : (utc > UINT32_MAX) ? UINT32_MAX : (uint32_t)utc;
+	}
+	if (!err && request->to != NULL && !(err = time_parse(request->to, &time_bucket.zone, &utc) != 0)) {
+		query.to = (utc < 0) ? 0 : (utc > UINT32_MAX) ? UINT32_MAX : (uint32_t)utc;
+	}
+	if (err) {
+		snprintf(reply->error, SERVE_ERROR_MAX, "--from and --to take YYYY-MM-DD[ HH:MM[:SS]] or @seconds");
+		time_bucket_free(&time_bucket);
+		return 1;
+	}
+	if (request->podcast != NULL && catalog_query_podcast(&query, request->podcast) != 0) {
+		snprintf(reply->error, SERVE_ERROR_MAX, "--podcast takes a show name or 0x<hash>");
+		time_bucket_free(&time_bucket);
+		return 1;
+	}
+
+	catalog_scan_t scan;
+	s3_stats_t perf;
+	stats_init(&perf, 0, 0);
+	FILE *input = catalog_scan_start(&scan, &snapshot->catalog, &query, server->readers);
+	FILE *output = (input != NULL) ? open_memstream(&reply->body, &reply->length) : NULL;
+	if (output == NULL) {
+		snprintf(reply->error, SERVE_ERROR_MAX, "scan could not start, see the server log");
+		if (input != NULL) {
+			fclose(input);
+			catalog_scan_finish(&scan);
+		}
+		time_bucket_free(&time_bucket);
+		return 1;
+	}
+	extract_config_t config = request->config;
+	config.perf = &perf;
+	config.time_bucket = &time_bucket;
+	config.wide = (scan.record_size == sizeof(s_log_wide_t));
+	config.threads = server->readers;
+	config.memory_budget = server->memory_budget;
+	err = extract_to_json(input, output, &config) != 0;
+	fclose(input);
+	err |= catalog_scan_finish(&scan) != 0;
+	err |= fclose(output) != 0;
+	time_bucket_free(&time_bucket);
+	if (err) {
+		free(reply->body);
+		reply->body = NULL;
+		snprintf(reply->error, SERVE_ERROR_MAX, "query failed, see the server log");
+	}
+	return err;
+}
+
+/**
+ * @BRIEF Answers one request, from the cache when the dataset has not changed since
+ * @PARAM server  : Server, need not be listening
+ * @PARAM request : s3_extract query options, one line
+ * @PARAM reply   : Body to free, or an error message
+ * @RETURN 0 on success, 1 with reply->error set
+ */
+int
+serve_answer(serve_t *server, const char *request, serve_reply_t *reply)
+{
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	memset(reply, 0, sizeof(*reply));
+
+	char line[SERVE_REQUEST_MAX + 1];
+	char key[SERVE_REQUEST_MAX + 2]; // words and a separator each, at most one byte more than the line
+	char *words[SERVE_WORDS_MAX];
+	extract_query_t parsed;
+	int count = -1;
+	if (strlen(request) <= SERVE_REQUEST_MAX) {
+		strcpy(line, request);
+		count = request_words(line, words, SERVE_WORDS_MAX);
+	}
+	if (count < 0) {
+		snprintf(reply->error, SERVE_ERROR_MAX, "request too long or an unclosed quote");
+	}
+	else if (request_parse(words, count, &parsed, reply->error) == 0) {
+		// The key ignores quoting and spacing, not the order of the options
+		size_t used = 0;
+		for (int i = 0; i < count; i++) {
+			used += snprintf(key + used, sizeof(key) - used, "%s\n", words[i]);
+		}
+
+		serve_snapshot_t *snapshot = snapshot_acquire(server);
+		if (!cache_get(server, key, snapshot->generation, reply) &&
+			request_run(server, snapshot, &parsed, reply) == 0) {
+			cache_put(server, key, snapshot->generation, reply->body, reply->length);
+		}
+		snapshot_release(server, snapshot);
+	}
+
+	reply->micros = elapsed_micros(&start);
+	pthread_mutex_lock(&server->lock);
+	server->queries++;
+	server->hits += reply->cached;
+	server->failures += (reply->body == NULL);
+	pthread_mutex_unlock(&server->lock);
+	return reply->body == NULL;
+}
+// END REQUESTS --------------------------------------------------------------------------------
+
+// SOCKET SERVER -------------------------------------------------------------------------------
+// A connection carries one request line. The reply is "OK <bytes> <hit|miss> <micros>\n" and
+// the body, or "ERR <message>\n". The connection is closed after the reply.
+
+static int
+send_all(int fd, const char *data, size_t length)
+{
+	while (length > 0) {
+		ssize_t sent = send(fd, data, length, MSG_NOSIGNAL);
+		if (sent < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return 1;
+		}
+		data += sent;
+		length -= (size_t)sent;
+	}
+	return 0;
+}
+
+// Reads one request and sends its reply
+static void
+serve_connection(serve_t *server, int client)
+{
+	char request[SERVE_REQUEST_MAX + 1];
+	struct timeval timeout = {SERVE_TIMEOUT, 0};
+	setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+	size_t length = 0;
+	char *newline = NULL;
+	while (newline == NULL && length < SERVE_REQUEST_MAX) {
+		ssize_t got = recv(client, request + length, SERVE_REQUEST_MAX - length, 0);
+		if (got < 0 && errno == EINTR) {
+			continue;
+		}
+		if (got <= 0) {
+			break;
+		}
+		newline = (char *)memchr(request + length, '\n', (size_t)got);
+		length += (size_t)got;
+	}
+	if (newline == NULL && length == 0) {
+		return;
+	}
+	if (newline != NULL) {
+		*newline = '\0';
+	}
+	request[length] = '\0';
+
+	char header[64 + SERVE_ERROR_MAX];
+	serve_reply_t reply;
+	if (newline == NULL && length == SERVE_REQUEST_MAX) {
+		snprintf(header, sizeof(header), "ERR request longer than %d bytes\n", SERVE_REQUEST_MAX);
+		send_all(client, header, strlen(header));
+		return;
+	}
+	if (serve_answer(server, request, &reply) != 0) {
+		snprintf(header, sizeof(header), "ERR %s\n", reply.error);
+		send_all(client, header, strlen(header));
+	}
+	else {
+		snprintf(header, sizeof(header), "OK %zu %s %.0f\n", reply.length, reply.cached ? "hit" : "miss",
+				 reply.micros);
+		if (send_all(client, header, strlen(header)) == 0) {
+			send_all(client, reply.body, reply.length);
+		}
+	}
+	if (server->verbose) {
+		fprintf(stderr, "Serve: %s %.2f ms: %s\n", (reply.body == NULL) ? "failed" : reply.cached ? "hit" : "miss",
+				reply.micros / 1000, request);
+	}
+	free(reply.body);
+}
+
+static void *
+serve_worker(void *arg)
+{
+	serve_t *server = (serve_t *)arg;
+	for (;;) {
+		pthread_mutex_lock(&server->lock);
+		while (server->queue_count == 0 && !server->closing) {
+			pthread_cond_wait(&server->ready, &server->lock);
+		}
+		if (server->queue_count == 0) {
+			pthread_mutex_unlock(&server->lock);
+			return NULL;
+		}
+		int client = server->queue[server->queue_head];
+		server->queue_head = (server->queue_head + 1) % SERVE_QUEUE;
+		server->queue_count--;
+		pthread_mutex_unlock(&server->lock);
+
+		serve_connection(server, client);
+		close(client);
+	}
+}
+
+/**
+ * @BRIEF Loads a dataset and listens for requests
+ * @PARAM server      : Server to initialize, serve_close frees it whatever the result
+ * @PARAM dataset     : Dataset directory (s3lp -A)
+ * @PARAM socket_path : Unix socket to create, NULL to only call serve_answer
+ * @PARAM workers     : Requests answered at once
+ * @PARAM readers     : Scan threads per request
+ * @PARAM cache_bytes : Bytes of results kept, 0 turns the cache off
+ * @RETURN 0 on success, 1 on failure
+ */
+int
+serve_open(serve_t *server, const char *dataset, const char *socket_path, int workers, int readers,
+		   uint64_t cache_bytes)
+{
+	memset(server, 0, sizeof(*server));
+	server->listen_fd = -1;
+	server->workers = (workers < 1) ? 1 : (workers > SERVE_WORKERS_MAX) ? SERVE_WORKERS_MAX : workers;
+	server->readers = (readers < 1) ? 1 : readers;
+	server->memory_budget = spill_default_budget() / server->workers;
+	server->cache_budget = cache_bytes;
+	pthread_mutex_init(&server->lock, NULL);
+	pthread_mutex_init(&server->reload, NULL);
+	pthread_cond_init(&server->ready, NULL);
+
+	size_t length = strlen(dataset) + strlen(CATALOG_MANIFEST) + 2;
+	server->dataset = strdup(dataset);
+	server->manifest_path = (char *)malloc(length);
+	if (server->dataset == NULL || server->manifest_path == NULL) {
+		perror("Serve: Malloc");
+		return 1;
+	}
+	snprintf(server->manifest_path, length, "%s/%s", dataset, CATALOG_MANIFEST);
+	server->snapshot = snapshot_load(server, 1);
+	if (server->snapshot == NULL || socket_path == NULL) {
+		return server->snapshot == NULL;
+	}
+
+	struct sockaddr_un address;
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	if (strlen(socket_path) >= sizeof(address.sun_path)) {
+		fprintf(stderr, "Serve: socket path %s is too long\n", socket_path);
+		return 1;
+	}
+	strcpy(address.sun_path, socket_path);
+	server->listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (server->listen_fd < 0) {
+		perror("Serve: socket");
+		return 1;
+	}
+	// A socket left by a server that died is replaced, one still answering is not
+	if (connect(server->listen_fd, (struct sockaddr *)&address, sizeof(address)) == 0) {
+		fprintf(stderr, "Serve: %s is in use by another server\n", socket_path);
+		return 1;
+	}
+	unlink(socket_path);
+	if (bind(server->listen_fd, (struct sockaddr *)&address, sizeof(address)) != 0 ||
+		listen(server->listen_fd, SERVE_QUEUE) != 0) {
+		perror("Serve: bind");
+		return 1;
+	}
+	server->socket_path = strdup(socket_path);
+	return 0;
+}
+
+/**
+ * @BRIEF Answers connections until serve_stop
+ * @PARAM server : Server opened with a socket
+ * @RETURN 0 after serve_stop, 1 on failure
+ *
+ * @DETAILS Connections accepted before the stop are still answered.
+ */
+int
+serve_run(serve_t *server)
+{
+	int started = 0;
+	for (; started < server->workers; started++) {
+		if (pthread_create(&server->threads[started], NULL, serve_worker, server) != 0) {
+			perror("Serve: pthread_create");
+			break;
+		}
+	}
+	int err = (started == 0);
+
+	while (!err && !server->stopping) {
+		int client = accept(server->listen_fd, NULL, NULL);
+		if (client < 0) {
+			if (server->stopping) {
+				break;
+			}
+			if (errno == EINTR || errno == ECONNABORTED) {
+				continue;
+			}
+			perror("Serve: accept");
+			err = 1;
+			break;
+		}
+		pthread_mutex_lock(&server->lock);
+		int full = (server->queue_count == SERVE_QUEUE);
+		if (!full) {
+			server->queue[(server->queue_head + server->queue_count) % SERVE_QUEUE] = client;
+			server->queue_count++;
+			pthread_cond_signal(&server->ready);
+		}
+		pthread_mutex_unlock(&server->lock);
+		if (full) {
+			const char *busy = "ERR server busy\n";
+			send_all(client, busy, strlen(busy));
+			close(client);
+		}
+	}
+
+	pthread_mutex_lock(&server->lock);
+	server->closing = 1;
+	pthread_cond_broadcast(&server->ready);
+	pthread_mutex_unlock(&server->lock);
+	for (int i = 0; i < started; i++) {
+		pthread_join(server->threads[i], NULL);
+	}
+	return err;
+}
+
+// Ends serve_run, only sets a flag and shuts the socket so a signal handler may call it
+void
+serve_stop(serve_t *server)
+{
+	server->stopping = 1;
+	if (server->listen_fd >= 0) {
+		shutdown(server->listen_fd, SHUT_RDWR);
+	}
+}
+
+void
+serve_close(serve_t *server)
+{
+	if (server->listen_fd >= 0) {
+		close(server->listen_fd);
+	}
+	if (server->socket_path != NULL) {
+		unlink(server->socket_path);
+	}
+	while (server->cache_count > 0) {
+		cache_drop(server, 0);
+	}
+	if (server->snapshot != NULL) {
+		snapshot_release(server, server->snapshot);
+	}
+	pthread_cond_destroy(&server->ready);
+	pthread_mutex_destroy(&server->reload);
+	pthread_mutex_destroy(&server->lock);
+	free(server->socket_path);
+	free(server->manifest_path);
+	free(server->dataset);
+	memset(server, 0, sizeof(*server));
+	server->listen_fd = -1;
+}
+// END SOCKET SERVER ---------------------------------------------------------------------------
+
+// CLIENT --------------------------------------------------------------------------------------
+
+/**
+ * @BRIEF Sends s3_extract query options to s3_serve and writes its reply
+ * @PARAM socket_path : Server socket
+ * @PARAM argc        : Number of options
+ * @PARAM argv        : Options, quoted as needed
+ * @PARAM output      : JSON destination
+ * @PARAM verbose     : Cache hit and server time on stderr
+ * @RETURN 0 on success, 1 on failure
+ */
+int
+serve_request(const char *socket_path, int argc, char **argv, FILE *output, int verbose)
+{
+	char line[SERVE_REQUEST_MAX + 1];
+	size_t length = 0;
+	for (int i = 0; i < argc; i++) {
+		const char *arg = argv[i];
+		int quote = (*arg == '\0' || strpbrk(arg, " \t\r\n\"\\") != NULL);
+		// Every character escaped, the quotes, a space and the newline
+		if (length + 2 * strlen(arg) + 4 > SERVE_REQUEST_MAX) {
+			fprintf(stderr, "Query options longer than %d bytes\n", SERVE_REQUEST_MAX);
+			return 1;
+		}
+		if (i > 0) {
+			line[length++] = ' ';
+		}
+		if (quote) {
+			line[length++] = '"';
+		}
+		for (; *arg != '\0'; arg++) {
+			if (quote && (*arg == '"' || *arg == '\\')) {
+				line[length++] = '\\';
+			}
+			line[length++] = (*arg == '\n' || *arg == '\r') ? ' ' : *arg;
+		}
+		if (quote) {
+			line[length++] = '"';
+		}
+	}
+	line[length++] = '\n';
+
+	struct sockaddr_un address;
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	snprintf(address.sun_path, sizeof(address.sun_path), "%s", socket_path);
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0 || connect(fd, (struct sockaddr *)&address, sizeof(address)) != 0 || send_all(fd, line, length) != 0) {
+		perror(socket_path);
+		if (fd >= 0) {
+			close(fd);
+		}
+		return 1;
+	}
+	FILE *reply = fdopen(fd, "r");
+	if (reply == NULL) {
+		perror("fdopen");
+		close(fd);
+		return 1;
+	}
+
+	char header[64 + SERVE_ERROR_MAX];
+	size_t bytes = 0;
+	char source[8] = "";
+	double micros = 0;
+	int err = 0;
+	if (fgets(header, sizeof(header), reply) == NULL) {
+		fprintf(stderr, "%s: no reply\n", socket_path);
+		err = 1;
+	}
+	else if (sscanf(header, "OK %zu %7s %lf", &bytes, source, &micros) != 3) {
+		fprintf(stderr, "s3_serve: %s", (strncmp(header, "ERR ", 4) == 0) ? header + 4 : header);
+		err = 1;
+	}
+	char buffer[1 << 16];
+	while (!err && bytes > 0) {
+		size_t got = fread(buffer, 1, (bytes < sizeof(buffer)) ? bytes : sizeof(buffer), reply);
+		if (got == 0 || fwrite(buffer, 1, got, output) != got) {
+			fprintf(stderr, "%s: reply cut short\n", socket_path);
+			err = 1;
+		}
+		bytes -= got;
+	}
+	if (!err && verbose) {
+		fprintf(stderr, "Server: %s, %.2f ms\n", source, micros / 1000);
+	}
+	fclose(reply);
+	return err;
+}
+// END CLIENT ----------------------------------------------------------------------------------
+
+void
+print_serve_help(void)
+{
+	printf("Usage: s3_serve -D <dataset> -l <socket> [options]\n");
+	printf("Answers s3_extract queries over a dataset (s3lp -A) from a long running process\n\n");
+	printf("Options:\n");
+	printf("    -D <dir>       Dataset directory, new files are picked up as s3lp registers them\n");
+	printf("    -l <socket>    Unix socket to listen on\n");
+	printf("    -n <workers>   Requests answered at once [default: 4]\n");
+	printf("    -j <threads>   Scan threads per request [default: cores / workers]\n");
+	printf("    -C <MB>        Result cache size, 0 turns it off [default: %d]\n", SERVE_CACHE_DEFAULT);
+	printf("    -v             Log each request on stderr\n");
+	printf("    -h             Show this help message\n\n");
+	printf("Query: s3_extract -S <socket> [-v] <options>, with -g -T -z -O -L -k -r -m -c -q -a -p\n");
+	printf("       and --from, --to, --podcast as for s3_extract -D\n");
+}
@@ -0,0 +1,143 @@
+// S3 Log Serve
+//
+//
+//
+#include "../include/s3serve.h"
+#include <getopt.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static const struct option SERVE_LONG_OPTIONS[] = {
+	{"dataset", required_argument, NULL, 'D'},
+	{"listen", required_argument, NULL, 'l'},
+	{"cache", required_argument, NULL, 'C'},
+	{"help", no_argument, NULL, 'h'},
+	{NULL, 0, NULL, 0},
+};
+
+static serve_t server;
+
+static void
+on_signal(int signum)
+{
+	(void)signum;
+	serve_stop(&server);
+}
+
+/**
+ * S3 Log Serve - Main Entry
+ *
+ * Keeps a dataset mapped and answers s3_extract queries over a Unix socket until SIGINT or SIGTERM.
+ */
+
+int
+main(int argc, char *argv[])
+{
+	char *dataset = NULL;
+	char *socket_path = NULL;
+	int workers = 4;
+	int readers = 0; // cores / workers
+	uint64_t cache_bytes = (uint64_t)SERVE_CACHE_DEFAULT << 20;
+	int verbose = 0;
+
+	{
+		int opt = 0;
+		while ((opt = getopt_long(argc, argv, SERVE_OPTIONS, SERVE_LONG_OPTIONS, NULL)) != -1) {
+			switch (opt) {
+			// Dataset directory with a MANIFEST (s3lp -A)
+			// INPUT: -D <dir>, --dataset
+			case 'D': {
+				dataset = optarg;
+				break;
+			}
+			// INPUT: -l <socket>, --listen
+			case 'l': {
+				socket_path = optarg;
+				break;
+			}
+			// Requests answered at once
+			// INPUT: -n <workers>
+			case 'n': {
+				workers = atoi(optarg);
+				if (workers <= 0 || workers > SERVE_WORKERS_MAX) {
+					fprintf(stderr, "-n requires 1 to %d workers\n", SERVE_WORKERS_MAX);
+					exit(EXIT_FAILURE);
+				}
+				break;
+			}
+			// Scan threads per request
+			// INPUT: -j <threads>
+			case 'j': {
+				readers = atoi(optarg);
+				if (readers <= 0) {
+					fprintf(stderr, "-j requires a positive number of threads\n");
+					exit(EXIT_FAILURE);
+				}
+				break;
+			}
+			// Result cache, 0 turns it off
+			// INPUT: -C <MB>, --cache
+			case 'C': {
+				char *end = NULL;
+				double megabytes = strtod(optarg, &end);
+				if (end == optarg || megabytes < 0) {
+					fprintf(stderr, "--cache requires a size in MB, 0 turns it off\n");
+					exit(EXIT_FAILURE);
+				}
+				cache_bytes = (uint64_t)(megabytes * 1024 * 1024);
+				break;
+			}
+			case 'v': {
+				verbose = (verbose == 1) ? 0 : 1;
+				break;
+			}
+			case 'h':
+			default:
+				print_serve_help();
+				exit(EXIT_FAILURE);
+			}
+		}
+	} // End getopt scope
+
+	if (dataset == NULL || socket_path == NULL) {
+		print_serve_help();
+		exit(EXIT_FAILURE);
+	}
+	// A missing MANIFEST is an empty dataset, a missing directory is a typo
+	if (access(dataset, R_OK | X_OK) != 0) {
+		perror(dataset);
+		exit(EXIT_FAILURE);
+	}
+	if (readers == 0) {
+		long cores = sysconf(_SC_NPROCESSORS_ONLN);
+		readers = (cores > workers) ? (int)(cores / workers) : 1;
+	}
+
+	if (serve_open(&server, dataset, socket_path, workers, readers, cache_bytes) != 0) {
+		serve_close(&server);
+		exit(EXIT_FAILURE);
+	}
+	server.verbose = verbose;
+
+	// No SA_RESTART, so a signal also breaks accept
+	struct sigaction action;
+	memset(&action, 0, sizeof(action));
+	action.sa_handler = on_signal;
+	sigemptyset(&action.sa_mask);
+	sigaction(SIGINT, &action, NULL);
+	sigaction(SIGTERM, &action, NULL);
+	if (verbose) {
+		fprintf(stderr, "Serving %s (%u files) on %s, %d workers, %d scan threads each\n", dataset,
+				server.snapshot->catalog.count, socket_path, server.workers, server.readers);
+	}
+
+	int err = serve_run(&server);
+	if (verbose) {
+		fprintf(stderr, "Served %lu requests, %lu from cache, %lu failed, %lu reloads\n", server.queries,
+				server.hits, server.failures, server.reloads);
+	}
+	serve_close(&server);
+	exit(err ? EXIT_FAILURE : EXIT_SUCCESS);
+}
@@ -0,0 +1,280 @@
+#include "../include/s3session.h"
+
+// DOWNLOAD SESSIONS ---------------------------------------------------------------------------
+// Stitches the GET requests of one listener for one episode into a single download record,
+// so a client fetching an episode in dozens of overlapping ranges counts once, with the bytes
+// it actually covered.
+
+/**
+ * @BRIEF Allocates an empty session table
+ * @PARAM capacity : Sessions held at once, rounded up to a power of two
+ * @PARAM window   : Seconds after its first request a session is closed
+ * @PARAM output   : Stream the s_log_t download records are written to
+ * @RETURN Session table, NULL on allocation failure
+ */
+session_table_t *
+session_table_create(uint32_t capacity, uint32_t window, FILE *output)
+{
+	uint32_t size = 1;
+	while (size < capacity) {
+		size <<= 1;
+	}
+
+	session_table_t *table = (session_table_t *)calloc(1, sizeof(session_table_t));
+	if (table == NULL) {
+		perror("Session Table: Calloc");
+		return NULL;
+	}
+	table->ring = (session_t *)malloc((size_t)size * sizeof(session_t));
+	table->buckets = (uint32_t *)malloc((size_t)size * 2 * sizeof(uint32_t));
+	if (table->ring == NULL || table->buckets == NULL) {
+		perror("Session Table: Malloc");
+		session_table_free(table);
+		return NULL;
+	}
+	memset(table->buckets, 0xff, (size_t)size * 2 * sizeof(uint32_t));
+	table->capacity = size;
+	table->bucket_mask = size * 2 - 1; // load factor <= 0.5
+	table->window = window;
+	table->output = output;
+	return table;
+}
+
+void
+session_table_free(session_table_t *table)
+{
+	if (table == NULL) {
+		return;
+	}
+	free(table->ring);
+	free(table->buckets);
+	free(table);
+}
+
+static inline uint32_t
+session_bucket(const session_table_t *table, uint64_t ip, uint64_t key, uint64_t agent)
+{
+	return (uint32_t)hash64_mix(ip ^ HASH64_SECRET[0], key ^ agent) & table->bucket_mask;
+}
+
+/**
+ * @BRIEF Adds a byte range to a session's coverage
+ * @PARAM session : Session to update
+ * @PARAM first   : First byte
+ * @PARAM last    : Last byte
+ * @PARAM merged  : Incremented when the list is full and a gap had to be filled
+ *
+ * @DETAILS Ranges that overlap or touch are merged. Once SESSION_INTERVALS
+ *          disjoint ranges are held, the two closest are joined, over counting
+ *          only the smallest gap.
+ */
+void
+session_add_range(session_t *session, uint64_t first, uint64_t last, uint64_t *merged)
+{
+	uint64_t(*covered)[2] = session->covered;
+	int count = session->intervals;
+	int i = 0;
+
+	// Skip ranges entirely before the new one
+	while (i < count && covered[i][1] + 1 < first) {
+		i++;
+	}
+	// Absorb every range that overlaps or touches it
+	int j = i;
+	while (j < count && covered[j][0] <= last + 1) {
+		if (covered[j][0] < first) {
+			first = covered[j][0];
+		}
+		if (covered[j][1] > last) {
+			last = covered[j][1];
+		}
+		j++;
+	}
+	// Replace covered[i, j) with the merged range
+	int absorbed = j - i;
+	if (absorbed != 1) {
+		memmove(&covered[i + 1], &covered[j], (size_t)(count - j) * sizeof(covered[0]));
+		count += 1 - absorbed;
+	}
+	covered[i][0] = first;
+	covered[i][1] = last;
+
+	// Full: fill the smallest gap
+	if (count > SESSION_INTERVALS - 1) {
+		int best = 0;
+		for (int k = 1; k < count - 1; k++) {
+			if (covered[k + 1][0] - covered[k][1] < covered[best + 1][0] - covered[best][1]) {
+				best = k;
+			}
+		}
+		covered[best][1] = covered[best + 1][1];
+		memmove(&covered[best + 1], &covered[best + 2], (size_t)(count - best - 2) * sizeof(covered[0]));
+		count--;
+		(*merged)++;
+	}
+	session->intervals = (uint8_t)count;
+}
+
+// Bytes of the object covered by a session
+uint64_t
+session_covered(const session_t *session)
+{
+	uint64_t bytes = 0;
+	for (int i = 0; i < session->intervals; i++) {
+		bytes += session->covered[i][1] - session->covered[i][0] + 1;
+	}
+	return bytes;
+}
+
+// Completes the download record and writes it, the slot stays in the ring until head reaches it
+static void
+session_emit(session_table_t *table, session_t *session)
+{
+	s_log_t *record = &session->record;
+	uint64_t covered = session_covered(session);
+	uint64_t object_size = session->object_size;
+
+	record->bytes_sent_kb = (covered / 1024 > UINT16_MAX) ? UINT16_MAX : covered / 1024;
+	record->download_time_ms = (session->download_ms > UINT16_MAX) ? UINT16_MAX : session->download_ms;
+	record->http_code = session->partial ? 206 : 200;
+	record->completion_percent = (object_size == 0)		 ? 0
+								 : (covered >= object_size) ? 100
+															: 100 * covered / object_size;
+	record->flags &= IP_HASHED;
+	if (session->intervals > 0 && session->covered[0][0] == 0) {
+		record->flags |= STRT_206DL;
+	}
+	if (session->intervals > 0 && object_size > 0 &&
+		session->covered[session->intervals - 1][1] + 1 >= object_size) {
+		record->flags |= END_206DL;
+	}
+
+	fwrite(record, sizeof(s_log_t), 1, table->output);
+	table->downloads++;
+	session->live = 0;
+
+	// Unlink from its chain
+	uint32_t slot = (uint32_t)(session - table->ring);
+	uint32_t *link = &table->buckets[session_bucket(table, session->ip, session->key, session->agent)];
+	while (*link != slot) {
+		link = &table->ring[*link].next;
+	}
+	*link = session->next;
+}
+
+// Drops the oldest slot, emitting it first if it is still open
+static void
+session_pop(session_table_t *table)
+{
+	session_t *oldest = &table->ring[table->head];
+	if (oldest->live) {
+		session_emit(table, oldest);
+	}
+	table->head = (table->head + 1) & (table->capacity - 1);
+	table->used--;
+}
+
+/**
+ * @BRIEF Folds one parsed request into its download session
+ * @PARAM table    : Session table
+ * @PARAM full_log : Parsed request
+ * @PARAM slim_log : Slim log extracted from it
+ *
+ * @DETAILS Only successful GET.OBJECT requests (200, 206) are sessions. A session
+ *          closes when a request for it arrives more than window seconds after
+ *          its first one, when stream time (the newest timestamp) passes that
+ *          point, or when the table is full and it is the oldest.
+ */
+void
+session_track(session_table_t *table, const p_log_t *full_log, const s_log_t *slim_log)
+{
+	if ((full_log->http_code != 200 && full_log->http_code != 206) ||
+		strcmp(LOG_FIELD(full_log, operation), "REST.GET.OBJECT") != 0) {
+		return;
+	}
+	table->requests++;
+
+	uint32_t now = slim_log->timestamp;
+	if (now > table->watermark) {
+		table->watermark = now;
+	}
+
+	// Expire from the head, oldest first
+	while (table->used > 0) {
+		session_t *oldest = &table->ring[table->head];
+		if (oldest->live && (uint64_t)oldest->record.timestamp + table->window >= table->watermark) {
+			break;
+		}
+		session_pop(table);
+	}
+
+	uint64_t agent = hash64(LOG_FIELD(full_log, user_agent), full_log->user_agent.len);
+	uint32_t bucket = session_bucket(table, full_log->ip_addr, full_log->key_hash64, agent);
+	session_t *session = NULL;
+
+	for (uint32_t slot = table->buckets[bucket]; slot != SESSION_END; slot = table->ring[slot].next) {
+		session_t *candidate = &table->ring[slot];
+		if (candidate->ip == full_log->ip_addr && candidate->key == full_log->key_hash64 &&
+			candidate->agent == agent) {
+			session = candidate;
+			break;
+		}
+	}
+
+	// Same listener coming back after the window is a new download
+	if (session != NULL && (uint64_t)session->record.timestamp + table->window < now) {
+		session_emit(table, session);
+		session = NULL;
+	}
+
+	if (session == NULL) {
+		if (table->used == table->capacity) {
+			if (table->ring[table->head].live) {
+				table->forced++;
+			}
+			session_pop(table);
+		}
+		uint32_t slot = (table->head + table->used) & (table->capacity - 1);
+		table->used++;
+
+		session = &table->ring[slot];
+		session->ip = full_log->ip_addr;
+		session->key = full_log->key_hash64;
+		session->agent = agent;
+		session->object_size = full_log->object_size;
+		session->download_ms = 0;
+		session->record = *slim_log;
+		session->live = 1;
+		session->partial = 0;
+		session->intervals = 0;
+		session->next = table->buckets[bucket];
+		table->buckets[bucket] = slot;
+	}
+
+	// Bytes actually sent, a range cut short only covers what was delivered
+	size_t first = (full_log->http_code == 206) ? full_log->byte_start : 0;
+	if (full_log->bytes_sent > 0) {
+		session_add_range(session, first, first + full_log->bytes_sent - 1, &table->merged);
+	}
+	if (full_log->http_code == 206) {
+		session->partial = 1;
+	}
+	if (full_log->object_size > session->object_size) {
+		session->object_size = full_log->object_size;
+	}
+	if (now < session->record.timestamp) {
+		session->record.timestamp = now;
+	}
+	session->download_ms += full_log->ms_ttime;
+}
+
+// Closes every open session, call once at end of input
+void
+session_flush(session_table_t *table)
+{
+	while (table->used > 0) {
+		session_pop(table);
+	}
+	fflush(table->output);
+}
+// END DOWNLOAD SESSIONS -----------------------------------------------------------------------
@@ -0,0 +1,389 @@
+#include "../include/s3sort.h"
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+// SORT KEYS -----------------------------------------------------------------------------------
+// Keys are read in place: the timestamp and podcast_hash fields of the record, as little endian
+// bytes, so the radix passes need no key extraction and runs stay plain record arrays.
+
+/**
+ * @BRIEF Key layout of a sort order
+ * @PARAM key     : Layout to fill
+ * @PARAM sort_by : SORT_BY_*
+ * @PARAM wide    : 1 for s_log_wide_t records
+ */
+void
+sort_key_init(sort_key_t *key, int sort_by, int wide)
+{
+	memset(key, 0, sizeof(*key));
+	key->record_size = wide ? sizeof(s_log_wide_t) : sizeof(s_log_t);
+	key->time_offset = wide ? offsetof(s_log_wide_t, timestamp) : offsetof(s_log_t, timestamp);
+	key->podcast_offset = wide ? offsetof(s_log_wide_t, podcast_hash) : offsetof(s_log_t, podcast_hash);
+	key->podcast_bytes = (sort_by == SORT_BY_PODCAST) ? (wide ? 8 : 4) : 0;
+
+	// Least significant first: the timestamp, then the podcast above it
+	for (int i = 0; i < 4; i++) {
+		key->digit[key->digit_count++] = (uint16_t)(key->time_offset + i);
+	}
+	for (int i = 0; i < key->podcast_bytes; i++) {
+		key->digit[key->digit_count++] = (uint16_t)(key->podcast_offset + i);
+	}
+}
+
+// <0, 0, >0 as record a sorts before, with or after b
+int
+sort_key_compare(const sort_key_t *key, const void *a, const void *b)
+{
+	if (key->podcast_bytes > 0) {
+		uint64_t left = 0, right = 0;
+		memcpy(&left, (const uint8_t *)a + key->podcast_offset, key->podcast_bytes);
+		memcpy(&right, (const uint8_t *)b + key->podcast_offset, key->podcast_bytes);
+		if (left != right) {
+			return (left < right) ? -1 : 1;
+		}
+	}
+	uint32_t left, right;
+	memcpy(&left, (const uint8_t *)a + key->time_offset, sizeof(left));
+	memcpy(&right, (const uint8_t *)b + key->time_offset, sizeof(right));
+	return (left < right) ? -1 : (left > right);
+}
+// END SORT KEYS -------------------------------------------------------------------------------
+
+// RADIX SORT ----------------------------------------------------------------------------------
+// LSD radix sort, one byte per pass, moving whole records. One read of the run builds every
+// pass's histogram, and a pass whose byte is the same for all records (the high timestamp
+// bytes of a day's logs) is skipped. Each pass is stable, so equal keys keep input order.
+
+// One pass, size is a constant at both call sites so the record copy is inlined
+static inline void
+radix_scatter(const uint8_t *src, uint8_t *dst, size_t count, size_t size, size_t digit, size_t *bucket)
+{
+	for (size_t i = 0; i < count; i++, src += size) {
+		memcpy(dst + bucket[src[digit]]++ * size, src, size);
+	}
+}
+
+/**
+ * @BRIEF Sorts records by key
+ * @PARAM key     : Key layout
+ * @PARAM records : count records
+ * @PARAM scratch : Room for count records
+ * @PARAM count   : Records
+ * @RETURN records or scratch, whichever holds the sorted run
+ */
+void *
+radix_sort_records(const sort_key_t *key, void *records, void *scratch, size_t count)
+{
+	size_t size = key->record_size;
+	size_t counts[SORT_DIGITS_MAX][256];
+	memset(counts, 0, sizeof(counts));
+	const uint8_t *p = (const uint8_t *)records;
+	for (size_t i = 0; i < count; i++, p += size) {
+		for (int d = 0; d < key->digit_count; d++) {
+			counts[d][p[key->digit[d]]]++;
+		}
+	}
+
+	uint8_t *src = (uint8_t *)records;
+	uint8_t *dst = (uint8_t *)scratch;
+	for (int d = 0; d < key->digit_count && count > 0; d++) {
+		size_t *bucket = counts[d];
+		if (bucket[src[key->digit[d]]] == count) {
+			continue;
+		}
+		size_t offset = 0;
+		for (int b = 0; b < 256; b++) {
+			size_t n = bucket[b];
+			bucket[b] = offset;
+			offset += n;
+		}
+		if (size == sizeof(s_log_t)) {
+			radix_scatter(src, dst, count, sizeof(s_log_t), key->digit[d], bucket);
+		}
+		else {
+			radix_scatter(src, dst, count, sizeof(s_log_wide_t), key->digit[d], bucket);
+		}
+		uint8_t *swap = src;
+		src = dst;
+		dst = swap;
+	}
+	return src;
+}
+// END RADIX SORT ------------------------------------------------------------------------------
+
+// EXTERNAL SORT -------------------------------------------------------------------------------
+// Inputs are read in order into runs of at most half the budget (the other half is the radix
+// scratch). A single run goes straight to the output. Otherwise every sorted run is appended
+// to one unlinked run file and a k-way heap merge streams them out, ties going to the earlier
+// run so the whole sort is stable across files.
+
+// Records left in the inputs, UINT64_MAX when one is not a regular file
+static uint64_t
+input_records(FILE **inputs, int input_count, size_t size)
+{
+	uint64_t total = 0;
+	for (int i = 0; i < input_count; i++) {
+		struct stat st;
+		if (fstat(fileno(inputs[i]), &st) != 0 || !S_ISREG(st.st_mode)) {
+			return UINT64_MAX;
+		}
+		off_t position = ftello(inputs[i]);
+		total += (uint64_t)(st.st_size - ((position > 0) ? position : 0)) / size;
+	}
+	return total;
+}
+
+// Skips inputs at EOF, returns 1 when none has data left
+static int
+inputs_done(FILE **inputs, int input_count, int *current)
+{
+	while (*current < input_count) {
+		int c = getc(inputs[*current]);
+		if (c != EOF) {
+			ungetc(c, inputs[*current]);
+			return 0;
+		}
+		(*current)++;
+	}
+	return 1;
+}
+
+// Reads up to capacity records across the inputs, -1 on a read error
+static int64_t
+fill_run(FILE **inputs, int input_count, int *current, uint8_t *records, size_t capacity, size_t size)
+{
+	size_t filled = 0;
+	while (filled < capacity && *current < input_count) {
+		size_t want = capacity - filled;
+		if (want > SORT_READ_CHUNK) {
+			want = SORT_READ_CHUNK;
+		}
+		size_t got = fread(records + filled * size, size, want, inputs[*current]);
+		filled += got;
+		if (got < want) {
+			if (ferror(inputs[*current])) {
+				perror("Sort: fread");
+				return -1;
+			}
+			(*current)++;
+		}
+	}
+	return (int64_t)filled;
+}
+
+// Sift down of the merge heap, smallest head (then earliest run) on top
+static void
+sort_sift(uint32_t *heap, uint32_t count, const uint8_t *heads, const sort_key_t *key, uint32_t i)
+{
+	size_t size = key->record_size;
+	for (;;) {
+		uint32_t smallest = i;
+		for (uint32_t child = 2 * i + 1; child <= 2 * i + 2 && child < count; child++) {
+			int order = sort_key_compare(key, heads + heap[child] * size, heads + heap[smallest] * size);
+			if (order < 0 || (order == 0 && heap[child] < heap[smallest])) {
+				smallest = child;
+			}
+		}
+		if (smallest == i) {
+			return;
+		}
+		uint32_t swap = heap[i];
+		heap[i] = heap[smallest];
+		heap[smallest] = swap;
+		i = smallest;
+	}
+}
+
+// K-way merge of the runs in run_file into output
+static int
+merge_runs(FILE *run_file, const uint64_t *run_end, uint32_t runs, FILE *output, const sort_key_t *key,
+		   uint64_t budget)
+{
+	size_t size = key->record_size;
+	size_t buffer = SPILL_BUFFER;
+	if (budget > 0 && budget / runs < buffer) {
+		buffer = (budget / runs < SPILL_MIN_BUFFER) ? SPILL_MIN_BUFFER : budget / runs;
+	}
+	if (fflush(run_file) != 0) {
+		perror("Sort: fflush run");
+		return 1;
+	}
+
+	run_reader_t *readers = (run_reader_t *)calloc(runs, sizeof(run_reader_t));
+	uint8_t *heads = (uint8_t *)malloc(runs * size);
+	uint32_t *heap = (uint32_t *)malloc(runs * sizeof(uint32_t));
+	int err = (readers == NULL || heads == NULL || heap == NULL);
+	uint32_t count = 0;
+	for (uint32_t i = 0; !err && i < runs; i++) {
+		err = run_reader_init(&readers[i], run_file, (i > 0) ? run_end[i - 1] : 0, run_end[i], buffer) != 0;
+		if (!err && run_reader_next(&readers[i], heads + i * size, size) == 1) {
+			heap[count++] = i;
+		}
+	}
+	for (uint32_t i = count / 2; !err && i-- > 0;) {
+		sort_sift(heap, count, heads, key, i);
+	}
+
+	while (!err && count > 0) {
+		uint32_t run = heap[0];
+		if (fwrite(heads + run * size, size, 1, output) != 1) {
+			perror("Sort: fwrite");
+			err = 1;
+			break;
+		}
+		int got = run_reader_next(&readers[run], heads + run * size, size);
+		if (got < 0) {
+			err = 1;
+		}
+		else if (got == 0) {
+			heap[0] = heap[--count];
+		}
+		sort_sift(heap, count, heads, key, 0);
+	}
+
+	for (uint32_t i = 0; readers != NULL && i < runs; i++) {
+		run_reader_free(&readers[i]);
+	}
+	free(readers);
+	free(heads);
+	free(heap);
+	return err;
+}
+
+/**
+ * @BRIEF Sorts the records of every input into output
+ * @PARAM inputs      : Slim (or wide) record streams, read in order
+ * @PARAM input_count : Inputs
+ * @PARAM output      : Destination, same record format
+ * @PARAM config      : Order, record width and memory budget
+ * @RETURN 0 on success, 1 on allocation or I/O failure
+ */
+int
+sort_files(FILE **inputs, int input_count, FILE *output, const sort_config_t *config)
+{
+	sort_key_t key;
+	sort_key_init(&key, config->sort_by, config->wide);
+	size_t size = key.record_size;
+
+	// Half the budget is the run, half its scratch, and no run is larger than the input
+	uint64_t known = input_records(inputs, input_count, size);
+	uint64_t capacity = config->memory_budget / 2 / size;
+	if (config->memory_budget == 0) {
+		capacity = (known != UINT64_MAX) ? known : SORT_MAX_RUN;
+	}
+	capacity = (capacity < SORT_MIN_RUN) ? SORT_MIN_RUN : capacity;
+	capacity = (known < capacity) ? ((known > 0) ? known : 1) : capacity;
+
+	uint8_t *records = (uint8_t *)malloc(capacity * size);
+	uint8_t *scratch = (uint8_t *)malloc(capacity * size);
+	if (records == NULL || scratch == NULL) {
+		perror("Sort: Malloc");
+		free(records);
+		free(scratch);
+		return 1;
+	}
+
+	FILE *run_file = NULL;
+	char *run_buffer = NULL;
+	uint64_t *run_end = NULL;
+	uint32_t runs = 0;
+	uint32_t run_capacity = 0;
+	uint64_t total = 0;
+	int current = 0;
+	int err = 0;
+	for (;;) {
+		int64_t filled = fill_run(inputs, input_count, &current, records, capacity, size);
+		if (filled < 0) {
+			err = 1;
+			break;
+		}
+		if (filled == 0 && runs > 0) {
+			break;
+		}
+		uint8_t *sorted = (uint8_t *)radix_sort_records(&key, records, scratch, (size_t)filled);
+		total += (uint64_t)filled;
+
+		// Everything fit in one run
+		if (runs == 0 && inputs_done(inputs, input_count, &current)) {
+			if (fwrite(sorted, size, (size_t)filled, output) != (size_t)filled) {
+				perror("Sort: fwrite");
+				err = 1;
+			}
+			break;
+		}
+
+		if (run_file == NULL) {
+			run_file = spill_tmpfile();
+			run_buffer = (char *)malloc(SPILL_BUFFER);
+			if (run_file == NULL || run_buffer == NULL) {
+				err = 1;
+				break;
+			}
+			setvbuf(run_file, run_buffer, _IOFBF, SPILL_BUFFER);
+		}
+		if (runs == run_capacity) {
+			run_capacity = (run_capacity == 0) ? 64 : run_capacity * 2;
+			uint64_t *grown = (uint64_t *)realloc(run_end, run_capacity * sizeof(uint64_t));
+			if (grown == NULL) {
+				perror("Sort: Realloc");
+				err = 1;
+				break;
+			}
+			run_end = grown;
+		}
+		if (fwrite(sorted, size, (size_t)filled, run_file) != (size_t)filled) {
+			perror("Sort: fwrite run");
+			err = 1;
+			break;
+		}
+		run_end[runs] = ((runs > 0) ? run_end[runs - 1] : 0) + (uint64_t)filled * size;
+		runs++;
+		if (config->verbose) {
+			fprintf(stderr, "Sort: run %u, %ld records\n", runs, filled);
+		}
+		if (inputs_done(inputs, input_count, &current)) {
+			break;
+		}
+	}
+
+	// The merge buffers take the run's memory
+	free(records);
+	free(scratch);
+	if (!err && runs > 0) {
+		if (config->verbose) {
+			fprintf(stderr, "Sort: merging %u runs, %lu records\n", runs, total);
+		}
+		err = merge_runs(run_file, run_end, runs, output, &key, config->memory_budget);
+	}
+	if (config->verbose) {
+		fprintf(stderr, "Sort: %lu records sorted by %s\n", total,
+				(config->sort_by == SORT_BY_PODCAST) ? "podcast, time" : "time");
+	}
+	if (run_file != NULL) {
+		fclose(run_file);
+	}
+	free(run_buffer);
+	free(run_end);
+	return err;
+}
+// END EXTERNAL SORT ---------------------------------------------------------------------------
+
+void
+print_sort_help(void)
+{
+	printf("S3 Log Sort - Orders slim log files for delta compression, time skipping and merges\n");
+	printf("Usage: ./s3_sort [options] [file.bin ...]\n\n");
+	printf("Options:\n");
+	printf("    -f <file>      binary log file, repeatable, files may also follow the options (default: stdin)\n");
+	printf("    -o <file>      Sorted binary output (default: stdout)\n");
+	printf("    -k             Sort key: t(ime), p(odcast then time) [default: t]\n");
+	printf("    -M <MB>        Memory for a run and its radix scratch, 0 for no limit [default: half of RAM]\n");
+	printf("    -w             Records are wide (s3lp -t w)\n");
+	printf("    -v             Verbose Output, runs and merge\n");
+	printf("    -h             This page right here\n\n");
+	printf("Example usage:\n");
+	printf("\t./s3_sort -o may.bin day01.bin day02.bin day03.bin  // One time ordered file\n");
+	printf("\t./s3_sort -k p -M 512 -f month.bin -o by_show.bin   // Show, then time, in 512 MB\n");
+}
@@ -0,0 +1,158 @@
+// S3 Log Sort
+//
+//
+//
+#include "../include/s3sort.h"
+#include <getopt.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+static const struct option SORT_LONG_OPTIONS[] = {
+	{"key", required_argument, NULL, 'k'},
+	{"memory", required_argument, NULL, 'M'},
+	{"help", no_argument, NULL, 'h'},
+	{NULL, 0, NULL, 0},
+};
+
+/**
+ * S3 Log Sort - Main Entry
+ *
+ * Sorts one or more binary slim log files written by s3lp into a single ordered file.
+ */
+
+int
+main(int argc, char *argv[])
+{
+	char *output_file = NULL;
+	FILE *ofp = stdout;
+	char **input_files = (char **)calloc(argc, sizeof(char *));
+	int input_count = 0;
+	int sort_by = SORT_BY_TIME;
+	int wide = 0;
+	int verbose = 0;
+	uint64_t memory_budget = spill_default_budget();
+	if (input_files == NULL) {
+		perror("calloc inputs");
+		exit(EXIT_FAILURE);
+	}
+
+	{
+		int opt = 0;
+		while ((opt = getopt_long(argc, argv, SORT_OPTIONS, SORT_LONG_OPTIONS, NULL)) != -1) {
+			switch (opt) {
+			case 'f': {
+				input_files[input_count++] = optarg;
+				break;
+			}
+			case 'o': {
+				output_file = optarg;
+				break;
+			}
+			// Sort key
+			// INPUT: -k [t/p], --key
+			case 'k': {
+				switch (*optarg) {
+				case 't':
+					sort_by = SORT_BY_TIME;
+					break;
+				case 'p':
+					sort_by = SORT_BY_PODCAST;
+					break;
+				default:
+					fprintf(stderr, "Invalid Key. Use: t(ime) or p(odcast then time)\n");
+					exit(EXIT_FAILURE);
+				}
+				break;
+			}
+			// Memory for a run and its radix scratch, 0 for no limit
+			// INPUT: -M <MB>, --memory
+			case 'M': {
+				char *end = NULL;
+				double megabytes = strtod(optarg, &end);
+				if (end == optarg || megabytes < 0) {
+					fprintf(stderr, "--memory requires a size in MB, 0 for no limit\n");
+					exit(EXIT_FAILURE);
+				}
+				memory_budget = (uint64_t)(megabytes * 1024 * 1024);
+				break;
+			}
+			// Records written by s3lp -t w
+			case 'w': {
+				wide = 1;
+				break;
+			}
+			case 'v': {
+				verbose = (verbose == 1) ? 0 : 1;
+				break;
+			}
+			case 'h':
+			default:
+				print_sort_help();
+				exit(EXIT_FAILURE);
+			}
+		}
+	} // End getopt scope
+	for (int i = optind; i < argc; i++) {
+		input_files[input_count++] = argv[i];
+	}
+
+	// Open Files, stdin when none is named
+	size_t record_size = wide ? sizeof(s_log_wide_t) : sizeof(s_log_t);
+	FILE **inputs = (FILE **)calloc((input_count > 0) ? input_count : 1, sizeof(FILE *));
+	char **buffers = (char **)calloc((input_count > 0) ? input_count : 1, sizeof(char *));
+	if (inputs == NULL || buffers == NULL) {
+		perror("calloc inputs");
+		exit(EXIT_FAILURE);
+	}
+	inputs[0] = stdin;
+	for (int i = 0; i < input_count; i++) {
+		inputs[i] = fopen(input_files[i], "rb");
+		if (inputs[i] == NULL) {
+			perror(input_files[i]);
+			exit(EXIT_FAILURE);
+		}
+		struct stat st;
+		if (fstat(fileno(inputs[i]), &st) == 0 && st.st_size % record_size != 0) {
+			fprintf(stderr, "%s: %ld trailing bytes are not a whole record, ignored\n", input_files[i],
+					(long)(st.st_size % record_size));
+		}
+		buffers[i] = (char *)malloc(SPILL_BUFFER);
+		if (buffers[i] != NULL) {
+			setvbuf(inputs[i], buffers[i], _IOFBF, SPILL_BUFFER);
+		}
+	}
+
+	if (output_file) {
+		ofp = fopen(output_file, "wb");
+		if (!ofp) {
+			perror("fopen output_file");
+			exit(EXIT_FAILURE);
+		}
+	}
+	char *output_buffer = (char *)malloc(SPILL_BUFFER);
+	if (output_buffer != NULL) {
+		setvbuf(ofp, output_buffer, _IOFBF, SPILL_BUFFER);
+	}
+
+	sort_config_t config = {sort_by, wide, verbose, memory_budget};
+	int err = sort_files(inputs, (input_count > 0) ? input_count : 1, ofp, &config);
+	if (err != 0) {
+		fprintf(stderr, "Sort failed, aborting\n");
+	}
+
+	for (int i = 0; i < input_count; i++) {
+		fclose(inputs[i]);
+		free(buffers[i]);
+	}
+	if (fclose(ofp) != 0) {
+		perror("fclose output");
+		err = 1;
+	}
+	free(output_buffer);
+	free(inputs);
+	free(buffers);
+	free(input_files);
+
+	exit(err ? EXIT_FAILURE : EXIT_SUCCESS);
+}
@@ -0,0 +1,243 @@
+#include "../include/s3spill.h"
+#include "../include/s3lp.h"
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// RUN FILES -----------------------------------------------------------------------------------
+// Spilled data never outlives the process: files are unlinked as soon as they are created and
+// vanish with their descriptor, even when s3_extract is killed mid run.
+
+/**
+ * @BRIEF Opens an anonymous read/write file in $TMPDIR (or SPILL_DIR)
+ * @RETURN File, NULL on failure
+ */
+FILE *
+spill_tmpfile(void)
+{
+	const char *dir = getenv("TMPDIR");
+	if (dir == NULL || *dir == '\0') {
+		dir = SPILL_DIR;
+	}
+	char path[4096];
+	snprintf(path, sizeof(path), "%s/s3_extract.XXXXXX", dir);
+	int fd = mkstemp(path);
+	if (fd < 0) {
+		perror("Spill: mkstemp");
+		return NULL;
+	}
+	unlink(path);
+	FILE *file = fdopen(fd, "w+b");
+	if (file == NULL) {
+		perror("Spill: fdopen");
+		close(fd);
+	}
+	return file;
+}
+
+// Budget when none is given, a share of physical memory
+uint64_t
+spill_default_budget(void)
+{
+	long pages = sysconf(_SC_PHYS_PAGES);
+	long page_size = sysconf(_SC_PAGESIZE);
+	if (pages <= 0 || page_size <= 0) {
+		return 0;
+	}
+	return (uint64_t)pages * (uint64_t)page_size / SPILL_DEFAULT_FRACTION;
+}
+
+/**
+ * @BRIEF Partitions for the rest of an input, so each is expected to fit the budget
+ * @PARAM input  : Stream being grouped, its size and position estimate what is left
+ * @PARAM used   : Bytes held when the budget was hit
+ * @PARAM budget : Bytes allowed
+ * @RETURN Partition count, twice the estimate, in [2, SPILL_MAX_PARTITIONS]
+ *
+ * @DETAILS Scales what was held by the share of the input read so far. Groups
+ *          repeat, so this over-estimates, and unknown sizes get SPILL_PARTITIONS.
+ */
+uint32_t
+spill_partitions(FILE *input, uint64_t used, uint64_t budget)
+{
+	struct stat st;
+	off_t position = ftello(input);
+	if (fstat(fileno(input), &st) != 0 || !S_ISREG(st.st_mode) || position <= 0 || budget == 0) {
+		return SPILL_PARTITIONS;
+	}
+	double expected = (double)used * ((double)st.st_size / (double)position);
+	double count = 2 * (expected / (double)budget + 1);
+	if (count > SPILL_MAX_PARTITIONS) {
+		return SPILL_MAX_PARTITIONS;
+	}
+	return (count < 2) ? 2 : (uint32_t)count;
+}
+
+/**
+ * @BRIEF Creates count partitions of record_size records
+ * @PARAM spill       : Partitions to fill
+ * @PARAM count       : Partitions
+ * @PARAM level       : Repartition depth, partitions of one level split differently from the last
+ * @PARAM record_size : Bytes per record
+ * @PARAM budget      : Memory budget, a quarter of it at most goes to write buffers
+ * @RETURN 0 on success, 1 on failure (spill_close releases what was opened)
+ */
+int
+spill_open(spill_t *spill, uint32_t count, uint32_t level, size_t record_size, uint64_t budget)
+{
+	memset(spill, 0, sizeof(*spill));
+	spill->level = level;
+	spill->record_size = record_size;
+	spill->buffer_size = SPILL_BUFFER;
+	if (budget > 0 && budget / 4 / count < SPILL_BUFFER) {
+		spill->buffer_size = (budget / 4 / count < SPILL_MIN_BUFFER) ? SPILL_MIN_BUFFER : budget / 4 / count;
+	}
+	spill->runs = (FILE **)calloc(count, sizeof(FILE *));
+	spill->buffers = (char **)calloc(count, sizeof(char *));
+	spill->records = (uint64_t *)calloc(count, sizeof(uint64_t));
+	if (spill->runs == NULL || spill->buffers == NULL || spill->records == NULL) {
+		perror("Spill: Calloc");
+		return 1;
+	}
+	spill->count = count;
+	for (uint32_t i = 0; i < count; i++) {
+		spill->runs[i] = spill_tmpfile();
+		spill->buffers[i] = (char *)malloc(spill->buffer_size);
+		if (spill->runs[i] == NULL || spill->buffers[i] == NULL) {
+			fprintf(stderr, "Spill: cannot open %u run files\n", count);
+			return 1;
+		}
+		setvbuf(spill->runs[i], spill->buffers[i], _IOFBF, spill->buffer_size);
+	}
+	return 0;
+}
+
+// Partition of a 128 bit key, seeded by level and independent of the hash tables' home slots
+uint32_t
+spill_partition(const spill_t *spill, uint64_t low, uint64_t high)
+{
+	uint64_t hash = hash64_mix(low ^ HASH64_SECRET[(spill->level + 1) & 3],
+							   (high + spill->level) ^ HASH64_SECRET[(spill->level + 2) & 3]);
+	return (uint32_t)(((hash >> 32) * spill->count) >> 32);
+}
+
+// Appends a record to a partition, 0 on success
+int
+spill_write(spill_t *spill, uint32_t partition, const void *record)
+{
+	if (fwrite(record, spill->record_size, 1, spill->runs[partition]) != 1) {
+		perror("Spill: fwrite");
+		return 1;
+	}
+	spill->records[partition]++;
+	return 0;
+}
+
+// Flushes a partition and positions it at its first record for reading
+FILE *
+spill_rewind(spill_t *spill, uint32_t partition)
+{
+	FILE *run = spill->runs[partition];
+	if (fflush(run) != 0 || fseeko(run, 0, SEEK_SET) != 0) {
+		perror("Spill: rewind");
+		return NULL;
+	}
+	return run;
+}
+
+// Closes a partition once read, its disk space goes back right away
+void
+spill_release(spill_t *spill, uint32_t partition)
+{
+	if (spill->runs[partition] != NULL) {
+		fclose(spill->runs[partition]);
+		spill->runs[partition] = NULL;
+	}
+	free(spill->buffers[partition]);
+	spill->buffers[partition] = NULL;
+}
+
+void
+spill_close(spill_t *spill)
+{
+	for (uint32_t i = 0; i < spill->count; i++) {
+		spill_release(spill, i);
+	}
+	free(spill->runs);
+	free(spill->buffers);
+	free(spill->records);
+	memset(spill, 0, sizeof(*spill));
+}
+// END RUN FILES -------------------------------------------------------------------------------
+
+// RUN READERS ---------------------------------------------------------------------------------
+// Sorted runs share one file, back to back. A k-way merge reads them all at once, each through
+// its own buffer and offset, so one descriptor serves any number of runs.
+
+/**
+ * @BRIEF Reader over [offset, end) of a run file
+ * @PARAM reader : Reader to set up
+ * @PARAM file   : Run file, flushed
+ * @PARAM offset : First byte of the run
+ * @PARAM end    : First byte past the run
+ * @PARAM size   : Buffer bytes
+ * @RETURN 0 on success, 1 on allocation failure
+ */
+int
+run_reader_init(run_reader_t *reader, FILE *file, uint64_t offset, uint64_t end, size_t size)
+{
+	memset(reader, 0, sizeof(*reader));
+	reader->fd = fileno(file);
+	reader->offset = offset;
+	reader->end = end;
+	reader->size = size;
+	reader->buffer = (char *)malloc(size);
+	if (reader->buffer == NULL) {
+		perror("Run reader: Malloc");
+		return 1;
+	}
+	return 0;
+}
+
+/**
+ * @BRIEF Copies the next record of the run
+ * @RETURN 1 when a record was read, 0 at the end of the run, -1 on a read error
+ */
+int
+run_reader_next(run_reader_t *reader, void *record, size_t record_size)
+{
+	if (reader->length - reader->position < record_size) {
+		size_t left = reader->length - reader->position;
+		memmove(reader->buffer, reader->buffer + reader->position, left);
+		reader->length = left;
+		reader->position = 0;
+		while (reader->length < record_size && reader->offset < reader->end) {
+			uint64_t want = reader->end - reader->offset;
+			if (want > reader->size - reader->length) {
+				want = reader->size - reader->length;
+			}
+			ssize_t got = pread(reader->fd, reader->buffer + reader->length, want, (off_t)reader->offset);
+			if (got <= 0) {
+				perror("Run reader: pread");
+				return -1;
+			}
+			reader->length += (size_t)got;
+			reader->offset += (uint64_t)got;
+		}
+		if (reader->length < record_size) {
+			return 0;
+		}
+	}
+	memcpy(record, reader->buffer + reader->position, record_size);
+	reader->position += record_size;
+	return 1;
+}
+
+void
+run_reader_free(run_reader_t *reader)
+{
+	free(reader->buffer);
+	memset(reader, 0, sizeof(*reader));
+}
+// END RUN READERS -----------------------------------------------------------------------------
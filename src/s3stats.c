@@ -0,0 +1,201 @@
+#include "../include/s3stats.h"
+#include "../include/s3lp.h"
+
+// STATS ---------------------------------------------------------------------------------------
+// Stage timers are raw cycle counts, they are converted to nanoseconds only when reporting
+// by comparing the cycles elapsed since stats_init against the monotonic clock.
+
+static double
+elapsed_seconds(const struct timespec *from, const struct timespec *to)
+{
+	return (double)(to->tv_sec - from->tv_sec) + (double)(to->tv_nsec - from->tv_nsec) / 1e9;
+}
+
+// Nanoseconds per counted cycle over the run so far
+static double
+ns_per_cycle(const s3_stats_t *stats)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	uint64_t cycles = stats_cycles() - stats->start_cycles;
+	return (cycles == 0) ? 0.0 : elapsed_seconds(&stats->start, &now) * 1e9 / (double)cycles;
+}
+
+/**
+ * @BRIEF Resets all counters and starts the run clock
+ * @PARAM stats           : Stats to initialize
+ * @PARAM enabled         : 0 leaves every timer as a single untaken branch
+ * @PARAM report_interval : Seconds between stderr reports, 0 for none
+ */
+void
+stats_init(s3_stats_t *stats, int enabled, double report_interval)
+{
+	memset(stats, 0, sizeof(*stats));
+	stats->enabled = enabled;
+	stats->report_interval = report_interval;
+	clock_gettime(CLOCK_MONOTONIC, &stats->start);
+	stats->last_report = stats->start;
+	stats->start_cycles = stats_cycles();
+}
+
+void
+stats_batch_begin(s3_stats_t *stats)
+{
+	if (stats->enabled) {
+		clock_gettime(CLOCK_MONOTONIC, &stats->batch_start);
+	}
+}
+
+/**
+ * @BRIEF Records the latency of the batch started by stats_batch_begin
+ * @PARAM stats : Stats to update
+ *
+ * @DETAILS Also emits the periodic report when report_interval has passed, so
+ *          the clock is only read once per batch.
+ */
+void
+stats_batch_end(s3_stats_t *stats)
+{
+	if (!stats->enabled) {
+		return;
+	}
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	uint64_t usec = (uint64_t)(elapsed_seconds(&stats->batch_start, &now) * 1e6);
+	int bucket = 0;
+	while (bucket < STATS_LATENCY_BUCKETS - 1 && (1ull << bucket) <= usec) {
+		bucket++;
+	}
+	stats->batch_latency[bucket]++;
+	stats->batches++;
+
+	if (stats->report_interval > 0 && elapsed_seconds(&stats->last_report, &now) >= stats->report_interval) {
+		stats_report(stats, stderr);
+	}
+}
+
+/**
+ * @BRIEF One line progress report: totals plus rates since the previous report
+ * @PARAM stats  : Stats to report
+ * @PARAM output : Destination stream
+ */
+void
+stats_report(s3_stats_t *stats, FILE *output)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	double interval = elapsed_seconds(&stats->last_report, &now);
+	if (interval <= 0) {
+		interval = 1e-9;
+	}
+
+	fprintf(output, "[stats] %.1fs lines=%lu lines/s=%.0f MB/s=%.1f batches=%lu dedup_load=%.3f\n",
+			elapsed_seconds(&stats->start, &now), stats->lines, (stats->lines - stats->last_lines) / interval,
+			(stats->bytes - stats->last_bytes) / interval / MEGABYTE, stats->batches, stats->dedup_load);
+
+	stats->last_report = now;
+	stats->last_lines = stats->lines;
+	stats->last_bytes = stats->bytes;
+}
+
+/**
+ * @BRIEF Writes the end of run summary as a JSON object
+ * @PARAM stats  : Stats to write
+ * @PARAM parse  : s3lp line accounting and dedup load, NULL for s3_extract
+ * @PARAM output : Destination stream
+ */
+void
+stats_write_json(const s3_stats_t *stats, const parse_stats_t *parse, FILE *output)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	double elapsed = elapsed_seconds(&stats->start, &now);
+	double ns_cycle = ns_per_cycle(stats);
+	double lines = (stats->lines == 0) ? 1.0 : (double)stats->lines;
+
+	fprintf(output, "{\n");
+	fprintf(output, "  \"elapsed_s\": %.6f,\n", elapsed);
+	fprintf(output, "  \"lines\": %lu,\n", stats->lines);
+	fprintf(output, "  \"bytes\": %lu,\n", stats->bytes);
+	fprintf(output, "  \"lines_per_sec\": %.1f,\n", (elapsed > 0) ? stats->lines / elapsed : 0.0);
+	fprintf(output, "  \"mb_per_sec\": %.3f,\n", (elapsed > 0) ? stats->bytes / elapsed / MEGABYTE : 0.0);
+	fprintf(output, "  \"batches\": %lu,\n", stats->batches);
+
+	// Stage timers, tokenize is reported exclusive of the nested timestamp stage
+	fprintf(output, "  \"stages\": {");
+	int first = 1;
+	for (int i = 0; i < STAGE_COUNT; i++) {
+		uint64_t cycles = stats->stage_cycles[i];
+		if (i == STAGE_TOKENIZE && cycles >= stats->stage_cycles[STAGE_TIMESTAMP]) {
+			cycles -= stats->stage_cycles[STAGE_TIMESTAMP];
+		}
+		if (cycles == 0) {
+			continue;
+		}
+		fprintf(output, "%s\n    \"%s\": {\"cycles\": %lu, \"ns_per_line\": %.2f}", first ? "" : ",",
+				stats_stage_name(i), cycles, cycles * ns_cycle / lines);
+		first = 0;
+	}
+	fprintf(output, "\n  },\n");
+
+	// Batch latency, keyed by bucket upper bound in microseconds
+	fprintf(output, "  \"batch_latency_us\": {");
+	first = 1;
+	for (int i = 0; i < STATS_LATENCY_BUCKETS; i++) {
+		if (stats->batch_latency[i] == 0) {
+			continue;
+		}
+		if (i == STATS_LATENCY_BUCKETS - 1) {
+			fprintf(output, "%s\"inf\": %lu", first ? "" : ", ", stats->batch_latency[i]);
+		}
+		else {
+			fprintf(output, "%s\"%llu\": %lu", first ? "" : ", ", 1ull << i, stats->batch_latency[i]);
+		}
+		first = 0;
+	}
+	fprintf(output, "}");
+
+	if (parse != NULL) {
+		fprintf(output, ",\n  \"dedup_load_factor\": %.4f,\n", stats->dedup_load);
+		fprintf(output, "  \"long_lines\": %lu,\n", parse->long_lines);
+		fprintf(output, "  \"duplicates\": %lu,\n", parse->duplicates);
+		fprintf(output, "  \"filtered\": %lu,\n", parse->filtered);
+		fprintf(output, "  \"rejected\": {\"total\": %lu", parse->malformed);
+		for (int i = PARSE_OK + 1; i < PARSE_STATUS_COUNT; i++) {
+			fprintf(output, ", \"%s\": %lu", parse_status_name(i), parse->rejected[i]);
+		}
+		fprintf(output, "}");
+	}
+	fprintf(output, "\n}\n");
+}
+
+const char *
+stats_stage_name(int stage)
+{
+	switch (stage) {
+	case STAGE_READ:
+		return "read";
+	case STAGE_TOKENIZE:
+		return "tokenize";
+	case STAGE_TIMESTAMP:
+		return "timestamp";
+	case STAGE_UA:
+		return "ua_classify";
+	case STAGE_GEO:
+		return "geo";
+	case STAGE_DEDUP:
+		return "dedup";
+	case STAGE_REDELIVERY:
+		return "redelivery";
+	case STAGE_SESSION:
+		return "session";
+	case STAGE_GROUP:
+		return "group";
+	case STAGE_WRITE:
+		return "write";
+	default:
+		return "unknown";
+	}
+}
+// END STATS -----------------------------------------------------------------------------------
@@ -0,0 +1,622 @@
+#include "../include/s3time.h"
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+// CIVIL CALENDAR ------------------------------------------------------------------------------
+// Proleptic Gregorian date <-> days since 1970-01-01, integer only (H. Hinnant's algorithms),
+// so bucketing and labels never call localtime or mktime.
+
+static inline int64_t
+floor_div(int64_t a, int64_t b)
+{
+	int64_t q = a / b;
+	return (a % b != 0 && (a < 0) != (b < 0)) ? q - 1 : q;
+}
+
+static int64_t
+days_from_civil(int64_t year, int month, int day)
+{
+	year -= month <= 2;
+	int64_t era = floor_div(year, 400);
+	int64_t year_of_era = year - era * 400;
+	int64_t day_of_year = (153 * (month + (month > 2 ? -3 : 9)) + 2) / 5 + day - 1;
+	int64_t day_of_era = year_of_era * 365 + year_of_era / 4 - year_of_era / 100 + day_of_year;
+	return era * 146097 + day_of_era - 719468;
+}
+
+static void
+civil_from_days(int64_t days, int64_t *year, int *month, int *day)
+{
+	days += 719468;
+	int64_t era = floor_div(days, 146097);
+	int64_t day_of_era = days - era * 146097;
+	int64_t year_of_era = (day_of_era - day_of_era / 1460 + day_of_era / 36524 - day_of_era / 146096) / 365;
+	int64_t day_of_year = day_of_era - (365 * year_of_era + year_of_era / 4 - year_of_era / 100);
+	int64_t shifted_month = (5 * day_of_year + 2) / 153; // March = 0
+	*day = (int)(day_of_year - (153 * shifted_month + 2) / 5 + 1);
+	*month = (int)(shifted_month < 10 ? shifted_month + 3 : shifted_month - 9);
+	*year = year_of_era + era * 400 + (*month <= 2);
+}
+
+// 0 = Sunday, 1970-01-01 was a Thursday
+static inline int
+weekday(int64_t days)
+{
+	return (int)(days - floor_div(days + 4, 7) * 7 + 4);
+}
+
+static inline int
+is_leap(int64_t year)
+{
+	return (year % 4 == 0 && year % 100 != 0) || year % 400 == 0;
+}
+// END CIVIL CALENDAR --------------------------------------------------------------------------
+
+// POSIX TZ RULES ------------------------------------------------------------------------------
+// "CET-1CEST,M3.5.0,M10.5.0/3": the footer of a TZif file, or a -z value on its own. It
+// carries the zone past the file's last transition, so the table runs to 2106.
+
+// One end of daylight saving time
+typedef struct tz_date_s {
+	char kind;	  // 'J' Julian 1..365 without Feb 29, 'n' zero based day, 'M' month.week.day
+	int month;	  // 'M' only
+	int week;	  // 'M' only, 5 is the last
+	int day;	  // day of year, or weekday for 'M'
+	int32_t time; // local seconds after midnight, can exceed a day
+} tz_date_t;
+
+typedef struct tz_rule_s {
+	int32_t std_offset; // seconds east of UTC
+	int32_t dst_offset;
+	int has_dst;
+	tz_date_t start; // standard -> daylight
+	tz_date_t end;	 // daylight -> standard
+} tz_rule_t;
+
+// "EST" or "<+0530>", NULL when there is no name
+static const char *
+tz_parse_name(const char *s)
+{
+	if (*s == '<') {
+		const char *end = strchr(s, '>');
+		return (end != NULL) ? end + 1 : NULL;
+	}
+	const char *p = s;
+	while (isalpha((unsigned char)*p)) {
+		p++;
+	}
+	return (p - s >= 3) ? p : NULL;
+}
+
+// [+-]hh[:mm[:ss]] as seconds, NULL on malformed input
+static const char *
+tz_parse_time(const char *s, int32_t *seconds)
+{
+	int sign = 1;
+	if (*s == '+' || *s == '-') {
+		sign = (*s == '-') ? -1 : 1;
+		s++;
+	}
+	if (!isdigit((unsigned char)*s)) {
+		return NULL;
+	}
+	int32_t parts[3] = {0, 0, 0};
+	for (int i = 0; i < 3; i++) {
+		char *end = NULL;
+		parts[i] = (int32_t)strtol(s, &end, 10);
+		s = end;
+		if (*s != ':' || i == 2) {
+			break;
+		}
+		s++;
+	}
+	*seconds = sign * (parts[0] * 3600 + parts[1] * 60 + parts[2]);
+	return s;
+}
+
+static const char *
+tz_parse_date(const char *s, tz_date_t *date)
+{
+	char *end = NULL;
+	date->time = 2 * 3600;
+	if (*s == 'M') {
+		date->kind = 'M';
+		date->month = (int)strtol(s + 1, &end, 10);
+		if (*end != '.') {
+			return NULL;
+		}
+		date->week = (int)strtol(end + 1, &end, 10);
+		if (*end != '.') {
+			return NULL;
+		}
+		date->day = (int)strtol(end + 1, &end, 10);
+		if (date->month < 1 || date->month > 12 || date->week < 1 || date->week > 5 || date->day < 0 ||
+			date->day > 6) {
+			return NULL;
+		}
+	}
+	else {
+		date->kind = (*s == 'J') ? 'J' : 'n';
+		const char *digits = (*s == 'J') ? s + 1 : s;
+		if (!isdigit((unsigned char)*digits)) {
+			return NULL;
+		}
+		date->day = (int)strtol(digits, &end, 10);
+	}
+	s = end;
+	if (*s == '/') {
+		s = tz_parse_time(s + 1, &date->time);
+	}
+	return s;
+}
+
+// Whole TZ string, 1 when it is not one
+static int
+tz_parse_rule(const char *s, tz_rule_t *rule)
+{
+	memset(rule, 0, sizeof(*rule));
+	int32_t seconds = 0;
+	if ((s = tz_parse_name(s)) == NULL || (s = tz_parse_time(s, &seconds)) == NULL) {
+		return 1;
+	}
+	rule->std_offset = -seconds; // POSIX counts west of UTC
+	if (*s == '\0') {
+		return 0;
+	}
+
+	if ((s = tz_parse_name(s)) == NULL) {
+		return 1;
+	}
+	rule->has_dst = 1;
+	rule->dst_offset = rule->std_offset + 3600;
+	if (*s != ',' && *s != '\0') {
+		if ((s = tz_parse_time(s, &seconds)) == NULL) {
+			return 1;
+		}
+		rule->dst_offset = -seconds;
+	}
+	if (*s == '\0') {
+		s = "," TIME_ZONE_DST_RULE;
+	}
+	if (*s != ',' || (s = tz_parse_date(s + 1, &rule->start)) == NULL || *s != ',' ||
+		(s = tz_parse_date(s + 1, &rule->end)) == NULL) {
+		return 1;
+	}
+	return (*s == '\0') ? 0 : 1;
+}
+
+// Day (since 1970) a rule date falls on in a year
+static int64_t
+tz_date_day(const tz_date_t *date, int64_t year)
+{
+	int64_t january = days_from_civil(year, 1, 1);
+	switch (date->kind) {
+	case 'J':
+		return january + date->day - 1 + (is_leap(year) && date->day >= 60);
+	case 'n':
+		return january + date->day;
+	default: {
+		int64_t first = days_from_civil(year, date->month, 1);
+		int64_t day = first + (date->day - weekday(first) + 7) % 7 + (int64_t)(date->week - 1) * 7;
+		int64_t next = (date->month == 12) ? days_from_civil(year + 1, 1, 1)
+										   : days_from_civil(year, date->month + 1, 1);
+		while (day >= next) {
+			day -= 7; // week 5 is the last such weekday of the month
+		}
+		return day;
+	}
+	}
+}
+// END POSIX TZ RULES --------------------------------------------------------------------------
+
+// TIME ZONES ----------------------------------------------------------------------------------
+
+static int
+zone_push(time_zone_t *zone, int64_t at, int32_t offset)
+{
+	if (zone->count > 0 && at <= zone->at[zone->count - 1]) {
+		return 0; // the rule only extends past the file's own table
+	}
+	if (zone->count == zone->capacity) {
+		uint32_t capacity = zone->capacity ? zone->capacity * 2 : 64;
+		int64_t *at_list = (int64_t *)realloc(zone->at, capacity * sizeof(int64_t));
+		if (at_list != NULL) {
+			zone->at = at_list;
+		}
+		int32_t *offsets = (int32_t *)realloc(zone->offset, capacity * sizeof(int32_t));
+		if (offsets != NULL) {
+			zone->offset = offsets;
+		}
+		if (at_list == NULL || offsets == NULL) {
+			perror("Time zone: Realloc");
+			return 1;
+		}
+		zone->capacity = capacity;
+	}
+	zone->at[zone->count] = at;
+	zone->offset[zone->count] = offset;
+	zone->count++;
+	return 0;
+}
+
+// Appends a daylight saving rule's transitions from first_year through TIME_ZONE_LAST_YEAR
+static int
+zone_expand_rule(time_zone_t *zone, const tz_rule_t *rule, int64_t first_year)
+{
+	for (int64_t year = first_year; year <= TIME_ZONE_LAST_YEAR; year++) {
+		// Each switch happens on the wall clock in effect before it
+		int64_t start = tz_date_day(&rule->start, year) * 86400 + rule->start.time - rule->std_offset;
+		int64_t end = tz_date_day(&rule->end, year) * 86400 + rule->end.time - rule->dst_offset;
+		int err = (start < end) ? zone_push(zone, start, rule->dst_offset) || zone_push(zone, end, rule->std_offset)
+								: zone_push(zone, end, rule->std_offset) || zone_push(zone, start, rule->dst_offset);
+		if (err) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static inline uint32_t
+read_be32(const uint8_t *p)
+{
+	return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+static inline int64_t
+read_be64(const uint8_t *p)
+{
+	return (int64_t)((uint64_t)read_be32(p) << 32 | read_be32(p + 4));
+}
+
+// RFC 8536 file, the 64 bit block when there is one, then its TZ string footer
+static int
+zone_parse_tzif(time_zone_t *zone, const uint8_t *data, size_t size)
+{
+	if (size < 44 || memcmp(data, "TZif", 4) != 0) {
+		return 1;
+	}
+	size_t pos = 0;
+	int time_size = 4;
+	for (;;) {
+		if (pos + 44 > size || memcmp(data + pos, "TZif", 4) != 0) {
+			return 1;
+		}
+		const uint8_t *header = data + pos + 20;
+		uint32_t isut_count = read_be32(header);
+		uint32_t isstd_count = read_be32(header + 4);
+		uint32_t leap_count = read_be32(header + 8);
+		uint32_t time_count = read_be32(header + 12);
+		uint32_t type_count = read_be32(header + 16);
+		uint32_t char_count = read_be32(header + 20);
+		size_t block = (size_t)time_count * time_size + time_count + (size_t)type_count * 6 + char_count +
+					   (size_t)leap_count * (time_size + 4) + isstd_count + isut_count;
+		if (type_count == 0 || pos + 44 + block > size) {
+			return 1;
+		}
+
+		// Version 2+ repeats everything with 64 bit times, skip the 32 bit block
+		if (time_size == 4 && data[4] >= '2') {
+			pos += 44 + block;
+			time_size = 8;
+			continue;
+		}
+
+		const uint8_t *times = data + pos + 44;
+		const uint8_t *indices = times + (size_t)time_count * time_size;
+		const uint8_t *types = indices + time_count;
+		zone->initial = (int32_t)read_be32(types);
+		for (uint32_t i = 0; i < time_count; i++) {
+			if (indices[i] >= type_count) {
+				return 1;
+			}
+			int64_t at = (time_size == 8) ? read_be64(times + (size_t)i * 8) : (int32_t)read_be32(times + (size_t)i * 4);
+			if (zone_push(zone, at, (int32_t)read_be32(types + (size_t)indices[i] * 6)) != 0) {
+				return 1;
+			}
+		}
+		pos += 44 + block;
+		break;
+	}
+
+	// Footer "\n<TZ string>\n", absent from version 1 files
+	if (time_size == 8 && pos + 2 < size && data[pos] == '\n') {
+		const uint8_t *newline = (const uint8_t *)memchr(data + pos + 1, '\n', size - pos - 1);
+		char footer[128];
+		size_t length = (newline != NULL) ? (size_t)(newline - data - pos - 1) : 0;
+		if (length > 0 && length < sizeof(footer)) {
+			memcpy(footer, data + pos + 1, length);
+			footer[length] = '\0';
+			tz_rule_t rule;
+			if (tz_parse_rule(footer, &rule) != 0) {
+				return 1;
+			}
+			int64_t first_year = 1970;
+			if (zone->count > 0) {
+				int month = 0;
+				int day = 0;
+				civil_from_days(floor_div(zone->at[zone->count - 1], 86400), &first_year, &month, &day);
+			}
+			if (!rule.has_dst) {
+				if (zone->count == 0) {
+					zone->initial = rule.std_offset;
+				}
+			}
+			else if (zone_expand_rule(zone, &rule, first_year) != 0) {
+				return 1;
+			}
+		}
+	}
+	return 0;
+}
+
+static int
+zone_read_file(time_zone_t *zone, FILE *input)
+{
+	struct stat st;
+	if (fstat(fileno(input), &st) != 0 || st.st_size <= 0 || st.st_size > (1 << 20)) {
+		return 1;
+	}
+	uint8_t *data = (uint8_t *)malloc(st.st_size);
+	if (data == NULL) {
+		perror("Time zone: Malloc");
+		return 1;
+	}
+	int err = fread(data, st.st_size, 1, input) != 1 || zone_parse_tzif(zone, data, st.st_size) != 0;
+	free(data);
+	return err;
+}
+
+/**
+ * @BRIEF Loads the UTC offset history of a reporting zone
+ * @PARAM zone : Zone to fill
+ * @PARAM name : "UTC", a fixed "+05:30" (east of UTC), a TZif name under
+ *               TIME_ZONE_DIR or a path, or a POSIX TZ string
+ * @RETURN 0 on success, 1 when the zone is unknown or unreadable
+ *
+ * @DETAILS The table is built once, offsets are then a binary search with no
+ *          libc time call. A TZif file's footer rule extends it to 2106.
+ */
+int
+time_zone_load(time_zone_t *zone, const char *name)
+{
+	memset(zone, 0, sizeof(*zone));
+	if (name == NULL || strcmp(name, "UTC") == 0 || strcmp(name, "Z") == 0) {
+		snprintf(zone->name, sizeof(zone->name), "UTC");
+		return 0;
+	}
+	snprintf(zone->name, sizeof(zone->name), "%s", name);
+
+	// ISO 8601 offset, east positive unlike POSIX strings
+	if ((name[0] == '+' || name[0] == '-') && isdigit((unsigned char)name[1])) {
+		int32_t seconds = 0;
+		const char *end = tz_parse_time(name, &seconds);
+		if (end == NULL || *end != '\0') {
+			fprintf(stderr, "%s: bad UTC offset, use +hh[:mm]\n", name);
+			return 1;
+		}
+		zone->initial = seconds;
+		return 0;
+	}
+
+	char path[512];
+	snprintf(path, sizeof(path), (name[0] == '/' || name[0] == '.') ? "%s" : TIME_ZONE_DIR "/%s", name);
+	FILE *input = fopen(path, "rb");
+	if (input != NULL) {
+		int err = zone_read_file(zone, input);
+		fclose(input);
+		if (err) {
+			fprintf(stderr, "%s: not a readable TZif file\n", path);
+			time_zone_free(zone);
+		}
+		return err;
+	}
+
+	tz_rule_t rule;
+	if (tz_parse_rule(name, &rule) != 0) {
+		fprintf(stderr, "%s: unknown time zone\n", name);
+		return 1;
+	}
+	zone->initial = rule.std_offset;
+	if (rule.has_dst && zone_expand_rule(zone, &rule, 1970) != 0) {
+		time_zone_free(zone);
+		return 1;
+	}
+	return 0;
+}
+
+void
+time_zone_free(time_zone_t *zone)
+{
+	free(zone->at);
+	free(zone->offset);
+	zone->at = NULL;
+	zone->offset = NULL;
+	zone->count = 0;
+	zone->capacity = 0;
+}
+
+// Offset in effect at a UTC second
+int32_t
+time_zone_offset(const time_zone_t *zone, int64_t utc)
+{
+	if (zone->count == 0 || utc < zone->at[0]) {
+		return zone->initial;
+	}
+	uint32_t low = 0;
+	uint32_t high = zone->count - 1;
+	while (low < high) {
+		uint32_t mid = (low + high + 1) / 2;
+		if (zone->at[mid] <= utc) {
+			low = mid;
+		}
+		else {
+			high = mid - 1;
+		}
+	}
+	return zone->offset[low];
+}
+// END TIME ZONES ------------------------------------------------------------------------------
+
+// TIME BUCKETS --------------------------------------------------------------------------------
+// GROUP_TIME keys are the local wall clock second a bucket starts at, so a key is its own
+// label and a bucket means the same local hour or day whatever the offset that day. The
+// repeated hour when clocks go back lands in one bucket.
+
+/**
+ * @BRIEF Parses a bucket width and loads its zone
+ * @PARAM bucket    : Bucket to fill
+ * @PARAM spec      : [n]m or [n]h dividing a day, d, w or M, NULL for d
+ * @PARAM zone_name : Reporting zone, see time_zone_load, NULL for UTC
+ * @RETURN 0 on success, 1 on a bad width or zone
+ */
+int
+time_bucket_init(time_bucket_t *bucket, const char *spec, const char *zone_name)
+{
+	memset(bucket, 0, sizeof(*bucket));
+	if (spec == NULL) {
+		spec = "d";
+	}
+	char *end = (char *)spec;
+	long count = isdigit((unsigned char)*spec) ? strtol(spec, &end, 10) : 1;
+	int ok = count > 0 && end[0] != '\0' && end[1] == '\0';
+	switch (ok ? *end : '\0') {
+	case 'm':
+	case 'h':
+		bucket->unit = BUCKET_SECONDS;
+		bucket->width = (uint32_t)count * ((*end == 'm') ? 60 : 3600);
+		ok = count <= 24 * 60 && 86400 % bucket->width == 0;
+		if (count == 1) {
+			snprintf(bucket->name, sizeof(bucket->name), (*end == 'm') ? "minute" : "hour");
+		}
+		else {
+			snprintf(bucket->name, sizeof(bucket->name), (*end == 'm') ? "%ldmin" : "%ldh", count);
+		}
+		break;
+	case 'd':
+		bucket->unit = BUCKET_SECONDS;
+		bucket->width = 86400;
+		ok = count == 1;
+		snprintf(bucket->name, sizeof(bucket->name), "day");
+		break;
+	case 'w':
+		bucket->unit = BUCKET_WEEK;
+		ok = count == 1;
+		snprintf(bucket->name, sizeof(bucket->name), "week");
+		break;
+	case 'M':
+		bucket->unit = BUCKET_MONTH;
+		ok = count == 1;
+		snprintf(bucket->name, sizeof(bucket->name), "month");
+		break;
+	default:
+		ok = 0;
+	}
+	if (!ok) {
+		fprintf(stderr, "%s: bad time bucket, use [n]m or [n]h dividing a day, d, w or M\n", spec);
+		return 1;
+	}
+	return time_zone_load(&bucket->zone, zone_name);
+}
+
+void
+time_bucket_free(time_bucket_t *bucket)
+{
+	time_zone_free(&bucket->zone);
+}
+
+// Local wall clock second of a UTC timestamp, UTC without a bucket
+int64_t
+time_local(const time_bucket_t *bucket, uint32_t timestamp)
+{
+	if (bucket == NULL) {
+		return timestamp;
+	}
+	return (int64_t)timestamp + time_zone_offset(&bucket->zone, timestamp);
+}
+
+/**
+ * @BRIEF Bucket a record falls in
+ * @PARAM bucket    : Width and zone, NULL for UTC days
+ * @PARAM timestamp : Record time, UTC
+ * @RETURN Local wall clock second the bucket starts at
+ */
+int64_t
+time_bucket_key(const time_bucket_t *bucket, uint32_t timestamp)
+{
+	int64_t local = time_local(bucket, timestamp);
+	if (bucket == NULL) {
+		return local - local % 86400;
+	}
+	switch (bucket->unit) {
+	case BUCKET_WEEK: {
+		int64_t days = floor_div(local, 86400);
+		return (days - (weekday(days) + 6) % 7) * 86400; // back to Monday
+	}
+	case BUCKET_MONTH: {
+		int64_t year = 0;
+		int month = 0;
+		int day = 0;
+		civil_from_days(floor_div(local, 86400), &year, &month, &day);
+		return days_from_civil(year, month, 1) * 86400;
+	}
+	default:
+		return floor_div(local, bucket->width) * bucket->width;
+	}
+}
+
+// "YYYY-MM-DD HH:MM:SS" of a local wall clock second
+void
+format_local_time(int64_t local, char *buffer, size_t size)
+{
+	int64_t days = floor_div(local, 86400);
+	int64_t seconds = local - days * 86400;
+	int64_t year = 0;
+	int month = 0;
+	int day = 0;
+	civil_from_days(days, &year, &month, &day);
+	snprintf(buffer, size, "%04ld-%02d-%02d %02ld:%02ld:%02ld", (long)year, month, day, (long)(seconds / 3600),
+			 (long)(seconds / 60 % 60), (long)(seconds % 60));
+}
+
+/**
+ * @BRIEF Parses a wall clock time in a zone
+ * @PARAM text : "YYYY-MM-DD", "YYYY-MM-DD HH:MM[:SS]" (or T between), or @seconds since 1970 UTC
+ * @PARAM zone : Zone of the wall clock
+ * @PARAM utc  : Parsed UTC second
+ * @RETURN 0 on success, 1 on a malformed time
+ *
+ * @DETAILS Wall clock times a DST change skips or repeats resolve to one of
+ *          the two offsets around the change.
+ */
+int
+time_parse(const char *text, const time_zone_t *zone, int64_t *utc)
+{
+	if (*text == '@') {
+		char *end = NULL;
+		*utc = strtoll(text + 1, &end, 10);
+		return (end == text + 1 || *end != '\0');
+	}
+	int year = 0, month = 0, day = 0, hour = 0, minute = 0, second = 0, used = 0;
+	if (sscanf(text, "%4d-%2d-%2d%n", &year, &month, &day, &used) != 3) {
+		return 1;
+	}
+	const char *rest = text + used;
+	if (*rest == 'T' || *rest == ' ') {
+		int fields = sscanf(rest + 1, "%2d:%2d%n:%2d%n", &hour, &minute, &used, &second, &used);
+		if (fields < 2) {
+			return 1;
+		}
+		rest += 1 + used;
+	}
+	if (*rest != '\0' || month < 1 || month > 12 || day < 1 || day > 31 || hour > 23 || minute > 59 || second > 59) {
+		return 1;
+	}
+
+	int64_t local = days_from_civil(year, month, day) * 86400 + hour * 3600 + minute * 60 + second;
+	int32_t offset = time_zone_offset(zone, local - time_zone_offset(zone, local));
+	*utc = local - offset;
+	return 0;
+}
+// END TIME BUCKETS ----------------------------------------------------------------------------
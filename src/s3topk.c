@@ -0,0 +1,788 @@
+#include "../include/s3topk.h"
+#include <pthread.h>
+#include <sys/mman.h>
+
+// SPACE-SAVING --------------------------------------------------------------------------------
+// Heavy hitters in bounded memory. Counters sit in a min-heap on count so the one to
+// replace is always on top, and an open addressing index finds an item's counter.
+
+static inline uint32_t
+ss_home(const space_saving_t *sketch, uint64_t item)
+{
+	return (uint32_t)hash64_mix(item ^ HASH64_SECRET[1], HASH64_SECRET[2]) & sketch->index_mask;
+}
+
+static inline uint64_t
+ss_count(const space_saving_t *sketch, uint32_t heap_pos)
+{
+	return sketch->counters[sketch->heap[heap_pos]].count;
+}
+
+static inline void
+ss_swap(space_saving_t *sketch, uint32_t a, uint32_t b)
+{
+	uint32_t counter_a = sketch->heap[a];
+	uint32_t counter_b = sketch->heap[b];
+	sketch->heap[a] = counter_b;
+	sketch->heap[b] = counter_a;
+	sketch->counters[counter_b].heap_pos = a;
+	sketch->counters[counter_a].heap_pos = b;
+}
+
+static void
+ss_sift_up(space_saving_t *sketch, uint32_t pos)
+{
+	while (pos > 0 && ss_count(sketch, (pos - 1) / 2) > ss_count(sketch, pos)) {
+		ss_swap(sketch, pos, (pos - 1) / 2);
+		pos = (pos - 1) / 2;
+	}
+}
+
+// Counts only grow, so an updated counter only ever moves down
+static void
+ss_sift_down(space_saving_t *sketch, uint32_t pos)
+{
+	for (;;) {
+		uint32_t smallest = 2 * pos + 1;
+		if (smallest >= sketch->count) {
+			return;
+		}
+		if (smallest + 1 < sketch->count && ss_count(sketch, smallest + 1) < ss_count(sketch, smallest)) {
+			smallest++;
+		}
+		if (ss_count(sketch, smallest) >= ss_count(sketch, pos)) {
+			return;
+		}
+		ss_swap(sketch, pos, smallest);
+		pos = smallest;
+	}
+}
+
+static void
+ss_index_insert(space_saving_t *sketch, uint64_t item, uint32_t counter)
+{
+	uint32_t slot = ss_home(sketch, item);
+	while (sketch->index[slot] != 0) {
+		slot = (slot + 1) & sketch->index_mask;
+	}
+	sketch->index[slot] = counter + 1;
+}
+
+// Linear probing delete: shifts later entries of the run back instead of leaving tombstones
+static void
+ss_index_remove(space_saving_t *sketch, uint64_t item)
+{
+	uint32_t mask = sketch->index_mask;
+	uint32_t hole = ss_home(sketch, item);
+	while (sketch->counters[sketch->index[hole] - 1].item != item) {
+		hole = (hole + 1) & mask;
+	}
+	for (uint32_t next = (hole + 1) & mask; sketch->index[next] != 0; next = (next + 1) & mask) {
+		uint32_t home = ss_home(sketch, sketch->counters[sketch->index[next] - 1].item);
+		// Entry may move back only if its home is not inside (hole, next]
+		if (((next - home) & mask) >= ((next - hole) & mask)) {
+			sketch->index[hole] = sketch->index[next];
+			hole = next;
+		}
+	}
+	sketch->index[hole] = 0;
+}
+
+// Resizes the arrays to hold capacity counters, index at no more than half load
+static int
+ss_reserve(space_saving_t *sketch, uint32_t capacity)
+{
+	uint32_t index_size = 1;
+	while (index_size < capacity * 2) {
+		index_size <<= 1;
+	}
+	ss_counter_t *counters = (ss_counter_t *)realloc(sketch->counters, capacity * sizeof(ss_counter_t));
+	if (counters == NULL) {
+		perror("Space Saving: Realloc");
+		return 1;
+	}
+	sketch->counters = counters;
+	uint32_t *heap = (uint32_t *)realloc(sketch->heap, capacity * sizeof(uint32_t));
+	if (heap == NULL) {
+		perror("Space Saving: Realloc");
+		return 1;
+	}
+	sketch->heap = heap;
+	uint32_t *index = (uint32_t *)calloc(index_size, sizeof(uint32_t));
+	if (index == NULL) {
+		perror("Space Saving: Calloc");
+		return 1;
+	}
+	free(sketch->index);
+	sketch->index = index;
+	sketch->index_mask = index_size - 1;
+	sketch->capacity = capacity;
+	for (uint32_t i = 0; i < sketch->count; i++) {
+		ss_index_insert(sketch, sketch->counters[i].item, i);
+	}
+	return 0;
+}
+
+/**
+ * @BRIEF Sets up an empty sketch
+ * @PARAM sketch : Sketch to initialize
+ * @PARAM limit  : Most counters ever held, memory starts at TOPK_START_COUNTERS
+ * @RETURN 0 on success, 1 on allocation failure
+ */
+int
+space_saving_init(space_saving_t *sketch, uint32_t limit)
+{
+	memset(sketch, 0, sizeof(*sketch));
+	sketch->limit = limit;
+	if (ss_reserve(sketch, (limit < TOPK_START_COUNTERS) ? limit : TOPK_START_COUNTERS) != 0) {
+		space_saving_free(sketch);
+		return 1;
+	}
+	return 0;
+}
+
+void
+space_saving_free(space_saving_t *sketch)
+{
+	free(sketch->counters);
+	free(sketch->heap);
+	free(sketch->index);
+	memset(sketch, 0, sizeof(*sketch));
+}
+
+// Counter holding item, -1 when it is not monitored
+int
+space_saving_find(const space_saving_t *sketch, uint64_t item)
+{
+	for (uint32_t slot = ss_home(sketch, item); sketch->index[slot] != 0;
+		 slot = (slot + 1) & sketch->index_mask) {
+		uint32_t counter = sketch->index[slot] - 1;
+		if (sketch->counters[counter].item == item) {
+			return (int)counter;
+		}
+	}
+	return -1;
+}
+
+// Most weight any unmonitored item can have
+uint64_t
+space_saving_min(const space_saving_t *sketch)
+{
+	uint64_t smallest = (sketch->count == sketch->limit) ? ss_count(sketch, 0) : 0;
+	return (smallest > sketch->unmonitored) ? smallest : sketch->unmonitored;
+}
+
+/**
+ * @BRIEF Adds weight to an item
+ * @PARAM sketch : Sketch
+ * @PARAM item   : Item key
+ * @PARAM weight : Weight to add
+ * @PARAM flags  : Record flags kept with a newly monitored item
+ * @RETURN 0 on success, 1 on allocation failure
+ */
+int
+space_saving_update(space_saving_t *sketch, uint64_t item, uint64_t weight, uint8_t flags)
+{
+	int found = space_saving_find(sketch, item);
+	if (found >= 0) {
+		sketch->counters[found].count += weight;
+		ss_sift_down(sketch, sketch->counters[found].heap_pos);
+		return 0;
+	}
+
+	if (sketch->count == sketch->capacity && sketch->capacity < sketch->limit) {
+		uint32_t capacity = (sketch->capacity * 2 < sketch->limit) ? sketch->capacity * 2 : sketch->limit;
+		if (ss_reserve(sketch, capacity) != 0) {
+			return 1;
+		}
+	}
+
+	// A new item may already have had up to the bound, it starts there
+	uint64_t bound = space_saving_min(sketch);
+	uint32_t counter;
+	uint32_t pos;
+	if (sketch->count < sketch->capacity) {
+		counter = sketch->count;
+		pos = sketch->count++;
+		sketch->heap[pos] = counter;
+	}
+	else {
+		counter = sketch->heap[0];
+		pos = 0;
+		ss_index_remove(sketch, sketch->counters[counter].item);
+	}
+
+	ss_counter_t *entry = &sketch->counters[counter];
+	entry->item = item;
+	entry->count = bound + weight;
+	entry->error = bound;
+	entry->heap_pos = pos;
+	entry->flags = flags;
+	ss_index_insert(sketch, item, counter);
+	ss_sift_up(sketch, pos);
+	ss_sift_down(sketch, entry->heap_pos);
+	return 0;
+}
+
+static int
+compare_counter(const void *a, const void *b)
+{
+	const ss_counter_t *x = (const ss_counter_t *)a;
+	const ss_counter_t *y = (const ss_counter_t *)b;
+	if (x->count != y->count) {
+		return (x->count < y->count) - (x->count > y->count); // descending
+	}
+	return (x->item > y->item) - (x->item < y->item);
+}
+
+/**
+ * @BRIEF Folds src into dst, the result summarizes both streams
+ * @PARAM dst : Sketch updated in place
+ * @PARAM src : Sketch with the same limit
+ * @RETURN 0 on success, 1 on allocation failure
+ *
+ * @DETAILS An item missing from one side gets that side's bound added to both
+ *          count and error. The union is cut back to the limit largest counts,
+ *          and the largest count cut off becomes a bound for unmonitored items.
+ */
+int
+space_saving_merge(space_saving_t *dst, const space_saving_t *src)
+{
+	uint64_t bound_dst = space_saving_min(dst);
+	uint64_t bound_src = space_saving_min(src);
+	uint32_t total = dst->count + src->count;
+	ss_counter_t *all = (ss_counter_t *)malloc((total ? total : 1) * sizeof(ss_counter_t));
+	if (all == NULL) {
+		perror("Space Saving Merge: Malloc");
+		return 1;
+	}
+
+	uint32_t n = 0;
+	for (uint32_t i = 0; i < dst->count; i++) {
+		all[n] = dst->counters[i];
+		int other = space_saving_find(src, all[n].item);
+		all[n].count += (other >= 0) ? src->counters[other].count : bound_src;
+		all[n].error += (other >= 0) ? src->counters[other].error : bound_src;
+		n++;
+	}
+	for (uint32_t i = 0; i < src->count; i++) {
+		if (space_saving_find(dst, src->counters[i].item) < 0) {
+			all[n] = src->counters[i];
+			all[n].count += bound_dst;
+			all[n].error += bound_dst;
+			n++;
+		}
+	}
+	qsort(all, n, sizeof(ss_counter_t), compare_counter);
+
+	uint32_t keep = (n < dst->limit) ? n : dst->limit;
+	uint64_t unmonitored = bound_dst + bound_src;
+	if (keep < n && all[keep].count > unmonitored) {
+		unmonitored = all[keep].count;
+	}
+	if (keep > dst->capacity && ss_reserve(dst, keep) != 0) {
+		free(all);
+		return 1;
+	}
+
+	// Descending counts read backwards are already a valid min-heap
+	memset(dst->index, 0, (dst->index_mask + 1) * sizeof(uint32_t));
+	dst->count = keep;
+	dst->unmonitored = unmonitored;
+	for (uint32_t i = 0; i < keep; i++) {
+		dst->counters[i] = all[i];
+		dst->counters[i].heap_pos = keep - 1 - i;
+		dst->heap[keep - 1 - i] = i;
+		ss_index_insert(dst, all[i].item, i);
+	}
+	free(all);
+	return 0;
+}
+// END SPACE-SAVING ----------------------------------------------------------------------------
+
+// TOP-K EXTRACT -------------------------------------------------------------------------------
+// Pass 1: every worker sketches its slice of the mapped input per group, and the sketches
+// are merged. Pass 2 (mapped input only): the workers count the merged candidates exactly,
+// so the reported values carry no sketch error.
+
+// One group's sketch and exact totals
+typedef struct topk_group_s {
+	uint64_t key;
+	uint64_t total;		  // exact metric sum over the group
+	uint64_t bound;		  // most weight an item outside the sketch can have
+	uint32_t base;		  // first exact counter of the group in pass 2
+	uint8_t flags;		  // flags of a record in the group, for formatting IP keys
+	space_saving_t sketch;
+} topk_group_t;
+
+// Group key -> sketch
+typedef struct topk_table_s {
+	topk_group_t *groups;
+	uint32_t *index; // open addressing key -> group + 1
+	uint32_t index_mask;
+	uint32_t count;
+	uint32_t capacity;
+	uint32_t limit; // sketch counters per group
+} topk_table_t;
+
+// One slice of the input
+typedef struct topk_worker_s {
+	const extract_config_t *config;
+	const char *records;
+	size_t first; // first record of the slice
+	size_t last;  // one past the last record
+	topk_table_t table;			// pass 1 sketches
+	const topk_table_t *merged; // pass 2 candidates
+	uint64_t *exact;			// pass 2 counts, indexed by group base + counter
+	int failed;
+} topk_worker_t;
+
+static inline uint32_t
+topk_home(const topk_table_t *table, uint64_t key)
+{
+	return (uint32_t)hash64_mix(key ^ HASH64_SECRET[3], HASH64_SECRET[0]) & table->index_mask;
+}
+
+static int
+topk_table_init(topk_table_t *table, uint32_t limit)
+{
+	memset(table, 0, sizeof(*table));
+	table->limit = limit;
+	table->capacity = GROUP_THRESHOLD;
+	table->index_mask = GROUP_THRESHOLD * 2 - 1;
+	table->groups = (topk_group_t *)malloc(table->capacity * sizeof(topk_group_t));
+	table->index = (uint32_t *)calloc(table->index_mask + 1, sizeof(uint32_t));
+	if (table->groups == NULL || table->index == NULL) {
+		perror("Top K: Malloc");
+		return 1;
+	}
+	return 0;
+}
+
+static void
+topk_table_free(topk_table_t *table)
+{
+	for (uint32_t i = 0; i < table->count; i++) {
+		space_saving_free(&table->groups[i].sketch);
+	}
+	free(table->groups);
+	free(table->index);
+	memset(table, 0, sizeof(*table));
+}
+
+static topk_group_t *
+topk_find(const topk_table_t *table, uint64_t key)
+{
+	for (uint32_t slot = topk_home(table, key); table->index[slot] != 0; slot = (slot + 1) & table->index_mask) {
+		topk_group_t *group = &table->groups[table->index[slot] - 1];
+		if (group->key == key) {
+			return group;
+		}
+	}
+	return NULL;
+}
+
+// Group for key, created empty on first use. NULL on allocation failure
+static topk_group_t *
+topk_get(topk_table_t *table, uint64_t key, uint8_t flags)
+{
+	topk_group_t *group = topk_find(table, key);
+	if (group != NULL) {
+		return group;
+	}
+
+	if (table->count == table->capacity) {
+		topk_group_t *groups = (topk_group_t *)realloc(table->groups, table->capacity * 2 * sizeof(topk_group_t));
+		uint32_t *index = (uint32_t *)calloc((table->index_mask + 1) * 2, sizeof(uint32_t));
+		if (groups == NULL || index == NULL) {
+			perror("Top K: Realloc");
+			free(index);
+			if (groups != NULL) {
+				table->groups = groups;
+			}
+			return NULL;
+		}
+		table->groups = groups;
+		table->capacity *= 2;
+		free(table->index);
+		table->index = index;
+		table->index_mask = table->index_mask * 2 + 1;
+		for (uint32_t i = 0; i < table->count; i++) {
+			uint32_t slot = topk_home(table, table->groups[i].key);
+			while (table->index[slot] != 0) {
+				slot = (slot + 1) & table->index_mask;
+			}
+			table->index[slot] = i + 1;
+		}
+	}
+
+	group = &table->groups[table->count];
+	group->key = key;
+	group->total = 0;
+	group->bound = 0;
+	group->base = 0;
+	group->flags = flags;
+	if (space_saving_init(&group->sketch, table->limit) != 0) {
+		return NULL;
+	}
+	uint32_t slot = topk_home(table, key);
+	while (table->index[slot] != 0) {
+		slot = (slot + 1) & table->index_mask;
+	}
+	table->index[slot] = ++table->count;
+	return group;
+}
+
+// Weight a record adds to its item
+static inline uint64_t
+topk_weight(const s_log_wide_t *log, int metric)
+{
+	switch (metric) {
+	case METRIC_UNIQUE:
+		return (log->flags & UNIQUE_IP) ? 1 : 0;
+	case METRIC_BYTES:
+		return log->bytes_sent_kb;
+	default:
+		return 1;
+	}
+}
+
+static inline void
+topk_record(const char *records, size_t i, int wide, s_log_wide_t *log)
+{
+	if (wide) {
+		memcpy(log, records + i * sizeof(s_log_wide_t), sizeof(s_log_wide_t));
+	}
+	else {
+		widen_record((const s_log_t *)(records + i * sizeof(s_log_t)), log);
+	}
+}
+
+// Pass 1 for one record
+static int
+topk_add(topk_table_t *table, const s_log_wide_t *log, const extract_config_t *config)
+{
+	uint64_t weight = topk_weight(log, config->metric);
+	if (weight == 0) {
+		return 0;
+	}
+	topk_group_t *group = topk_get(table, extract_group_key(log, config->group_by, config), log->flags);
+	if (group == NULL) {
+		return 1;
+	}
+	group->total += weight;
+	return space_saving_update(&group->sketch, extract_group_key(log, config->rank_by, config), weight,
+							   log->flags);
+}
+
+static void *
+topk_sketch_slice(void *arg)
+{
+	topk_worker_t *worker = (topk_worker_t *)arg;
+	s_log_wide_t log;
+	for (size_t i = worker->first; i < worker->last && !worker->failed; i++) {
+		topk_record(worker->records, i, worker->config->wide, &log);
+		worker->failed = topk_add(&worker->table, &log, worker->config);
+	}
+	return NULL;
+}
+
+static void *
+topk_count_slice(void *arg)
+{
+	topk_worker_t *worker = (topk_worker_t *)arg;
+	const extract_config_t *config = worker->config;
+	s_log_wide_t log;
+	for (size_t i = worker->first; i < worker->last; i++) {
+		topk_record(worker->records, i, config->wide, &log);
+		uint64_t weight = topk_weight(&log, config->metric);
+		if (weight == 0) {
+			continue;
+		}
+		const topk_group_t *group = topk_find(worker->merged, extract_group_key(&log, config->group_by, config));
+		int counter = space_saving_find(&group->sketch, extract_group_key(&log, config->rank_by, config));
+		if (counter >= 0) {
+			worker->exact[group->base + counter] += weight;
+		}
+	}
+	return NULL;
+}
+
+static int
+compare_group(const void *a, const void *b)
+{
+	const topk_group_t *x = (const topk_group_t *)a;
+	const topk_group_t *y = (const topk_group_t *)b;
+	if (x->total != y->total) {
+		return (x->total < y->total) - (x->total > y->total); // descending
+	}
+	return (x->key > y->key) - (x->key < y->key);
+}
+
+static const char *
+metric_name(int metric)
+{
+	switch (metric) {
+	case METRIC_UNIQUE:
+		return "unique_downloads";
+	case METRIC_BYTES:
+		return "bytes_sent_kb";
+	default:
+		return "requests";
+	}
+}
+
+/**
+ * @BRIEF Writes the ranked lists
+ * @PARAM table  : Merged sketches, counters replaced by exact counts when exact
+ * @PARAM output : JSON destination
+ * @PARAM config : Top K settings
+ * @PARAM exact  : 1 when counts come from the refinement pass
+ *
+ * @DETAILS "complete" is true when no item outside the list can outrank its
+ *          last entry: the K-th exact count is at least the sketch's bound on
+ *          unmonitored items. Estimates carry their error instead.
+ */
+// Records each group's bound before the counters are sorted or replaced
+static void
+topk_bounds(topk_table_t *table)
+{
+	for (uint32_t i = 0; i < table->count; i++) {
+		table->groups[i].bound = space_saving_min(&table->groups[i].sketch);
+	}
+}
+
+static void
+print_top_k(topk_table_t *table, FILE *output, const extract_config_t *config, int exact)
+{
+	qsort(table->groups, table->count, sizeof(topk_group_t), compare_group);
+
+	fprintf(output, "{\n");
+	fprintf(output, "  \"top_k\": %d, \n", config->top_k);
+	fprintf(output, "  \"ranked_by\": \"%s\", \n", get_group_name(config->rank_by, config));
+	fprintf(output, "  \"metric\": \"%s\", \n", metric_name(config->metric));
+	fprintf(output, "  \"grouped_by\": \"%s\", \n", get_group_name(config->group_by, config));
+	fprintf(output, "  \"exact\": %s, \n", exact ? "true" : "false");
+	fprintf(output, "  \"groups\":  {\n");
+
+	for (uint32_t i = 0; i < table->count; i++) {
+		topk_group_t *group = &table->groups[i];
+		space_saving_t *sketch = &group->sketch;
+		qsort(sketch->counters, sketch->count, sizeof(ss_counter_t), compare_counter);
+		uint32_t shown = (sketch->count < (uint32_t)config->top_k) ? sketch->count : (uint32_t)config->top_k;
+		int complete = exact && ((shown == (uint32_t)config->top_k) ? sketch->counters[shown - 1].count >= group->bound
+																	  : group->bound == 0);
+
+		char *group_key_str = format_group_key(config->group_by, group->key, group->flags, config);
+		fprintf(output, "%s    \"%s\": {\n", (i > 0) ? ",\n" : "", group_key_str);
+		fprintf(output, "      \"total\": %lu, \n", group->total);
+		fprintf(output, "      \"complete\": %s, \n", complete ? "true" : "false");
+		fprintf(output, "      \"top\": [\n");
+		for (uint32_t j = 0; j < shown; j++) {
+			ss_counter_t *counter = &sketch->counters[j];
+			char *item_str = format_group_key(config->rank_by, counter->item, counter->flags, config);
+			fprintf(output, "%s        {\"%s\": \"%s\", \"value\": %lu", (j > 0) ? ",\n" : "",
+					get_group_name(config->rank_by, config), item_str, counter->count);
+			if (!exact) {
+				fprintf(output, ", \"error\": %lu", counter->error);
+			}
+			fprintf(output, "}");
+			free(item_str);
+		}
+		fprintf(output, "\n      ]\n");
+		fprintf(output, "    }");
+		free(group_key_str);
+	}
+
+	fprintf(output, "\n  },\n");
+	fprintf(output, "  \"total_groups\": %u\n", table->count);
+	fprintf(output, "}\n");
+}
+
+// Inputs that cannot be mapped (pipes) get one pass and estimated counts
+static int
+top_k_stream(FILE *input, topk_table_t *table, const extract_config_t *config)
+{
+	s3_stats_t *perf = config->perf;
+	size_t record_size = config->wide ? sizeof(s_log_wide_t) : sizeof(s_log_t);
+	s_log_wide_t log;
+	while (read_record(input, config->wide, &log) == 1) {
+		if (topk_add(table, &log, config) != 0) {
+			return 1;
+		}
+		perf->lines++;
+		perf->bytes += record_size;
+	}
+	return 0;
+}
+
+/**
+ * @BRIEF Top K items per group in bounded memory
+ * @PARAM input  : Binary slim (or wide) log stream
+ * @PARAM output : JSON destination
+ * @PARAM config : Grouping, ranked item, metric, K and threads
+ * @RETURN 0 on success, -1 on allocation or thread failure
+ *
+ * @DETAILS Memory is config->counters (default K * TOPK_SLACK, at least
+ *          TOPK_MIN_COUNTERS) counters per group per worker, whatever the
+ *          input size. Groups whose weight is spread over more items than
+ *          that come out "complete": false. A regular
+ *          file is mapped and split across config->threads workers, then
+ *          counted exactly for the merged candidates in a second pass.
+ */
+int
+extract_top_k(FILE *input, FILE *output, const extract_config_t *config)
+{
+	s3_stats_t *perf = config->perf;
+	size_t record_size = config->wide ? sizeof(s_log_wide_t) : sizeof(s_log_t);
+	uint32_t limit = (uint32_t)config->top_k * TOPK_SLACK;
+	if (limit < TOPK_MIN_COUNTERS) {
+		limit = TOPK_MIN_COUNTERS;
+	}
+	if (config->counters > 0) {
+		limit = (config->counters < config->top_k) ? (uint32_t)config->top_k : (uint32_t)config->counters;
+	}
+
+	struct stat st;
+	void *mapping = MAP_FAILED;
+	size_t records = 0;
+	if (fstat(fileno(input), &st) == 0 && S_ISREG(st.st_mode) && st.st_size >= (off_t)record_size) {
+		records = st.st_size / record_size;
+		mapping = mmap(NULL, records * record_size, PROT_READ, MAP_PRIVATE, fileno(input), 0);
+	}
+
+	uint64_t timer = stats_begin(perf);
+	if (mapping == MAP_FAILED) {
+		topk_table_t table;
+		if (topk_table_init(&table, limit) != 0 || top_k_stream(input, &table, config) != 0) {
+			topk_table_free(&table);
+			return -1;
+		}
+		stats_end(perf, STAGE_GROUP, timer);
+		topk_bounds(&table);
+		timer = stats_begin(perf);
+		print_top_k(&table, output, config, 0);
+		stats_end(perf, STAGE_WRITE, timer);
+		topk_table_free(&table);
+		return 0;
+	}
+	posix_madvise(mapping, records * record_size, POSIX_MADV_SEQUENTIAL);
+
+	// Slices of at least FLUSH_THRESHOLD records, thread start up is not free
+	int threads = config->threads;
+	if (threads < 1) {
+		threads = 1;
+	}
+	if (threads > TOPK_THREADS_MAX) {
+		threads = TOPK_THREADS_MAX;
+	}
+	if ((size_t)threads > records / FLUSH_THRESHOLD + 1) {
+		threads = (int)(records / FLUSH_THRESHOLD + 1);
+	}
+
+	topk_worker_t workers[TOPK_THREADS_MAX];
+	pthread_t ids[TOPK_THREADS_MAX];
+	int err = 0;
+	for (int t = 0; t < threads; t++) {
+		workers[t].config = config;
+		workers[t].records = (const char *)mapping;
+		workers[t].first = records * t / threads;
+		workers[t].last = records * (t + 1) / threads;
+		workers[t].failed = topk_table_init(&workers[t].table, limit);
+		workers[t].exact = NULL;
+	}
+
+	// PASS 1: sketch every slice, then fold them into worker 0's table
+	for (int t = 1; t < threads; t++) {
+		if (pthread_create(&ids[t], NULL, topk_sketch_slice, &workers[t]) != 0) {
+			workers[t].failed = 1;
+			ids[t] = 0;
+		}
+	}
+	topk_sketch_slice(&workers[0]);
+	for (int t = 1; t < threads; t++) {
+		if (ids[t] != 0) {
+			pthread_join(ids[t], NULL);
+		}
+	}
+	topk_table_t *merged = &workers[0].table;
+	for (int t = 0; t < threads && !err; t++) {
+		err = workers[t].failed;
+		for (uint32_t i = 0; t > 0 && !err && i < workers[t].table.count; i++) {
+			topk_group_t *part = &workers[t].table.groups[i];
+			topk_group_t *group = topk_get(merged, part->key, part->flags);
+			err = (group == NULL) || space_saving_merge(&group->sketch, &part->sketch) != 0;
+			if (!err) {
+				group->total += part->total;
+			}
+		}
+	}
+	for (int t = 1; t < threads; t++) {
+		topk_table_free(&workers[t].table);
+	}
+	stats_end(perf, STAGE_GROUP, timer);
+
+	// PASS 2: exact counts for every candidate
+	timer = stats_begin(perf);
+	topk_bounds(merged);
+	uint32_t candidates = 0;
+	for (uint32_t i = 0; !err && i < merged->count; i++) {
+		merged->groups[i].base = candidates;
+		candidates += merged->groups[i].sketch.count;
+	}
+	for (int t = 0; t < threads && !err; t++) {
+		workers[t].merged = merged;
+		workers[t].exact = (uint64_t *)calloc(candidates ? candidates : 1, sizeof(uint64_t));
+		err = (workers[t].exact == NULL);
+	}
+	if (!err) {
+		for (int t = 1; t < threads; t++) {
+			if (pthread_create(&ids[t], NULL, topk_count_slice, &workers[t]) != 0) {
+				topk_count_slice(&workers[t]); // count it here instead
+				ids[t] = 0;
+			}
+		}
+		topk_count_slice(&workers[0]);
+		for (int t = 1; t < threads; t++) {
+			if (ids[t] != 0) {
+				pthread_join(ids[t], NULL);
+			}
+		}
+		// Exact counts replace the estimates, the error is gone
+		for (uint32_t i = 0; i < merged->count; i++) {
+			space_saving_t *sketch = &merged->groups[i].sketch;
+			for (uint32_t c = 0; c < sketch->count; c++) {
+				uint64_t count = 0;
+				for (int t = 0; t < threads; t++) {
+					count += workers[t].exact[merged->groups[i].base + c];
+				}
+				sketch->counters[c].count = count;
+				sketch->counters[c].error = 0;
+			}
+		}
+	}
+	stats_end(perf, STAGE_GROUP, timer);
+	perf->lines += records;
+	perf->bytes += records * record_size;
+
+	if (!err) {
+		timer = stats_begin(perf);
+		print_top_k(merged, output, config, 1);
+		stats_end(perf, STAGE_WRITE, timer);
+	}
+	else {
+		perror("Top K");
+	}
+	if (config->verbose) {
+		fprintf(stderr, "Top K: %zu records, %d threads, %u groups, %u candidates\n", records, threads,
+				merged->count, candidates);
+	}
+
+	for (int t = 0; t < threads; t++) {
+		free(workers[t].exact);
+	}
+	topk_table_free(merged);
+	munmap(mapping, records * record_size);
+	return err ? -1 : 0;
+}
+// END TOP-K EXTRACT ---------------------------------------------------------------------------
@@ -1,7 +1,27 @@
 #include <gtest/gtest.h>
+#include <atomic>
+#include <map>
+#include <set>
+#include <sys/mman.h>
+#include <thread>
 extern "C" {
 #include "../include/s3lp.h"
+#include "../include/s3aggregate.h"
+#include "../include/s3api.h"
+#include "../include/s3catalog.h"
+#include "../include/s3checkpoint.h"
+#include "../include/s3live.h"
+#include "../include/s3prefilter.h"
+#include "../include/s3quantile.h"
+#include "../include/s3redelivery.h"
+#include "../include/s3serve.h"
+#include "../include/s3session.h"
+#include "../include/s3sort.h"
+#include "../include/s3spill.h"
+#include "../include/s3time.h"
+#include "../include/s3topk.h"
 }
+#include "../include/s3query.hpp"
 
 // SET FLAGS TESTS---------------------------------------------------------------
 // Tests if start of file requests get set to correct bit -
@@ -12,7 +32,7 @@ TEST(extract_utils, CorrecltySetsFlags206Strt)
 	s_log_t slim_log;
 	p_log_t full_log;
 
-	s_context_t context;
+	s_context_t context = {};
 	context.ip_track.capacity = 1;
 	context.ip_track.count = 0;
 	context.ip_track.ip_hashes = (uint64_t *)calloc(context.ip_track.capacity, sizeof(uint64_t));
@@ -39,7 +59,7 @@ TEST(extract_utils, CorrecltySetsFlags206Mid)
 	s_log_t slim_log;
 	p_log_t full_log;
 
-	s_context_t context;
+	s_context_t context = {};
 	context.ip_track.capacity = 1;
 	context.ip_track.count = 0;
 	context.ip_track.ip_hashes = (uint64_t *)calloc(context.ip_track.capacity, sizeof(uint64_t));
@@ -64,7 +84,7 @@ TEST(extract_utils, CorrecltySetsFlags206End)
 	s_log_t slim_log;
 	p_log_t full_log;
 
-	s_context_t context;
+	s_context_t context = {};
 	context.ip_track.capacity = 2;
 	context.ip_track.count = 0;
 	context.ip_track.ip_hashes = (uint64_t *)calloc(context.ip_track.capacity, sizeof(uint64_t));
@@ -90,7 +110,7 @@ TEST(extract_utils, CorrecltySetsFlags206End)
 // IS UNIQUE IP TESTS------------------------------------------------------------
 TEST(extract_utils, InsertsHashedIPCorrectly)
 {
-	s_context_t context;
+	s_context_t context = {};
 	context.ip_track.capacity = 1;
 	context.ip_track.count = 0;
 	context.ip_track.ip_hashes = (uint64_t *)calloc(context.ip_track.capacity, sizeof(uint64_t));
@@ -111,7 +131,7 @@ TEST(extract_utils, InsertsHashedIPCorrectly)
 // Ensures linear insert working correctly
 TEST(extract_utils, InsertsHashLinearlyCorrectly)
 {
-	s_context_t context;
+	s_context_t context = {};
 	context.ip_track.capacity = 5;
 	context.ip_track.count = 0;
 	context.ip_track.ip_hashes = (uint64_t *)calloc(context.ip_track.capacity, sizeof(uint64_t));
@@ -163,3 +183,2097 @@ TEST(extract_utils, FailsPartialPatternGracefully)
 }
 
 // CHECK PATTERN TESTS------------------------------------------------------------
+// LINE READER TESTS------------------------------------------------------------
+// Lines longer than LOG_DEFAULT must come back whole, not split into several lines
+TEST(line_reader, ReturnsLongLinesWhole)
+{
+	std::string text = std::string(3 * LOG_DEFAULT, 'a') + "\nshort\nlast";
+	FILE *input = fmemopen((void *)text.data(), text.size(), "r");
+	line_reader_t reader;
+	size_t length = 0;
+	ASSERT_EQ(line_reader_init(&reader, input), 0);
+
+	char *line = read_line(&reader, &length);
+	ASSERT_NE(line, nullptr);
+	EXPECT_EQ(length, (size_t)(3 * LOG_DEFAULT));
+	EXPECT_EQ(strlen(line), length);
+	EXPECT_EQ(line_reader_offset(&reader), (uint64_t)(3 * LOG_DEFAULT + 1));
+
+	line = read_line(&reader, &length);
+	EXPECT_STREQ(line, "short");
+	EXPECT_EQ(line_reader_offset(&reader), (uint64_t)(3 * LOG_DEFAULT + 7));
+
+	// No trailing newline on the final line
+	line = read_line(&reader, &length);
+	EXPECT_STREQ(line, "last");
+	EXPECT_EQ(read_line(&reader, &length), nullptr);
+
+	line_reader_free(&reader);
+	fclose(input);
+}
+
+// An unreadable input is an error, not an early end of file
+TEST(line_reader, ReadErrorFailsTheRun)
+{
+	FILE *write_only = fopen("/dev/null", "w");
+	line_reader_t reader;
+	size_t length = 0;
+	ASSERT_EQ(line_reader_init(&reader, write_only), 0);
+	EXPECT_EQ(read_line(&reader, &length), nullptr);
+	EXPECT_EQ(reader.error, EBADF);
+	line_reader_free(&reader);
+
+	s_context_t context = {};
+	ASSERT_EQ(ip_track_init(&context.ip_track, IP_HASH, DEDUP_WINDOW), 0);
+	context.output_filetype_flag = BIN_FILE;
+	FILE *output = tmpfile();
+	rewind(write_only);
+	EXPECT_NE(process_log(write_only, output, &context), 0);
+	ip_track_free(&context.ip_track);
+	fclose(output);
+	fclose(write_only);
+}
+
+TEST(line_reader, RejectsShortLines)
+{
+	char line[] = "owner bucket [06/Feb/2019:00:00:38 +0000] 192.0.2.3";
+	p_log_t full_log;
+	s_context_t context = {};
+
+	EXPECT_EQ(parse_log_entry(line, &full_log, &context), PARSE_SHORT_LINE);
+	EXPECT_STREQ(LOG_FIELD(&full_log, remote_ip), "192.0.2.3");
+	EXPECT_STREQ(LOG_FIELD(&full_log, key), "");
+}
+// LINE READER TESTS------------------------------------------------------------
+// STATS TESTS------------------------------------------------------------------
+// Helper: strict JSON check, objects, arrays, strings, numbers and literals
+static bool
+json_value(const char *&at)
+{
+	auto skip = [&at] {
+		while (*at == ' ' || *at == '\n' || *at == '\t' || *at == '\r') {
+			at++;
+		}
+	};
+	auto quoted = [&at] {
+		if (*at++ != '"') {
+			return false;
+		}
+		while (*at != '"') {
+			if (*at == '\0' || (unsigned char)*at < 0x20 || (*at == '\\' && *++at == '\0')) {
+				return false;
+			}
+			at++;
+		}
+		at++;
+		return true;
+	};
+	skip();
+	if (*at == '{' || *at == '[') {
+		char close = (*at == '{') ? '}' : ']';
+		at++;
+		skip();
+		if (*at == close) {
+			at++;
+			return true;
+		}
+		for (;;) {
+			if (close == '}') {
+				skip();
+				if (!quoted()) {
+					return false;
+				}
+				skip();
+				if (*at++ != ':') {
+					return false;
+				}
+			}
+			if (!json_value(at)) {
+				return false;
+			}
+			skip();
+			if (*at == close) {
+				at++;
+				return true;
+			}
+			if (*at++ != ',') {
+				return false;
+			}
+		}
+	}
+	if (*at == '"') {
+		return quoted();
+	}
+	for (const char *literal : {"true", "false", "null"}) {
+		if (strncmp(at, literal, strlen(literal)) == 0) {
+			at += strlen(literal);
+			return true;
+		}
+	}
+	char *end = NULL;
+	strtod(at, &end);
+	if (end == at || !(isdigit((unsigned char)*at) || *at == '-')) {
+		return false;
+	}
+	at = end;
+	return true;
+}
+
+static bool
+json_valid(const std::string &text)
+{
+	const char *at = text.c_str();
+	if (!json_value(at)) {
+		return false;
+	}
+	while (*at == ' ' || *at == '\n') {
+		at++;
+	}
+	return *at == '\0';
+}
+
+static std::string
+stats_json(const s3_stats_t *stats, const parse_stats_t *parse)
+{
+	FILE *output = tmpfile();
+	stats_write_json(stats, parse, output);
+	std::string text(ftell(output), '\0');
+	rewind(output);
+	EXPECT_EQ(fread(&text[0], 1, text.size(), output), text.size());
+	fclose(output);
+	return text;
+}
+
+// The run summary is valid JSON, tokenize excludes the timestamp cycles nested in it
+TEST(stats, WritesSummaryJson)
+{
+	s3_stats_t stats;
+	stats_init(&stats, 1, 0);
+	stats.lines = 1000;
+	stats.bytes = 400000;
+	stats.batches = 7;
+	stats.stage_cycles[STAGE_TOKENIZE] = 5000;
+	stats.stage_cycles[STAGE_TIMESTAMP] = 2000;
+	stats.stage_cycles[STAGE_DEDUP] = 700;
+	stats.batch_latency[0] = 2;
+	stats.batch_latency[3] = 1;
+	stats.batch_latency[STATS_LATENCY_BUCKETS - 1] = 4;
+	parse_stats_t parse = {};
+	parse.lines = 1003;
+	parse.malformed = 3;
+	parse.rejected[PARSE_SHORT_LINE] = 3;
+	parse.duplicates = 5;
+
+	std::string text = stats_json(&stats, &parse);
+	EXPECT_TRUE(json_valid(text)) << text;
+	EXPECT_NE(text.find("\"tokenize\": {\"cycles\": 3000,"), std::string::npos) << text;
+	EXPECT_NE(text.find("\"timestamp\": {\"cycles\": 2000,"), std::string::npos);
+	EXPECT_NE(text.find("\"dedup\": {\"cycles\": 700,"), std::string::npos);
+	EXPECT_EQ(text.find("\"write\""), std::string::npos); // stages that never ran are left out
+	EXPECT_NE(text.find("\"batch_latency_us\": {\"1\": 2, \"8\": 1, \"inf\": 4}"), std::string::npos) << text;
+	EXPECT_NE(text.find("\"duplicates\": 5,"), std::string::npos);
+	EXPECT_NE(text.find(std::string("\"rejected\": {\"total\": 3, \"") + parse_status_name(PARSE_SHORT_LINE) + "\": 3"),
+			  std::string::npos);
+
+	// s3_extract has no line accounting
+	text = stats_json(&stats, NULL);
+	EXPECT_TRUE(json_valid(text)) << text;
+	EXPECT_EQ(text.find("rejected"), std::string::npos);
+	EXPECT_FALSE(json_valid("{\"a\": 1,}"));
+	EXPECT_FALSE(json_valid("{\"a: 1}"));
+}
+
+// A batch lands in the first log2 microsecond bucket above its latency, the last is open ended
+TEST(stats, BatchLatencyBuckets)
+{
+	s3_stats_t stats;
+	stats_init(&stats, 1, 0);
+	auto batch_taking = [&stats](long micros) {
+		stats_batch_begin(&stats);
+		stats.batch_start.tv_sec -= micros / 1000000;
+		stats.batch_start.tv_nsec -= (micros % 1000000) * 1000;
+		if (stats.batch_start.tv_nsec < 0) {
+			stats.batch_start.tv_sec--;
+			stats.batch_start.tv_nsec += 1000000000;
+		}
+		stats_batch_end(&stats);
+	};
+
+	batch_taking(5000); // 4096 <= 5000 < 8192
+	EXPECT_EQ(stats.batch_latency[13], 1u);
+	batch_taking(20 * 1000000); // past 2^23 us
+	EXPECT_EQ(stats.batch_latency[STATS_LATENCY_BUCKETS - 1], 1u);
+	EXPECT_EQ(stats.batches, 2u);
+
+	// Disabled stats leave everything untouched
+	stats_init(&stats, 0, 0);
+	batch_taking(5000);
+	EXPECT_EQ(stats.batches, 0u);
+	EXPECT_EQ(stats.batch_latency[13], 0u);
+}
+// STATS TESTS------------------------------------------------------------------
+// PARSE VALIDATION TESTS-------------------------------------------------------
+TEST(parse_validation, ParsesTimestampWithOffset)
+{
+	time_t ts = 0;
+	const char *utc = "[06/Feb/2019:00:00:38 +0000]";
+	const char *est = "[05/Feb/2019:19:00:38 -0500]";
+
+	ASSERT_EQ(parse_timestamp(utc, strlen(utc), &ts), 0);
+	EXPECT_EQ(ts, 1549411238);
+	ASSERT_EQ(parse_timestamp(est, strlen(est), &ts), 0);
+	EXPECT_EQ(ts, 1549411238);
+}
+
+TEST(parse_validation, RejectsBadTimestamps)
+{
+	time_t ts = 0;
+	const char *bad[] = {"[06/Fob/2019:00:00:38 +0000]", "[31/Feb/2019:00:00:38 +0000]",
+						 "[06/Feb/2019:24:00:38 +0000]", "[06/Feb/2019:00:00:38]",
+						 "[29/Feb/2025:00:00:38 +0000]", "[29/Feb/2100:00:00:38 +0000]",
+						 "[06/Feb/2019:00:00:38 +9999]", "[06/Feb/2019:00:00:38 -1500]",
+						 "[06/Feb/2019:00:00:38 +0560]", "-"};
+	for (const char *field : bad) {
+		EXPECT_EQ(parse_timestamp(field, strlen(field), &ts), -1) << field;
+	}
+	// Leap days and the widest real offsets still parse
+	const char *good[] = {"[29/Feb/2024:00:00:38 +0000]", "[29/Feb/2000:00:00:38 +0000]",
+						  "[06/Feb/2019:00:00:38 +1400]", "[06/Feb/2019:00:00:38 -1200]"};
+	for (const char *field : good) {
+		EXPECT_EQ(parse_timestamp(field, strlen(field), &ts), 0) << field;
+	}
+}
+
+TEST(parse_validation, ParsesRangeHeader)
+{
+	size_t start = 1, end = 1;
+	const char *quoted = "\"bytes=0-1023\"";
+	const char *open = "bytes=2048-";
+	const char *bad = "\"bytes0-1023\"";
+
+	ASSERT_EQ(parse_range(quoted, strlen(quoted), &start, &end), 0);
+	EXPECT_EQ(start, 0u);
+	EXPECT_EQ(end, 1023u);
+	ASSERT_EQ(parse_range(open, strlen(open), &start, &end), 0);
+	EXPECT_EQ(start, 2048u);
+	EXPECT_EQ(end, SIZE_MAX);
+	EXPECT_EQ(parse_range(bad, strlen(bad), &start, &end), -1);
+}
+
+TEST(parse_validation, RejectsStatusOutsideRange)
+{
+	char line[] = "owner bucket [06/Feb/2019:00:00:38 +0000] 192.0.2.3 - REQ REST.GET.OBJECT show/ep.mp3 "
+				  "\"GET /show/ep.mp3 HTTP/1.1\" 102 - 10 10 1 1 \"-\" \"curl/7.15.1\" - HOST SigV4 "
+				  "ECDHE AuthHeader host TLSv1.2 - -";
+	p_log_t full_log;
+	s_context_t context = {};
+
+	EXPECT_EQ(parse_log_entry(line, &full_log, &context), PARSE_BAD_STATUS);
+}
+// PARSE VALIDATION TESTS-------------------------------------------------------
+
+// IP ENCODING TESTS------------------------------------------------------------
+TEST(ip_encoding, ParsesIPv4Exactly)
+{
+	uint32_t ip = 0;
+	const char *good[] = {"192.0.2.3", "0.0.0.0", "255.255.255.255", "10.1.22.133"};
+	const uint32_t want[] = {0xc0000203, 0, 0xffffffff, 0x0a011685};
+	for (int i = 0; i < 4; i++) {
+		ASSERT_EQ(parse_ipv4(good[i], strlen(good[i]), &ip), 0) << good[i];
+		EXPECT_EQ(ip, want[i]) << good[i];
+	}
+
+	const char *bad[] = {"256.0.0.1", "1.2.3", "1.2.3.4.5", "1..2.3", "1.2.3.4a", "1234.1.1.1", "-", ""};
+	for (const char *field : bad) {
+		EXPECT_EQ(parse_ipv4(field, strlen(field), &ip), -1) << field;
+	}
+}
+
+TEST(ip_encoding, ParsesIPv6Groups)
+{
+	uint16_t groups[8];
+	const char *full = "2001:db8:85a3:0:0:8a2e:370:7334";
+	const char *gap = "2001:db8::1";
+	const char *mapped = "::ffff:192.0.2.3";
+
+	ASSERT_EQ(parse_ipv6(full, strlen(full), groups), 0);
+	EXPECT_EQ(groups[0], 0x2001);
+	EXPECT_EQ(groups[7], 0x7334);
+	ASSERT_EQ(parse_ipv6(gap, strlen(gap), groups), 0);
+	EXPECT_EQ(groups[1], 0x0db8);
+	EXPECT_EQ(groups[2], 0);
+	EXPECT_EQ(groups[7], 1);
+	ASSERT_EQ(parse_ipv6(mapped, strlen(mapped), groups), 0);
+	EXPECT_EQ(groups[5], 0xffff);
+	EXPECT_EQ(groups[6], 0xc000);
+
+	const char *bad[] = {"2001:db8::1::2", "2001:db8:1", "12345::1", "2001:db8:", ":1"};
+	for (const char *field : bad) {
+		EXPECT_EQ(parse_ipv6(field, strlen(field), groups), -1) << field;
+	}
+}
+
+// IPv6 listeners in one /64 share a record value and are flagged
+TEST(ip_encoding, SlimLogKeepsIPv4AndFlagsIPv6)
+{
+	char v4[] = "owner bucket [06/Feb/2019:00:00:38 +0000] 192.0.2.3 - REQ REST.GET.OBJECT /show/ep.mp3 "
+				"\"GET /show/ep.mp3 HTTP/1.1\" 200 - 10 10 1 1 \"-\" \"curl/7.15.1\" - HOST SigV4 "
+				"ECDHE AuthHeader host TLSv1.2 - -";
+	char v6a[] = "owner bucket [06/Feb/2019:00:00:38 +0000] 2001:db8:1:2::a - REQ REST.GET.OBJECT /show/ep.mp3 "
+				 "\"GET /show/ep.mp3 HTTP/1.1\" 200 - 10 10 1 1 \"-\" \"curl/7.15.1\" - HOST SigV4 "
+				 "ECDHE AuthHeader host TLSv1.2 - -";
+	char v6b[] = "owner bucket [06/Feb/2019:00:00:38 +0000] 2001:db8:1:2::b - REQ REST.GET.OBJECT /show/ep.mp3 "
+				 "\"GET /show/ep.mp3 HTTP/1.1\" 200 - 10 10 1 1 \"-\" \"curl/7.15.1\" - HOST SigV4 "
+				 "ECDHE AuthHeader host TLSv1.2 - -";
+	p_log_t full_log;
+	s_log_t a, b;
+	s_context_t context = {};
+
+	ASSERT_EQ(parse_log_entry(v4, &full_log, &context), PARSE_OK);
+	extract_log_entry(&full_log, &a, &context);
+	EXPECT_EQ(a.ip_hash, 0xc0000203u);
+	EXPECT_EQ(a.flags & IP_HASHED, 0);
+
+	ASSERT_EQ(parse_log_entry(v6a, &full_log, &context), PARSE_OK);
+	EXPECT_EQ(full_log.ip_addr, 0x20010db800010002ull);
+	extract_log_entry(&full_log, &a, &context);
+	ASSERT_EQ(parse_log_entry(v6b, &full_log, &context), PARSE_OK);
+	extract_log_entry(&full_log, &b, &context);
+	EXPECT_EQ(a.ip_hash, b.ip_hash);
+	EXPECT_EQ(a.flags & IP_HASHED, IP_HASHED);
+}
+// IP ENCODING TESTS------------------------------------------------------------
+
+// GEO LOOKUP TESTS-------------------------------------------------------------
+TEST(geo_lookup, FindsRangesAndGaps)
+{
+	char path[] = "/tmp/s3lp_geo_XXXXXX";
+	int fd = mkstemp(path);
+	ASSERT_GE(fd, 0);
+	FILE *db_file = fdopen(fd, "w");
+	fprintf(db_file, "\"ip_from\",\"ip_to\",\"country_code\"\n"
+					 "10.0.0.0,10.0.0.255,US\n"
+					 "\"167772416\",\"167772671\",\"DE\"\n" // 10.0.1.0 - 10.0.1.255
+					 "192.0.2.0,192.0.2.255,gb\n"
+					 "2001:db8::,2001:db8::ffff,FR\n"
+					 "1.0.0.0,1.0.0.255,ZZ\n");
+	fclose(db_file);
+
+	geo_db_t *db = geo_db_load(path);
+	unlink(path);
+	ASSERT_NE(db, nullptr);
+	EXPECT_EQ(db->count, 3u);
+
+	EXPECT_STREQ(geo_country_code(extract_location(0x0a000000, db)), "US");
+	EXPECT_STREQ(geo_country_code(extract_location(0x0a0000ff, db)), "US");
+	EXPECT_STREQ(geo_country_code(extract_location(0x0a000100, db)), "DE");
+	EXPECT_STREQ(geo_country_code(extract_location(0xc0000203, db)), "GB");
+	EXPECT_EQ(extract_location(0x0a000200, db), GEO_UNKNOWN);
+	EXPECT_EQ(extract_location(0x01000001, db), GEO_UNKNOWN);
+	EXPECT_EQ(extract_location(0xffffffff, db), GEO_UNKNOWN);
+	EXPECT_EQ(extract_location(0, db), GEO_UNKNOWN);
+	geo_db_free(db);
+}
+
+TEST(geo_lookup, CountryIdsRoundTrip)
+{
+	EXPECT_EQ(geo_country_id("--"), GEO_UNKNOWN);
+	EXPECT_STREQ(geo_country_code(geo_country_id("US")), "US");
+	EXPECT_STREQ(geo_country_code(geo_country_id("zw")), "ZW");
+	EXPECT_STREQ(geo_country_code(GEO_UNKNOWN), "--");
+}
+// GEO LOOKUP TESTS-------------------------------------------------------------
+
+// DOWNLOAD SESSION TESTS-------------------------------------------------------
+TEST(download_session, MergesOverlappingRanges)
+{
+	session_t session = {};
+	uint64_t merged = 0;
+
+	session_add_range(&session, 0, 1, &merged);			// probe
+	session_add_range(&session, 0, 999, &merged);		// overlaps the probe
+	session_add_range(&session, 2000, 2999, &merged);	// gap
+	session_add_range(&session, 1000, 1999, &merged);	// fills the gap exactly
+	session_add_range(&session, 500, 1500, &merged);	// re-fetch inside coverage
+	EXPECT_EQ(session.intervals, 1);
+	EXPECT_EQ(session_covered(&session), 3000u);
+	EXPECT_EQ(merged, 0u);
+
+	// Too many disjoint ranges: the smallest gap is filled
+	for (uint64_t i = 1; i <= SESSION_INTERVALS; i++) {
+		session_add_range(&session, 10000 * i, 10000 * i + 99, &merged);
+	}
+	EXPECT_LT(session.intervals, SESSION_INTERVALS);
+	EXPECT_GT(merged, 0u);
+}
+
+// Three range requests for one episode by one listener -> one download record
+TEST(download_session, StitchesRangeRequestsIntoOneDownload)
+{
+	const char *ranges[] = {"\"bytes=0-1\"", "\"bytes=0-999\"", "\"bytes=1000-1999\""};
+	const char *sent[] = {"2", "1000", "1000"};
+	FILE *output = tmpfile();
+	session_table_t *table = session_table_create(16, SESSION_WINDOW, output);
+	s_context_t context = {};
+	uint64_t ip_hashes[16] = {};
+	context.ip_track.ip_hashes = ip_hashes;
+	context.ip_track.capacity = 16;
+	ASSERT_NE(table, nullptr);
+
+	for (int i = 0; i < 3; i++) {
+		char line[LOG_DEFAULT];
+		snprintf(line, sizeof(line),
+				 "owner bucket [06/Feb/2019:00:00:%02d +0000] 192.0.2.3 - REQ REST.GET.OBJECT /show/ep.mp3 "
+				 "\"GET /show/ep.mp3 HTTP/1.1\" 206 - %s 2000 5 1 \"-\" \"Overcast/3.0\" - HOST SigV4 "
+				 "ECDHE AuthHeader host TLSv1.2 - - %s",
+				 10 + i, sent[i], ranges[i]);
+		p_log_t full_log;
+		s_log_t slim_log;
+		ASSERT_EQ(parse_log_entry(line, &full_log, &context), PARSE_OK);
+		extract_log_entry(&full_log, &slim_log, &context);
+		session_track(table, &full_log, &slim_log);
+	}
+	session_flush(table);
+	EXPECT_EQ(table->requests, 3u);
+	EXPECT_EQ(table->downloads, 1u);
+
+	s_log_t download;
+	rewind(output);
+	ASSERT_EQ(fread(&download, sizeof(download), 1, output), 1u);
+	EXPECT_EQ(download.completion_percent, 100);
+	EXPECT_EQ(download.download_time_ms, 15);
+	EXPECT_EQ(download.flags & (STRT_206DL | END_206DL), STRT_206DL | END_206DL);
+	EXPECT_EQ(download.ip_hash, 0xc0000203u);
+	session_table_free(table);
+	fclose(output);
+}
+// DOWNLOAD SESSION TESTS-------------------------------------------------------
+
+// HASHING TESTS----------------------------------------------------------------
+// The tokenizer's fused hashes must match the string helpers
+TEST(hashing, TokenizerMatchesStringHashes)
+{
+	char line[] = "owner bucket [06/Feb/2019:00:00:38 +0000] 192.0.2.3 - REQ REST.GET.OBJECT /show/ep.mp3 "
+				  "\"GET /show/ep.mp3 HTTP/1.1\" 200 - 10 10 1 1 \"-\" \"curl/7.15.1\" - HOST SigV4 "
+				  "ECDHE AuthHeader host TLSv1.2 - -";
+	p_log_t full_log;
+	s_log_t slim_log;
+	s_context_t context = {};
+
+	ASSERT_EQ(parse_log_entry(line, &full_log, &context), PARSE_OK);
+	extract_log_entry(&full_log, &slim_log, &context);
+	EXPECT_EQ(slim_log.ip_hash, 0xc0000203u);
+	EXPECT_EQ(slim_log.key_hash, hash_key("/show/ep.mp3"));
+	EXPECT_EQ(slim_log.podcast_hash, hash_key("show"));
+	EXPECT_EQ(extract_path("show/ep.mp3"), hash_key("show"));
+	EXPECT_EQ(full_log.podcast_hash64, hash64("show", 4));
+}
+
+// Every length class of hash64 (0-3, 4-16, 17-48, >48) separates keys one byte apart
+TEST(hashing, DistinctKeysDoNotCollide)
+{
+	char key[128];
+	memset(key, 'a', sizeof(key));
+	for (size_t len = 1; len < sizeof(key); len++) {
+		uint64_t before = hash64(key, len);
+		key[len - 1] = 'b';
+		EXPECT_NE(hash64(key, len), before) << len;
+		EXPECT_NE(hash64(key, len), hash64(key, len - 1)) << len;
+		key[len - 1] = 'a';
+	}
+}
+// HASHING TESTS----------------------------------------------------------------
+
+// DEDUP STATE TESTS------------------------------------------------------------
+// A pair counts once per window, then again once the window has passed
+TEST(dedup_state, PairsExpireAfterWindow)
+{
+	s_context_t context = {};
+	ASSERT_EQ(ip_track_init(&context.ip_track, 7, 24), 0);
+
+	context.ip_track.now_hour = 1000;
+	EXPECT_EQ(is_unique_ip(1, 2, &context), 1);
+	context.ip_track.now_hour = 1023;
+	EXPECT_EQ(is_unique_ip(1, 2, &context), 0);
+	context.ip_track.now_hour = 1024;
+	EXPECT_EQ(is_unique_ip(1, 2, &context), 1);
+	EXPECT_EQ(is_unique_ip(1, 2, &context), 0);
+
+	// Growing keeps live pairs and drops expired ones
+	for (uint32_t key = 0; key < 100; key++) {
+		EXPECT_EQ(is_unique_ip(7, key, &context), 1);
+	}
+	EXPECT_GT(context.ip_track.capacity, 100u);
+	EXPECT_EQ(is_unique_ip(1, 2, &context), 0);
+	context.ip_track.now_hour = 2000;
+	EXPECT_EQ(is_unique_ip(7, 0, &context), 1);
+	ip_track_free(&context.ip_track);
+}
+
+// A saved table is picked up by the next run
+TEST(dedup_state, SnapshotRoundTrip)
+{
+	char path[] = "/tmp/s3lp_dedup_XXXXXX";
+	int fd = mkstemp(path);
+	ASSERT_GE(fd, 0);
+	close(fd);
+
+	s_context_t context = {};
+	ASSERT_EQ(ip_track_init(&context.ip_track, 101, 24), 0);
+	context.ip_track.now_hour = 500;
+	for (uint32_t key = 0; key < 50; key++) {
+		is_unique_ip(3, key, &context);
+	}
+	ASSERT_EQ(ip_track_save(&context.ip_track, path), 0);
+	ip_track_free(&context.ip_track);
+
+	s_context_t next = {};
+	ASSERT_EQ(ip_track_load(&next.ip_track, path, 24), 0);
+	EXPECT_EQ(next.ip_track.count, 50u);
+	EXPECT_EQ(next.ip_track.now_hour, 500u);
+	EXPECT_EQ(is_unique_ip(3, 10, &next), 0);
+	EXPECT_EQ(is_unique_ip(3, 50, &next), 1);
+	next.ip_track.now_hour = 524;
+	EXPECT_EQ(is_unique_ip(3, 10, &next), 1);
+	ip_track_free(&next.ip_track);
+
+	EXPECT_EQ(ip_track_load(&next.ip_track, "/nonexistent/dedup", 24), -1);
+	EXPECT_EQ(ip_track_load(&next.ip_track, (std::string(path) + "/x").c_str(), 24), 2); // not a fresh start
+	EXPECT_EQ(errno, ENOTDIR);
+	unlink(path);
+}
+// DEDUP STATE TESTS------------------------------------------------------------
+
+// CHECKPOINT TESTS-------------------------------------------------------------
+// A checkpoint written mid-run restores the offsets and the dedup table, and the
+// output is cut back to the checkpointed length
+TEST(checkpoint, ResumesFromLastCheckpoint)
+{
+	char dir[] = "/tmp/s3lp_ckpt_XXXXXX";
+	ASSERT_NE(mkdtemp(dir), nullptr);
+	std::string path = std::string(dir) + "/ckpt";
+	std::string out_path = std::string(dir) + "/out.bin";
+
+	s_context_t context = {};
+	ASSERT_EQ(ip_track_init(&context.ip_track, 101, 24), 0);
+	context.output_filetype_flag = BIN_FILE;
+	context.stats.lines = 42;
+	is_unique_ip(5, 6, &context);
+
+	FILE *input = tmpfile();
+	FILE *output = fopen(out_path.c_str(), "w");
+	ASSERT_NE(output, nullptr);
+	fputs("input bytes", input);
+	fputs("0123456789", output);
+	fflush(input);
+
+	checkpoint_t checkpoint;
+	ASSERT_EQ(checkpoint_init(&checkpoint, path.c_str(), 2), 0);
+	checkpoint_batch(&checkpoint, &context, 7, input, output);
+	EXPECT_EQ(checkpoint.written, 0u); // every 2 batches
+	checkpoint_batch(&checkpoint, &context, 11, input, output);
+	EXPECT_EQ(checkpoint.written, 1u);
+	fputs("partial batch", output);
+	checkpoint_finish(&checkpoint, 0); // waits for the writer, keeps the files
+	EXPECT_EQ(checkpoint.failed, 0u);
+	fclose(output);
+	fclose(input);
+	ip_track_free(&context.ip_track);
+
+	s_context_t next = {};
+	checkpoint_record_t record;
+	ASSERT_EQ(checkpoint_init(&checkpoint, path.c_str(), 2), 0);
+	ASSERT_EQ(checkpoint_resume(&checkpoint, &record, &next.ip_track, 24), 0);
+	EXPECT_EQ(record.input_offset, 11u);
+	EXPECT_EQ(record.input_size, 11u);
+	EXPECT_EQ(record.output_offset, 10u);
+	EXPECT_EQ(record.stats.lines, 42u);
+	EXPECT_EQ(checkpoint.slot, 1); // the next snapshot leaves this one alone
+	EXPECT_EQ(is_unique_ip(5, 6, &next), 0);
+
+	output = checkpoint_reopen(out_path.c_str(), record.output_offset);
+	ASSERT_NE(output, nullptr);
+	EXPECT_EQ(ftello(output), 10);
+	fclose(output);
+	EXPECT_EQ(checkpoint_reopen(out_path.c_str(), 100), nullptr);
+
+	checkpoint_finish(&checkpoint, 1);
+	EXPECT_NE(access(path.c_str(), F_OK), 0);
+	ip_track_free(&next.ip_track);
+	unlink(out_path.c_str());
+	rmdir(dir);
+}
+// CHECKPOINT TESTS-------------------------------------------------------------
+
+// TOP K TESTS------------------------------------------------------------------
+// Zipf-like stream: item i has weight 1000 / (i + 1). The heavy items survive a
+// small sketch and every estimate brackets the true weight.
+TEST(top_k, SpaceSavingKeepsHeavyHitters)
+{
+	space_saving_t sketch;
+	ASSERT_EQ(space_saving_init(&sketch, 32), 0);
+	for (int round = 0; round < 1000; round++) {
+		for (uint64_t item = 0; item < 500; item++) {
+			if (round % (item + 1) == 0) {
+				ASSERT_EQ(space_saving_update(&sketch, item, 1, 0), 0);
+			}
+		}
+	}
+	for (uint64_t item = 0; item < 4; item++) {
+		int counter = space_saving_find(&sketch, item);
+		ASSERT_GE(counter, 0) << item;
+		uint64_t truth = (1000 + item) / (item + 1);
+		EXPECT_GE(sketch.counters[counter].count, truth);
+		EXPECT_LE(sketch.counters[counter].count - sketch.counters[counter].error, truth);
+	}
+	EXPECT_EQ(sketch.count, 32u);
+	space_saving_free(&sketch);
+}
+
+// Two halves merged bracket the weights of the whole stream
+TEST(top_k, MergedSketchesBracketTotals)
+{
+	space_saving_t left;
+	space_saving_t right;
+	ASSERT_EQ(space_saving_init(&left, 16), 0);
+	ASSERT_EQ(space_saving_init(&right, 16), 0);
+	uint64_t truth[100] = {};
+	for (uint64_t i = 0; i < 20000; i++) {
+		uint64_t item = (i * i) % 97 < 10 ? i % 3 : (i * 2654435761u) % 100;
+		truth[item] += 2;
+		space_saving_update((i & 1) ? &left : &right, item, 2, 0);
+	}
+	ASSERT_EQ(space_saving_merge(&left, &right), 0);
+	EXPECT_LE(left.count, 16u);
+	for (uint64_t item = 0; item < 100; item++) {
+		int counter = space_saving_find(&left, item);
+		if (counter < 0) {
+			EXPECT_LE(truth[item], space_saving_min(&left)) << item;
+			continue;
+		}
+		EXPECT_GE(left.counters[counter].count, truth[item]) << item;
+		EXPECT_LE(left.counters[counter].count - left.counters[counter].error, truth[item]) << item;
+	}
+	space_saving_free(&left);
+	space_saving_free(&right);
+}
+// TOP K TESTS------------------------------------------------------------------
+
+// QUANTILE TESTS---------------------------------------------------------------
+// Every quantile of a wide spread stays within alpha of the exact value
+TEST(quantile, WithinRelativeAccuracy)
+{
+	dd_mapping_t mapping;
+	ASSERT_EQ(dd_mapping_init(&mapping, 0.01), 0);
+	dd_sketch_t sketch;
+	dd_sketch_init(&sketch, &mapping);
+	// 1..60000 once each plus a run of zeros, exact rank r holds r - 99
+	for (uint64_t value = 1; value <= 60000; value++) {
+		ASSERT_EQ(dd_sketch_add(&sketch, value), 0);
+	}
+	for (int i = 0; i < 100; i++) {
+		ASSERT_EQ(dd_sketch_add(&sketch, 0), 0);
+	}
+	EXPECT_EQ(sketch.count, 60100u);
+	EXPECT_EQ(dd_sketch_quantile(&sketch, 0.001), 0);
+	EXPECT_EQ(dd_sketch_quantile(&sketch, 1), 60000);
+	for (double q = 0.01; q < 1; q += 0.01) {
+		double exact = (double)(uint64_t)(q * (sketch.count - 1)) - 99;
+		EXPECT_NEAR(dd_sketch_quantile(&sketch, q), exact, exact * 0.01 + 1e-9) << q;
+	}
+	EXPECT_LT(sketch.bin_count, 600u);
+	dd_sketch_free(&sketch);
+	dd_mapping_free(&mapping);
+}
+
+// Merging two halves gives the sketch of the whole stream
+TEST(quantile, MergeMatchesSingleSketch)
+{
+	dd_mapping_t mapping;
+	ASSERT_EQ(dd_mapping_init(&mapping, 0.02), 0);
+	dd_sketch_t whole;
+	dd_sketch_t low;
+	dd_sketch_t high;
+	dd_sketch_init(&whole, &mapping);
+	dd_sketch_init(&low, &mapping);
+	dd_sketch_init(&high, &mapping);
+	for (uint64_t i = 0; i < 20000; i++) {
+		uint64_t value = (i * 2654435761u) % 30000;
+		dd_sketch_add(&whole, value);
+		dd_sketch_add((value < 500) ? &low : &high, value);
+	}
+	ASSERT_EQ(dd_sketch_merge(&low, &high), 0);
+	EXPECT_EQ(low.count, whole.count);
+	EXPECT_EQ(low.sum, whole.sum);
+	EXPECT_EQ(low.min, whole.min);
+	EXPECT_EQ(low.max, whole.max);
+	for (double q = 0; q <= 1; q += 0.05) {
+		EXPECT_DOUBLE_EQ(dd_sketch_quantile(&low, q), dd_sketch_quantile(&whole, q)) << q;
+	}
+	dd_sketch_free(&whole);
+	dd_sketch_free(&low);
+	dd_sketch_free(&high);
+	dd_mapping_free(&mapping);
+}
+// QUANTILE TESTS---------------------------------------------------------------
+
+// TIME BUCKET TESTS------------------------------------------------------------
+static std::string
+bucket_label(const time_bucket_t *bucket, uint32_t timestamp)
+{
+	char label[32];
+	format_local_time(time_bucket_key(bucket, timestamp), label, sizeof(label));
+	return label;
+}
+
+// Buckets follow the local wall clock across both DST switches
+TEST(time_bucket, FollowsWallClockAcrossDst)
+{
+	const char *berlin = "CET-1CEST,M3.5.0,M10.5.0/3";
+	time_bucket_t hour;
+	time_bucket_t day;
+	time_bucket_t five;
+	time_bucket_t week;
+	time_bucket_t month;
+	ASSERT_EQ(time_bucket_init(&hour, "h", berlin), 0);
+	ASSERT_EQ(time_bucket_init(&day, "d", berlin), 0);
+	ASSERT_EQ(time_bucket_init(&five, "5m", berlin), 0);
+	ASSERT_EQ(time_bucket_init(&week, "w", berlin), 0);
+	ASSERT_EQ(time_bucket_init(&month, "M", berlin), 0);
+	EXPECT_STREQ(five.name, "5min");
+
+	// 2025-03-30 00:30 UTC is 01:30 CET, an hour later the clock reads 03:30 CEST
+	EXPECT_EQ(bucket_label(&hour, 1743294600), "2025-03-30 01:00:00");
+	EXPECT_EQ(bucket_label(&hour, 1743298200), "2025-03-30 03:00:00");
+	EXPECT_EQ(bucket_label(&five, 1743298200 + 7 * 60), "2025-03-30 03:35:00");
+	EXPECT_EQ(time_bucket_key(&day, 1743294600), time_bucket_key(&day, 1743298200));
+	EXPECT_EQ(bucket_label(&day, 1743298200), "2025-03-30 00:00:00");
+	EXPECT_EQ(bucket_label(&week, 1743298200), "2025-03-24 00:00:00"); // a Sunday, back to Monday
+	EXPECT_EQ(bucket_label(&month, 1743298200), "2025-03-01 00:00:00");
+
+	// 2025-10-26 00:30 and 01:30 UTC both read 02:30, one repeated hour bucket
+	EXPECT_EQ(time_bucket_key(&hour, 1761438600), time_bucket_key(&hour, 1761442200));
+	EXPECT_EQ(bucket_label(&hour, 1761442200), "2025-10-26 02:00:00");
+
+	time_bucket_t bad;
+	EXPECT_NE(time_bucket_init(&bad, "7m", NULL), 0);
+	EXPECT_NE(time_bucket_init(&bad, "2w", NULL), 0);
+	EXPECT_NE(time_bucket_init(&bad, "h", "Not/AZone"), 0);
+
+	time_bucket_free(&hour);
+	time_bucket_free(&day);
+	time_bucket_free(&five);
+	time_bucket_free(&week);
+	time_bucket_free(&month);
+}
+
+// A TZif file and its POSIX rule agree, including past the file's last transition
+TEST(time_bucket, TzifMatchesPosixRule)
+{
+	time_zone_t file;
+	time_zone_t rule;
+	if (access(TIME_ZONE_DIR "/Europe/Berlin", R_OK) != 0) {
+		GTEST_SKIP() << "no tzdata";
+	}
+	ASSERT_EQ(time_zone_load(&file, "Europe/Berlin"), 0);
+	ASSERT_EQ(time_zone_load(&rule, "CET-1CEST,M3.5.0,M10.5.0/3"), 0);
+	// 2020-01-01 through 2040-01-01, hourly
+	for (int64_t t = 1577836800; t < 2208988800; t += 3600) {
+		ASSERT_EQ(time_zone_offset(&file, t), time_zone_offset(&rule, t)) << t;
+	}
+	EXPECT_EQ(time_zone_offset(&file, 4102444800), 3600); // 2100-01-01
+	time_zone_free(&file);
+	time_zone_free(&rule);
+}
+// TIME BUCKET TESTS------------------------------------------------------------
+
+// AGGREGATE TESTS--------------------------------------------------------------
+// Packed keys unpack to the single key values and sort by the outermost key first
+TEST(aggregate, PackedKeysRoundTripInKeyOrder)
+{
+	extract_config_t config = {};
+	config.group_count = 3;
+	config.group_keys[0] = GROUP_PODCAST;
+	config.group_keys[1] = GROUP_TIME;
+	config.group_keys[2] = GROUP_SYSTEM;
+	composite_key_t layout;
+	ASSERT_EQ(composite_key_init(&layout, &config), 0);
+	EXPECT_EQ(layout.bits[0] + layout.bits[1] + layout.bits[2], 32 + 16 + 8); // days to 2106 need 16 bits
+
+	s_log_wide_t low = {};
+	low.podcast_hash = 0x10;
+	low.timestamp = 4000000000u;
+	low.system_id = 7;
+	s_log_wide_t high = low;
+	high.podcast_hash = 0x11;
+	high.timestamp = 1000;
+	high.system_id = 0;
+	packed_key_t low_key = composite_key_pack(&layout, &low, &config);
+	EXPECT_LT(low_key, composite_key_pack(&layout, &high, &config));
+	for (int level = 0; level < 3; level++) {
+		EXPECT_EQ(composite_key_part(&layout, low_key, level), extract_group_key(&low, layout.group_by[level], &config));
+	}
+
+	// Three 64 bit wide hashes do not fit
+	config.wide = 1;
+	config.group_keys[1] = GROUP_KEY;
+	config.group_keys[2] = GROUP_IP;
+	EXPECT_NE(composite_key_init(&layout, &config), 0);
+}
+
+// Innermost groups are ranked inside their parent and cut to the limit
+TEST(aggregate, NestedOutputHonoursOrderAndLimit)
+{
+	// (system, platform, requests): system 1 has platforms 2 (x3) and 5 (x1), system 2 has 4 (x2)
+	uint8_t keys[][2] = {{1, 5}, {2, 4}, {1, 2}, {1, 2}, {2, 4}, {1, 2}};
+	FILE *input = tmpfile();
+	for (auto &key : keys) {
+		s_log_t log = {};
+		log.system_id = key[0];
+		log.platform_id = key[1];
+		log.bytes_sent_kb = 10;
+		fwrite(&log, sizeof(log), 1, input);
+	}
+	rewind(input);
+
+	s3_stats_t perf;
+	stats_init(&perf, 0, 0);
+	extract_config_t config = {};
+	config.perf = &perf;
+	config.aggregate = 1;
+	config.group_count = 2;
+	config.group_keys[0] = GROUP_SYSTEM;
+	config.group_keys[1] = GROUP_PLATFORM;
+	config.order_by = ORDER_REQUESTS;
+	config.limit = 1;
+	char *text = NULL;
+	size_t length = 0;
+	FILE *output = open_memstream(&text, &length);
+	ASSERT_EQ(extract_to_json(input, output, &config), 0);
+	fclose(output);
+	fclose(input);
+
+	std::string json(text);
+	free(text);
+	EXPECT_NE(json.find("\"grouped_by\": [\"system\", \"platform\"]"), std::string::npos);
+	EXPECT_NE(json.find("    \"1\": {\n      \"2\": {\"requests\": 3, \"unique\": 0, \"bytes_kb\": 30"), std::string::npos)
+		<< json;
+	EXPECT_EQ(json.find("\"5\": {"), std::string::npos) << json; // past the limit
+	EXPECT_NE(json.find("\"2\": {\n      \"4\": {\"requests\": 2"), std::string::npos) << json;
+	EXPECT_NE(json.find("\"total_groups\": 3, \n  \"printed_groups\": 2"), std::string::npos) << json;
+}
+// AGGREGATE TESTS--------------------------------------------------------------
+
+// SPILL TESTS------------------------------------------------------------------
+// Helper: runs extract_to_json over records and returns the JSON
+static std::string
+extract_text(const std::vector<s_log_t> &logs, extract_config_t *config)
+{
+	FILE *input = tmpfile();
+	fwrite(logs.data(), sizeof(s_log_t), logs.size(), input);
+	rewind(input);
+	char *text = NULL;
+	size_t length = 0;
+	FILE *output = open_memstream(&text, &length);
+	EXPECT_EQ(extract_to_json(input, output, config), 0);
+	fclose(output);
+	fclose(input);
+	std::string json(text);
+	free(text);
+	return json;
+}
+
+// Every record comes back from the partition its key hashes to, in write order
+TEST(spill, PartitionsReadBackInWriteOrder)
+{
+	spill_t spill;
+	ASSERT_EQ(spill_open(&spill, 8, 1, sizeof(uint64_t), 1 << 20), 0);
+	for (uint64_t value = 0; value < 10000; value++) {
+		uint64_t key = value % 97;
+		ASSERT_EQ(spill_write(&spill, spill_partition(&spill, key, 0), &value), 0);
+	}
+
+	uint64_t total = 0;
+	for (uint32_t i = 0; i < spill.count; i++) {
+		FILE *run = spill_rewind(&spill, i);
+		ASSERT_NE(run, nullptr);
+		uint64_t value, last = 0, read = 0;
+		while (fread(&value, sizeof(value), 1, run) == 1) {
+			EXPECT_EQ(spill_partition(&spill, value % 97, 0), i);
+			EXPECT_TRUE(read == 0 || value > last);
+			last = value;
+			read++;
+		}
+		EXPECT_EQ(read, spill.records[i]);
+		total += read;
+		spill_release(&spill, i);
+	}
+	EXPECT_EQ(total, 10000u);
+	spill_close(&spill);
+}
+
+// A budget far below the table spills and merges back to the same output
+TEST(spill, AggregatesUnderBudgetMatchUnbounded)
+{
+	std::vector<s_log_t> logs;
+	for (uint32_t i = 0; i < 20000; i++) {
+		s_log_t log = {};
+		log.ip_hash = (i * 2654435761u) % 5003;
+		log.podcast_hash = i % 7;
+		log.bytes_sent_kb = (uint16_t)(i % 300);
+		log.flags = (i % 3 == 0) ? UNIQUE_IP : 0;
+		logs.push_back(log);
+	}
+
+	s3_stats_t perf;
+	stats_init(&perf, 0, 0);
+	extract_config_t config = {};
+	config.perf = &perf;
+	config.aggregate = 1;
+	config.group_count = 2;
+	config.group_keys[0] = GROUP_PODCAST;
+	config.group_keys[1] = GROUP_IP;
+	config.group_by = GROUP_PODCAST;
+	config.order_by = ORDER_BYTES;
+	std::string unbounded = extract_text(logs, &config);
+	config.memory_budget = 16 << 10;
+	EXPECT_EQ(extract_text(logs, &config), unbounded);
+
+	// Grouped logs keep every group and its records, in partition order
+	config.aggregate = 0;
+	config.group_count = 1;
+	config.group_by = GROUP_IP;
+	config.memory_budget = 0;
+	unbounded = extract_text(logs, &config);
+	config.memory_budget = 64 << 10;
+	std::string spilled = extract_text(logs, &config);
+	EXPECT_NE(spilled, unbounded);
+	EXPECT_EQ(spilled.size(), unbounded.size());
+	EXPECT_NE(spilled.find("\"total_groups\": 5003"), std::string::npos);
+}
+// SPILL TESTS------------------------------------------------------------------
+
+// SORT TESTS-------------------------------------------------------------------
+// Podcast then time, equal keys keep their input order (key_hash numbers the input)
+TEST(sort, RadixSortIsOrderedAndStable)
+{
+	std::vector<s_log_t> logs(5000), scratch(5000);
+	for (uint32_t i = 0; i < logs.size(); i++) {
+		logs[i] = {};
+		logs[i].podcast_hash = hash64_mix(i % 13, HASH64_SECRET[0]) & 0xffffffffu;
+		logs[i].timestamp = 1746000000u + (uint32_t)(hash64_mix(i, HASH64_SECRET[1]) % 50) * 3600;
+		logs[i].key_hash = i;
+	}
+	sort_key_t key;
+	sort_key_init(&key, SORT_BY_PODCAST, 0);
+	EXPECT_EQ(key.digit_count, 8);
+	const s_log_t *sorted = (const s_log_t *)radix_sort_records(&key, logs.data(), scratch.data(), logs.size());
+
+	for (size_t i = 1; i < logs.size(); i++) {
+		int order = sort_key_compare(&key, &sorted[i - 1], &sorted[i]);
+		ASSERT_LE(order, 0) << i;
+		if (order == 0) {
+			EXPECT_LT(sorted[i - 1].key_hash, sorted[i].key_hash) << i;
+		}
+	}
+}
+
+// Two files merged through many small runs match one in-memory sort of both
+TEST(sort, ExternalMergeMatchesInMemorySort)
+{
+	std::vector<s_log_t> logs(20000);
+	FILE *inputs[2] = {tmpfile(), tmpfile()};
+	for (uint32_t i = 0; i < logs.size(); i++) {
+		logs[i] = {};
+		logs[i].timestamp = 1746000000u + (uint32_t)(hash64_mix(i, HASH64_SECRET[2]) % 86400);
+		logs[i].key_hash = i;
+		fwrite(&logs[i], sizeof(s_log_t), 1, inputs[i % 2]);
+	}
+	rewind(inputs[0]);
+	rewind(inputs[1]);
+
+	sort_config_t config = {SORT_BY_TIME, 0, 0, 64 << 10}; // 1170 record runs
+	char *text = NULL;
+	size_t length = 0;
+	FILE *output = open_memstream(&text, &length);
+	ASSERT_EQ(sort_files(inputs, 2, output, &config), 0);
+	fclose(output);
+	fclose(inputs[0]);
+	fclose(inputs[1]);
+
+	// The inputs in file order, sorted stably
+	std::vector<s_log_t> expected;
+	for (int file = 0; file < 2; file++) {
+		for (size_t i = file; i < logs.size(); i += 2) {
+			expected.push_back(logs[i]);
+		}
+	}
+	std::stable_sort(expected.begin(), expected.end(),
+					 [](const s_log_t &a, const s_log_t &b) { return a.timestamp < b.timestamp; });
+	ASSERT_EQ(length, expected.size() * sizeof(s_log_t));
+	EXPECT_EQ(memcmp(text, expected.data(), length), 0);
+	free(text);
+}
+// SORT TESTS-------------------------------------------------------------------
+
+// CATALOG TESTS----------------------------------------------------------------
+// Three days in two buckets, each day holding records of its own two shows
+static std::vector<s_log_t>
+catalog_fixture(const char *dir)
+{
+	std::vector<s_log_t> logs;
+	char path[256];
+	for (uint32_t day = 0; day < 3; day++) {
+		snprintf(path, sizeof(path), "%s/%s", dir, (day == 1) ? "b" : "a");
+		mkdir(path, 0755);
+		snprintf(path, sizeof(path), "%s/%s/day%u.bin", dir, (day == 1) ? "b" : "a", day);
+		FILE *file = fopen(path, "wb");
+		for (uint32_t i = 0; i < 1000; i++) {
+			s_log_t log = {};
+			log.timestamp = 1746057600u + day * 86400 + (uint32_t)(hash64_mix(i, HASH64_SECRET[0]) % 86400);
+			log.podcast_hash = 100 + day + (i % 2) * 10; // 100/110, 101/111, 102/112
+			log.key_hash = day * 1000 + i;
+			fwrite(&log, sizeof(log), 1, file);
+			logs.push_back(log);
+		}
+		fclose(file);
+		EXPECT_EQ(catalog_register(dir, path, sizeof(s_log_t), NULL), 0);
+	}
+	return logs;
+}
+
+// The manifest lists every file once, re-registering replaces its line, queries prune days and shows
+TEST(catalog, ManifestPrunesByTimeAndPodcast)
+{
+	char dir[] = "/tmp/s3catalog_test_XXXXXX";
+	ASSERT_NE(mkdtemp(dir), nullptr);
+	catalog_fixture(dir);
+	std::string day0 = std::string(dir) + "/a/day0.bin";
+	ASSERT_EQ(catalog_register(dir, day0.c_str(), sizeof(s_log_t), NULL), 0);
+
+	catalog_t catalog;
+	ASSERT_EQ(catalog_load(&catalog, dir), 0);
+	ASSERT_EQ(catalog.count, 3u);
+	EXPECT_STREQ(catalog.entries[0].path, "a/day0.bin");
+	EXPECT_STREQ(catalog.entries[2].bucket, "b");
+	EXPECT_EQ(catalog.entries[1].records, 1000u);
+	EXPECT_EQ(catalog.entries[1].podcast_count, 2u);
+
+	// Day 1 only, then the show of day 2 over all days
+	catalog_query_t query = {1746057600u + 86400, 1746057600u + 2 * 86400, 0, 0, 0};
+	EXPECT_EQ(catalog_match(&catalog.entries[0], &query), 0);
+	EXPECT_EQ(catalog_match(&catalog.entries[2], &query), 1);
+	EXPECT_EQ(catalog_match(&catalog.entries[1], &query), 0);
+	query = {0, UINT32_MAX, 0, 0, 0};
+	ASSERT_EQ(catalog_query_podcast(&query, "0x70"), 0); // 112
+	EXPECT_EQ(catalog_match(&catalog.entries[0], &query), 0);
+	EXPECT_EQ(catalog_match(&catalog.entries[1], &query), 1);
+	EXPECT_EQ(catalog_match(&catalog.entries[2], &query), 0);
+	EXPECT_NE(catalog_query_podcast(&query, "0xzz"), 0);
+	catalog_free(&catalog);
+
+	// Files directly in the dataset take the bucket they are registered with
+	std::string flat = std::string(dir) + "/flat.bin";
+	std::string copy = std::string("cp ") + day0 + " " + flat;
+	ASSERT_EQ(system(copy.c_str()), 0);
+	EXPECT_NE(catalog_register(dir, flat.c_str(), sizeof(s_log_t), "bad\tname"), 0);
+	ASSERT_EQ(catalog_register(dir, flat.c_str(), sizeof(s_log_t), "podcast-media"), 0);
+	ASSERT_EQ(catalog_load(&catalog, dir), 0);
+	ASSERT_EQ(catalog.count, 4u);
+	EXPECT_STREQ(catalog.entries[3].path, "flat.bin");
+	EXPECT_STREQ(catalog.entries[3].bucket, "podcast-media");
+	catalog_free(&catalog);
+	ASSERT_EQ(catalog_register(dir, flat.c_str(), sizeof(s_log_t), NULL), 0);
+	ASSERT_EQ(catalog_load(&catalog, dir), 0);
+	EXPECT_STREQ(catalog.entries[3].bucket, "-");
+	catalog_free(&catalog);
+
+	std::string command = std::string("rm -rf ") + dir;
+	EXPECT_EQ(system(command.c_str()), 0);
+}
+
+// Three readers over half days at both ends deliver exactly the records a serial filter keeps
+TEST(catalog, ParallelScanMatchesRecordFilter)
+{
+	char dir[] = "/tmp/s3catalog_test_XXXXXX";
+	ASSERT_NE(mkdtemp(dir), nullptr);
+	std::vector<s_log_t> logs = catalog_fixture(dir);
+	catalog_t catalog;
+	ASSERT_EQ(catalog_load(&catalog, dir), 0);
+
+	catalog_query_t query = {1746057600u + 43200, 1746057600u + 3 * 86400 - 43200, 0, 0, 0};
+	catalog_scan_t scan;
+	FILE *stream = catalog_scan_start(&scan, &catalog, &query, 3);
+	ASSERT_NE(stream, nullptr);
+	std::vector<uint32_t> seen;
+	s_log_t log;
+	while (fread(&log, sizeof(log), 1, stream) == 1) {
+		seen.push_back(log.key_hash);
+	}
+	fclose(stream);
+	ASSERT_EQ(catalog_scan_finish(&scan), 0);
+
+	std::vector<uint32_t> expected;
+	for (const s_log_t &record : logs) {
+		if (catalog_record_match(&query, &record, sizeof(s_log_t))) {
+			expected.push_back(record.key_hash);
+		}
+	}
+	std::sort(seen.begin(), seen.end());
+	EXPECT_EQ(seen, expected);
+	EXPECT_EQ(scan.matched, expected.size());
+	EXPECT_EQ(scan.scanned, 3000u);
+	catalog_free(&catalog);
+
+	std::string command = std::string("rm -rf ") + dir;
+	EXPECT_EQ(system(command.c_str()), 0);
+}
+// CATALOG TESTS----------------------------------------------------------------
+
+// LIBRARY API TESTS------------------------------------------------------------
+typedef struct library_sink_s {
+	std::string records;
+	int rejected[PARSE_STATUS_COUNT];
+} library_sink_t;
+
+static int
+collect_batch(const s_log_t *logs, const s_log_wide_t *wide, size_t count, void *user)
+{
+	library_sink_t *sink = (library_sink_t *)user;
+	sink->records.append((const char *)logs, count * sizeof(s_log_t));
+	EXPECT_EQ(wide, nullptr);
+	return 0;
+}
+
+static void
+count_reject(const char *line, size_t length, int status, void *user)
+{
+	EXPECT_EQ(strlen(line), length);
+	EXPECT_STREQ(line, "truncated line"); // restored as read
+	((library_sink_t *)user)->rejected[status]++;
+}
+
+// Bytes fed 7 at a time in batches of 64 give the records process_log writes for the same text
+TEST(library, PushParserMatchesProcessLog)
+{
+	std::string text;
+	char line[LOG_DEFAULT];
+	for (int i = 0; i < 300; i++) {
+		snprintf(line, sizeof(line),
+				 "owner bucket [06/Feb/2019:00:%02d:%02d +0000] 192.0.2.%d - REQ REST.GET.OBJECT /show%d/ep%d.mp3 "
+				 "\"GET /x HTTP/1.1\" %d - %d 2000 5 1 \"-\" \"Spotify/8.8 Android/33\" - HOST SigV4 "
+				 "ECDHE AuthHeader host TLSv1.2 - - %s\r\n",
+				 i / 60, i % 60, i % 7, i % 3, i % 11, (i % 4) ? 200 : 206, 100 + i,
+				 (i % 4) ? "" : "\"bytes=0-99\"");
+		text += (i % 50 == 49) ? "truncated line\n" : line;
+	}
+	text += "owner bucket [06/Feb/2019:01:00:00 +0000] 192.0.2.1 - REQ REST.GET.OBJECT /a/b.mp3 \"GET /x HTTP/1.1\" "
+			"200 - 1 2 3 4 \"-\" \"-\" - HOST SigV4 ECDHE AuthHeader host TLSv1.2 - -"; // no newline
+
+	FILE *input = tmpfile();
+	FILE *output = tmpfile();
+	fwrite(text.data(), 1, text.size(), input);
+	rewind(input);
+	s_context_t context = {};
+	ASSERT_EQ(ip_track_init(&context.ip_track, IP_HASH, DEDUP_WINDOW), 0);
+	context.output_filetype_flag = BIN_FILE;
+	ASSERT_EQ(process_log(input, output, &context), 0);
+	std::string expected(ftell(output), '\0');
+	rewind(output);
+	ASSERT_EQ(fread(&expected[0], 1, expected.size(), output), expected.size());
+	fclose(input);
+	fclose(output);
+	ip_track_free(&context.ip_track);
+
+	library_sink_t sink = {};
+	s3lp_options_t options = {};
+	options.on_batch = collect_batch;
+	options.on_reject = count_reject;
+	options.user = &sink;
+	options.batch_size = 64;
+	s3lp_parser_t parser;
+	ASSERT_EQ(s3lp_parser_init(&parser, &options), S3LP_OK);
+	for (size_t i = 0; i < text.size(); i += 7) {
+		ASSERT_EQ(s3lp_parser_feed(&parser, text.data() + i, std::min<size_t>(7, text.size() - i)), S3LP_OK);
+	}
+	EXPECT_EQ(sink.records.size(), 4 * 64 * sizeof(s_log_t)); // only whole batches before finish
+	ASSERT_EQ(s3lp_parser_finish(&parser), S3LP_OK);
+	EXPECT_EQ(s3lp_parser_feed(&parser, "x", 1), S3LP_ESTATE);
+
+	EXPECT_EQ(sink.records.size(), 295 * sizeof(s_log_t));
+	EXPECT_TRUE(sink.records == expected);
+	EXPECT_EQ(sink.rejected[PARSE_SHORT_LINE], 6);
+	EXPECT_EQ(s3lp_parser_stats(&parser)->lines, 301u);
+	EXPECT_EQ(s3lp_parser_stats(&parser)->rejected[PARSE_SHORT_LINE], 6u);
+	s3lp_parser_free(&parser);
+}
+
+// Failures come back as codes, the library never prints
+TEST(library, ErrorsStayOffStderr)
+{
+	char path[] = "/tmp/s3lp_state_XXXXXX";
+	int fd = mkstemp(path);
+	ASSERT_GE(fd, 0);
+	ASSERT_EQ(write(fd, "not a snapshot", 14), 14);
+	close(fd);
+
+	library_sink_t sink = {};
+	s3lp_options_t options = {};
+	options.on_batch = collect_batch;
+	options.user = &sink;
+	options.dedup_state = path;
+	options.operations = "REST.GET.OBJECT";
+	s3lp_parser_t parser;
+	testing::internal::CaptureStderr();
+	EXPECT_EQ(s3lp_parser_init(&parser, &options), S3LP_EFORMAT);
+	EXPECT_EQ(parser.prefilter.operations.count, 0u); // released by the failed init
+	EXPECT_EQ(parser.context.prefilter, nullptr);
+	std::string unreadable = std::string(path) + "/x"; // ENOTDIR, the history is there but unreadable
+	options.dedup_state = unreadable.c_str();
+	EXPECT_EQ(s3lp_parser_init(&parser, &options), S3LP_EIO);
+
+	options.dedup_state = NULL;
+	ASSERT_EQ(s3lp_parser_init(&parser, &options), S3LP_OK);
+	EXPECT_EQ(s3lp_parser_save(&parser, "/nonexistent/dir/state"), S3LP_EIO);
+	EXPECT_EQ(errno, ENOENT);
+	s3lp_parser_free(&parser);
+	EXPECT_EQ(testing::internal::GetCapturedStderr(), "");
+	unlink(path);
+}
+
+// The prefilter options give the records process_log writes under -O -H, without printing
+TEST(library, PushParserPrefilters)
+{
+	std::string text;
+	char line[LOG_DEFAULT];
+	const char *operations[] = {"REST.GET.OBJECT", "REST.PUT.OBJECT", "REST.HEAD.OBJECT"};
+	for (int i = 0; i < 90; i++) {
+		snprintf(line, sizeof(line),
+				 "owner bucket [06/Feb/2019:00:00:%02d +0000] 192.0.2.%d - REQ %s /show/ep%d.mp3 "
+				 "\"GET /x HTTP/1.1\" %d - 100 2000 5 1 \"-\" \"-\" - HOST SigV4 ECDHE AuthHeader host TLSv1.2 - -\n",
+				 i % 60, i % 5, operations[i % 3], i, (i % 4) ? 200 : 404);
+		text += line;
+	}
+
+	prefilter_t prefilter = {};
+	ASSERT_EQ(prefilter_add(&prefilter, PREFILTER_FIELD_OPERATION, "REST.GET.OBJECT"), 0);
+	ASSERT_EQ(prefilter_status(&prefilter, "200-299"), 0);
+	FILE *input = tmpfile();
+	FILE *output = tmpfile();
+	fwrite(text.data(), 1, text.size(), input);
+	rewind(input);
+	s_context_t context = {};
+	ASSERT_EQ(ip_track_init(&context.ip_track, IP_HASH, DEDUP_WINDOW), 0);
+	context.output_filetype_flag = BIN_FILE;
+	context.prefilter = &prefilter;
+	ASSERT_EQ(process_log(input, output, &context), 0);
+	std::string expected(ftell(output), '\0');
+	rewind(output);
+	ASSERT_EQ(fread(&expected[0], 1, expected.size(), output), expected.size());
+	fclose(input);
+	fclose(output);
+	ip_track_free(&context.ip_track);
+	prefilter_free(&prefilter);
+
+	library_sink_t sink = {};
+	s3lp_options_t options = {};
+	options.on_batch = collect_batch;
+	options.user = &sink;
+	options.operations = "REST.GET.OBJECT";
+	options.status_range = "200-299";
+	s3lp_parser_t parser;
+	testing::internal::CaptureStderr();
+	ASSERT_EQ(s3lp_parser_init(&parser, &options), S3LP_OK);
+	ASSERT_EQ(s3lp_parser_feed(&parser, text.data(), text.size()), S3LP_OK);
+	ASSERT_EQ(s3lp_parser_finish(&parser), S3LP_OK);
+	EXPECT_EQ(sink.records.size(), 22 * sizeof(s_log_t)); // 30 GETs, every fourth line a 404
+	EXPECT_TRUE(sink.records == expected);
+	EXPECT_EQ(s3lp_parser_stats(&parser)->filtered, 68u);
+	EXPECT_EQ(s3lp_parser_stats(&parser)->malformed, 0u);
+	s3lp_parser_free(&parser);
+
+	options.status_range = "99-";
+	EXPECT_EQ(s3lp_parser_init(&parser, &options), S3LP_EOPTION);
+	options.status_range = NULL;
+	options.buckets = "a,,b";
+	EXPECT_EQ(s3lp_parser_init(&parser, &options), S3LP_EOPTION);
+	EXPECT_EQ(testing::internal::GetCapturedStderr(), "");
+}
+
+// Unfiltered reads come back as one run in place, a filter hands out runs of matches only
+TEST(library, PullReaderPushesFilterDown)
+{
+	char path[] = "/tmp/s3lp_reader_XXXXXX";
+	int fd = mkstemp(path);
+	ASSERT_GE(fd, 0);
+	std::vector<s_log_t> logs(1000);
+	for (uint32_t i = 0; i < logs.size(); i++) {
+		logs[i] = {};
+		logs[i].timestamp = 1746057600u + i;
+		logs[i].podcast_hash = (i / 10) % 3; // runs of 10
+		logs[i].key_hash = i;
+	}
+	ASSERT_EQ(write(fd, logs.data(), logs.size() * sizeof(s_log_t)), (ssize_t)(logs.size() * sizeof(s_log_t)));
+	ASSERT_EQ(write(fd, "xx", 2), 2); // partial record, ignored
+	close(fd);
+
+	s3lp_reader_t reader;
+	const void *records = NULL;
+	ASSERT_EQ(s3lp_reader_open(&reader, path, 0, NULL), S3LP_OK);
+	ASSERT_EQ(s3lp_reader_next_batch(&reader, &records, 5000), logs.size());
+	EXPECT_EQ(memcmp(records, logs.data(), logs.size() * sizeof(s_log_t)), 0);
+	EXPECT_EQ(s3lp_reader_next(&reader), nullptr);
+	s3lp_reader_close(&reader);
+
+	catalog_query_t filter = {1746057600u + 100, 1746057600u + 900, 1, 2, 0};
+	ASSERT_EQ(s3lp_reader_open(&reader, path, 0, &filter), S3LP_OK);
+	std::vector<uint32_t> seen;
+	size_t count = 0;
+	while ((count = s3lp_reader_next_batch(&reader, &records, 8)) > 0) {
+		EXPECT_LE(count, 8u);
+		for (size_t i = 0; i < count; i++) {
+			seen.push_back(((const s_log_t *)records)[i].key_hash);
+		}
+	}
+	std::vector<uint32_t> expected;
+	for (const s_log_t &log : logs) {
+		if (catalog_record_match(&filter, &log, sizeof(s_log_t))) {
+			expected.push_back(log.key_hash);
+		}
+	}
+	EXPECT_EQ(seen, expected);
+	EXPECT_EQ(reader.matched, expected.size());
+	EXPECT_EQ(reader.scanned, 1000u);
+	s3lp_reader_close(&reader);
+
+	// An empty file has no mapping and ends at once
+	ASSERT_EQ(truncate(path, 0), 0);
+	ASSERT_EQ(s3lp_reader_open(&reader, path, 0, &filter), S3LP_OK);
+	EXPECT_EQ(reader.data, nullptr);
+	records = logs.data();
+	EXPECT_EQ(s3lp_reader_next_batch(&reader, &records, 8), 0u);
+	EXPECT_EQ(records, nullptr);
+	EXPECT_EQ(s3lp_reader_next(&reader), nullptr);
+	s3lp_reader_close(&reader);
+	unlink(path);
+}
+// LIBRARY API TESTS------------------------------------------------------------
+
+// QUERY KERNEL TESTS-----------------------------------------------------------
+// Helper: records every minute across the 2025-10-26 Berlin DST switch
+static std::vector<s_log_t>
+query_logs(size_t count)
+{
+	std::vector<s_log_t> logs(count);
+	for (uint32_t i = 0; i < count; i++) {
+		logs[i] = {};
+		logs[i].timestamp = 1761300000u + i * 61; // 2025-10-24 to 10-27
+		logs[i].podcast_hash = i % 5;
+		logs[i].key_hash = i % 11;
+		logs[i].ip_hash = i * 2654435761u;
+		logs[i].flags = ((i % 3 == 0) ? UNIQUE_IP : 0) | ((i % 7 == 0) ? IP_HASHED : 0);
+		logs[i].bytes_sent_kb = (uint16_t)(i % 500);
+		logs[i].download_time_ms = i % 900;
+		logs[i].system_id = i % 4;
+		logs[i].platform_id = i % 9;
+	}
+	return logs;
+}
+
+// Typed aggregates give the totals of aggregate_add over the same packed keys
+TEST(query, TypedAggregateMatchesAggregateTable)
+{
+	using namespace s3q;
+	std::vector<s_log_t> logs = query_logs(10000);
+	extract_config_t config = {};
+	GroupBy<PodcastKey, DayKey>::Aggregate<Count, Unique, Sum<&s_log_t::bytes_sent_kb>,
+										   Avg<&s_log_t::download_time_ms>, Max<&s_log_t::bytes_sent_kb>>
+		totals(&config);
+	ASSERT_EQ(totals.add(logs.data(), 6000), 0);
+
+	// Halves merged give the same groups as one pass
+	GroupBy<PodcastKey, DayKey>::Aggregate<Count, Unique, Sum<&s_log_t::bytes_sent_kb>,
+										   Avg<&s_log_t::download_time_ms>, Max<&s_log_t::bytes_sent_kb>>
+		rest(&config);
+	ASSERT_EQ(rest.add(logs.data() + 6000, logs.size() - 6000), 0);
+	ASSERT_EQ(totals.merge(rest), 0);
+	totals.sort();
+
+	config.group_count = 2;
+	config.group_keys[0] = GROUP_PODCAST;
+	config.group_keys[1] = GROUP_TIME;
+	composite_key_t layout;
+	ASSERT_EQ(composite_key_init(&layout, &config), 0);
+	aggregate_table_t table;
+	ASSERT_EQ(aggregate_table_init(&table), 0);
+	std::map<packed_key_t, uint32_t> maximum;
+	for (const s_log_t &log : logs) {
+		s_log_wide_t wide;
+		widen_record(&log, &wide);
+		packed_key_t key = composite_key_pack(&layout, &wide, &config);
+		ASSERT_EQ(aggregate_add(&table, key, &wide), 0);
+		maximum[key] = std::max<uint32_t>(maximum[key], log.bytes_sent_kb);
+	}
+	ASSERT_EQ(totals.size(), table.count);
+	packed_key_t last = 0;
+	for (const auto &group : totals) {
+		EXPECT_TRUE(&group == totals.begin() || group.key > last);
+		last = group.key;
+		const aggregate_t *expected = NULL;
+		for (uint32_t i = 0; i < table.count; i++) {
+			expected = (table.groups[i].key == group.key) ? &table.groups[i] : expected;
+		}
+		ASSERT_NE(expected, nullptr);
+		EXPECT_EQ(totals.value<0>(group), expected->requests);
+		EXPECT_EQ(totals.value<1>(group), expected->unique);
+		EXPECT_EQ(totals.value<2>(group), expected->bytes_kb);
+		EXPECT_DOUBLE_EQ(totals.value<3>(group), (double)expected->time_ms / expected->requests);
+		EXPECT_EQ(totals.value<4>(group), maximum[group.key]);
+		EXPECT_EQ(totals.key(group, 0), composite_key_part(&layout, expected->key, 0));
+	}
+	aggregate_table_free(&table);
+
+	// Records of the other width are refused
+	std::vector<s_log_wide_t> wide(1);
+	EXPECT_NE(totals.add(wide.data(), wide.size()), 0);
+}
+
+// Batched packing matches composite_key_pack, also for a batch spanning a DST switch
+TEST(query, BatchPackingMatchesCompositeKeys)
+{
+	std::vector<s_log_t> logs = query_logs(QUERY_BATCH);
+	std::vector<s_log_wide_t> wide(logs.size());
+	for (size_t i = 0; i < logs.size(); i++) {
+		widen_record(&logs[i], &wide[i]);
+	}
+	time_bucket_t hour;
+	time_bucket_t week;
+	ASSERT_EQ(time_bucket_init(&hour, "h", "CET-1CEST,M3.5.0,M10.5.0/3"), 0);
+	ASSERT_EQ(time_bucket_init(&week, "w", "CET-1CEST,M3.5.0,M10.5.0/3"), 0);
+	int keys[][3] = {{GROUP_TIME, GROUP_SYSTEM, GROUP_PODCAST},
+					 {GROUP_IP, GROUP_PLATFORM, -1},
+					 {GROUP_COUNTRY, GROUP_KEY, GROUP_TIME}};
+	time_bucket_t *buckets[] = {NULL, &hour, &week};
+
+	std::vector<packed_key_t> packed(logs.size());
+	for (auto &levels : keys) {
+		for (time_bucket_t *bucket : buckets) {
+			for (int width = 0; width < 2; width++) {
+				extract_config_t config = {};
+				config.wide = width;
+				config.time_bucket = bucket;
+				for (int level = 0; level < 3 && levels[level] >= 0; level++) {
+					config.group_keys[config.group_count++] = levels[level];
+				}
+				composite_key_t layout;
+				ASSERT_EQ(composite_key_init(&layout, &config), 0);
+				const void *records = width ? (const void *)wide.data() : (const void *)logs.data();
+				query_pack_keys(&layout, &config, records, logs.size(), packed.data());
+				for (size_t i = 0; i < logs.size(); i++) {
+					s_log_wide_t record = wide[i];
+					if (!width) {
+						widen_record(&logs[i], &record);
+					}
+					ASSERT_EQ(packed[i], composite_key_pack(&layout, &record, &config))
+						<< levels[0] << " " << width << " " << i;
+				}
+			}
+		}
+	}
+	time_bucket_free(&hour);
+	time_bucket_free(&week);
+}
+// QUERY KERNEL TESTS-----------------------------------------------------------
+
+// QUERY SERVER TESTS-----------------------------------------------------------
+// Helper: s3_extract -D of a query over the files as stored, without the server
+static std::string
+dataset_json(const char *dir, const catalog_query_t *query, extract_config_t *config)
+{
+	catalog_t catalog;
+	EXPECT_EQ(catalog_load(&catalog, dir), 0);
+	catalog_scan_t scan;
+	FILE *input = catalog_scan_start(&scan, &catalog, query, 1);
+	char *text = NULL;
+	size_t length = 0;
+	FILE *output = open_memstream(&text, &length);
+	s3_stats_t perf;
+	stats_init(&perf, 0, 0);
+	config->perf = &perf;
+	EXPECT_EQ(extract_to_json(input, output, config), 0);
+	fclose(input);
+	EXPECT_EQ(catalog_scan_finish(&scan), 0);
+	fclose(output);
+	catalog_free(&catalog);
+	std::string json(text, length);
+	free(text);
+	return json;
+}
+
+// Answers match s3_extract, repeat from the cache, and follow files registered later
+TEST(serve, CachedAnswersFollowManifest)
+{
+	char dir[] = "/tmp/s3serve_test_XXXXXX";
+	ASSERT_NE(mkdtemp(dir), nullptr);
+	catalog_fixture(dir);
+	serve_t server;
+	ASSERT_EQ(serve_open(&server, dir, NULL, 2, 2, 1 << 20), 0);
+
+	extract_config_t config = {};
+	config.aggregate = 1;
+	config.group_count = 1;
+	config.group_by = config.group_keys[0] = GROUP_PODCAST;
+	config.order_by = ORDER_REQUESTS;
+	catalog_query_t query = {1746057600u + 43200, UINT32_MAX, 0, 0, 0};
+	std::string expected = dataset_json(dir, &query, &config);
+
+	serve_reply_t reply;
+	ASSERT_EQ(serve_answer(&server, "-g p --from @1746100800 -O n", &reply), 0) << reply.error;
+	EXPECT_EQ(std::string(reply.body, reply.length), expected);
+	EXPECT_EQ(reply.cached, 0);
+	free(reply.body);
+	ASSERT_EQ(serve_answer(&server, " -g  p --from \"@1746100800\" -O n", &reply), 0);
+	EXPECT_EQ(std::string(reply.body, reply.length), expected);
+	EXPECT_EQ(reply.cached, 1);
+	free(reply.body);
+
+	// A new day is read on the next request, not served from the cache
+	char path[256];
+	snprintf(path, sizeof(path), "%s/a/day3.bin", dir);
+	FILE *file = fopen(path, "wb");
+	s_log_t log = {};
+	log.timestamp = 1746057600u + 3 * 86400;
+	log.podcast_hash = 103;
+	fwrite(&log, sizeof(log), 1, file);
+	fclose(file);
+	ASSERT_EQ(catalog_register(dir, path, sizeof(s_log_t), NULL), 0);
+	ASSERT_EQ(serve_answer(&server, "-g p --from @1746100800 -O n", &reply), 0);
+	EXPECT_EQ(reply.cached, 0);
+	EXPECT_EQ(std::string(reply.body, reply.length), dataset_json(dir, &query, &config));
+	EXPECT_NE(std::string(reply.body, reply.length), expected);
+	EXPECT_EQ(server.snapshot->generation, 2u);
+	free(reply.body);
+
+	EXPECT_NE(serve_answer(&server, "-g p -w", &reply), 0);
+	EXPECT_STREQ(reply.error, "-w is not a query option");
+	EXPECT_NE(serve_answer(&server, "-g p -P \"open", &reply), 0);
+	EXPECT_EQ(server.queries, 5u);
+	EXPECT_EQ(server.hits, 1u);
+
+	// Values are read by extract_query_option, as s3_extract reads its command line
+	EXPECT_NE(serve_answer(&server, "-g p -k 5x", &reply), 0);
+	EXPECT_STREQ(reply.error, "-k requires a positive count");
+	EXPECT_NE(serve_answer(&server, "-g p --limit=0", &reply), 0);
+	EXPECT_STREQ(reply.error, "--limit requires a positive count");
+	extract_query_t request;
+	char error[EXTRACT_ERROR_MAX];
+	extract_query_init(&request);
+	EXPECT_EQ(extract_query_option(&request, 'g', "h,p", error), 0);
+	EXPECT_EQ(extract_query_option(&request, 'L', "3", error), 0);
+	EXPECT_EQ(extract_query_finish(&request, error), 0);
+	EXPECT_STREQ(request.bucket_spec, "h");
+	EXPECT_EQ(request.config.aggregate, 1);
+	EXPECT_EQ(request.config.group_keys[1], GROUP_PODCAST);
+	EXPECT_NE(extract_query_option(&request, 'g', "p,n", error), 0);
+	EXPECT_NE(extract_query_option(&request, 'w', "", error), 0);
+	serve_close(&server);
+
+	std::string command = std::string("rm -rf ") + dir;
+	EXPECT_EQ(system(command.c_str()), 0);
+}
+
+// s3_extract -S sends its options over the socket and gets the in process answer back
+TEST(serve, SocketRoundTrip)
+{
+	char dir[] = "/tmp/s3serve_test_XXXXXX";
+	ASSERT_NE(mkdtemp(dir), nullptr);
+	catalog_fixture(dir);
+	std::string socket_path = std::string(dir) + "/serve.sock";
+	serve_t server;
+	ASSERT_EQ(serve_open(&server, dir, socket_path.c_str(), 2, 1, 1 << 20), 0);
+	std::thread running([&server] { EXPECT_EQ(serve_run(&server), 0); });
+
+	serve_reply_t reply;
+	ASSERT_EQ(serve_answer(&server, "-g t,p -P 0x70 -O n --limit 1", &reply), 0);
+	const char *options[] = {"-g", "t,p", "-P", "0x70", "-O", "n", "--limit", "1"};
+	char *text = NULL;
+	size_t length = 0;
+	FILE *output = open_memstream(&text, &length);
+	EXPECT_EQ(serve_request(socket_path.c_str(), 8, (char **)options, output, 0), 0);
+	fclose(output);
+	EXPECT_EQ(std::string(text, length), std::string(reply.body, reply.length));
+	EXPECT_NE(std::string(text, length).find("\"total_groups\": 1"), std::string::npos);
+	free(text);
+	free(reply.body);
+
+	// Errors come back as a failure, not as output
+	const char *bad[] = {"-g", "p", "-T", "7m"};
+	output = open_memstream(&text, &length);
+	EXPECT_NE(serve_request(socket_path.c_str(), 4, (char **)bad, output, 0), 0);
+	fclose(output);
+	EXPECT_EQ(length, 0u);
+	free(text);
+
+	serve_stop(&server);
+	running.join();
+	EXPECT_EQ(server.queries, 3u);
+	serve_close(&server);
+	EXPECT_NE(access(socket_path.c_str(), F_OK), 0);
+	std::string command = std::string("rm -rf ") + dir;
+	EXPECT_EQ(system(command.c_str()), 0);
+}
+// QUERY SERVER TESTS-----------------------------------------------------------
+
+// LIVE WINDOW TESTS------------------------------------------------------------
+// Minute totals match the records, the ring keeps the newest ones in order
+TEST(live, WindowMatchesPublishedRecords)
+{
+	std::string name = "/s3lp_live_test_" + std::to_string(getpid());
+	live_t live;
+	ASSERT_EQ(live_open(&live, name.c_str(), 100), 0);
+
+	const uint32_t base = 1746662400;
+	std::vector<s_log_t> logs(300);
+	for (uint32_t i = 0; i < logs.size(); i++) {
+		memset(&logs[i], 0, sizeof(s_log_t));
+		logs[i].timestamp = base + i * 20; // 100 minutes
+		logs[i].ip_hash = i % 37;
+		logs[i].key_hash = i;
+		logs[i].bytes_sent_kb = (uint16_t)i;
+		logs[i].flags = (i % 3 == 0) ? UNIQUE_IP : 0;
+	}
+	live_publish(&live, &logs[0], 70);
+	live_publish(&live, &logs[70], 130);
+	live_publish(&live, &logs[200], 100);
+	live_publish(&live, &logs[0], 1); // an hour and more behind the newest
+
+	live_view_t view;
+	ASSERT_EQ(live_attach(&view, name.c_str()), 0);
+	live_header_t header;
+	std::vector<s_log_t> recent(500);
+	uint32_t count = 50;
+	ASSERT_EQ(live_snapshot(&view, &header, recent.data(), &count), 0);
+	EXPECT_EQ(header.written, 301u);
+	EXPECT_EQ(header.late, 1u);
+	ASSERT_EQ(count, 50u);
+	for (uint32_t i = 0; i < count; i++) {
+		uint32_t expected = (i == count - 1) ? 0 : 251 + i;
+		EXPECT_EQ(recent[i].key_hash, expected);
+	}
+	count = 500;
+	ASSERT_EQ(live_snapshot(&view, &header, recent.data(), &count), 0);
+	EXPECT_EQ(count, 100u);
+
+	// Last 15 minutes, exactly
+	live_window_t window;
+	live_window(&header, 15, &window);
+	uint32_t newest = (base + 299 * 20) / 60;
+	EXPECT_EQ(window.last, newest);
+	uint64_t requests = 0, downloads = 0, bytes = 0;
+	std::set<uint32_t> listeners;
+	for (uint32_t i = 0; i < logs.size(); i++) {
+		if (logs[i].timestamp / 60 + 15 > newest) {
+			requests++;
+			downloads += (logs[i].flags & UNIQUE_IP) ? 1 : 0;
+			bytes += logs[i].bytes_sent_kb;
+			listeners.insert(logs[i].ip_hash);
+		}
+	}
+	EXPECT_EQ(window.requests, requests);
+	EXPECT_EQ(window.downloads, downloads);
+	EXPECT_EQ(window.bytes_kb, bytes);
+	EXPECT_NEAR(window.listeners, (double)listeners.size(), listeners.size() * 0.1);
+
+	live_detach(&view);
+	live_close(&live);
+	shm_unlink(name.c_str());
+}
+
+// A reader copying while the writer publishes never keeps a torn copy
+TEST(live, SnapshotsStayConsistentDuringPublish)
+{
+	std::string name = "/s3lp_live_test_" + std::to_string(getpid());
+	live_t live;
+	ASSERT_EQ(live_open(&live, name.c_str(), 256), 0);
+	live_view_t view;
+	ASSERT_EQ(live_attach(&view, name.c_str()), 0);
+
+	const int batches = 20000;
+	const int size = 50;
+	std::atomic<int> done(0);
+	std::thread writer([&]() {
+		std::vector<s_log_t> batch(size);
+		memset(batch.data(), 0, size * sizeof(s_log_t));
+		for (int b = 0; b < batches; b++) {
+			for (int i = 0; i < size; i++) {
+				batch[i].timestamp = 1746662400;
+				batch[i].key_hash = (uint32_t)(b * size + i);
+				batch[i].bytes_sent_kb = 1;
+			}
+			live_publish(&live, batch.data(), size);
+		}
+		done = 1;
+	});
+
+	live_header_t header;
+	std::vector<s_log_t> recent(128);
+	uint64_t snapshots = 0;
+	while (!done) {
+		uint32_t count = 128;
+		if (live_snapshot(&view, &header, recent.data(), &count) != 0) {
+			continue;
+		}
+		snapshots++;
+		ASSERT_EQ(header.written % size, 0u);
+		if (header.written == 0) {
+			continue;
+		}
+		// The ring, the minute and the counter all describe the same publish
+		const live_minute_t *slot = &header.minutes[(1746662400 / 60) % LIVE_MINUTES];
+		ASSERT_EQ(slot->requests, header.written);
+		ASSERT_EQ(slot->bytes_kb, header.written);
+		for (uint32_t i = 0; i < count; i++) {
+			ASSERT_EQ(recent[i].key_hash, header.written - count + i);
+		}
+	}
+	writer.join();
+	EXPECT_GT(snapshots, 0u);
+	uint32_t count = 0;
+	ASSERT_EQ(live_snapshot(&view, &header, NULL, &count), 0);
+	EXPECT_EQ(header.written, (uint64_t)batches * size);
+
+	live_detach(&view);
+	live_close(&live);
+	shm_unlink(name.c_str());
+}
+// LIVE WINDOW TESTS------------------------------------------------------------
+
+// REDELIVERY TESTS-------------------------------------------------------------
+static std::string
+delivery_line(const char *request_id, const char *host_id, int second)
+{
+	char line[LOG_DEFAULT];
+	snprintf(line, sizeof(line),
+			 "owner bucket [06/Feb/2019:%02d:%02d:%02d +0000] 192.0.2.%d - %s REST.GET.OBJECT /show/ep.mp3 "
+			 "\"GET /x HTTP/1.1\" 200 - 100 2000 5 1 \"-\" \"Spotify/8.8 Android/33\" - %s SigV4 ECDHE AuthHeader "
+			 "host TLSv1.2 - -\n",
+			 second / 3600, second / 60 % 60, second % 60, second % 200, request_id, host_id);
+	return line;
+}
+
+// Only the same request id from the same host is a repeat, and only within the window
+TEST(redelivery, DropsRepeatedRequestsOnly)
+{
+	redelivery_t filter;
+	ASSERT_EQ(redelivery_init(&filter, 1), 0);
+	s_context_t context = {};
+	p_log_t parsed;
+	auto seen = [&](const char *id, const char *host, int second) {
+		std::string line = delivery_line(id, host, second);
+		EXPECT_EQ(parse_log_entry(&line[0], &parsed, &context), PARSE_OK);
+		return redelivery_seen(&filter, &parsed);
+	};
+
+	EXPECT_EQ(seen("3E57427F33A59F07", "hostA=", 0), 0);
+	EXPECT_EQ(seen("3E57427F33A59F07", "hostA=", 0), 1);
+	EXPECT_EQ(seen("3E57427F33A59F07", "hostB=", 0), 0); // same id, other host
+	EXPECT_EQ(seen("-", "hostA=", 1), 0);
+	EXPECT_EQ(seen("-", "hostA=", 1), 0); // no request id, never dropped
+
+	// Thousands of other requests later the first one still repeats
+	char id[32];
+	for (int i = 0; i < 5000; i++) {
+		snprintf(id, sizeof(id), "%016X", i);
+		EXPECT_EQ(seen(id, "hostA=", 2 + i % 600), 0);
+	}
+	EXPECT_EQ(seen("3E57427F33A59F07", "hostA=", 0), 1);
+	EXPECT_EQ(filter.duplicates, 2u);
+	EXPECT_EQ(filter.missing, 2u);
+
+	// Two hours of log time later every filter has rotated past it
+	EXPECT_EQ(seen("0000000000000001", "hostA=", 7200), 0);
+	EXPECT_EQ(seen("3E57427F33A59F07", "hostA=", 7200), 0);
+	redelivery_free(&filter);
+}
+
+// The exact window grows to hold every request the filters cover, rotation clears old bits lazily
+TEST(redelivery, ExactWindowSpansTheFilters)
+{
+	redelivery_t filter;
+	ASSERT_EQ(redelivery_init(&filter, 1), 0);
+	s_context_t context = {};
+	p_log_t parsed;
+	char id[32];
+	auto seen = [&](int request, int second) {
+		snprintf(id, sizeof(id), "%016X", request);
+		std::string line = delivery_line(id, "hostA=", second);
+		EXPECT_EQ(parse_log_entry(&line[0], &parsed, &context), PARSE_OK);
+		return redelivery_seen(&filter, &parsed);
+	};
+
+	EXPECT_EQ(seen(0, 0), 0);
+	for (int i = 1; i <= REDELIVERY_CONFIRM + 1000; i++) {
+		ASSERT_EQ(seen(i, 600), 0);
+	}
+	EXPECT_EQ(seen(0, 900), 1); // more than REDELIVERY_CONFIRM requests later, still in the hour
+	EXPECT_EQ(filter.capacity, 2u * REDELIVERY_CONFIRM);
+	EXPECT_EQ(filter.forgotten, 0u);
+
+	// Every generation has rotated, the lines still hold their bits until touched
+	uint64_t unconfirmed = filter.unconfirmed; // false positives so far
+	for (int i = 1; i <= 1000; i++) {
+		EXPECT_EQ(seen(i, 3 * 3600 + i), 0);
+	}
+	EXPECT_EQ(filter.unconfirmed, unconfirmed);
+	redelivery_free(&filter);
+}
+
+// Dropped lines never reach the output or the unique listener counts
+TEST(redelivery, ProcessLogDropsRepeatsBeforeExtract)
+{
+	std::string text, clean;
+	char id[32];
+	for (int i = 0; i < 400; i++) {
+		snprintf(id, sizeof(id), "%016X", i * 7919);
+		std::string line = delivery_line(id, "s9lzHYrFp76ZVxRcpX9+5cjAnEH2ROuNkd2BHfIa6Uk=", i * 3);
+		text += line;
+		clean += line;
+		if (i % 10 == 3) {
+			text += line; // delivered twice
+		}
+	}
+	auto run = [](const std::string &input_text, redelivery_t *filter, parse_stats_t *stats) {
+		FILE *input = tmpfile();
+		FILE *output = tmpfile();
+		fwrite(input_text.data(), 1, input_text.size(), input);
+		rewind(input);
+		s_context_t context = {};
+		EXPECT_EQ(ip_track_init(&context.ip_track, IP_HASH, DEDUP_WINDOW), 0);
+		context.output_filetype_flag = BIN_FILE;
+		context.redelivery = filter;
+		EXPECT_EQ(process_log(input, output, &context), 0);
+		std::string records(ftell(output), '\0');
+		rewind(output);
+		EXPECT_EQ(fread(&records[0], 1, records.size(), output), records.size());
+		fclose(input);
+		fclose(output);
+		ip_track_free(&context.ip_track);
+		*stats = context.stats;
+		return records;
+	};
+
+	redelivery_t filter;
+	ASSERT_EQ(redelivery_init(&filter, REDELIVERY_WINDOW), 0);
+	parse_stats_t with, without;
+	std::string deduplicated = run(text, &filter, &with);
+	std::string expected = run(clean, NULL, &without);
+	EXPECT_EQ(with.duplicates, 40u);
+	EXPECT_EQ(with.lines, 440u);
+	EXPECT_EQ(deduplicated.size(), 400 * sizeof(s_log_t));
+	EXPECT_EQ(deduplicated, expected);
+	redelivery_free(&filter);
+}
+// REDELIVERY TESTS-------------------------------------------------------------
+
+// PREFILTER TESTS--------------------------------------------------------------
+static std::string
+prefilter_line(const char *bucket, const char *time, const char *operation, const char *key, const char *status)
+{
+	char line[LOG_DEFAULT];
+	snprintf(line, sizeof(line),
+			 "owner %s [%s +0000] 192.0.2.7 - 3E57427F33A59F07 %s %s \"GET /x HTTP/1.1\" %s - 100 2000 5 1 \"-\" "
+			 "\"Spotify/8.8 Android/33\" - hostA= SigV4 ECDHE AuthHeader host TLSv1.2 - -\n",
+			 bucket, time, operation, key, status);
+	return line;
+}
+
+// Each set is checked on its own field, a failing line stops before later fields are parsed
+TEST(prefilter, ChecksEachFieldAsItCloses)
+{
+	prefilter_t filter = {};
+	ASSERT_EQ(prefilter_add(&filter, PREFILTER_FIELD_OPERATION, "REST.GET.OBJECT,REST.HEAD.OBJECT"), 0);
+	ASSERT_EQ(prefilter_add(&filter, PREFILTER_FIELD_BUCKET, "podcast-media"), 0);
+	ASSERT_EQ(prefilter_add(&filter, PREFILTER_FIELD_KEY, "show-1/,show-2/"), 0);
+	ASSERT_EQ(prefilter_status(&filter, "200-299"), 0);
+	EXPECT_EQ(filter.last_field, PREFILTER_FIELD_STATUS);
+	s_context_t context = {};
+	context.prefilter = &filter;
+	p_log_t parsed;
+	auto parse = [&](const char *bucket, const char *time, const char *operation, const char *key,
+					 const char *status) {
+		std::string line = prefilter_line(bucket, time, operation, key, status);
+		return parse_log_entry(&line[0], &parsed, &context);
+	};
+	const char *time = "06/Feb/2019:00:00:38";
+
+	EXPECT_EQ(parse("podcast-media", time, "REST.GET.OBJECT", "show-1/ep.mp3", "200"), PARSE_OK);
+	EXPECT_EQ(parse("podcast-media", time, "REST.HEAD.OBJECT", "show-2/ep.mp3", "206"), PARSE_OK);
+	EXPECT_EQ(parse("podcast-media", time, "REST.GET.OBJECT_TAGGING", "show-1/ep.mp3", "200"), PARSE_FILTERED);
+	EXPECT_EQ(parse("podcast-media", time, "REST.GET", "show-1/ep.mp3", "200"), PARSE_FILTERED);
+	EXPECT_EQ(parsed.key.len, 0u); // stopped at the operation, the key was never stored
+	EXPECT_EQ(parse("other-bucket", time, "REST.GET.OBJECT", "show-1/ep.mp3", "200"), PARSE_FILTERED);
+	EXPECT_EQ(parse("podcast-media", time, "REST.GET.OBJECT", "show-3/ep.mp3", "200"), PARSE_FILTERED);
+	EXPECT_EQ(parse("podcast-media", time, "REST.GET.OBJECT", "show-1/ep.mp3", "404"), PARSE_FILTERED);
+
+	// The bucket fails before the timestamp is read, a malformed status is still malformed
+	EXPECT_EQ(parse("other-bucket", "not a time", "REST.GET.OBJECT", "show-1/ep.mp3", "200"), PARSE_FILTERED);
+	EXPECT_EQ(parsed.timestamp, 0);
+	EXPECT_EQ(parse("podcast-media", "not a time", "REST.GET.OBJECT", "show-1/ep.mp3", "200"), PARSE_TIME_FAIL);
+	EXPECT_EQ(parse("podcast-media", time, "REST.GET.OBJECT", "show-1/ep.mp3", "2x0"), PARSE_BAD_STATUS);
+
+	// Option values
+	prefilter_t bad = {};
+	EXPECT_NE(prefilter_add(&bad, PREFILTER_FIELD_OPERATION, "REST.GET.OBJECT,,REST.PUT.OBJECT"), 0);
+	EXPECT_NE(prefilter_status(&bad, "199"), 0);
+	EXPECT_NE(prefilter_status(&bad, "300-200"), 0);
+	EXPECT_NE(prefilter_status(&bad, "200-x"), 0);
+	EXPECT_EQ(prefilter_status(&bad, "400-"), 0);
+	EXPECT_EQ(bad.status_min, 400);
+	EXPECT_EQ(bad.status_max, 599);
+	prefilter_free(&bad);
+	prefilter_free(&filter);
+}
+
+// Prefiltering gives the same output as parsing input that only held the kept lines
+TEST(prefilter, ProcessLogMatchesPrefilteredInput)
+{
+	const char *operations[] = {"REST.GET.OBJECT", "REST.PUT.OBJECT", "REST.HEAD.OBJECT", "REST.GET.BUCKET"};
+	const char *statuses[] = {"200", "206", "304", "403"};
+	std::string text, kept;
+	char time[32], key[32];
+	for (int i = 0; i < 600; i++) {
+		snprintf(time, sizeof(time), "06/Feb/2019:%02d:%02d:%02d", i / 3600, i / 60 % 60, i % 60);
+		snprintf(key, sizeof(key), "show-%d/ep-%d.mp3", i % 5, i % 17);
+		const char *operation = operations[i % 4];
+		const char *status = statuses[i / 4 % 4];
+		std::string line = prefilter_line("podcast-media", i % 40 == 8 ? "bad" : time, operation, key, status);
+		text += line;
+		if (strcmp(operation, "REST.GET.OBJECT") == 0 && strcmp(status, "403") != 0) {
+			kept += line;
+		}
+	}
+	auto run = [](const std::string &input_text, prefilter_t *filter, parse_stats_t *stats) {
+		FILE *input = tmpfile();
+		FILE *output = tmpfile();
+		fwrite(input_text.data(), 1, input_text.size(), input);
+		rewind(input);
+		s_context_t context = {};
+		EXPECT_EQ(ip_track_init(&context.ip_track, IP_HASH, DEDUP_WINDOW), 0);
+		context.output_filetype_flag = BIN_FILE;
+		context.prefilter = filter;
+		EXPECT_EQ(process_log(input, output, &context), 0);
+		std::string records(ftell(output), '\0');
+		rewind(output);
+		EXPECT_EQ(fread(&records[0], 1, records.size(), output), records.size());
+		fclose(input);
+		fclose(output);
+		ip_track_free(&context.ip_track);
+		*stats = context.stats;
+		return records;
+	};
+
+	prefilter_t filter = {};
+	ASSERT_EQ(prefilter_add(&filter, PREFILTER_FIELD_OPERATION, "REST.GET.OBJECT"), 0);
+	ASSERT_EQ(prefilter_status(&filter, "200-399"), 0);
+	parse_stats_t with, without;
+	std::string filtered = run(text, &filter, &with);
+	std::string expected = run(kept, NULL, &without);
+	EXPECT_EQ(filtered, expected);
+	EXPECT_GT(filtered.size(), 0u);
+	EXPECT_EQ(with.lines, 600u);
+	EXPECT_EQ(with.malformed, without.malformed); // kept lines with a bad timestamp
+	EXPECT_EQ(with.filtered, 600u - without.lines);
+	EXPECT_EQ(without.filtered, 0u);
+	prefilter_free(&filter);
+}
+// PREFILTER TESTS--------------------------------------------------------------
+
+// CSV OUTPUT TESTS-------------------------------------------------------------
+// One header per file, and each row is its own record across batch boundaries
+TEST(csv_output, WritesEachRecordOnceWithOneHeader)
+{
+	std::string text;
+	char time[32], key[32];
+	int lines = BATCH_SIZE + 3;
+	for (int i = 0; i < lines; i++) {
+		snprintf(time, sizeof(time), "06/Feb/2019:%02d:%02d:%02d", i / 3600, i / 60 % 60, i % 60);
+		snprintf(key, sizeof(key), "show-%d/ep-%d.mp3", i % 5, i);
+		text += prefilter_line("podcast-media", time, "REST.GET.OBJECT", key, "200");
+	}
+	FILE *input = tmpfile();
+	FILE *output = tmpfile();
+	fwrite(text.data(), 1, text.size(), input);
+	rewind(input);
+	s_context_t context = {};
+	ASSERT_EQ(ip_track_init(&context.ip_track, IP_HASH, DEDUP_WINDOW), 0);
+	context.output_filetype_flag = CSV_FILE;
+	ASSERT_EQ(process_log(input, output, &context), 0);
+	rewind(output);
+
+	char row[256];
+	int headers = 0, rows = 0;
+	uint32_t previous = 0;
+	std::set<uint32_t> keys;
+	while (fgets(row, sizeof(row), output) != NULL) {
+		if (strncmp(row, "timestamp,", 10) == 0) {
+			headers++;
+			continue;
+		}
+		unsigned timestamp, ip_hash, podcast_hash, key_hash;
+		ASSERT_EQ(sscanf(row, "%u,%u,%u,%u", &timestamp, &ip_hash, &podcast_hash, &key_hash), 4);
+		EXPECT_EQ(timestamp, rows == 0 ? 1549411200u : previous + 1);
+		previous = timestamp;
+		keys.insert(key_hash);
+		rows++;
+	}
+	EXPECT_EQ(headers, 1);
+	EXPECT_EQ(rows, lines);
+	EXPECT_EQ(keys.size(), (size_t)lines);
+	ip_track_free(&context.ip_track);
+	fclose(input);
+	fclose(output);
+}
+// Log listings, plain and grouped, parse as JSON with the country as the last field
+TEST(csv_output, LogListingsAreValidJson)
+{
+	FILE *input = tmpfile();
+	for (uint32_t i = 0; i < 6; i++) {
+		s_log_t log = {};
+		log.timestamp = 1746057600u + i * 60;
+		log.podcast_hash = i % 2;
+		log.key_hash = i;
+		log.download_time_ms = 250 + i;
+		log.location_id = geo_country_id("DE");
+		fwrite(&log, sizeof(log), 1, input);
+	}
+	auto listing = [input](int group_by) {
+		extract_query_t request;
+		extract_query_init(&request);
+		extract_config_t config = request.config;
+		s3_stats_t perf;
+		stats_init(&perf, 0, 0);
+		config.perf = &perf;
+		config.threads = 1;
+		config.group_by = group_by;
+		config.group_count = (group_by != GROUP_NONE);
+		config.group_keys[0] = group_by;
+		rewind(input);
+		char *text = NULL;
+		size_t length = 0;
+		FILE *output = open_memstream(&text, &length);
+		EXPECT_EQ(extract_to_json(input, output, &config), 0);
+		fclose(output);
+		std::string json(text, length);
+		free(text);
+		return json;
+	};
+
+	std::string plain = listing(GROUP_NONE);
+	EXPECT_TRUE(json_valid(plain)) << plain;
+	EXPECT_NE(plain.find("\"download_time_ms\": 253,"), std::string::npos);
+	EXPECT_NE(plain.find("\"country\": \"DE\"\n    }"), std::string::npos);
+	std::string grouped = listing(GROUP_PODCAST);
+	EXPECT_TRUE(json_valid(grouped)) << grouped;
+	fclose(input);
+}
+// CSV OUTPUT TESTS-------------------------------------------------------------